@@ -0,0 +1,242 @@
+/************************************************************
+MPU9250_Bus_Benchmark
+ Bus cost report for the MPU-9250 DMP Arduino Library
+https://github.com/sparkfun/SparkFun_MPU9250_DMP_Arduino_Library
+
+This example sketch runs the library's main API calls against
+the simulated MPU-9250 (no sensor needs to be connected) and
+reports what each call costs on the bus: transactions, bytes
+moved, and the time those would take on an I2C bus at
+100 kHz, 400 kHz and 1 MHz, and on SPI at 1 MHz.
+
+The report is printed as CSV, or as JSON when BENCHMARK_JSON
+is set to 1, so it can be saved and compared between library
+versions. Time spent in delays is not bus time and is not
+included.
+
+Development environment specifics:
+Arduino IDE 1.8.19
+
+Supported Platforms:
+- ESP32
+*************************************************************/
+#include <SparkFunMPU9250-DMP.h>
+#include <util/sim_mpu9250.h>
+
+#define SerialPort Serial
+
+// Set to 1 to print the report as JSON instead of CSV.
+#define BENCHMARK_JSON 0
+
+// Packet the simulated DMP puts in the FIFO for the features
+// passed to dmpBegin below: 6-axis quaternion (16 bytes),
+// accel (6), gyro (6), and the gesture word (4) of the tap
+// detection that dmpEnableFeatures always turns on.
+#define DMP_PACKET_LENGTH 32
+#define DMP_FEATURES (DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_SEND_RAW_ACCEL | \
+                      DMP_FEATURE_SEND_CAL_GYRO | DMP_FEATURE_GYRO_CAL)
+
+sim_mpu9250_s sim;
+mpu_bus_s simBus;
+MPU9250_DMP imu(&simBus);
+// Driver state for the calls the class does not wrap.
+mpu_state_s driver;
+
+unsigned char dmpTrace[DMP_PACKET_LENGTH];
+unsigned char reportCount = 0;
+
+void setup()
+{
+  SerialPort.begin(115200);
+
+  // The simulator follows micros(), so samples accumulate
+  // while the sketch and the library wait.
+  sim_mpu9250_init(&sim, &simBus, 0x68);
+  sim_mpu9250_set_clock(&sim, micros);
+  sim.mag[0] = 100;
+
+  // Level and still: w = 1.0 in q30, accel 1 g on Z.
+  dmpTrace[0] = 0x40;
+  dmpTrace[16 + 4] = 0x40;
+  sim_mpu9250_set_trace(&sim, dmpTrace, DMP_PACKET_LENGTH, 1);
+
+  printHeader();
+
+  startBenchmark();
+  report("begin", imu.begin());
+
+  delay(100);
+  startBenchmark();
+  report("update", imu.update(UPDATE_ACCEL | UPDATE_GYRO | UPDATE_COMPASS));
+
+  delay(100);
+  startBenchmark();
+  report("updateAll", imu.updateAll());
+
+  delay(100);
+  startBenchmark();
+  report("updateCompass", imu.updateCompass());
+
+  imu.configureFifo(INV_XYZ_GYRO | INV_XYZ_ACCEL);
+  delay(20);
+  startBenchmark();
+  report("updateFifo", imu.updateFifo());
+
+  // Switch between a low-power idle mode and a high-rate
+  // capture mode, one call at a time, then staged.
+  startBenchmark();
+  report("idleMode", enterMode(false, false));
+  startBenchmark();
+  report("captureMode", enterMode(true, false));
+  startBenchmark();
+  report("idleModeStaged", enterMode(false, true));
+  startBenchmark();
+  report("captureModeStaged", enterMode(true, true));
+
+  startBenchmark();
+  report("mpu_load_firmware", imu.dmpLoad());
+
+  // Start over, so dmpBegin loads the firmware itself.
+  imu.begin();
+  startBenchmark();
+  report("dmpBegin", imu.dmpBegin(DMP_FEATURES, 100));
+
+  delay(20);
+  startBenchmark();
+  report("dmpUpdateFifo", imu.dmpUpdateFifo());
+
+  // Asking again for what is already set only resets the FIFO.
+  startBenchmark();
+  report("dmpEnableFeatures", imu.dmpEnableFeatures(DMP_FEATURES));
+
+  // The simulated sensors do not respond to self-test
+  // excitation, so expect a failed status here. The bus cost
+  // is still representative.
+  startBenchmark();
+  report("selfTest", imu.selfTest());
+
+  // The driver's full self-test, with the compass measuring on
+  // its own. The compass has to read again afterwards; a
+  // nonzero compassAfterSelfTest status is a regression.
+  setupDriver();
+  startBenchmark();
+  report("mpu_run_6500_self_test", driverSelfTest());
+  delay(20);
+  startBenchmark();
+  report("compassAfterSelfTest", driverReadCompass());
+
+  printFooter();
+}
+
+void loop()
+{
+}
+
+int enterMode(bool capture, bool staged)
+{
+  int err = 0;
+
+  if (staged)
+    err |= imu.beginConfig();
+  if (capture)
+  {
+    err |= imu.setSensors(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
+    err |= imu.setGyroFSR(2000);
+    err |= imu.setAccelFSR(8);
+    err |= imu.setSampleRate(1000);
+    err |= imu.configureFifo(INV_XYZ_GYRO | INV_XYZ_ACCEL);
+  }
+  else
+  {
+    err |= imu.setSensors(INV_XYZ_ACCEL);
+    err |= imu.setAccelFSR(2);
+    err |= imu.setSampleRate(10);
+    err |= imu.configureFifo(INV_XYZ_ACCEL);
+  }
+  if (staged)
+    err |= imu.commit();
+  return err;
+}
+
+void setupDriver(void)
+{
+  struct int_param_s intParam;
+
+  mpu_init_state(&driver, &simBus, 0x68);
+  mpu_init(&driver, &intParam);
+  mpu_set_sensors(&driver, INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
+  mpu_set_compass_sample_rate(&driver, 100);
+  mpu_set_compass_continuous(&driver, 1);
+  delay(20);
+}
+
+int driverSelfTest(void)
+{
+  long gyro[3], accel[3];
+
+  return mpu_run_6500_self_test(&driver, gyro, accel, 0);
+}
+
+int driverReadCompass(void)
+{
+  short data[3];
+  unsigned long timestamp;
+
+  return mpu_get_compass_reg(&driver, data, &timestamp);
+}
+
+void startBenchmark(void)
+{
+  sim_mpu9250_reset_stats(&sim);
+}
+
+void printHeader(void)
+{
+#if BENCHMARK_JSON
+  SerialPort.println("[");
+#else
+  SerialPort.println("api,status,read_transactions,write_transactions,"
+                     "read_bytes,write_bytes,i2c_100khz_us,i2c_400khz_us,"
+                     "i2c_1mhz_us,spi_1mhz_us");
+#endif
+}
+
+void printFooter(void)
+{
+#if BENCHMARK_JSON
+  SerialPort.println();
+  SerialPort.println("]");
+#endif
+}
+
+void report(const char * api, int status)
+{
+  const sim_mpu9250_stats_s & s = sim.stats;
+  unsigned long i2c100k = sim_mpu9250_i2c_time_us(&s, 100000);
+  unsigned long i2c400k = sim_mpu9250_i2c_time_us(&s, 400000);
+  unsigned long i2c1m = sim_mpu9250_i2c_time_us(&s, 1000000);
+  unsigned long spi1m = sim_mpu9250_spi_time_us(&s, 1000000);
+
+#if BENCHMARK_JSON
+  if (reportCount > 0)
+    SerialPort.println(",");
+  SerialPort.print("  {\"api\": \"" + String(api) + "\"" +
+                   ", \"status\": " + String(status) +
+                   ", \"read_transactions\": " + String(s.read_transactions) +
+                   ", \"write_transactions\": " + String(s.write_transactions) +
+                   ", \"read_bytes\": " + String(s.read_bytes) +
+                   ", \"write_bytes\": " + String(s.write_bytes) +
+                   ", \"i2c_100khz_us\": " + String(i2c100k) +
+                   ", \"i2c_400khz_us\": " + String(i2c400k) +
+                   ", \"i2c_1mhz_us\": " + String(i2c1m) +
+                   ", \"spi_1mhz_us\": " + String(spi1m) + "}");
+#else
+  SerialPort.println(String(api) + "," + String(status) + "," +
+                     String(s.read_transactions) + "," +
+                     String(s.write_transactions) + "," +
+                     String(s.read_bytes) + "," + String(s.write_bytes) + "," +
+                     String(i2c100k) + "," + String(i2c400k) + "," +
+                     String(i2c1m) + "," + String(spi1m));
+#endif
+  reportCount++;
+}
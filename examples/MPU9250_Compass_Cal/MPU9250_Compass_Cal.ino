@@ -0,0 +1,117 @@
+/************************************************************
+MPU9250_Compass_Cal
+ Compass calibration example for MPU-9250 DMP Arduino Library
+https://github.com/sparkfun/SparkFun_MPU9250_DMP_Arduino_Library
+
+This example sketch demonstrates how to calibrate the
+magnetometer for hard iron (magnets and magnetised parts
+near the sensor) and soft iron (nearby metal). Turn the
+board slowly through every orientation you can for a few
+seconds: once the readings cover enough of them, the
+correction is applied to every compass reading, and printed
+so that it can be restored with setMagCalibration() later.
+The heading is then streamed.
+
+Development environment specifics:
+Arduino IDE 1.8.19
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+- ESP32
+*************************************************************/
+#include <SparkFunMPU9250-DMP.h>
+
+#ifdef ESP32
+#define SerialPort Serial
+#else
+#define SerialPort SerialUSB
+#endif
+
+MPU9250_DMP imu;
+
+mpu_sample_s samples[32];
+bool calibrated = false;
+unsigned long lastTry = 0;
+
+void setup()
+{
+  SerialPort.begin(115200);
+
+  // Call imu.begin() to verify communication and initialize
+  if (imu.begin() != INV_SUCCESS)
+  {
+    while (1)
+    {
+      SerialPort.println("Unable to communicate with MPU-9250");
+      SerialPort.println("Check connections, and try again.");
+      SerialPort.println();
+      delay(5000);
+    }
+  }
+
+  // Have every compass measurement (100Hz) go through the FIFO
+  imu.setSampleRate(100);
+  imu.setCompassSampleRate(100);
+  imu.setCompassContinuous();
+  imu.configureFifo(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
+
+  SerialPort.println("Turn the board through every orientation...");
+}
+
+void loop()
+{
+  unsigned short count = imu.readFifoBatch(samples, 32);
+
+  if (!calibrated)
+  {
+    imu.magCalAdd(samples, count);
+    // Try a fit once a second, until the readings are good enough
+    if (millis() - lastTry >= 1000)
+    {
+      mpu_magcal_fit_s fit;
+
+      lastTry = millis();
+      if (imu.magCalSolve(&fit) == INV_SUCCESS)
+      {
+        if (fit.model == MPU_MAGCAL_ELLIPSOID)
+        {
+          calibrated = true;
+          printCalibration(fit);
+        }
+        else
+        {
+          // Only the hard-iron offset could be fitted so far. It
+          // is applied; the next fit refines it.
+          SerialPort.println("Offset found, keep turning...");
+        }
+      }
+    }
+    return;
+  }
+
+  for (unsigned short i = 0; i < count; i++)
+  {
+    // computeCompassHeading() works from mx, my and mz
+    if (samples[i].sensors & INV_XYZ_COMPASS)
+    {
+      imu.mx = samples[i].compass[0];
+      imu.my = samples[i].compass[1];
+      imu.mz = samples[i].compass[2];
+    }
+  }
+  SerialPort.println("Heading: " + String(imu.computeCompassHeading()));
+  delay(100);
+}
+
+void printCalibration(const mpu_magcal_fit_s & fit)
+{
+  SerialPort.println("Calibrated. Fit error: " +
+                     String(fit.error * 100.0f) + "% of " +
+                     String(imu.calcMag((int) fit.field)) + " uT");
+  SerialPort.print("float offset[3] = {");
+  for (int i = 0; i < 3; i++)
+    SerialPort.print(String(fit.offset[i], 1) + (i < 2 ? ", " : "};\n"));
+  SerialPort.print("float matrix[9] = {");
+  for (int i = 0; i < 9; i++)
+    SerialPort.print(String(fit.matrix[i], 5) + (i < 8 ? ", " : "};\n"));
+}
@@ -6,9 +6,8 @@ original creation date: November 23, 2016
 https://github.com/sparkfun/SparkFun_MPU9250_DMP_Arduino_Library
 
 This example sketch demonstrates how to use the MPU-9250's
-512 byte first-in, first-out (FIFO) buffer. The FIFO can be
-set to store either accelerometer and/or gyroscope (not the
-magnetometer, though :( ).
+first-in, first-out (FIFO) buffer. The FIFO can be set to
+store accelerometer, gyroscope and magnetometer readings.
 
 Development environment specifics:
 Arduino IDE 1.6.12
@@ -46,52 +45,79 @@ void setup()
   // setSampleRate. Acceptable values range from 4Hz to 1kHz
   imu.setSampleRate(100); // Set sample rate to 100Hz
 
+  // Let the magnetometer measure at 100Hz on its own, and
+  // have the MPU-9250 pick up every reading.
+  imu.setCompassSampleRate(100);
+  imu.setCompassContinuous();
+
   // Use configureFifo to set which sensors should be stored
   // in the buffer.  
   // Parameter to this function can be: INV_XYZ_GYRO, 
-  // INV_XYZ_ACCEL, INV_X_GYRO, INV_Y_GYRO, or INV_Z_GYRO
-  imu.configureFifo(INV_XYZ_GYRO |INV_XYZ_ACCEL);
+  // INV_XYZ_ACCEL, INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO, or
+  // INV_XYZ_COMPASS
+  imu.configureFifo(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
 }
 
+// A 20-byte accel+gyro+compass packet means at most
+// 1024 / 20 = 51 packets can be waiting in the FIFO.
+#define FIFO_BATCH_SIZE 51
+mpu_sample_s samples[FIFO_BATCH_SIZE];
+
 void loop() 
 {
   // fifoAvailable returns the number of bytes in the FIFO
-  // The FIFO is 512 bytes max. We'll read when it reaches
-  // half of that.
+  // We'll read when it reaches 256 bytes.
   if ( imu.fifoAvailable() >= 256)
   {
-    // Then read while there is data in the FIFO
-    while ( imu.fifoAvailable() > 0)
+    // readFifoBatch empties the FIFO in a few burst reads,
+    // rather than one FIFO count and one read per packet.
+    // It returns the number of samples read, and reports
+    // how many were lost if the FIFO overflowed.
+    unsigned short dropped;
+    unsigned short count = imu.readFifoBatch(samples,
+                                  FIFO_BATCH_SIZE, &dropped);
+    if (dropped > 0)
+    {
+      SerialPort.println("FIFO overflow: " + String(dropped) +
+                         " samples dropped");
+    }
+    for (unsigned short i = 0; i < count; i++)
     {
-    // Call updateFifo to update ax, ay, az, gx, gy, and/or gz
-      if ( imu.updateFifo() == INV_SUCCESS)
-      {
-        printIMUData();
-      }
+      printIMUData(samples[i]);
     }
   }
 }
 
-void printIMUData(void)
+void printIMUData(const mpu_sample_s & sample)
 {  
-  // After calling update() the ax, ay, az, gx, gy, gz, mx,
-  // my, mz, time, and/or temerature class variables are all
-  // updated. Access them by placing the object. in front:
+  // Each sample holds the raw accel, gyro and compass
+  // readings from one FIFO packet. readFifoBatch also copies
+  // the newest one into imu.ax, imu.ay, ... imu.mz.
 
   // Use the calcAccel, calcGyro, and calcMag functions to
   // convert the raw sensor readings (signed 16-bit values)
   // to their respective units.
-  float accelX = imu.calcAccel(imu.ax);
-  float accelY = imu.calcAccel(imu.ay);
-  float accelZ = imu.calcAccel(imu.az);
-  float gyroX = imu.calcGyro(imu.gx);
-  float gyroY = imu.calcGyro(imu.gy);
-  float gyroZ = imu.calcGyro(imu.gz);
+  float accelX = imu.calcAccel(sample.accel[0]);
+  float accelY = imu.calcAccel(sample.accel[1]);
+  float accelZ = imu.calcAccel(sample.accel[2]);
+  float gyroX = imu.calcGyro(sample.gyro[0]);
+  float gyroY = imu.calcGyro(sample.gyro[1]);
+  float gyroZ = imu.calcGyro(sample.gyro[2]);
   
   SerialPort.println("Accel: " + String(accelX) + ", " +
               String(accelY) + ", " + String(accelZ) + " g");
   SerialPort.println("Gyro: " + String(gyroX) + ", " +
               String(gyroY) + ", " + String(gyroZ) + " dps");
-  SerialPort.println("Time: " + String(imu.time) + " ms");
+  // The compass is only flagged in packets that carry a
+  // new reading.
+  if (sample.sensors & INV_XYZ_COMPASS)
+  {
+    float magX = imu.calcMag(sample.compass[0]);
+    float magY = imu.calcMag(sample.compass[1]);
+    float magZ = imu.calcMag(sample.compass[2]);
+    SerialPort.println("Mag: " + String(magX) + ", " +
+                String(magY) + ", " + String(magZ) + " uT");
+  }
+  SerialPort.println("Time: " + String(sample.timestamp) + " ms");
   SerialPort.println();
 }
@@ -0,0 +1,122 @@
+/************************************************************
+MPU9250_Fusion_Benchmark
+ Sensor fusion cost report for the MPU-9250 DMP Arduino Library
+https://github.com/sparkfun/SparkFun_MPU9250_DMP_Arduino_Library
+
+This example sketch reads 1 kHz accel, gyro and compass
+samples from the simulated MPU-9250 (no sensor needs to be
+connected), then fuses them with each of the library's 9-axis
+filters: Madgwick and Mahony, in float and in integer math.
+For each it reports the time and CPU cycles spent per sample,
+and the share of the CPU that fusing a 1 kHz FIFO would take.
+
+The report is printed as CSV.
+
+Development environment specifics:
+Arduino IDE 1.8.19
+
+Supported Platforms:
+- ESP32
+*************************************************************/
+#include <SparkFunMPU9250-DMP.h>
+#include <util/sim_mpu9250.h>
+
+#define SerialPort Serial
+
+#define SAMPLE_RATE 1000
+// Samples read from the simulator, and times each filter
+// goes through them.
+#define NUM_SAMPLES 200
+#define PASSES 10
+
+sim_mpu9250_s sim;
+mpu_bus_s simBus;
+mpu_clock_s simClock;
+MPU9250_DMP imu(&simBus);
+
+mpu_sample_s samples[NUM_SAMPLES];
+unsigned short numSamples = 0;
+
+void setup()
+{
+  SerialPort.begin(115200);
+
+  // The simulator runs on its own clock, advanced below, so
+  // the samples come out the same on every board.
+  sim_mpu9250_init(&sim, &simBus, 0x68);
+  sim_mpu9250_clock_init(&sim, &simClock);
+  imu.setClock(&simClock);
+  sim.sample_cb = turn;
+
+  // Tilted, with the earth's field about 50 uT
+  sim.accel[0] = 2000;
+  sim.accel[1] = -3000;
+  sim.accel[2] = 15800;
+  sim.mag[0] = 80;
+  sim.mag[1] = 110;
+  sim.mag[2] = -250;
+
+  imu.begin();
+  imu.setGyroFSR(2000);
+  imu.setSampleRate(SAMPLE_RATE);
+  imu.setCompassSampleRate(100);
+  imu.setCompassContinuous();
+  imu.configureFifo(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
+
+  while (numSamples < NUM_SAMPLES)
+  {
+    sim_mpu9250_advance(&sim, 20000);
+    numSamples += imu.readFifoBatch(samples + numSamples,
+                                    NUM_SAMPLES - numSamples);
+  }
+
+  SerialPort.println("filter,samples,us_per_sample,"
+                     "cycles_per_sample,cpu_at_1khz_percent");
+  report("madgwick_float", MPU_FUSION_MADGWICK, false);
+  report("madgwick_fixed", MPU_FUSION_MADGWICK, true);
+  report("mahony_float", MPU_FUSION_MAHONY, false);
+  report("mahony_fixed", MPU_FUSION_MAHONY, true);
+}
+
+void loop()
+{
+}
+
+// Turn slowly back and forth about each axis.
+void turn(sim_mpu9250_s * s, void * arg)
+{
+  static int t = 0;
+  t = (t + 1) % 2000;
+  int v = t < 1000 ? t - 500 : 1500 - t;
+  s->gyro[0] = v / 4;
+  s->gyro[1] = -v / 8;
+  s->gyro[2] = v / 2;
+}
+
+void report(const char * name, unsigned char algorithm, bool fixedPoint)
+{
+  unsigned long long span = samples[numSamples - 1].timestamp_us -
+                            samples[0].timestamp_us;
+  unsigned long used = 0;
+  unsigned long elapsed = 0;
+
+  // Each pass continues where the last left off in time.
+  span += span / (numSamples - 1);
+  imu.fusionBegin(algorithm, fixedPoint);
+  for (unsigned char pass = 0; pass < PASSES; pass++)
+  {
+    unsigned long start = micros();
+    used += imu.fusionUpdate(samples, numSamples);
+    elapsed += micros() - start;
+    for (unsigned short i = 0; i < numSamples; i++)
+      samples[i].timestamp_us += span;
+  }
+
+  float usPerSample = (float)elapsed / used;
+  SerialPort.print(String(name) + "," + String(used) + "," +
+                   String(usPerSample, 3) + ",");
+#ifdef F_CPU
+  SerialPort.print(String(usPerSample * (F_CPU / 1000000.0f), 0));
+#endif
+  SerialPort.println("," + String(usPerSample * SAMPLE_RATE / 10000.0f, 2));
+}
@@ -17,31 +17,72 @@ Supported Platforms:
 ******************************************************************************/
 #include "SparkFunMPU9250-DMP.h"
 #include "MPU9250_RegisterMap.h"
+#include <string.h>
 
 extern "C" {
 #include "util/inv_mpu.h"
+#include "util/arduino_mpu9250_i2c.h"
 }
 
-static unsigned char mpu9250_orientation;
-static unsigned char tap_count;
-static unsigned char tap_direction;
-static bool _tap_available;
-static void orient_cb(unsigned char orient);
-static void tap_cb(unsigned char direction, unsigned char count);
+#if !defined(ARDUINO)
+#include <math.h>
+#define PI 3.1415926535897932384626433832795
+#define constrain(amt, low, high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#endif
 
+// Float versions of PI and 180 / PI, so angle math stays in single precision
+#define PI_F         3.14159265f
+#define RAD_TO_DEG_F 57.29577951f
+#define DEG_TO_RAD_F 0.01745329252f
+
+// Filter held in _fusion
+#define FUSION_OFF   0
+#define FUSION_FLOAT 1
+#define FUSION_FIXED 2
+
+#if defined(ARDUINO)
 MPU9250_DMP::MPU9250_DMP()
 {
-	i2cAddr = 0x68;
-	_mSense = 6.665f; // Constant - 4915 / 32760
-	_aSense = 0.0f;   // Updated after accel FSR is set
-	_gSense = 0.0f;   // Updated after gyro FSR is set
+	init(&arduino_i2c_bus, 0x68);
+}
+
+MPU9250_DMP::MPU9250_DMP(const unsigned char addr)
+{
+	init(&arduino_i2c_bus, addr);
+}
+#endif
+
+MPU9250_DMP::MPU9250_DMP(const mpu_bus_s * bus, const unsigned char addr)
+{
+	init(bus, addr);
 }
 
-MPU9250_DMP::MPU9250_DMP(const unsigned char addr){
-	i2cAddr = addr;
+void MPU9250_DMP::init(const mpu_bus_s * bus, unsigned char addr)
+{
+	mpu_init_state(&_mpu, bus, addr);
 	_mSense = 6.665f; // Constant - 4915 / 32760
 	_aSense = 0.0f;   // Updated after accel FSR is set
 	_gSense = 0.0f;   // Updated after gyro FSR is set
+	_aScale = 0.0f;
+	_gScale = 0.0f;
+	_aScaleFixed = 0;
+	_gScaleFixed = 0;
+	_orientation = 0;
+	_tapCount = 0;
+	_tapDirection = 0;
+	_tapAvailable = false;
+	_asyncStage = 0;
+	memset(&_ring, 0, sizeof(_ring));
+	_captureTask = 0;
+	_captureStop = false;
+	_capturePin = -1;
+	_fusionMode = FUSION_OFF;
+	mpu_magcal_init(&_magCal);
+}
+
+void MPU9250_DMP::setClock(const mpu_clock_s * clock)
+{
+	mpu_set_clock(&_mpu, clock);
 }
 
 inv_error_t MPU9250_DMP::begin(void)
@@ -53,43 +94,105 @@ inv_error_t MPU9250_DMP::begin(uint32_t i2cFrequency)
 {
 	inv_error_t result;
     struct int_param_s int_param;
-	Wire.setClock(i2cFrequency);
-	Wire.begin();
+#if defined(ARDUINO)
+	if (_mpu.bus == &arduino_i2c_bus)
+	{
+		Wire.setClock(i2cFrequency);
+		Wire.begin();
+	}
+#endif
 	
-	result = mpu_init(i2cAddr, &int_param);
+	result = mpu_init(&_mpu, &int_param);
 	
 	if (result)
 		return result;
 	
-	mpu_set_bypass(i2cAddr, 1); // Place all slaves (including compass) on primary bus
+	mpu_set_bypass(&_mpu, 1); // Place all slaves (including compass) on primary bus
 	
 	setSensors(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
 	
-	_gSense = getGyroSens();
-	_aSense = getAccelSens();
+	updateSens();
 	
 	return result;
 }
 
+// beginAsync()/poll() steps, run in this order. Each starts a driver
+// operation that mpu_poll() finishes.
+#define ASYNC_IDLE    0
+#define ASYNC_INIT    1 // mpu_init
+#define ASYNC_BYPASS  2 // Place all slaves (including compass) on primary bus
+#define ASYNC_SENSORS 3 // Power up gyro, accel and compass
+#define ASYNC_OTHER   4 // Operation with no follow-up (resetFifoAsync)
+
+inv_error_t MPU9250_DMP::beginAsync(uint32_t i2cFrequency)
+{
+    struct int_param_s int_param;
+#if defined(ARDUINO)
+	if (_mpu.bus == &arduino_i2c_bus)
+	{
+		Wire.setClock(i2cFrequency);
+		Wire.begin();
+	}
+#endif
+	
+	if (_asyncStage != ASYNC_IDLE)
+		return INV_ERROR;
+	if (mpu_init_start(&_mpu, &int_param) < 0)
+		return INV_ERROR;
+	_asyncStage = ASYNC_INIT;
+	return poll();
+}
+
+inv_error_t MPU9250_DMP::poll(void)
+{
+	int result = mpu_poll(&_mpu);
+	
+	while (result == 0)
+	{
+		switch (_asyncStage)
+		{
+		case ASYNC_INIT:
+			result = mpu_set_bypass_start(&_mpu, 1);
+			break;
+		case ASYNC_BYPASS:
+			result = mpu_set_sensors_start(&_mpu, INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
+			break;
+		case ASYNC_SENSORS:
+			updateSens();
+			// Fall through
+		default:
+			_asyncStage = ASYNC_IDLE;
+			return INV_SUCCESS;
+		}
+		_asyncStage++;
+	}
+	if (result < 0)
+	{
+		_asyncStage = ASYNC_IDLE;
+		return INV_ERROR;
+	}
+	return INV_IN_PROGRESS;
+}
+
 inv_error_t MPU9250_DMP::enableInterrupt(unsigned char enable)
 {
-	return set_int_enable(i2cAddr, enable);
+	return set_int_enable(&_mpu, enable);
 }
 
 inv_error_t MPU9250_DMP::setIntLevel(unsigned char active_low)
 {
-	return mpu_set_int_level(active_low);
+	return mpu_set_int_level(&_mpu, active_low);
 }
 
 inv_error_t MPU9250_DMP::setIntLatched(unsigned char enable)
 {
-	return mpu_set_int_latched(i2cAddr, enable);
+	return mpu_set_int_latched(&_mpu, enable);
 }
 
 short MPU9250_DMP::getIntStatus(void)
 {
 	short status;
-	if (mpu_get_int_status(i2cAddr, &status) == INV_SUCCESS)
+	if (mpu_get_int_status(&_mpu, &status) == INV_SUCCESS)
 	{
 		return status;
 	}
@@ -102,16 +205,16 @@ short MPU9250_DMP::getIntStatus(void)
 // Disables compass and gyro
 inv_error_t MPU9250_DMP::lowPowerAccel(unsigned short rate)
 {
-	return mpu_lp_accel_mode(i2cAddr, rate);
+	return mpu_lp_accel_mode(&_mpu, rate);
 }
 
 inv_error_t MPU9250_DMP::setGyroFSR(unsigned short fsr)
 {
 	inv_error_t err;
-	err = mpu_set_gyro_fsr(i2cAddr, fsr);
+	err = mpu_set_gyro_fsr(&_mpu, fsr);
 	if (err == INV_SUCCESS)
 	{
-		_gSense = getGyroSens();
+		updateSens();
 	}
 	return err;
 }
@@ -119,10 +222,10 @@ inv_error_t MPU9250_DMP::setGyroFSR(unsigned short fsr)
 inv_error_t MPU9250_DMP::setAccelFSR(unsigned char fsr)
 {
 	inv_error_t err;
-	err = mpu_set_accel_fsr(i2cAddr, fsr);
+	err = mpu_set_accel_fsr(&_mpu, fsr);
 	if (err == INV_SUCCESS)
 	{
-		_aSense = getAccelSens();
+		updateSens();
 	}
 	return err;
 }
@@ -130,7 +233,7 @@ inv_error_t MPU9250_DMP::setAccelFSR(unsigned char fsr)
 unsigned short MPU9250_DMP::getGyroFSR(void)
 {
 	unsigned short tmp;
-	if (mpu_get_gyro_fsr(&tmp) == INV_SUCCESS)
+	if (mpu_get_gyro_fsr(&_mpu, &tmp) == INV_SUCCESS)
 	{
 		return tmp;
 	}
@@ -140,7 +243,7 @@ unsigned short MPU9250_DMP::getGyroFSR(void)
 unsigned char MPU9250_DMP::getAccelFSR(void)
 {
 	unsigned char tmp;
-	if (mpu_get_accel_fsr(&tmp) == INV_SUCCESS)
+	if (mpu_get_accel_fsr(&_mpu, &tmp) == INV_SUCCESS)
 	{
 		return tmp;
 	}
@@ -150,7 +253,7 @@ unsigned char MPU9250_DMP::getAccelFSR(void)
 unsigned short MPU9250_DMP::getMagFSR(void)
 {
 	unsigned short tmp;
-	if (mpu_get_compass_fsr(&tmp) == INV_SUCCESS)
+	if (mpu_get_compass_fsr(&_mpu, &tmp) == INV_SUCCESS)
 	{
 		return tmp;
 	}
@@ -159,13 +262,13 @@ unsigned short MPU9250_DMP::getMagFSR(void)
 
 inv_error_t MPU9250_DMP::setLPF(unsigned short lpf)
 {
-	return mpu_set_lpf(i2cAddr, lpf);
+	return mpu_set_lpf(&_mpu, lpf);
 }
 
 unsigned short MPU9250_DMP::getLPF(void)
 {
 	unsigned short tmp;
-	if (mpu_get_lpf(&tmp) == INV_SUCCESS)
+	if (mpu_get_lpf(&_mpu, &tmp) == INV_SUCCESS)
 	{
 		return tmp;
 	}
@@ -174,13 +277,13 @@ unsigned short MPU9250_DMP::getLPF(void)
 
 inv_error_t MPU9250_DMP::setSampleRate(unsigned short rate)
 {
-    return mpu_set_sample_rate(i2cAddr, rate);
+    return mpu_set_sample_rate(&_mpu, rate);
 }
 
 unsigned short MPU9250_DMP::getSampleRate(void)
 {
 	unsigned short tmp;
-	if (mpu_get_sample_rate(&tmp) == INV_SUCCESS)
+	if (mpu_get_sample_rate(&_mpu, &tmp) == INV_SUCCESS)
 	{
 		return tmp;
 	}
@@ -189,13 +292,18 @@ unsigned short MPU9250_DMP::getSampleRate(void)
 
 inv_error_t MPU9250_DMP::setCompassSampleRate(unsigned short rate)
 {
-	return mpu_set_compass_sample_rate(i2cAddr, rate);
+	return mpu_set_compass_sample_rate(&_mpu, rate);
+}
+
+inv_error_t MPU9250_DMP::setCompassContinuous(bool enable)
+{
+	return mpu_set_compass_continuous(&_mpu, enable);
 }
 
 unsigned short MPU9250_DMP::getCompassSampleRate(void)
 {
 	unsigned short tmp;
-	if (mpu_get_compass_sample_rate(&tmp) == INV_SUCCESS)
+	if (mpu_get_compass_sample_rate(&_mpu, &tmp) == INV_SUCCESS)
 	{
 		return tmp;
 	}
@@ -206,7 +314,7 @@ unsigned short MPU9250_DMP::getCompassSampleRate(void)
 float MPU9250_DMP::getGyroSens(void)
 {
 	float sens;
-	if (mpu_get_gyro_sens(&sens) == INV_SUCCESS)
+	if (mpu_get_gyro_sens(&_mpu, &sens) == INV_SUCCESS)
 	{
 		return sens;
 	}
@@ -216,7 +324,7 @@ float MPU9250_DMP::getGyroSens(void)
 unsigned short MPU9250_DMP::getAccelSens(void)
 {
 	unsigned short sens;
-	if (mpu_get_accel_sens(&sens) == INV_SUCCESS)
+	if (mpu_get_accel_sens(&_mpu, &sens) == INV_SUCCESS)
 	{
 		return sens;
 	}
@@ -231,7 +339,7 @@ float MPU9250_DMP::getMagSens(void)
 unsigned char MPU9250_DMP::getFifoConfig(void)
 {
 	unsigned char sensors;
-	if (mpu_get_fifo_config(&sensors) == INV_SUCCESS)
+	if (mpu_get_fifo_config(&_mpu, &sensors) == INV_SUCCESS)
 	{
 		return sensors;
 	}
@@ -240,21 +348,168 @@ unsigned char MPU9250_DMP::getFifoConfig(void)
 
 inv_error_t MPU9250_DMP::configureFifo(unsigned char sensors)
 {
-	return mpu_configure_fifo(i2cAddr, sensors);
+	return mpu_configure_fifo(&_mpu, sensors);
 }
 
 inv_error_t MPU9250_DMP::resetFifo(void)
 {
-	return mpu_reset_fifo(i2cAddr);
+	return mpu_reset_fifo(&_mpu);
+}
+
+inv_error_t MPU9250_DMP::setFifoRecovery(unsigned char policy)
+{
+	return mpu_set_fifo_recovery(&_mpu, policy);
+}
+
+mpu_fifo_stats_s MPU9250_DMP::getFifoStats(void)
+{
+	mpu_fifo_stats_s stats;
+	mpu_get_fifo_stats(&_mpu, &stats);
+	return stats;
+}
+
+void MPU9250_DMP::resetFifoStats(void)
+{
+	mpu_reset_fifo_stats(&_mpu);
+}
+
+void MPU9250_DMP::markDataReady(void)
+{
+	mpu_mark_data_ready(&_mpu);
+}
+
+inv_error_t MPU9250_DMP::getSampleTiming(unsigned long * periodNs, long * driftPpm)
+{
+	return mpu_get_sample_timing(&_mpu, periodNs, driftPpm);
+}
+
+inv_error_t MPU9250_DMP::startCapture(mpu_sample_s * buffer, unsigned short size, int intPin)
+{
+	if (_captureTask)
+		return INV_ERROR;
+#if defined(ESP32)
+	// Kept, with the samples still in it, if the task can't be started
+	mpu_ring_s oldRing = _ring;
+#else
+	// No capture task without FreeRTOS
+	if (intPin >= 0)
+		return INV_ERROR;
+#endif
+	if (mpu_ring_init(&_ring, buffer, size) != INV_SUCCESS)
+		return INV_ERROR;
+	if (intPin < 0)
+		return INV_SUCCESS;
+#if defined(ESP32)
+	// The bus can't be used from the interrupt handler, so it only wakes a
+	// task that does the reading.
+	TaskHandle_t task;
+	_captureStop = false;
+	if (xTaskCreate(captureTask, "mpu9250", CAPTURE_TASK_STACK, this,
+	                CAPTURE_TASK_PRIO, &task) != pdPASS)
+	{
+		_ring = oldRing;
+		return INV_ERROR;
+	}
+	_captureTask = task;
+	_capturePin = intPin;
+	attachInterruptArg(digitalPinToInterrupt(intPin), captureIsr, this,
+	                   _mpu.chip_cfg.active_low_int ? FALLING : RISING);
+#endif
+	return INV_SUCCESS;
+}
+
+void MPU9250_DMP::stopCapture(void)
+{
+#if defined(ESP32)
+	if (!_captureTask)
+		return;
+	detachInterrupt(digitalPinToInterrupt(_capturePin));
+	_captureStop = true;
+	xTaskNotifyGive((TaskHandle_t)_captureTask);
+	while (_captureTask)
+		delay(1);
+#endif
+}
+
+#if defined(ESP32)
+void IRAM_ATTR MPU9250_DMP::captureIsr(void * arg)
+{
+	MPU9250_DMP * imu = (MPU9250_DMP *)arg;
+	BaseType_t woken = pdFALSE;
+	
+	imu->markDataReady();
+	vTaskNotifyGiveFromISR((TaskHandle_t)imu->_captureTask, &woken);
+	if (woken)
+		portYIELD_FROM_ISR();
+}
+
+void MPU9250_DMP::captureTask(void * arg)
+{
+	MPU9250_DMP * imu = (MPU9250_DMP *)arg;
+	
+	while (!imu->_captureStop)
+	{
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CAPTURE_TASK_TIMEOUT));
+		if (!imu->_captureStop)
+			imu->captureFifo();
+	}
+	imu->_captureTask = 0;
+	vTaskDelete(NULL);
+}
+#endif
+
+unsigned short MPU9250_DMP::captureFifo(void)
+{
+	unsigned char dmpOn;
+	int result;
+	
+	if (mpu_get_dmp_state(&_mpu, &dmpOn) != INV_SUCCESS)
+		return 0;
+	if (dmpOn)
+		result = dmp_read_fifo_ring(&_mpu, &_ring);
+	else
+		result = mpu_read_fifo_ring(&_mpu, &_ring);
+	
+	return result > 0 ? result : 0;
+}
+
+unsigned short MPU9250_DMP::popSamples(mpu_sample_s * samples, unsigned short maxSamples)
+{
+	unsigned short count = mpu_ring_pop(&_ring, samples, maxSamples);
+	
+	if (count > 0)
+		updateFromSample(&samples[count - 1]);
+	
+	return count;
+}
+
+unsigned short MPU9250_DMP::samplesAvailable(void)
+{
+	return mpu_ring_count(&_ring);
+}
+
+unsigned long MPU9250_DMP::captureOverruns(void)
+{
+	return _ring.full;
+}
+
+inv_error_t MPU9250_DMP::resetFifoAsync(void)
+{
+	if (_asyncStage != ASYNC_IDLE)
+		return INV_ERROR;
+	if (mpu_reset_fifo_start(&_mpu) < 0)
+		return INV_ERROR;
+	_asyncStage = ASYNC_OTHER;
+	return poll();
 }
 
 unsigned short MPU9250_DMP::fifoAvailable(void)
 {
 	unsigned char fifoH, fifoL;
 	
-	if (mpu_read_reg(i2cAddr, MPU9250_FIFO_COUNTH, &fifoH) != INV_SUCCESS)
+	if (mpu_read_reg(&_mpu, MPU9250_FIFO_COUNTH, &fifoH) != INV_SUCCESS)
 		return 0;
-	if (mpu_read_reg(i2cAddr, MPU9250_FIFO_COUNTL, &fifoL) != INV_SUCCESS)
+	if (mpu_read_reg(&_mpu, MPU9250_FIFO_COUNTL, &fifoL) != INV_SUCCESS)
 		return 0;
 	
 	return (fifoH << 8 ) | fifoL;
@@ -262,43 +517,57 @@ unsigned short MPU9250_DMP::fifoAvailable(void)
 
 inv_error_t MPU9250_DMP::updateFifo(void)
 {
-	short gyro[3], accel[3];
-	unsigned long timestamp;
-	unsigned char sensors, more;
+	mpu_sample_s sample;
+	unsigned short count, more, dropped;
 	inv_error_t err;
 	
-	if ((err = mpu_read_fifo(i2cAddr, gyro, accel, &timestamp, &sensors, &more)) != INV_SUCCESS)
-		return err; //i added to try and debug
-		//return INV_ERROR;
-	
-	if (sensors & INV_XYZ_ACCEL)
-	{
-		ax = accel[X_AXIS];
-		ay = accel[Y_AXIS];
-		az = accel[Z_AXIS];
-	}
-	if (sensors & INV_X_GYRO)
-		gx = gyro[X_AXIS];
-	if (sensors & INV_Y_GYRO)
-		gy = gyro[Y_AXIS];
-	if (sensors & INV_Z_GYRO)
-		gz = gyro[Z_AXIS];
+	if ((err = mpu_read_fifo_batch(&_mpu, &sample, 1, &count, &more, &dropped)) != INV_SUCCESS)
+		return err;
+	if (count == 0)
+		return INV_ERROR;
 	
-	time = timestamp;
+	updateFromSample(&sample);
 	
 	return INV_SUCCESS;
 }
 
+unsigned short MPU9250_DMP::readFifoBatch(mpu_sample_s * samples, unsigned short maxSamples,
+                                          unsigned short * dropped)
+{
+	unsigned short count, more, lost;
+	
+	if (dropped)
+		*dropped = 0;
+	if (mpu_read_fifo_batch(&_mpu, samples, maxSamples, &count, &more, &lost) != INV_SUCCESS)
+		count = 0;
+	if (dropped)
+		*dropped = lost;
+	if (count > 0)
+		updateFromSample(&samples[count - 1]);
+	
+	return count;
+}
+
 inv_error_t MPU9250_DMP::setSensors(unsigned char sensors)
 {
-	return mpu_set_sensors(i2cAddr, sensors);
+	return mpu_set_sensors(&_mpu, sensors);
+}
+
+inv_error_t MPU9250_DMP::beginConfig(void)
+{
+	return mpu_config_begin(&_mpu);
+}
+
+inv_error_t MPU9250_DMP::commit(void)
+{
+	return mpu_config_commit(&_mpu);
 }
 
 bool MPU9250_DMP::dataReady()
 {
 	unsigned char intStatusReg;
 	
-	if (mpu_read_reg(i2cAddr, MPU9250_INT_STATUS, &intStatusReg) == INV_SUCCESS)
+	if (mpu_read_reg(&_mpu, MPU9250_INT_STATUS, &intStatusReg) == INV_SUCCESS)
 	{
 		return (intStatusReg & (1<<INT_STATUS_RAW_DATA_RDY_INT));
 	}
@@ -312,6 +581,10 @@ inv_error_t MPU9250_DMP::update(unsigned char sensors)
 	inv_error_t mErr = INV_SUCCESS;
 	inv_error_t tErr = INV_SUCCESS;
 	
+	// Two or more sensors: one burst costs less than a read each
+	if (sensors & (sensors - 1))
+		return updateBurst(sensors, 0);
+	
 	if (sensors & UPDATE_ACCEL)
 		aErr = updateAccel();
 	if (sensors & UPDATE_GYRO)
@@ -324,11 +597,52 @@ inv_error_t MPU9250_DMP::update(unsigned char sensors)
 	return aErr | gErr | mErr | tErr;
 }
 
+inv_error_t MPU9250_DMP::updateAll(unsigned char * intStatus)
+{
+	return updateBurst(0, intStatus);
+}
+
+inv_error_t MPU9250_DMP::updateBurst(unsigned char sensors, unsigned char * intStatus)
+{
+	short accel[3], gyro[3], mag[3];
+	short valid;
+	long temp;
+	
+	if (mpu_get_all_reg(&_mpu, accel, gyro, &temp, mag, intStatus, &valid, &time))
+		return INV_ERROR;
+	
+	if (valid & INV_XYZ_ACCEL)
+	{
+		ax = accel[X_AXIS];
+		ay = accel[Y_AXIS];
+		az = accel[Z_AXIS];
+	}
+	if (valid & INV_XYZ_GYRO)
+	{
+		gx = gyro[X_AXIS];
+		gy = gyro[Y_AXIS];
+		gz = gyro[Z_AXIS];
+	}
+	if (valid & INV_XYZ_COMPASS)
+	{
+		mx = mag[X_AXIS];
+		my = mag[Y_AXIS];
+		mz = mag[Z_AXIS];
+	}
+	temperature = temp;
+	
+	if (((sensors & UPDATE_ACCEL) && !(valid & INV_XYZ_ACCEL)) ||
+	    ((sensors & UPDATE_GYRO) && !(valid & INV_XYZ_GYRO)) ||
+	    ((sensors & UPDATE_COMPASS) && !(valid & INV_XYZ_COMPASS)))
+		return INV_ERROR;
+	return INV_SUCCESS;
+}
+
 int MPU9250_DMP::updateAccel(void)
 {
 	short data[3];
 	
-	if (mpu_get_accel_reg(i2cAddr, data, &time))
+	if (mpu_get_accel_reg(&_mpu, data, &time))
 	{
 		return INV_ERROR;		
 	}
@@ -342,7 +656,7 @@ int MPU9250_DMP::updateGyro(void)
 {
 	short data[3];
 	
-	if (mpu_get_gyro_reg(i2cAddr, data, &time))
+	if (mpu_get_gyro_reg(&_mpu, data, &time))
 	{
 		return INV_ERROR;		
 	}
@@ -356,7 +670,7 @@ int MPU9250_DMP::updateCompass(void)
 {
 	short data[3];
 	
-	if (mpu_get_compass_reg(i2cAddr, data, &time))
+	if (mpu_get_compass_reg(&_mpu, data, &time))
 	{
 		return INV_ERROR;		
 	}
@@ -368,13 +682,13 @@ int MPU9250_DMP::updateCompass(void)
 
 inv_error_t MPU9250_DMP::updateTemperature(void)
 {
-	return mpu_get_temperature(i2cAddr, &temperature, &time);
+	return mpu_get_temperature(&_mpu, &temperature, &time);
 }
 
 int MPU9250_DMP::selfTest(unsigned char debug)
 {
 	long gyro[3], accel[3];
-	return mpu_run_self_test(i2cAddr, gyro, accel);
+	return mpu_run_self_test(&_mpu, gyro, accel);
 }
 
 inv_error_t MPU9250_DMP::dmpBegin(unsigned short features, unsigned short fifoRate)
@@ -388,16 +702,10 @@ inv_error_t MPU9250_DMP::dmpBegin(unsigned short features, unsigned short fifoRa
 	// 3-axis and 6-axis LP quat are mutually exclusive.
 	// If both are selected, default to 3-axis
 	if (feat & DMP_FEATURE_LP_QUAT)
-	{
 		feat &= ~(DMP_FEATURE_6X_LP_QUAT);
-		dmp_enable_lp_quat(i2cAddr, 1);
-	}
-	else if (feat & DMP_FEATURE_6X_LP_QUAT)
-		dmp_enable_6x_lp_quat(i2cAddr, 1);
-	
-	if (feat & DMP_FEATURE_GYRO_CAL)
-		dmp_enable_gyro_cal(i2cAddr, 1);
 	
+	// dmpEnableFeatures sets the quaternion and gyro calibration keys
+	// itself, in one batch with a single FIFO reset.
 	if (dmpEnableFeatures(feat) != INV_SUCCESS)
 		return INV_ERROR;
 	
@@ -405,18 +713,67 @@ inv_error_t MPU9250_DMP::dmpBegin(unsigned short features, unsigned short fifoRa
 	if (dmpSetFifoRate(rate) != INV_SUCCESS)
 		return INV_ERROR;
 	
-	return mpu_set_dmp_state(i2cAddr, 1);
+	return mpu_set_dmp_state(&_mpu, 1);
+}
+
+inv_error_t MPU9250_DMP::dmpBeginWarm(unsigned short features, unsigned short fifoRate)
+{
+	unsigned short feat = features;
+	unsigned short rate = constrain(fifoRate, 1, 200);
+	struct int_param_s int_param;
+#if defined(ARDUINO)
+	if (_mpu.bus == &arduino_i2c_bus)
+	{
+		Wire.setClock(400000);
+		Wire.begin();
+	}
+#endif
+	
+	if (mpu_init_warm(&_mpu, &int_param) != INV_SUCCESS)
+		return INV_ERROR;
+	if (!_mpu.chip_cfg.dmp_on)
+		return INV_ERROR;
+	if (dmp_adopt_motion_driver_firmware(&_mpu) != INV_SUCCESS)
+		return INV_ERROR;
+	if (dmp_adopt_features(&_mpu) != INV_SUCCESS)
+		return INV_ERROR;
+	// The DMP doesn't know about DMP_FEATURE_SEND_COMPASS; take it as asked.
+	_mpu.dmp.feature_mask |= features & DMP_FEATURE_SEND_COMPASS;
+	
+	// Apply the same adjustments as dmpBegin and dmpEnableFeatures.
+	if (feat & DMP_FEATURE_LP_QUAT)
+		feat &= ~(DMP_FEATURE_6X_LP_QUAT);
+	feat |= DMP_FEATURE_TAP | DMP_FEATURE_PEDOMETER;
+	if (dmpGetEnabledFeatures() != feat)
+		return INV_ERROR;
+	// The DMP only runs at whole divisions of its 200Hz rate.
+	if (dmpGetFifoRate() != MAX_DMP_SAMPLE_RATE / (MAX_DMP_SAMPLE_RATE / rate))
+		return INV_ERROR;
+	
+	if (features & DMP_FEATURE_TAP)
+		dmp_register_tap_cb(&_mpu, tapCallback, this);
+	if (features & DMP_FEATURE_ANDROID_ORIENT)
+		dmp_register_android_orient_cb(&_mpu, orientCallback, this);
+	
+	updateSens();
+	
+	return INV_SUCCESS;
 }
 
 inv_error_t MPU9250_DMP::dmpLoad(void)
 {
-	return dmp_load_motion_driver_firmware(i2cAddr);
+	return dmp_load_motion_driver_firmware(&_mpu);
+}
+
+inv_error_t MPU9250_DMP::dmpSetLoadVerify(unsigned char mode)
+{
+	return mpu_set_firmware_verify(&_mpu, mode);
 }
 
 unsigned short MPU9250_DMP::dmpGetFifoRate(void)
 {
 	unsigned short rate;
-	if (dmp_get_fifo_rate(&rate) == INV_SUCCESS)
+	if (dmp_get_fifo_rate(&_mpu, &rate) == INV_SUCCESS)
 		return rate;
 	
 	return 0;
@@ -425,56 +782,43 @@ unsigned short MPU9250_DMP::dmpGetFifoRate(void)
 inv_error_t MPU9250_DMP::dmpSetFifoRate(unsigned short rate)
 {
 	if (rate > MAX_DMP_SAMPLE_RATE) rate = MAX_DMP_SAMPLE_RATE;
-	return dmp_set_fifo_rate(i2cAddr, rate);
+	return dmp_set_fifo_rate(&_mpu, rate);
 }
 
 inv_error_t MPU9250_DMP::dmpUpdateFifo(void)
 {
-	short gyro[3];
-	short accel[3];
-	long quat[4];
-	unsigned long timestamp;
-	short sensors;
-	unsigned char more;
+	mpu_sample_s sample;
+	unsigned short count, more;
 	inv_error_t err;
-	int starttime, dtime;
-	
-	starttime = millis();
-	err = dmp_read_fifo(i2cAddr, gyro, accel, quat, &timestamp, &sensors, &more);
-	dtime = millis() - starttime;
 	
+	err = dmp_read_fifo_batch(&_mpu, &sample, 1, &count, &more);
+	if (count > 0)
+		updateFromSample(&sample);
 	if (err != INV_SUCCESS)
-    {
-		Serial.print("time taken for read: ");
-		Serial.print(dtime);
-		Serial.print(" ms\n");
 		return err;
-		//return INV_ERROR;
-    }
 	
-	if (sensors & INV_XYZ_ACCEL)
-	{
-		ax = accel[X_AXIS];
-		ay = accel[Y_AXIS];
-		az = accel[Z_AXIS];
-	}
-	if (sensors & INV_X_GYRO)
-		gx = gyro[X_AXIS];
-	if (sensors & INV_Y_GYRO)
-		gy = gyro[Y_AXIS];
-	if (sensors & INV_Z_GYRO)
-		gz = gyro[Z_AXIS];
-	if (sensors & INV_WXYZ_QUAT)
-	{
-		qw = quat[0];
-		qx = quat[1];
-		qy = quat[2];
-		qz = quat[3];
-	}
+	return count ? INV_SUCCESS : INV_ERROR;
+}
+
+unsigned short MPU9250_DMP::dmpDrainFifo(mpu_sample_s * samples, unsigned short maxSamples,
+                                         inv_error_t * result)
+{
+	unsigned short count, more;
+	inv_error_t err;
 	
-	time = timestamp;
+	// Packets decoded before an error are good; keep them
+	err = dmp_read_fifo_batch(&_mpu, samples, maxSamples, &count, &more);
+	if (result)
+		*result = err;
+	if (count > 0)
+		updateFromSample(&samples[count - 1]);
 	
-	return INV_SUCCESS;
+	return count;
+}
+
+inv_error_t MPU9250_DMP::dmpSetFifoResync(bool enable)
+{
+	return dmp_set_fifo_resync(&_mpu, enable);
 }
 
 inv_error_t MPU9250_DMP::dmpEnableFeatures(unsigned short mask)
@@ -484,13 +828,13 @@ inv_error_t MPU9250_DMP::dmpEnableFeatures(unsigned short mask)
 	// Combat known issue where fifo sample rate is incorrect
 	// unless tap is enabled in the DMP.
 	enMask |= DMP_FEATURE_TAP; 
-	return dmp_enable_feature(i2cAddr, enMask);
+	return dmp_enable_feature(&_mpu, enMask);
 }
 
 unsigned short MPU9250_DMP::dmpGetEnabledFeatures(void)
 {
 	unsigned short mask;
-	if (dmp_get_enabled_features(&mask) == INV_SUCCESS)
+	if (dmp_get_enabled_features(&_mpu, &mask) == INV_SUCCESS)
 		return mask;
 	return 0;
 }
@@ -500,56 +844,56 @@ inv_error_t MPU9250_DMP::dmpSetTap(
         unsigned char taps, unsigned short tapTime, unsigned short tapMulti)
 {
 	unsigned char axes = 0;
+	inv_error_t result = INV_SUCCESS;
+	
+	// Send the tap settings together, skipping any already in place.
+	dmp_mem_batch_begin(&_mpu);
 	if (xThresh > 0)
 	{
 		axes |= TAP_X;
 		xThresh = constrain(xThresh, 1, 1600);
-		if (dmp_set_tap_thresh(i2cAddr, 1<<X_AXIS, xThresh) != INV_SUCCESS)
-			return INV_ERROR;
+		result |= dmp_set_tap_thresh(&_mpu, 1<<X_AXIS, xThresh);
 	}
 	if (yThresh > 0)
 	{
 		axes |= TAP_Y;
 		yThresh = constrain(yThresh, 1, 1600);
-		if (dmp_set_tap_thresh(i2cAddr, 1<<Y_AXIS, yThresh) != INV_SUCCESS)
-			return INV_ERROR;
+		result |= dmp_set_tap_thresh(&_mpu, 1<<Y_AXIS, yThresh);
 	}
 	if (zThresh > 0)
 	{
 		axes |= TAP_Z;
 		zThresh = constrain(zThresh, 1, 1600);
-		if (dmp_set_tap_thresh(i2cAddr, 1<<Z_AXIS, zThresh) != INV_SUCCESS)
-			return INV_ERROR;
+		result |= dmp_set_tap_thresh(&_mpu, 1<<Z_AXIS, zThresh);
 	}
-	if (dmp_set_tap_axes(i2cAddr, axes) != INV_SUCCESS)
-		return INV_ERROR;
-	if (dmp_set_tap_count(i2cAddr, taps) != INV_SUCCESS)
-		return INV_ERROR;
-	if (dmp_set_tap_time(i2cAddr, tapTime) != INV_SUCCESS)
-		return INV_ERROR;
-	if (dmp_set_tap_time_multi(i2cAddr, tapMulti) != INV_SUCCESS)
+	result |= dmp_set_tap_axes(&_mpu, axes);
+	result |= dmp_set_tap_count(&_mpu, taps);
+	result |= dmp_set_tap_time(&_mpu, tapTime);
+	result |= dmp_set_tap_time_multi(&_mpu, tapMulti);
+	result |= dmp_mem_batch_end(&_mpu);
+	if (result != INV_SUCCESS)
 		return INV_ERROR;
 	
-    dmp_register_tap_cb(tap_cb);
+    dmp_register_tap_cb(&_mpu, tapCallback, this);
 	
 	return INV_SUCCESS;
 }
 
 unsigned char MPU9250_DMP::getTapDir(void)
 {
-	_tap_available = false;
-	return tap_direction;
+	_tapAvailable = false;
+	return _tapDirection;
 }
 
 unsigned char MPU9250_DMP::getTapCount(void)
 {
-	_tap_available = false;
-	return tap_count;
+	_tapAvailable = false;
+	return _tapCount;
 }
 
 bool MPU9250_DMP::tapAvailable(void)
 {
-	return _tap_available;
+	return _tapAvailable;
 }
 
 inv_error_t MPU9250_DMP::dmpSetOrientation(const signed char * orientationMatrix)
@@ -559,14 +903,14 @@ inv_error_t MPU9250_DMP::dmpSetOrientation(const signed char * orientationMatrix
 	scalar |= orientation_row_2_scale(orientationMatrix + 3) << 3;
 	scalar |= orientation_row_2_scale(orientationMatrix + 6) << 6;
 	
-    dmp_register_android_orient_cb(orient_cb);
+    dmp_register_android_orient_cb(&_mpu, orientCallback, this);
 	
-	return dmp_set_orientation(i2cAddr, scalar);
+	return dmp_set_orientation(&_mpu, scalar);
 }
 
 unsigned char MPU9250_DMP::dmpGetOrientation(void)
 {
-	return mpu9250_orientation;
+	return _orientation;
 }
 
 inv_error_t MPU9250_DMP::dmpEnable3Quat(void)
@@ -581,13 +925,13 @@ inv_error_t MPU9250_DMP::dmpEnable3Quat(void)
 	if (dmpEnableFeatures(dmpFeatures) != INV_SUCCESS)
 		return INV_ERROR;
 	
-	return dmp_enable_lp_quat(i2cAddr, 1);
+	return dmp_enable_lp_quat(&_mpu, 1);
 }
 	
 unsigned long MPU9250_DMP::dmpGetPedometerSteps(void)
 {
 	unsigned long steps;
-	if (dmp_get_pedometer_step_count(i2cAddr, &steps) == INV_SUCCESS)
+	if (dmp_get_pedometer_step_count(&_mpu, &steps) == INV_SUCCESS)
 	{
 		return steps;
 	}
@@ -596,13 +940,13 @@ unsigned long MPU9250_DMP::dmpGetPedometerSteps(void)
 
 inv_error_t MPU9250_DMP::dmpSetPedometerSteps(unsigned long steps)
 {
-	return dmp_set_pedometer_step_count(i2cAddr, steps);
+	return dmp_set_pedometer_step_count(&_mpu, steps);
 }
 
 unsigned long MPU9250_DMP::dmpGetPedometerTime(void)
 {
 	unsigned long walkTime;
-	if (dmp_get_pedometer_walk_time(i2cAddr, &walkTime) == INV_SUCCESS)
+	if (dmp_get_pedometer_walk_time(&_mpu, &walkTime) == INV_SUCCESS)
 	{
 		return walkTime;
 	}
@@ -611,7 +955,7 @@ unsigned long MPU9250_DMP::dmpGetPedometerTime(void)
 
 inv_error_t MPU9250_DMP::dmpSetPedometerTime(unsigned long time)
 {
-	return dmp_set_pedometer_walk_time(i2cAddr, time);
+	return dmp_set_pedometer_walk_time(&_mpu, time);
 }
 
 float MPU9250_DMP::calcAccel(int axis)
@@ -633,15 +977,98 @@ float MPU9250_DMP::calcQuat(long axis)
 {
 	return qToFloat(axis, 30);
 }
+
+// 1 / _mSense, and 65536 / _mSense
+#define MAG_SCALE       0.1500375f
+#define MAG_SCALE_FIXED 9833
+
+void MPU9250_DMP::calcAccel(const short * raw, float * out, unsigned long count)
+{
+	mpu_convert_float(raw, out, count, _aScale);
+}
+
+void MPU9250_DMP::calcGyro(const short * raw, float * out, unsigned long count)
+{
+	mpu_convert_float(raw, out, count, _gScale);
+}
+
+void MPU9250_DMP::calcMag(const short * raw, float * out, unsigned long count)
+{
+	mpu_convert_float(raw, out, count, MAG_SCALE);
+}
+
+long MPU9250_DMP::calcAccelFixed(int axis)
+{
+	return (long) axis * _aScaleFixed;
+}
+
+long MPU9250_DMP::calcGyroFixed(int axis)
+{
+	return (long) (((long long) axis * _gScaleFixed + 0x8000) >> 16);
+}
+
+long MPU9250_DMP::calcMagFixed(int axis)
+{
+	return (long) axis * MAG_SCALE_FIXED;
+}
+
+void MPU9250_DMP::calcAccelFixed(const short * raw, long * out, unsigned long count)
+{
+	mpu_convert_fixed(raw, out, count, _aScaleFixed, 0);
+}
+
+void MPU9250_DMP::calcGyroFixed(const short * raw, long * out, unsigned long count)
+{
+	mpu_convert_fixed(raw, out, count, _gScaleFixed, 16);
+}
+
+void MPU9250_DMP::calcMagFixed(const short * raw, long * out, unsigned long count)
+{
+	mpu_convert_fixed(raw, out, count, MAG_SCALE_FIXED, 0);
+}
+
+inv_error_t MPU9250_DMP::calcQuatFixed(long * quat)
+{
+	const long q[4] = {qw, qx, qy, qz};
+	if (mpu_quat_normalize_q30(q, quat))
+		return INV_ERROR;
+	return INV_SUCCESS;
+}
 	
-float MPU9250_DMP::qToFloat(long number, unsigned char q)
+void MPU9250_DMP::updateFromSample(const mpu_sample_s * sample)
 {
-	unsigned long mask = 0;
-	for (int i=0; i<q; i++)
+	if (sample->sensors & INV_XYZ_ACCEL)
+	{
+		ax = sample->accel[X_AXIS];
+		ay = sample->accel[Y_AXIS];
+		az = sample->accel[Z_AXIS];
+	}
+	if (sample->sensors & INV_X_GYRO)
+		gx = sample->gyro[X_AXIS];
+	if (sample->sensors & INV_Y_GYRO)
+		gy = sample->gyro[Y_AXIS];
+	if (sample->sensors & INV_Z_GYRO)
+		gz = sample->gyro[Z_AXIS];
+	if (sample->sensors & INV_XYZ_COMPASS)
 	{
-		mask |= (1<<i);
+		mx = sample->compass[X_AXIS];
+		my = sample->compass[Y_AXIS];
+		mz = sample->compass[Z_AXIS];
 	}
-	return (number >> q) + ((number & mask) / (float) (2<<(q-1)));
+	if (sample->sensors & INV_WXYZ_QUAT)
+	{
+		qw = sample->quat[0];
+		qx = sample->quat[1];
+		qy = sample->quat[2];
+		qz = sample->quat[3];
+	}
+	time = sample->timestamp;
+	timeMicros = sample->timestamp_us;
+}
+
+float MPU9250_DMP::qToFloat(long number, unsigned char q)
+{
+	return (float) number * (1.0f / (float) (1UL << q));
 }
 
 void MPU9250_DMP::computeEulerAngles(bool degrees)
@@ -662,18 +1089,18 @@ void MPU9250_DMP::computeEulerAngles(bool degrees)
     t2 = t2 > 1.0f ? 1.0f : t2;
     t2 = t2 < -1.0f ? -1.0f : t2;
   
-    pitch = asin(t2) * 2;
-    roll = atan2(t3, t4);
-    yaw = atan2(t1, t0);
+    pitch = asinf(t2) * 2;
+    roll = atan2f(t3, t4);
+    yaw = atan2f(t1, t0);
 	
 	if (degrees)
 	{
-		pitch *= (180.0 / PI);
-		roll *= (180.0 / PI);
-		yaw *= (180.0 / PI);
-		if (pitch < 0) pitch = 360.0 + pitch;
-		if (roll < 0) roll = 360.0 + roll;
-		if (yaw < 0) yaw = 360.0 + yaw;	
+		pitch *= RAD_TO_DEG_F;
+		roll *= RAD_TO_DEG_F;
+		yaw *= RAD_TO_DEG_F;
+		if (pitch < 0) pitch = 360.0f + pitch;
+		if (roll < 0) roll = 360.0f + roll;
+		if (yaw < 0) yaw = 360.0f + yaw;	
 	}
 }
 
@@ -693,15 +1120,15 @@ void MPU9250_DMP::computeEulerAngles2(bool degrees)
     //t2 = t2 > 1.0f ? 1.0f : t2;
     //t2 = t2 < -1.0f ? -1.0f : t2;
   
-	yaw = atan2(+2.0f * (q1 * q2 + q0 * q3), q02 + q12 - q22 - q32);
-	pitch = atan2(+2.0f * (q0 * q1 + q2 * q3), q02 - q12 - q22 + q32);
-    roll = -asin(+2.0f * (q1 * q3 - q0 * q2));
+	yaw = atan2f(+2.0f * (q1 * q2 + q0 * q3), q02 + q12 - q22 - q32);
+	pitch = atan2f(+2.0f * (q0 * q1 + q2 * q3), q02 - q12 - q22 + q32);
+    roll = -asinf(+2.0f * (q1 * q3 - q0 * q2));
 	
 	if (degrees)
 	{
-		yaw = yaw * 180.0 / PI;
-		pitch = pitch * 180.0 / PI;
-		roll = roll * 180.0 / PI;
+		yaw = yaw * RAD_TO_DEG_F;
+		pitch = pitch * RAD_TO_DEG_F;
+		roll = roll * RAD_TO_DEG_F;
 		
 		//if (pitch < 0) pitch = 360.0 + pitch;
 		//if (roll < 0) roll = 360.0 + roll;
@@ -709,22 +1136,233 @@ void MPU9250_DMP::computeEulerAngles2(bool degrees)
 	}
 }
 
+void MPU9250_DMP::computeEulerAnglesFixed(bool degrees)
+{
+	const long q[4] = {qw, qx, qy, qz};
+	long euler[3];
+	
+	mpu_quat_to_euler_q16(q, euler);
+	rollQ16 = euler[0];
+	pitchQ16 = euler[1] * 2; // Scaled as in computeEulerAngles
+	yawQ16 = euler[2];
+	
+	if (degrees)
+	{
+		if (pitchQ16 < 0) pitchQ16 += MPU_Q16_DEG_360;
+		if (rollQ16 < 0) rollQ16 += MPU_Q16_DEG_360;
+		if (yawQ16 < 0) yawQ16 += MPU_Q16_DEG_360;
+	}
+	else
+	{
+		pitchQ16 = mpu_deg_to_rad_q16(pitchQ16);
+		rollQ16 = mpu_deg_to_rad_q16(rollQ16);
+		yawQ16 = mpu_deg_to_rad_q16(yawQ16);
+	}
+}
+
+long MPU9250_DMP::computeCompassHeadingFixed(void)
+{
+	if (my == 0)
+		headingQ16 = (mx < 0) ? MPU_Q16_DEG_180 : 0;
+	else
+		headingQ16 = mpu_atan2_q16(mx, my, 0);
+	
+	if (headingQ16 < 0) headingQ16 += MPU_Q16_DEG_360;
+	
+	return headingQ16;
+}
+
 float MPU9250_DMP::computeCompassHeading(void)
 {
 	if (my == 0)
-		heading = (mx < 0) ? PI : 0;
+		heading = (mx < 0) ? PI_F : 0;
 	else
-		heading = atan2(mx, my);
+		heading = atan2f((float) mx, (float) my);
 	
-	if (heading > PI) heading -= (2 * PI);
-	else if (heading < -PI) heading += (2 * PI);
-	else if (heading < 0) heading += 2 * PI;
+	if (heading > PI_F) heading -= (2 * PI_F);
+	else if (heading < -PI_F) heading += (2 * PI_F);
+	else if (heading < 0) heading += 2 * PI_F;
 	
-	heading*= 180.0 / PI;
+	heading *= RAD_TO_DEG_F;
 	
 	return heading;
 }
 
+inv_error_t MPU9250_DMP::fusionBegin(unsigned char algorithm, bool fixedPoint)
+{
+	if (algorithm != MPU_FUSION_MADGWICK && algorithm != MPU_FUSION_MAHONY)
+		return INV_ERROR;
+	if (_gScale <= 0.0f)
+		return INV_ERROR;
+	
+	if (fixedPoint)
+	{
+		mpu_fusion_init_fixed(&_fusion.x, algorithm, 0);
+		_fusionMode = FUSION_FIXED;
+	}
+	else
+	{
+		mpu_fusion_init(&_fusion.f, algorithm, 0.0f);
+		_fusionMode = FUSION_FLOAT;
+	}
+	updateSens(); // Sets the filter's gyro scale
+	
+	return INV_SUCCESS;
+}
+
+unsigned short MPU9250_DMP::fusionUpdate(const mpu_sample_s * samples, unsigned short count)
+{
+	long q[4];
+	unsigned short used;
+	
+	if (_fusionMode == FUSION_FIXED)
+	{
+		used = mpu_fusion_update_fixed(&_fusion.x, samples, count);
+		memcpy(q, _fusion.x.q, sizeof(q));
+	}
+	else if (_fusionMode == FUSION_FLOAT)
+	{
+		used = mpu_fusion_update(&_fusion.f, samples, count);
+		mpu_fusion_get_quat(&_fusion.f, q);
+	}
+	else
+	{
+		return 0;
+	}
+	qw = q[0];
+	qx = q[1];
+	qy = q[2];
+	qz = q[3];
+	
+	return used;
+}
+
+float MPU9250_DMP::computeFusionHeading(void)
+{
+	if (_fusionMode == FUSION_FIXED)
+		heading = mpu_fusion_heading_fixed(&_fusion.x) * (1.0f / 65536.0f);
+	else if (_fusionMode == FUSION_FLOAT)
+		heading = mpu_fusion_heading(&_fusion.f);
+	
+	return heading;
+}
+
+long MPU9250_DMP::computeFusionHeadingFixed(void)
+{
+	if (_fusionMode == FUSION_FIXED)
+		headingQ16 = mpu_fusion_heading_fixed(&_fusion.x);
+	else if (_fusionMode == FUSION_FLOAT)
+		headingQ16 = (long) (mpu_fusion_heading(&_fusion.f) * 65536.0f);
+	
+	return headingQ16;
+}
+
+void MPU9250_DMP::magCalAdd(const mpu_sample_s * samples, unsigned short count)
+{
+	for (unsigned short i = 0; i < count; i++)
+	{
+		if ((samples[i].sensors & INV_XYZ_COMPASS) == INV_XYZ_COMPASS)
+			mpu_magcal_add(&_magCal, samples[i].compass);
+	}
+}
+
+void MPU9250_DMP::magCalAdd(void)
+{
+	short reading[3] = {(short) mx, (short) my, (short) mz};
+	
+	mpu_magcal_add(&_magCal, reading);
+}
+
+inv_error_t MPU9250_DMP::magCalSolve(mpu_magcal_fit_s * fit)
+{
+	mpu_magcal_fit_s result;
+	float offset[3], matrix[9];
+	
+	if (mpu_magcal_solve(&_magCal, &result))
+		return INV_ERROR;
+	// The readings gathered were corrected by the calibration applied then
+	if (getMagCalibration(offset, matrix) == INV_SUCCESS &&
+	    mpu_magcal_compose(&result, offset, matrix))
+		return INV_ERROR;
+	
+	if (setMagCalibration(result.offset, result.matrix) != INV_SUCCESS)
+		return INV_ERROR;
+	if (fit)
+		*fit = result;
+	
+	return INV_SUCCESS;
+}
+
+void MPU9250_DMP::magCalReset(void)
+{
+	mpu_magcal_init(&_magCal);
+}
+
+inv_error_t MPU9250_DMP::setMagCalibration(const float * offset, const float * matrix)
+{
+	short offsetReg[3], matrixReg[9];
+	
+	if (offset)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			if (offset[i] >= 32767.5f || offset[i] < -32768.0f)
+				return INV_ERROR;
+			offsetReg[i] = (short) floorf(offset[i] + 0.5f);
+		}
+		// The driver holds the matrix in Q14
+		for (int i = 0; i < 9; i++)
+		{
+			float m = matrix ? matrix[i] * 16384.0f : ((i % 4) ? 0.0f : 16384.0f);
+			if (m >= 32767.5f || m < -32768.0f)
+				return INV_ERROR;
+			matrixReg[i] = (short) floorf(m + 0.5f);
+		}
+	}
+	
+	if (mpu_set_compass_cal(&_mpu, offset ? offsetReg : 0,
+	                        offset ? matrixReg : 0))
+		return INV_ERROR;
+	// Readings gathered under the old calibration no longer fit
+	mpu_magcal_init(&_magCal);
+	
+	return INV_SUCCESS;
+}
+
+inv_error_t MPU9250_DMP::getMagCalibration(float * offset, float * matrix)
+{
+	short offsetReg[3], matrixReg[9];
+	
+	if (mpu_get_compass_cal(&_mpu, offsetReg, matrixReg))
+		return INV_ERROR;
+	
+	for (int i = 0; i < 3; i++)
+		offset[i] = offsetReg[i];
+	for (int i = 0; i < 9; i++)
+		matrix[i] = matrixReg[i] * (1.0f / 16384.0f);
+	
+	return INV_SUCCESS;
+}
+
+void MPU9250_DMP::updateSens(void)
+{
+	_gSense = getGyroSens();
+	_aSense = getAccelSens();
+	
+	_aScale = _aSense ? 1.0f / _aSense : 0.0f;
+	_gScale = _gSense > 0 ? 1.0f / _gSense : 0.0f;
+	// Accel sensitivities are powers of two, so this one is exact.
+	_aScaleFixed = _aSense ? 65536000L / _aSense : 0;
+	_gScaleFixed = _gSense > 0 ? (long) (65536000.0f / _gSense + 0.5f) : 0;
+	
+	// Keep a running fusion filter in step with the gyro FSR: rad/s per
+	// LSB, Q30 for the integer one.
+	if (_fusionMode == FUSION_FLOAT)
+		_fusion.f.gyro_scale = _gScale * DEG_TO_RAD_F;
+	else if (_fusionMode == FUSION_FIXED)
+		_fusion.x.gyro_scale = (long) (_gScale * DEG_TO_RAD_F * 1073741824.0f + 0.5f);
+}
+
 unsigned short MPU9250_DMP::orientation_row_2_scale(const signed char *row)
 {
     unsigned short b;
@@ -746,14 +1384,15 @@ unsigned short MPU9250_DMP::orientation_row_2_scale(const signed char *row)
     return b;
 }
 		
-static void tap_cb(unsigned char direction, unsigned char count)
+void MPU9250_DMP::tapCallback(void * arg, unsigned char direction, unsigned char count)
 {
-	_tap_available = true;
-	tap_count = count;
-	tap_direction = direction;
+	MPU9250_DMP * imu = (MPU9250_DMP *)arg;
+	imu->_tapAvailable = true;
+	imu->_tapCount = count;
+	imu->_tapDirection = direction;
 }
 
-static void orient_cb(unsigned char orient)
+void MPU9250_DMP::orientCallback(void * arg, unsigned char orient)
 {
-	mpu9250_orientation = orient;
+	((MPU9250_DMP *)arg)->_orientation = orient;
 }
\ No newline at end of file
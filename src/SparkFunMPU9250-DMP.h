@@ -18,8 +18,12 @@ Supported Platforms:
 #ifndef _SPARKFUN_MPU9250_DMP_H_
 #define _SPARKFUN_MPU9250_DMP_H_
 
+#if defined(ARDUINO)
 #include <Wire.h>
 #include <Arduino.h>
+#else
+#include <stdint.h>
+#endif
 
 // Optimally, these defines would be passed as compiler options, but Arduino
 // doesn't give us a great way to do that.
@@ -32,11 +36,18 @@ Supported Platforms:
 extern "C" {
 #include "util/inv_mpu.h"
 #include "util/inv_mpu_dmp_motion_driver.h"
+#include "util/mpu_fixmath.h"
+#include "util/mpu_convert.h"
+#include "util/mpu_orient.h"
+#include "util/mpu_fusion.h"
+#include "util/mpu_magcal.h"
 }
 
 typedef int inv_error_t;
 #define INV_SUCCESS 0
 #define INV_ERROR 0x20
+// Returned by poll() and the xxxAsync() functions while still working.
+#define INV_IN_PROGRESS 0x21
 
 enum t_axisOrder {
 	X_AXIS, // 0
@@ -58,6 +69,12 @@ enum t_axisOrder {
 #define MAX_DMP_SAMPLE_RATE 200 // Maximum sample rate for the DMP FIFO (200Hz)
 #define FIFO_BUFFER_SIZE 512 // Max FIFO buffer size
 
+// Task startCapture() runs on the ESP32: stack size, priority, and how long
+// it waits for an interrupt before draining the FIFO anyway (ms).
+#define CAPTURE_TASK_STACK   4096
+#define CAPTURE_TASK_PRIO    5
+#define CAPTURE_TASK_TIMEOUT 100
+
 const signed char defaultOrientation[9] = {
 	1, 0, 0,
 	0, 1, 0,
@@ -77,12 +94,30 @@ public:
 	long qw, qx, qy, qz;
 	long temperature;
 	unsigned long time;
+	// Capture time of the FIFO packet last read, in microseconds
+	unsigned long long timeMicros;
 	float pitch, roll, yaw;
 	float heading;
-	unsigned char i2cAddr = 0x68;
+	// Integer counterparts of pitch, roll, yaw and heading, Q16 (65536 = 1
+	// degree or radian), set by the xxxFixed functions below
+	long pitchQ16, rollQ16, yawQ16;
+	long headingQ16;
 	
+#if defined(ARDUINO)
 	MPU9250_DMP();
 	MPU9250_DMP(const unsigned char addr);
+#endif
+	// MPU9250_DMP(bus, addr) -- Talk to the MPU-9250 over a bus transport other
+	// than the default Wire instance, e.g. arduino_i2c_bus_init() for Wire1, or
+	// the Linux i2c-dev, spidev or simulated backends in util/. The bus must
+	// outlive this object.
+	MPU9250_DMP(const mpu_bus_s * bus, const unsigned char addr = 0x68);
+	
+	// setClock -- Take timestamps and delays from another clock than the
+	// platform's (esp_timer or micros() on Arduino, CLOCK_MONOTONIC_RAW on
+	// Linux), e.g. the simulated clock from sim_mpu9250_clock_init(). Call
+	// before begin(). The clock must outlive this object.
+	void setClock(const mpu_clock_s * clock);
 	
 	// begin(void) -- Verifies communication with the MPU-9250 and the AK8963,
 	// and initializes them to the default state:
@@ -95,6 +130,33 @@ public:
 	inv_error_t begin(uint32_t i2cFrequency);
 	inv_error_t begin(void);
 	
+	// beginAsync -- Same as begin(), without blocking. The reset and sensor
+	// power-up settling times (about 160 ms in total) are waited out in
+	// poll() instead of in delay(), so the sketch keeps running.
+	// Output: INV_IN_PROGRESS while poll() still has work to do,
+	//         INV_SUCCESS (0) if already done, otherwise error
+	inv_error_t beginAsync(uint32_t i2cFrequency = 400000);
+	// poll -- Advance a beginAsync() or resetFifoAsync() in progress. Never
+	// waits; call it from loop() until it stops returning INV_IN_PROGRESS.
+	// No other call should be made to the library in the meantime.
+	// Output: INV_IN_PROGRESS, INV_SUCCESS (0) when done, otherwise error
+	inv_error_t poll(void);
+	
+	// beginConfig -- Start a batch of configuration changes. Until commit(),
+	// setSensors, setGyroFSR, setAccelFSR, setLPF, setSampleRate,
+	// configureFifo, lowPowerAccel and setIntLatched only record what they
+	// would write. Getters report the new settings straight away.
+	// setCompassContinuous, selfTest and the Async calls fail until commit().
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t beginConfig(void);
+	// commit -- Apply the changes made since beginConfig(). Only registers
+	// that end up with a new value are written, neighbouring ones in a single
+	// burst, and the FIFO is reset and the sensors given time to settle at
+	// most once. Switching between two modes this way takes a handful of
+	// transactions instead of dozens.
+	// Output: INV_SUCCESS (0) on success, otherwise error (run begin() again)
+	inv_error_t commit(void);
+	
 	// setSensors(unsigned char) -- Turn on or off MPU-9250 sensors. Any of the 
 	// following defines can be combined: INV_XYZ_GYRO, INV_XYZ_ACCEL, 
 	// INV_XYZ_COMPASS, INV_X_GYRO, INV_Y_GYRO, or INV_Z_GYRO
@@ -170,6 +232,14 @@ public:
 	//
 	// Output: set sample rate of the magnetometer. A value between 1-100
 	unsigned short getCompassSampleRate(void);
+	// setCompassContinuous -- Have the magnetometer measure at 100 Hz on its
+	// own, and the MPU-9250 pick up each new reading, instead of starting
+	// one measurement per compass sample. Readings then cost the host no
+	// bus traffic beyond reading them, and can go into the FIFO (see
+	// configureFifo). Use a compass sample rate of 100 Hz to get them all.
+	// Input: true for continuous mode, false for single measurements
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setCompassContinuous(bool enable = true);
 	
 	// dataReady -- checks to see if new accel/gyro data is available.
 	// (New magnetometer data cannot be checked, as the library runs that sensor 
@@ -184,8 +254,17 @@ public:
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	// Note: after a successful update the public sensor variables 
 	// (e.g. ax, ay, az, gx, gy, gz) will be updated with new data 
+	// When more than one sensor is asked for, they are all read in a
+	// single burst (see updateAll).
 	inv_error_t update(unsigned char sensors = 
 	                   UPDATE_ACCEL | UPDATE_GYRO | UPDATE_COMPASS);
+	// updateAll -- Reads INT_STATUS, accel, temperature, gyro, and the
+	// magnetometer data the MPU-9250 fetches for us, in a single bus
+	// transaction, and updates the variables of every sensor that is on.
+	// A magnetometer reading that isn't ready yet is skipped.
+	// Input: Optional pointer to receive INT_STATUS (which reading clears)
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t updateAll(unsigned char * intStatus = 0);
 	
 	// updateAccel, updateGyro, updateCompass, and updateTemperature are 
 	// called by the update() public method. They read from their respective
@@ -199,7 +278,9 @@ public:
 	// configureFifo(unsigned char) -- Initialize the FIFO, set it to read from
 	// a select set of sensors.
 	// Any of the following defines can be combined for the [sensors] parameter:
-	// INV_XYZ_GYRO, INV_XYZ_ACCEL, INV_X_GYRO, INV_Y_GYRO, or INV_Z_GYRO
+	// INV_XYZ_GYRO, INV_XYZ_ACCEL, INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO, or
+	// INV_XYZ_COMPASS (packets then carry the latest magnetometer reading,
+	// flagged only when it is a new one)
 	// Input: Combination of sensors to be read into FIFO
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t configureFifo(unsigned char sensors);
@@ -214,9 +295,74 @@ public:
 	// in ax, ay, az, gx, gy, or gz (depending on how the FIFO is configured).
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t updateFifo(void);
+	// readFifoBatch -- Reads every complete packet in the FIFO (up to
+	// maxSamples) using a single FIFO count read and as few burst reads as
+	// the bus allows. Each packet is parsed into the samples array, and ax,
+	// ay, az, gx, gy, and/or gz are updated with the newest one.
+	// Input: Array of at least maxSamples samples, its length, and an optional
+	//        pointer to receive the number of packets lost to a FIFO overflow
+	// Output: Number of samples read. 0 if the FIFO was empty or on error.
+	unsigned short readFifoBatch(mpu_sample_s * samples, unsigned short maxSamples,
+	                             unsigned short * dropped = 0);
 	// resetFifo -- Resets the FIFO's read/write pointers
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t resetFifo(void);
+	// resetFifoAsync -- resetFifo() without the 50 ms wait; finish with poll()
+	// Output: INV_IN_PROGRESS, INV_SUCCESS (0) if already done, otherwise error
+	inv_error_t resetFifoAsync(void);
+	
+	// setFifoRecovery -- Choose what happens when the FIFO overflows:
+	// INV_FIFO_RECOVER_RESET (default) resets the FIFO and the DMP, which
+	// blanks the DMP for 50 ms. INV_FIFO_RECOVER_FIFO_ONLY empties the FIFO
+	// with one write. INV_FIFO_RECOVER_DISCARD throws away only the partly
+	// overwritten oldest packet and keeps the rest.
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setFifoRecovery(unsigned char policy);
+	// getFifoStats -- Overflows seen, packets lost, resyncs and time spent
+	// recovering since begin() or resetFifoStats()
+	mpu_fifo_stats_s getFifoStats(void);
+	void resetFifoStats(void);
+	
+	// FIFO packets are stamped with the time the sensor captured them,
+	// worked out from how many packets were queued behind them and the
+	// sample rate, so time and timeMicros step by one sample period even
+	// when several packets are read at once.
+	// markDataReady -- Call from the data ready interrupt handler to pin
+	// the timestamps to the interrupt instead of estimating them.
+	void markDataReady(void);
+	// getSampleTiming -- Sample period measured against the host clock, and
+	// how far the sensor's clock is off, in ppm (positive if fast).
+	// Output: INV_SUCCESS (0) once measured (a few seconds of FIFO reads),
+	//         otherwise error and the configured period
+	inv_error_t getSampleTiming(unsigned long * periodNs, long * driftPpm);
+	
+	// startCapture -- Queue FIFO samples in the background, in a ring of
+	// size samples (a power of two) held in buffer. captureFifo() fills it;
+	// popSamples() empties it. On the ESP32, given the pin the interrupt is
+	// wired to, a task does the filling each time the interrupt fires.
+	// Elsewhere, call captureFifo() from a thread or loop of your own.
+	// While capturing, only popSamples() and samplesAvailable() may be
+	// called from another thread than the one filling the ring.
+	// Input: Ring storage, its length, and the interrupt pin (or -1)
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t startCapture(mpu_sample_s * buffer, unsigned short size, int intPin = -1);
+	// stopCapture -- Stop the capture task, if any. Samples still queued
+	// can be popped.
+	void stopCapture(void);
+	// captureFifo -- Move every complete packet in the FIFO into the ring
+	// (the DMP's packets if it is on), as far as there is room.
+	// Output: Number of samples queued. 0 if none, or on error.
+	unsigned short captureFifo(void);
+	// popSamples -- Take the oldest samples out of the ring, and update ax,
+	// ay, az, ... with the newest of them.
+	// Input: Array of at least maxSamples samples, and its length
+	// Output: Number of samples copied
+	unsigned short popSamples(mpu_sample_s * samples, unsigned short maxSamples);
+	// samplesAvailable -- Number of samples waiting in the ring
+	unsigned short samplesAvailable(void);
+	// captureOverruns -- Times captureFifo() found the ring full, leaving
+	// packets in the FIFO
+	unsigned long captureOverruns(void);
 	
 	// enableInterrupt -- Configure the MPU-9250's interrupt output to indicate
 	// when new data is ready.
@@ -250,16 +396,34 @@ public:
 	// DMP_FEATURE_SEND_RAW_ACCEL -- Send raw accelerometer values to FIFO
 	// DMP_FEATURE_SEND_RAW_GYRO -- Send raw gyroscope values to FIFO
 	// DMP_FEATURE_SEND_CAL_GYRO -- Send calibrated gyroscop values to FIFO
+	// DMP_FEATURE_SEND_COMPASS -- Add the magnetometer to the newest sample
+	//   of each FIFO read (mx, my, mz). Best with setCompassContinuous().
 	// fifoRate can be anywhere between 4 and 200Hz.
 	// Input: OR'd list of features and requested FIFO sampling rate
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpBegin(unsigned short features = 0, unsigned short fifoRate = MAX_DMP_SAMPLE_RATE);
 	
+	// dmpBeginWarm -- Take over an MPU-9250 whose DMP is already running, e.g.
+	// after a reset of the microcontroller alone. Succeeds only if the DMP image,
+	// features and FIFO rate on the device match the request; the live
+	// configuration is then adopted without begin()'s reset or a firmware reload.
+	// The compass is set up again, in continuous mode if it was running so.
+	// Call begin() and dmpBegin() instead if it fails.
+	// Input: Same as dmpBegin
+	// Output: INV_SUCCESS (0) if the running DMP was adopted, otherwise error
+	inv_error_t dmpBeginWarm(unsigned short features = 0, unsigned short fifoRate = MAX_DMP_SAMPLE_RATE);
+	
 	// dmpLoad -- Loads the DMP with 3062-byte image memory. Must be called to begin DMP.
 	// This function is called by the dmpBegin function.
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpLoad(void);
 	
+	// dmpSetLoadVerify -- Choose how much of the DMP image dmpLoad reads back:
+	// INV_FW_VERIFY_FULL (default, every byte), INV_FW_VERIFY_SAMPLED (the end
+	// of every write) or INV_FW_VERIFY_NONE (fastest startup).
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t dmpSetLoadVerify(unsigned char mode);
+	
 	// dmpGetFifoRate -- Returns the sample rate of the FIFO
 	// Output: Set sample rate, in Hz, of the FIFO
 	unsigned short dmpGetFifoRate(void);
@@ -274,6 +438,27 @@ public:
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpUpdateFifo(void); 
 	
+	// dmpDrainFifo -- Reads every complete packet in the FIFO (up to maxSamples)
+	// using a single FIFO count read and as few burst reads as the bus allows.
+	// Each packet is parsed into the samples array, and the public variables
+	// are updated with the newest one (as with dmpUpdateFifo). Packets read
+	// before a corrupted packet reset the FIFO are still returned.
+	// Input: Array of at least maxSamples samples, its length, and an optional
+	//        pointer to receive INV_SUCCESS (0), or the error that ended the
+	//        read (-2 if a corrupted packet reset the FIFO)
+	// Output: Number of samples read. 0 if the FIFO was empty.
+	unsigned short dmpDrainFifo(mpu_sample_s * samples, unsigned short maxSamples,
+	                            inv_error_t * result = 0);
+	
+	// dmpSetFifoResync -- When a corrupted packet is read (its quaternion is
+	// not of unit length, e.g. after a bus glitch), find the next packet
+	// boundary and carry on instead of resetting the FIFO and the DMP. A
+	// glitch then costs about one packet. Bytes skipped are counted in
+	// getFifoStats(). Needs a quaternion feature to be enabled.
+	// Input: true to resync, false to reset (default)
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t dmpSetFifoResync(bool enable);
+	
 	// dmpEnableFeatures -- Enable one, or multiple DMP features.
 	// Input: An OR'd list of features (see dmpBegin)
 	// Output: INV_SUCCESS (0) on success, otherwise error
@@ -363,9 +548,18 @@ public:
 	// calcQuat -- Convert Q30-format quaternion to a vector between +/- 1
 	float calcQuat(long axis);
 	
+	// calcAccel, calcGyro, calcMag -- Convert count raw values at once, e.g.
+	// N samples of 3 axes, multiplying by the sensitivity's reciprocal. Use
+	// SIMD instructions where the platform has them.
+	void calcAccel(const short * raw, float * out, unsigned long count);
+	void calcGyro(const short * raw, float * out, unsigned long count);
+	void calcMag(const short * raw, float * out, unsigned long count);
+	
 	// computeEulerAngles -- Compute euler angles based on most recently read qw, qx, qy, and qz
 	// Input: boolean indicating whether angle results are presented in degrees or radians
 	// Output: class variables roll, pitch, and yaw will be updated on exit.	
+	// For arrays of quaternions, and rotation matrices, gravity and tilt, see
+	// util/mpu_orient.h.
 	void computeEulerAngles(bool degrees = true);
 	
 	void computeEulerAngles2(bool degrees = true);
@@ -374,6 +568,93 @@ public:
 	// Output: class variable heading will be updated on exit
 	float computeCompassHeading(void);
 	
+	// Integer-only versions of the conversions above, for targets without an
+	// FPU (e.g. the SAMD21). Angles come from CORDIC, within 0.001 degree.
+	
+	// calcAccelFixed -- Convert 16-bit signed acceleration value to milli-g's, Q16
+	long calcAccelFixed(int axis);
+	// calcGyroFixed -- Convert 16-bit signed gyroscope value to milli-degrees per second
+	long calcGyroFixed(int axis);
+	// calcMagFixed -- Convert 16-bit signed magnetometer value to microtesla (uT), Q16
+	long calcMagFixed(int axis);
+	// calcQuatFixed -- Scale the most recently read qw, qx, qy, and qz to unit length
+	// Output: quat receives {w, x, y, z} in Q30. INV_SUCCESS (0) on success,
+	//         INV_ERROR if the quaternion is too far from unit length.
+	inv_error_t calcQuatFixed(long * quat);
+	// computeEulerAnglesFixed -- computeEulerAngles in integer math
+	// Input: boolean indicating whether angle results are presented in degrees or radians
+	// Output: class variables rollQ16, pitchQ16, and yawQ16 will be updated on exit,
+	//         with the same ranges as roll, pitch, and yaw.
+	void computeEulerAnglesFixed(bool degrees = true);
+	// computeCompassHeadingFixed -- computeCompassHeading in integer math
+	// Output: class variable headingQ16 (degrees, Q16) will be updated and returned
+	long computeCompassHeadingFixed(void);
+	// calcAccelFixed, calcGyroFixed, calcMagFixed -- Convert count raw values
+	// at once, in the same units as the single-value versions
+	void calcAccelFixed(const short * raw, long * out, unsigned long count);
+	void calcGyroFixed(const short * raw, long * out, unsigned long count);
+	void calcMagFixed(const short * raw, long * out, unsigned long count);
+	
+	// 9-axis sensor fusion on the host. The DMP's quaternions use the accel
+	// and gyro only, so their yaw drifts; this adds the compass, and runs on
+	// raw FIFO samples at any rate up to 1 kHz (or on the DMP's raw accel
+	// and gyro output).
+	// fusionBegin -- Start a Madgwick (MPU_FUSION_MADGWICK) or Mahony
+	// (MPU_FUSION_MAHONY) filter, in float or, for targets without an FPU,
+	// integer math. Set the gyro FSR first, and have the FIFO carry the
+	// gyro, accel and compass. The orientation settles within a few seconds.
+	// Input: Algorithm, and true for integer math
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t fusionBegin(unsigned char algorithm = MPU_FUSION_MADGWICK,
+	                        bool fixedPoint = false);
+	// fusionUpdate -- Fuse samples from readFifoBatch(), popSamples() or
+	// dmpDrainFifo(), oldest first, stepping by their timestamps. qw, qx, qy
+	// and qz receive the orientation (Q30, body to world: X magnetic north,
+	// Y west, Z up), for the functions of util/mpu_orient.h.
+	// Input: Array of samples, and its length
+	// Output: Number of samples used
+	unsigned short fusionUpdate(const mpu_sample_s * samples, unsigned short count);
+	// computeFusionHeading -- Tilt-compensated heading from the fused
+	// orientation, in degrees clockwise from magnetic north (as
+	// computeCompassHeading, which is only right when level)
+	// Output: class variable heading will be updated and returned
+	float computeFusionHeading(void);
+	// computeFusionHeadingFixed -- computeFusionHeading in integer math
+	// Output: class variable headingQ16 (degrees, Q16) will be updated and returned
+	long computeFusionHeadingFixed(void);
+	
+	// Compass calibration. Magnetised parts near the sensor (hard iron) add
+	// an offset to every reading, and nearby metal (soft iron) stretches the
+	// field, skewing headings by tens of degrees. Only sums of the readings
+	// are gathered (140 bytes), so any number can go in.
+	// magCalAdd -- Gather the compass readings of FIFO samples, or with no
+	// arguments mx, my and mz. Turn the device through as many orientations
+	// as possible meanwhile: a few seconds of slow tumbling is enough.
+	// Input: Array of samples, and its length
+	void magCalAdd(const mpu_sample_s * samples, unsigned short count);
+	void magCalAdd(void);
+	// magCalSolve -- Fit the readings gathered and correct every compass
+	// reading from then on: mx, my and mz, FIFO samples, and so headings and
+	// fusion. Refines any calibration already applied, then starts gathering
+	// afresh.
+	// Input: Optional fit to fill in (offset, matrix, field, error, model)
+	// Output: INV_SUCCESS (0) on success, INV_ERROR if the readings are too
+	//         few or cover too few orientations
+	inv_error_t magCalSolve(mpu_magcal_fit_s * fit = 0);
+	// magCalReset -- Discard the readings gathered
+	void magCalReset(void);
+	// setMagCalibration -- Apply a calibration, e.g. one saved from
+	// getMagCalibration, so it need not be redone after every reset
+	// Input: Offset (hardware units) and row-major 3x3 matrix, such that
+	//        corrected = matrix * (reading - offset); a null offset removes
+	//        the correction, a null matrix is the identity
+	// Output: INV_SUCCESS (0) on success, otherwise error (the readings
+	//         gathered for magCalSolve are then kept)
+	inv_error_t setMagCalibration(const float * offset, const float * matrix = 0);
+	// getMagCalibration -- Get the calibration applied
+	// Output: INV_SUCCESS (0) on success, INV_ERROR if none is applied
+	inv_error_t getMagCalibration(float * offset, float * matrix);
+	
 	// selfTest -- Run gyro and accel self-test.
 	// Output: Returns bit mask, 1 indicates success. A 0x7 is success on all sensors.
 	//         Bit pos 0: gyro
@@ -382,12 +663,53 @@ public:
 	int selfTest(unsigned char debug = 0);
 	
 private:
+	// Driver state for this device (FSRs, FIFO and DMP configuration, ...)
+	mpu_state_s _mpu;
 	unsigned short _aSense;
 	float _gSense, _mSense;
+	// 1 / _aSense and 1 / _gSense, for the batch conversions
+	float _aScale, _gScale;
+	// Q16 multipliers for calcAccelFixed (mg) and calcGyroFixed (mdps)
+	long _aScaleFixed, _gScaleFixed;
+	unsigned char _orientation;
+	unsigned char _tapCount;
+	unsigned char _tapDirection;
+	bool _tapAvailable;
+	// Step of beginAsync() that poll() is on (ASYNC_xxx)
+	unsigned char _asyncStage;
+	// Samples queued by captureFifo(), and the task and pin feeding it
+	mpu_ring_s _ring;
+	void * volatile _captureTask;
+	volatile bool _captureStop;
+	int _capturePin;
+	// Filter started by fusionBegin(), float or integer (FUSION_xxx)
+	union {
+		mpu_fusion_s f;
+		mpu_fusion_fixed_s x;
+	} _fusion;
+	unsigned char _fusionMode;
+	// Compass readings gathered by magCalAdd()
+	mpu_magcal_s _magCal;
 	
+	// Set up the driver state and members, for every constructor
+	void init(const mpu_bus_s * bus, unsigned char addr);
 	// Convert a QN-format number to a float
 	float qToFloat(long number, unsigned char q);
+	// Read the accel and gyro sensitivities for the current full-scale ranges
+	void updateSens(void);
 	unsigned short orientation_row_2_scale(const signed char *row);
+	// Copy the valid fields of a FIFO sample into the public variables
+	void updateFromSample(const mpu_sample_s * sample);
+	// Burst read for update() and updateAll(). Fails if any of sensors
+	// (UPDATE_xxx) could not be read.
+	inv_error_t updateBurst(unsigned char sensors, unsigned char * intStatus);
+	
+	// DMP gesture callbacks. arg is the MPU9250_DMP that registered them.
+	static void tapCallback(void * arg, unsigned char direction, unsigned char count);
+	static void orientCallback(void * arg, unsigned char orient);
+	// Capture interrupt handler and task (ESP32). arg is the MPU9250_DMP.
+	static void captureIsr(void * arg);
+	static void captureTask(void * arg);
 };
 
 #endif // _SPARKFUN_MPU9250_DMP_H_
\ No newline at end of file
@@ -109,6 +109,11 @@ enum mpu9250_register {
 	MPU9250_USER_CTRL =         0x6A,
 	MPU9250_PWR_MGMT_1 =        0x6B,
 	MPU9250_PWR_MGMT_2 =        0x6C,
+	MPU9250_BANK_SEL =          0x6D,
+	MPU9250_MEM_START_ADDR =    0x6E,
+	MPU9250_MEM_R_W =           0x6F,
+	MPU9250_DMP_CFG_1 =         0x70,
+	MPU9250_DMP_CFG_2 =         0x71,
 	MPU9250_FIFO_COUNTH =       0x72,
 	MPU9250_FIFO_COUNTL =       0x73,
 	MPU9250_FIFO_R_W =          0x74,
@@ -16,7 +16,11 @@ Supported Platforms:
 - ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
 ******************************************************************************/
 #include "arduino_mpu9250_clk.h"
+#include "inv_mpu.h"
 #include <Arduino.h>
+#if defined(ESP32)
+#include <esp_timer.h>
+#endif
 
 int arduino_get_clock_ms(unsigned long *count)
 {
@@ -28,4 +32,35 @@ int arduino_delay_ms(unsigned long num_ms)
 {
 	delay(num_ms);
 	return 0;
-}
\ No newline at end of file
+}
+
+unsigned long long arduino_clock_now_us(void * ctx)
+{
+	(void)ctx;
+#if defined(ESP32)
+	return (unsigned long long)esp_timer_get_time();
+#else
+	// Extend micros() past its 71 minute wrap. Needs calling at least
+	// once per wrap, which any running driver does.
+	static unsigned long last;
+	static unsigned long long high;
+	unsigned long now = micros();
+	
+	if (now < last)
+		high += 1ULL << 32;
+	last = now;
+	return high | now;
+#endif
+}
+
+void arduino_clock_delay_ms(void * ctx, unsigned long ms)
+{
+	(void)ctx;
+	delay(ms);
+}
+
+const struct mpu_clock_s arduino_clock = {
+	arduino_clock_now_us,
+	arduino_clock_delay_ms,
+	0
+};
@@ -18,7 +18,24 @@ Supported Platforms:
 #ifndef _ARDUINO_MPU9250_CLK_H_
 #define _ARDUINO_MPU9250_CLK_H_
 
+#if defined(__cplusplus) 
+extern "C" {
+#endif
+
 int arduino_get_clock_ms(unsigned long *count);
 int arduino_delay_ms(unsigned long num_ms);
 
+struct mpu_clock_s;
+
+// Microseconds since boot, 64 bits wide: esp_timer on the ESP32, micros()
+// elsewhere.
+unsigned long long arduino_clock_now_us(void * ctx);
+void arduino_clock_delay_ms(void * ctx, unsigned long ms);
+// Clock over the above; the default for every device.
+extern const struct mpu_clock_s arduino_clock;
+
+#if defined(__cplusplus) 
+}
+#endif
+
 #endif // _ARDUINO_MPU9250_CLK_H_
\ No newline at end of file
@@ -16,34 +16,81 @@ Supported Platforms:
 - ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
 ******************************************************************************/
 #include "arduino_mpu9250_i2c.h"
+#include "inv_mpu.h"
 #include <arduino.h>
 #include <Wire.h>
 
+// Largest read Wire can service with a single requestFrom(), limited by its
+// receive buffer (and by the 8-bit length used below).
+#if defined(I2C_BUFFER_LENGTH)
+#define WIRE_MAX_READ I2C_BUFFER_LENGTH
+#elif defined(BUFFER_LENGTH)
+#define WIRE_MAX_READ BUFFER_LENGTH
+#else
+#define WIRE_MAX_READ 32
+#endif
+
+// Largest transfer in either direction: a write shares the buffer with
+// the register address.
+#define WIRE_MAX_TRANSFER (((WIRE_MAX_READ > 255) ? 255 : WIRE_MAX_READ) - 1)
+
 int arduino_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
                        unsigned char length, unsigned char * data)
 {
-	Wire.beginTransmission(slave_addr);
-	Wire.write(reg_addr);
-	for (unsigned char i = 0; i < length; i++)
-	{
-		Wire.write(data[i]);
-	}
-	Wire.endTransmission(true);
-	
-	return 0;
+	return arduino_wire_write(&Wire, slave_addr, reg_addr, length, data);
 }
 
 int arduino_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
                        unsigned char length, unsigned char * data)
 {
-	Wire.beginTransmission(slave_addr);
-	Wire.write(reg_addr);
-	Wire.endTransmission(false);
-	Wire.requestFrom(slave_addr, length);
-	for (unsigned char i = 0; i < length; i++)
+	return arduino_wire_read(&Wire, slave_addr, reg_addr, length, data);
+}
+
+int arduino_wire_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                       unsigned short length, unsigned char const * data)
+{
+	TwoWire * wire = (TwoWire *)ctx;
+	
+	wire->beginTransmission(slave_addr);
+	wire->write(reg_addr);
+	if (length)
+		wire->write(data, length);
+	if (wire->endTransmission(true) != 0)
+		return -1;
+	
+	return 0;
+}
+
+int arduino_wire_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                       unsigned short length, unsigned char * data)
+{
+	TwoWire * wire = (TwoWire *)ctx;
+	
+	wire->beginTransmission(slave_addr);
+	wire->write(reg_addr);
+	if (wire->endTransmission(false) != 0)
+		return -1;
+	if (wire->requestFrom(slave_addr, (uint8_t)length) != length)
+		return -1;
+	for (unsigned short i = 0; i < length; i++)
 	{
-		data[i] = Wire.read();
+		data[i] = wire->read();
 	}
 	
 	return 0;
 }
+
+void arduino_i2c_bus_init(struct mpu_bus_s * bus, void * wire)
+{
+	bus->write = arduino_wire_write;
+	bus->read = arduino_wire_read;
+	bus->max_transfer = WIRE_MAX_TRANSFER;
+	bus->ctx = wire;
+}
+
+const struct mpu_bus_s arduino_i2c_bus = {
+	arduino_wire_write,
+	arduino_wire_read,
+	WIRE_MAX_TRANSFER,
+	&Wire
+};
@@ -27,6 +27,18 @@ int arduino_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 int arduino_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
                        unsigned char length, unsigned char * data);
 
+struct mpu_bus_s;
+
+// Bus transport over a TwoWire instance. ctx is the TwoWire to use.
+int arduino_wire_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                       unsigned short length, unsigned char const * data);
+int arduino_wire_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                       unsigned short length, unsigned char * data);
+// Point bus at a TwoWire instance other than Wire (e.g. &Wire1).
+void arduino_i2c_bus_init(struct mpu_bus_s * bus, void * wire);
+// Bus transport over the default Wire instance.
+extern const struct mpu_bus_s arduino_i2c_bus;
+
 #if defined(__cplusplus) 
 }
 #endif
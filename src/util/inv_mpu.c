@@ -19,31 +19,42 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include "inv_mpu.h"
 
 /* The following functions must be defined for this platform:
- * i2c_write(unsigned char slave_addr, unsigned char reg_addr,
- *      unsigned char length, unsigned char const *data)
- * i2c_read(unsigned char slave_addr, unsigned char reg_addr,
- *      unsigned char length, unsigned char *data)
- * delay_ms(unsigned long num_ms)
- * get_ms(unsigned long *count)
  * reg_int_cb(void (*cb)(void), unsigned char port, unsigned char pin)
  * labs(long x)
  * fabsf(float x)
  * min(int a, int b)
+ * Bus access goes through the mpu_bus_s of the device being driven; see
+ * mpu_init_state. Time is read from, and delays waited out on, its
+ * mpu_clock_s; by default the platform clock below (see mpu_set_clock).
  */
+#if defined(ARDUINO)
 #include <arduino.h>
-#define MPU9250
-#include "arduino_mpu9250_i2c.h"
 #include "arduino_mpu9250_clk.h"
-#define i2c_write(a, b, c, d) arduino_i2c_write(a, b, c, d)
-#define i2c_read(a, b, c, d)  arduino_i2c_read(a, b, c, d)
-#define delay_ms  arduino_delay_ms
-#define get_ms    arduino_get_clock_ms
+#define default_clock   arduino_clock
+#else
+#include "linux_mpu9250_clk.h"
+#define default_clock   linux_clock
+#define log_i(...)  do { } while (0)
+#define log_e(...)  fprintf(stderr, __VA_ARGS__)
+#define _min(a, b)  (((a) < (b)) ? (a) : (b))
+#endif
+#define MPU9250
+#define i2c_write(a, b, c, d) st->bus->write(st->bus->ctx, a, b, c, d)
+#define i2c_read(a, b, c, d)  st->bus->read(st->bus->ctx, a, b, c, d)
+#define i2c_max_read()        (st->bus->max_transfer)
+/* Ordered accesses to the indices shared by the two sides of a ring. */
+#define ring_load(p)          __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ring_store(p, v)      __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define get_us()              (st->clock->now_us(st->clock->ctx))
+#define get_ms(count)         ((count)[0] = (unsigned long)(get_us() / 1000))
+#define delay_ms(num_ms)      st->clock->delay_ms(st->clock->ctx, num_ms)
 //#define log_i     _MLPrintLog
 //#define log_e     _MLPrintLog 
 static inline int reg_int_cb(struct int_param_s *int_param)
@@ -133,7 +144,9 @@ struct gyro_reg_s {
     unsigned char s1_addr;
     unsigned char s1_reg;
     unsigned char s1_ctrl;
+    unsigned char s4_addr;
     unsigned char s4_ctrl;
+    unsigned char i2c_mst_status;
     unsigned char s0_do;
     unsigned char s1_do;
     unsigned char i2c_delay_ctrl;
@@ -145,7 +158,7 @@ struct gyro_reg_s {
 
 /* Information specific to a particular device. */
 struct hw_s {
-    //unsigned char addr;
+    //struct mpu_state_s *st;
     unsigned short max_fifo;
     unsigned char num_reg;
     unsigned short temp_sens;
@@ -156,69 +169,6 @@ struct hw_s {
 #endif
 };
 
-/* When entering motion interrupt mode, the driver keeps track of the
- * previous state so that it can be restored at a later time.
- * TODO: This is tacky. Fix it.
- */
-struct motion_int_cache_s {
-    unsigned short gyro_fsr;
-    unsigned char accel_fsr;
-    unsigned short lpf;
-    unsigned short sample_rate;
-    unsigned char sensors_on;
-    unsigned char fifo_sensors;
-    unsigned char dmp_on;
-};
-
-/* Cached chip configuration data.
- * TODO: A lot of these can be handled with a bitmask.
- */
-struct chip_cfg_s {
-    /* Matches gyro_cfg >> 3 & 0x03 */
-    unsigned char gyro_fsr;
-    /* Matches accel_cfg >> 3 & 0x03 */
-    unsigned char accel_fsr;
-    /* Enabled sensors. Uses same masks as fifo_en, NOT pwr_mgmt_2. */
-    unsigned char sensors;
-    /* Matches config register. */
-    unsigned char lpf;
-    unsigned char clk_src;
-    /* Sample rate, NOT rate divider. */
-    unsigned short sample_rate;
-    /* Matches fifo_en register. */
-    unsigned char fifo_enable;
-    /* Matches int enable register. */
-    unsigned char int_enable;
-    /* 1 if devices on auxiliary I2C bus appear on the primary. */
-    unsigned char bypass_mode;
-    /* 1 if half-sensitivity.
-     * NOTE: This doesn't belong here, but everything else in hw_s is const,
-     * and this allows us to save some precious RAM.
-     */
-    unsigned char accel_half;
-    /* 1 if device in low-power accel-only mode. */
-    unsigned char lp_accel_mode;
-    /* 1 if interrupts are only triggered on motion events. */
-    unsigned char int_motion_only;
-    struct motion_int_cache_s cache;
-    /* 1 for active low interrupts. */
-    unsigned char active_low_int;
-    /* 1 for latched interrupts. */
-    unsigned char latched_int;
-    /* 1 if DMP is enabled. */
-    unsigned char dmp_on;
-    /* Ensures that DMP will only be loaded once. */
-    unsigned char dmp_loaded;
-    /* Sampling rate used when DMP is enabled. */
-    unsigned short dmp_sample_rate;
-#ifdef AK89xx_SECONDARY
-    /* Compass sample rate. */
-    unsigned short compass_sample_rate;
-    unsigned char compass_addr;
-    short mag_sens_adj[3];
-#endif
-};
-
 /* Information for self-test. */
 struct test_s {
     unsigned long gyro_sens;
@@ -241,14 +191,6 @@ struct test_s {
 #endif
 };
 
-/* Gyro driver state variables. */
-struct gyro_state_s {
-    const struct gyro_reg_s *reg;
-    const struct hw_s *hw;
-    struct chip_cfg_s chip_cfg;
-    const struct test_s *test;
-};
-
 /* Filter configurations. */
 enum lpf_e {
     INV_FILTER_256HZ_NOLPF2 = 0,
@@ -315,6 +257,8 @@ enum lp_accel_rate_e {
 #define BIT_DMP_EN          (0x80)
 #define BIT_FIFO_RST        (0x04)
 #define BIT_DMP_RST         (0x08)
+/* USER_CTRL reset bits, which clear themselves. */
+#define BITS_USER_CTRL_RST  (0x0F)
 #define BIT_FIFO_OVERFLOW   (0x10)
 #define BIT_DATA_RDY_EN     (0x01)
 #define BIT_DMP_INT_EN      (0x02)
@@ -336,6 +280,8 @@ enum lp_accel_rate_e {
 #define BIT_SLAVE_EN        (0x80)
 #define BIT_I2C_READ        (0x80)
 #define BITS_I2C_MASTER_DLY (0x1F)
+#define BIT_SLV4_DONE       (0x40)
+#define BIT_SLV4_NACK       (0x10)
 #define BIT_AUX_IF_EN       (0x20)
 #define BIT_ACTL            (0x80)
 #define BIT_LATCH_EN        (0x20)
@@ -384,6 +330,8 @@ enum lp_accel_rate_e {
 #define AKM_SINGLE_MEASUREMENT  (0x01 | SUPPORTS_AK89xx_HIGH_SENS)
 #define AKM_FUSE_ROM_ACCESS     (0x0F | SUPPORTS_AK89xx_HIGH_SENS)
 #define AKM_MODE_SELF_TEST      (0x08 | SUPPORTS_AK89xx_HIGH_SENS)
+/* AK8963 only: 100Hz continuous measurement mode 2. */
+#define AKM_CONTINUOUS_100HZ    (0x06 | SUPPORTS_AK89xx_HIGH_SENS)
 
 #define AKM_WHOAMI      (0x48)
 #endif
@@ -426,7 +374,9 @@ const struct gyro_reg_s reg = {
     .s1_addr        = 0x28,
     .s1_reg         = 0x29,
     .s1_ctrl        = 0x2A,
+    .s4_addr        = 0x31,
     .s4_ctrl        = 0x34,
+    .i2c_mst_status = 0x36,
     .s0_do          = 0x63,
     .s1_do          = 0x64,
     .i2c_delay_ctrl = 0x67
@@ -460,12 +410,6 @@ const struct test_s test = {
     .max_g          = 0.95f,
     .max_accel_var  = 0.14f
 };
-
-static struct gyro_state_s st = {
-    .reg = &reg,
-    .hw = &hw,
-    .test = &test
-};
 #elif defined MPU6500
 const struct gyro_reg_s reg = {
     .who_am_i       = 0x75,
@@ -506,7 +450,9 @@ const struct gyro_reg_s reg = {
     .s1_addr        = 0x28,
     .s1_reg         = 0x29,
     .s1_ctrl        = 0x2A,
+    .s4_addr        = 0x31,
     .s4_ctrl        = 0x34,
+    .i2c_mst_status = 0x36,
     .s0_do          = 0x63,
     .s1_do          = 0x64,
     .i2c_delay_ctrl = 0x67
@@ -542,24 +488,189 @@ const struct test_s test = {
     .max_g_offset   = .5f,   //500 mg for Accel Criteria C
     .sample_wait_ms = 10    //10ms sample time wait
 };
-
-static struct gyro_state_s st = {
-    .reg = &reg,
-    .hw = &hw,
-    .test = &test
-};
 #endif
 
 #define MAX_PACKET_LENGTH (12)
+/* Bytes pulled from the FIFO per burst by mpu_read_fifo_batch. Must be at
+ * least MAX_PACKET_LENGTH.
+ */
+#define MAX_BURST_LENGTH (252)
+/* Shortest and longest span the sample period is measured over, and the
+ * largest clock drift believed; see mpu_stamp_samples.
+ */
+#define MPU_TIMING_MIN_WINDOW_US    (1000000UL)
+#define MPU_TIMING_MAX_WINDOW_US    (32000000UL)
+#define MPU_TIMING_MAX_DRIFT_PPM    (20000L)
+/* How far a measured sample period is trusted, in ppm. */
+#define MPU_TIMING_TRACK_PPM    (1000L)
 #ifdef MPU6500
 #define HWST_MAX_PACKET_LENGTH (512)
 #endif
 
+static unsigned char get_fifo_packet_size(unsigned char fifo_enable);
+static int set_sensors_write(struct mpu_state_s *st, unsigned char sensors);
+static int recover_fifo_overflow(struct mpu_state_s *st, unsigned short *count);
 #ifdef AK89xx_SECONDARY
-static int setup_compass(unsigned char addr);
+static int decode_compass(struct mpu_state_s *st, const unsigned char *tmp,
+    short *data);
+static int setup_compass(struct mpu_state_s *st);
+static int setup_compass_step(struct mpu_state_s *st, unsigned char *stage);
 #define MAX_COMPASS_SAMPLE_RATE (100)
 #endif
 
+/* Configuration registers kept in mpu_shadow_s, in address order so that
+ * neighbours can be written in one burst. A register the part does not
+ * have is at address 0 and never used.
+ */
+static const unsigned char shadow_fields[MPU_SHADOW_REGS] = {
+    offsetof(struct gyro_reg_s, rate_div),
+    offsetof(struct gyro_reg_s, lpf),
+    offsetof(struct gyro_reg_s, gyro_cfg),
+    offsetof(struct gyro_reg_s, accel_cfg),
+    offsetof(struct gyro_reg_s, accel_cfg2),
+    offsetof(struct gyro_reg_s, fifo_en),
+    offsetof(struct gyro_reg_s, int_pin_cfg),
+    offsetof(struct gyro_reg_s, int_enable),
+    offsetof(struct gyro_reg_s, user_ctrl),
+    offsetof(struct gyro_reg_s, pwr_mgmt_1),
+    offsetof(struct gyro_reg_s, pwr_mgmt_2)
+};
+
+/* Unchanged registers a commit may rewrite to join two changes in one
+ * burst. One byte costs less than addressing the device again.
+ */
+#define SHADOW_MAX_GAP  (1)
+
+static unsigned char shadow_addr(const struct mpu_state_s *st, unsigned char idx)
+{
+    return ((const unsigned char*)st->reg)[shadow_fields[idx]];
+}
+
+/* Index of a register in the shadow, or -1 if it is not kept there. */
+static int shadow_index(const struct mpu_state_s *st, unsigned char reg)
+{
+    unsigned char ii;
+
+    if (!reg)
+        return -1;
+    for (ii = 0; ii < MPU_SHADOW_REGS; ii++)
+        if (shadow_addr(st, ii) == reg)
+            return ii;
+    return -1;
+}
+
+/* Record what length registers from reg now hold. */
+static void shadow_store(struct mpu_state_s *st, unsigned char reg,
+    unsigned char length, const unsigned char *data)
+{
+    unsigned char ii, value;
+    int idx;
+
+    for (ii = 0; ii < length; ii++) {
+        idx = shadow_index(st, reg + ii);
+        if (idx < 0)
+            continue;
+        value = data[ii];
+        if (reg + ii == st->reg->user_ctrl)
+            value &= ~BITS_USER_CTRL_RST;
+        st->shadow.value[idx] = value;
+        st->shadow.valid |= 1 << idx;
+        /* A later write supersedes a staged one. */
+        st->shadow.dirty &= ~(1 << idx);
+    }
+}
+
+static void shadow_forget(struct mpu_state_s *st, unsigned char reg,
+    unsigned char length)
+{
+    unsigned char ii;
+    int idx;
+
+    for (ii = 0; ii < length; ii++) {
+        idx = shadow_index(st, reg + ii);
+        if (idx >= 0)
+            st->shadow.valid &= ~(1 << idx);
+    }
+}
+
+/* Write configuration registers, staged or not. */
+static int cfg_write_now(struct mpu_state_s *st, unsigned char reg,
+    unsigned char length, const unsigned char *data)
+{
+    if (i2c_write(st->addr, reg, length, data)) {
+        shadow_forget(st, reg, length);
+        return -1;
+    }
+    shadow_store(st, reg, length, data);
+    return 0;
+}
+
+/* Write one configuration register now, unless it is known to hold data. */
+static int cfg_update(struct mpu_state_s *st, unsigned char reg, unsigned char data)
+{
+    int idx = shadow_index(st, reg);
+
+    if (idx >= 0 && (st->shadow.valid & (1 << idx)) &&
+        st->shadow.value[idx] == data) {
+        st->shadow.dirty &= ~(1 << idx);
+        return 0;
+    }
+    return cfg_write_now(st, reg, 1, &data);
+}
+
+/* Write configuration registers. While staging (mpu_config_begin), those
+ * in the shadow are only recorded for mpu_config_commit.
+ */
+static int cfg_write(struct mpu_state_s *st, unsigned char reg,
+    unsigned char length, const unsigned char *data)
+{
+    unsigned char ii;
+    int idx;
+
+    if (!st->shadow.staging)
+        return cfg_write_now(st, reg, length, data);
+    for (ii = 0; ii < length; ii++)
+        if (shadow_index(st, reg + ii) < 0)
+            return cfg_write_now(st, reg, length, data);
+    for (ii = 0; ii < length; ii++) {
+        idx = shadow_index(st, reg + ii);
+        st->shadow.staged[idx] = data[ii];
+        st->shadow.dirty |= 1 << idx;
+    }
+    return 0;
+}
+
+/* Read a configuration register, from the shadow when it is known. */
+static int cfg_read(struct mpu_state_s *st, unsigned char reg, unsigned char *data)
+{
+    int idx = shadow_index(st, reg);
+
+    if (idx >= 0 && (st->shadow.dirty & (1 << idx))) {
+        data[0] = st->shadow.staged[idx];
+        return 0;
+    }
+    if (idx >= 0 && (st->shadow.valid & (1 << idx))) {
+        data[0] = st->shadow.value[idx];
+        return 0;
+    }
+    if (i2c_read(st->addr, reg, 1, data))
+        return -1;
+    shadow_store(st, reg, 1, data);
+    return 0;
+}
+
+/* FIFO reset a configuration change needs. Left to the commit while
+ * staging, so that it is done once.
+ */
+static int cfg_reset_fifo(struct mpu_state_s *st)
+{
+    if (st->shadow.staging) {
+        st->shadow.reset_fifo = 1;
+        return 0;
+    }
+    return mpu_reset_fifo(st);
+}
+
 /**
  *  @brief      Enable/disable data ready interrupt.
  *  If the DMP is on, the DMP interrupt is enabled. Otherwise, the data ready
@@ -567,30 +678,30 @@ static int setup_compass(unsigned char addr);
  *  @param[in]  enable      1 to enable interrupt.
  *  @return     0 if successful.
  */
-int set_int_enable(unsigned char addr, unsigned char enable)
+int set_int_enable(struct mpu_state_s *st, unsigned char enable)
 {
     unsigned char tmp;
 
-    if (st.chip_cfg.dmp_on) {
+    if (st->chip_cfg.dmp_on) {
         if (enable)
             tmp = BIT_DMP_INT_EN;
         else
             tmp = 0x00;
-        if (i2c_write(addr, st.reg->int_enable, 1, &tmp))
+        if (cfg_write(st, st->reg->int_enable, 1, &tmp))
             return -1;
-        st.chip_cfg.int_enable = tmp;
+        st->chip_cfg.int_enable = tmp;
     } else {
-        if (!st.chip_cfg.sensors)
+        if (!st->chip_cfg.sensors)
             return -1;
-        if (enable && st.chip_cfg.int_enable)
+        if (enable && st->chip_cfg.int_enable)
             return 0;
         if (enable)
             tmp = BIT_DATA_RDY_EN;
         else
             tmp = 0x00;
-        if (i2c_write(addr, st.reg->int_enable, 1, &tmp))
+        if (cfg_write(st, st->reg->int_enable, 1, &tmp))
             return -1;
-        st.chip_cfg.int_enable = tmp;
+        st->chip_cfg.int_enable = tmp;
     }
     return 0;
 }
@@ -599,15 +710,15 @@ int set_int_enable(unsigned char addr, unsigned char enable)
  *  @brief      Register dump for testing.
  *  @return     0 if successful.
  */
-int mpu_reg_dump(unsigned char addr)
+int mpu_reg_dump(struct mpu_state_s *st)
 {
     unsigned char ii;
     unsigned char data;
 
-    for (ii = 0; ii < st.hw->num_reg; ii++) {
-        if (ii == st.reg->fifo_r_w || ii == st.reg->mem_r_w)
+    for (ii = 0; ii < st->hw->num_reg; ii++) {
+        if (ii == st->reg->fifo_r_w || ii == st->reg->mem_r_w)
             continue;
-        if (i2c_read(addr, ii, 1, &data))
+        if (i2c_read(st->addr, ii, 1, &data))
             return -1;
         log_i("%#5x: %#5x\r\n", ii, data);
     }
@@ -621,15 +732,210 @@ int mpu_reg_dump(unsigned char addr)
  *  @param[out] data    Register data.
  *  @return     0 if successful.
  */
-int mpu_read_reg(unsigned char addr, unsigned char reg, unsigned char *data)
+int mpu_read_reg(struct mpu_state_s *st, unsigned char reg, unsigned char *data)
+{
+    if (reg == st->reg->fifo_r_w || reg == st->reg->mem_r_w)
+        return -1;
+    if (reg >= st->hw->num_reg)
+        return -1;
+    return i2c_read(st->addr, reg, 1, data);
+}
+
+/**
+ *  @brief      Prepare a device context for use.
+ *  Must be called once, before any other function is passed @e st. No bus
+ *  traffic is generated; the chip itself is set up by @e mpu_init.
+ *  @param[out] st      Device context to initialize.
+ *  @param[in]  bus     Transport the device is attached to. Must outlive
+ *                      @e st.
+ *  @param[in]  addr    I2C address of the device.
+ */
+void mpu_init_state(struct mpu_state_s *st, const struct mpu_bus_s *bus,
+    unsigned char addr)
+{
+    memset(st, 0, sizeof(*st));
+    st->bus = bus;
+    st->clock = &default_clock;
+    st->addr = addr;
+    st->reg = &reg;
+    st->hw = &hw;
+    st->test = &test;
+}
+
+/**
+ *  @brief      Take time from another clock than the platform's.
+ *  For instance a simulated clock, so that delays advance simulated time
+ *  instead of being waited out. Set it before anything else is done with
+ *  the device.
+ *  @param[in]  clock   Clock to use. Must outlive @e st.
+ */
+void mpu_set_clock(struct mpu_state_s *st, const struct mpu_clock_s *clock)
+{
+    st->clock = clock;
+}
+
+/* Run a step function to completion, sleeping between steps. */
+static int run_steps(struct mpu_state_s *st,
+    int (*step)(struct mpu_state_s *st, unsigned char *stage))
+{
+    unsigned char stage = 0;
+    int result;
+
+    while ((result = step(st, &stage)) > 0)
+        delay_ms(result);
+    return result;
+}
+
+/* Hand a step function to mpu_poll. Only one can be pending at a time. */
+static int start_steps(struct mpu_state_s *st,
+    int (*step)(struct mpu_state_s *st, unsigned char *stage), unsigned char arg)
+{
+    /* Steps wait on the device, which a staged configuration has not
+     * reached yet.
+     */
+    if (st->async.step || st->shadow.staging)
+        return -1;
+    st->async.step = step;
+    st->async.stage = 0;
+    st->async.arg = arg;
+    st->async.wait_ms = 0;
+    st->async.start_us = get_us();
+    return mpu_poll(st);
+}
+
+/**
+ *  @brief      Advance an operation started by one of the @e mpu_xxx_start
+ *  functions.
+ *  Never waits: if the current step is still settling, returns right away.
+ *  Call it from the main loop until it stops returning 1.
+ *  @return     1 if in progress, 0 if complete (or nothing pending),
+ *              negative on error.
+ */
+int mpu_poll(struct mpu_state_s *st)
+{
+    int result;
+
+    if (!st->async.step)
+        return 0;
+    if (get_us() - st->async.start_us < st->async.wait_ms * 1000ULL)
+        return 1;
+    result = st->async.step(st, &st->async.stage);
+    if (result > 0) {
+        st->async.start_us = get_us();
+        st->async.wait_ms = result;
+        return 1;
+    }
+    st->async.step = 0;
+    return result;
+}
+
+/* mpu_init stages. */
+#define INIT_RESET      (0)
+#define INIT_CONFIG     (1)
+#define INIT_COMPASS    (2)
+#define INIT_DONE       (0xFF)
+
+static int init_step(struct mpu_state_s *st, unsigned char *stage)
 {
-    if (reg == st.reg->fifo_r_w || reg == st.reg->mem_r_w)
+    unsigned char data[6];
+#ifdef AK89xx_SECONDARY
+    unsigned char compass_stage;
+    int result;
+#endif
+
+    if (*stage == INIT_DONE)
+        return 0;
+
+    if (*stage == INIT_RESET) {
+        /* Reset device. */
+        data[0] = BIT_RESET;
+        if (i2c_write(st->addr, st->reg->pwr_mgmt_1, 1, data))
+            return -1;
+        /* Every register is back to its default, and nothing is staged. */
+        memset(&st->shadow, 0, sizeof(st->shadow));
+        st->chip_cfg.mem_ptr_valid = 0;
+        st->dmp.mem_valid = 0;
+        st->dmp.mem_dirty = 0;
+        st->dmp.mem_batch = 0;
+        *stage = INIT_CONFIG;
+        return 100;
+    }
+
+    if (*stage == INIT_CONFIG) {
+        /* Wake up chip. */
+        data[0] = 0x00;
+        if (cfg_write(st, st->reg->pwr_mgmt_1, 1, data))
+            return -1;
+
+        st->chip_cfg.accel_half = 0;
+
+#ifdef MPU6500
+        /* MPU6500 shares 4kB of memory between the DMP and the FIFO. Since the
+         * first 3kB are needed by the DMP, we'll use the last 1kB for the FIFO.
+         */
+        data[0] = BIT_FIFO_SIZE_1024 | 0x8;
+        if (cfg_write(st, st->reg->accel_cfg2, 1, data))
+            return -1;
+#endif
+
+        /* Set to invalid values to ensure no I2C writes are skipped. */
+        st->chip_cfg.sensors = 0xFF;
+        st->chip_cfg.gyro_fsr = 0xFF;
+        st->chip_cfg.accel_fsr = 0xFF;
+        st->chip_cfg.lpf = 0xFF;
+        st->chip_cfg.sample_rate = 0xFFFF;
+        st->chip_cfg.fifo_enable = 0xFF;
+        st->chip_cfg.fifo_packet_size = 0;
+        st->chip_cfg.bypass_mode = 0xFF;
+#ifdef AK89xx_SECONDARY
+        st->chip_cfg.compass_sample_rate = 0xFFFF;
+#endif
+        /* mpu_set_sensors always preserves this setting. */
+        st->chip_cfg.clk_src = INV_CLK_PLL;
+        /* Handled in next call to mpu_set_bypass. */
+        st->chip_cfg.active_low_int = 1;
+        st->chip_cfg.latched_int = 0;
+        st->chip_cfg.int_motion_only = 0;
+        st->chip_cfg.lp_accel_mode = 0;
+        memset(&st->chip_cfg.cache, 0, sizeof(st->chip_cfg.cache));
+        st->chip_cfg.dmp_on = 0;
+        st->chip_cfg.dmp_loaded = 0;
+        st->chip_cfg.dmp_sample_rate = 0;
+        mpu_reset_fifo_stats(st);
+
+        if (mpu_set_gyro_fsr(st, 2000))
+            return -1;
+        if (mpu_set_accel_fsr(st, 2))
+            return -1;
+        if (mpu_set_lpf(st, 42))
+            return -1;
+        if (mpu_set_sample_rate(st, 50))
+            return -1;
+        if (mpu_configure_fifo(st, 0))
+            return -1;
+        *stage = INIT_COMPASS;
+    }
+
+#ifdef AK89xx_SECONDARY
+    compass_stage = *stage - INIT_COMPASS;
+    result = setup_compass_step(st, &compass_stage);
+    *stage = INIT_COMPASS + compass_stage;
+    if (result > 0)
+        return result;
+    if (mpu_set_compass_sample_rate(st, 10))
         return -1;
-    if (reg >= st.hw->num_reg)
+#else
+    /* Already disabled by setup_compass. */
+    if (mpu_set_bypass(st, 0))
         return -1;
-    return i2c_read(addr, reg, 1, data);
+#endif
+
+    set_sensors_write(st, 0);
+    *stage = INIT_DONE;
+    return 50;
 }
 
+
 /**
  *  @brief      Initialize hardware.
  *  Initial configuration:\n
@@ -643,82 +949,167 @@ int mpu_read_reg(unsigned char addr, unsigned char reg, unsigned char *data)
  *  @param[in]  int_param   Platform-specific parameters to interrupt API.
  *  @return     0 if successful.
  */
-int mpu_init(unsigned char addr, struct int_param_s *int_param)
+int mpu_init(struct mpu_state_s *st, struct int_param_s *int_param)
 {
-    unsigned char data[6];
-
-    /* Reset device. */
-    data[0] = BIT_RESET;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, data))
-        return -1;
-    delay_ms(100);
-
-    /* Wake up chip. */
-    data[0] = 0x00;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, data))
-        return -1;
-
-   st.chip_cfg.accel_half = 0;
+#ifndef EMPL_TARGET_STM32F4    
+    if (int_param)
+        reg_int_cb(int_param);
+#endif
+    return run_steps(st, init_step);
+}
 
-#ifdef MPU6500
-    /* MPU6500 shares 4kB of memory between the DMP and the FIFO. Since the
-     * first 3kB are needed by the DMP, we'll use the last 1kB for the FIFO.
-     */
-    data[0] = BIT_FIFO_SIZE_1024 | 0x8;
-    if (i2c_write(addr, st.reg->accel_cfg2, 1, data))
-        return -1;
+/**
+ *  @brief      Start @e mpu_init without blocking.
+ *  Call @e mpu_poll until it stops returning 1.
+ *  @param[in]  int_param   Platform-specific parameters to interrupt API.
+ *  @return     1 if in progress, 0 if complete, negative on error.
+ */
+int mpu_init_start(struct mpu_state_s *st, struct int_param_s *int_param)
+{
+#ifndef EMPL_TARGET_STM32F4    
+    if (int_param)
+        reg_int_cb(int_param);
 #endif
+    return start_steps(st, init_step, 0);
+}
 
-    /* Set to invalid values to ensure no I2C writes are skipped. */
-    st.chip_cfg.sensors = 0xFF;
-    st.chip_cfg.gyro_fsr = 0xFF;
-    st.chip_cfg.accel_fsr = 0xFF;
-    st.chip_cfg.lpf = 0xFF;
-    st.chip_cfg.sample_rate = 0xFFFF;
-    st.chip_cfg.fifo_enable = 0xFF;
-    st.chip_cfg.bypass_mode = 0xFF;
+/**
+ *  @brief      Take over a device that is already configured.
+ *  Use instead of @e mpu_init when only the host was reset and the MPU kept
+ *  power. There is no reset and no 100ms delay: the driver state is read
+ *  back from the device registers. The compass sensitivity adjustment is
+ *  not kept on the MPU, so the compass is set up again as in @e mpu_init;
+ *  if it was measuring continuously (@e mpu_set_compass_continuous), it is
+ *  put back in continuous mode.
+ *  \n Raw FIFO sensors chosen before the DMP was turned on are not
+ *  recovered; call @e mpu_configure_fifo before turning the DMP off.
+ *  @param[in]  int_param   Platform-specific parameters to interrupt API.
+ *  @return     0 if successful, 1 if the device is asleep, in low-power
+ *              accel mode or has the LPF off and needs @e mpu_init, -1 on
+ *              a bus error or if the compass is not found.
+ */
+int mpu_init_warm(struct mpu_state_s *st, struct int_param_s *int_param)
+{
+    unsigned char data[2], user_ctrl, tmp;
 #ifdef AK89xx_SECONDARY
-    st.chip_cfg.compass_sample_rate = 0xFFFF;
+    unsigned short compass_rate;
+#endif
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+    unsigned char continuous;
 #endif
-    /* mpu_set_sensors always preserves this setting. */
-    st.chip_cfg.clk_src = INV_CLK_PLL;
-    /* Handled in next call to mpu_set_bypass. */
-    st.chip_cfg.active_low_int = 1;
-    st.chip_cfg.latched_int = 0;
-    st.chip_cfg.int_motion_only = 0;
-    st.chip_cfg.lp_accel_mode = 0;
-    memset(&st.chip_cfg.cache, 0, sizeof(st.chip_cfg.cache));
-    st.chip_cfg.dmp_on = 0;
-    st.chip_cfg.dmp_loaded = 0;
-    st.chip_cfg.dmp_sample_rate = 0;
 
-    if (mpu_set_gyro_fsr(addr, 2000))
+    /* Trust nothing kept from before. */
+    memset(&st->shadow, 0, sizeof(st->shadow));
+    st->chip_cfg.mem_ptr_valid = 0;
+    st->dmp.mem_valid = 0;
+    st->dmp.mem_dirty = 0;
+    st->dmp.mem_batch = 0;
+    if (i2c_read(st->addr, st->reg->pwr_mgmt_1, 2, data))
+        return -1;
+    shadow_store(st, st->reg->pwr_mgmt_1, 2, data);
+    if (data[0] & (BIT_SLEEP | BIT_LPA_CYCLE))
+        return 1;
+    st->chip_cfg.clk_src = data[0] & 0x07;
+    st->chip_cfg.sensors = 0;
+    if (!(data[1] & BIT_STBY_XG))
+        st->chip_cfg.sensors |= INV_X_GYRO;
+    if (!(data[1] & BIT_STBY_YG))
+        st->chip_cfg.sensors |= INV_Y_GYRO;
+    if (!(data[1] & BIT_STBY_ZG))
+        st->chip_cfg.sensors |= INV_Z_GYRO;
+    if (!(data[1] & BIT_STBY_XYZA))
+        st->chip_cfg.sensors |= INV_XYZ_ACCEL;
+    if (!st->chip_cfg.sensors)
+        return 1;
+
+    if (cfg_read(st, st->reg->gyro_cfg, &tmp))
+        return -1;
+    st->chip_cfg.gyro_fsr = (tmp >> 3) & 0x03;
+    if (cfg_read(st, st->reg->accel_cfg, &tmp))
+        return -1;
+    st->chip_cfg.accel_fsr = (tmp >> 3) & 0x03;
+    st->chip_cfg.accel_half = 0;
+    if (cfg_read(st, st->reg->lpf, &tmp))
+        return -1;
+    /* With the LPF off the base rate is 8kHz, not 1kHz; the driver never
+     * sets that up, so leave it to mpu_init.
+     */
+    if ((tmp & 0x07) == INV_FILTER_256HZ_NOLPF2 ||
+        (tmp & 0x07) == INV_FILTER_2100HZ_NOLPF)
+        return 1;
+    st->chip_cfg.lpf = tmp & 0x07;
+    if (cfg_read(st, st->reg->rate_div, &tmp))
         return -1;
-    if (mpu_set_accel_fsr(addr, 2))
+    st->chip_cfg.sample_rate = 1000 / (1 + tmp);
+    if (cfg_read(st, st->reg->fifo_en, &tmp))
         return -1;
-    if (mpu_set_lpf(addr, 42))
+#if defined AK89xx_SECONDARY && !defined AK89xx_BYPASS
+    st->chip_cfg.fifo_enable = tmp & (INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS);
+#else
+    st->chip_cfg.fifo_enable = tmp & (INV_XYZ_GYRO | INV_XYZ_ACCEL);
+#endif
+    st->chip_cfg.fifo_packet_size =
+        get_fifo_packet_size(st->chip_cfg.fifo_enable);
+    if (cfg_read(st, st->reg->int_enable, &tmp))
         return -1;
-    if (mpu_set_sample_rate(addr, 50))
+    st->chip_cfg.int_enable = tmp;
+    if (cfg_read(st, st->reg->user_ctrl, &user_ctrl))
         return -1;
-    if (mpu_configure_fifo(addr, 0))
+    st->chip_cfg.dmp_on = (user_ctrl & BIT_DMP_EN) ? 1 : 0;
+    if (cfg_read(st, st->reg->int_pin_cfg, &tmp))
         return -1;
+    st->chip_cfg.active_low_int = (tmp & BIT_ACTL) ? 1 : 0;
+    st->chip_cfg.latched_int = (tmp & BIT_LATCH_EN) ? 1 : 0;
+    /* With the I2C master on the aux bus is not bypassed, whatever the
+     * pin config says (begin leaves it that way).
+     */
+    st->chip_cfg.bypass_mode =
+        ((tmp & BIT_BYPASS_EN) && !(user_ctrl & BIT_AUX_IF_EN)) ? 1 : 0;
 
-#ifndef EMPL_TARGET_STM32F4    
+    st->chip_cfg.int_motion_only = 0;
+    st->chip_cfg.lp_accel_mode = 0;
+    memset(&st->chip_cfg.cache, 0, sizeof(st->chip_cfg.cache));
+    /* Set by mpu_adopt_firmware if the DMP image is still there. */
+    st->chip_cfg.dmp_loaded = 0;
+    st->chip_cfg.dmp_sample_rate = 0;
+
+#ifndef EMPL_TARGET_STM32F4
     if (int_param)
         reg_int_cb(int_param);
 #endif
 
 #ifdef AK89xx_SECONDARY
-    setup_compass(addr);
-    if (mpu_set_compass_sample_rate(addr, 10))
-        return -1;
+#ifdef AK89xx_BYPASS
+    if (st->chip_cfg.bypass_mode)
+        st->chip_cfg.sensors |= INV_XYZ_COMPASS;
 #else
-    /* Already disabled by setup_compass. */
-    if (mpu_set_bypass(0))
+    if (user_ctrl & BIT_AUX_IF_EN)
+        st->chip_cfg.sensors |= INV_XYZ_COMPASS;
+#endif
+    if (i2c_read(st->addr, st->reg->s4_ctrl, 1, &tmp))
         return -1;
+    compass_rate = st->chip_cfg.sample_rate / ((tmp & 0x1F) + 1);
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+    /* Continuous mode leaves slave 0 reading with slave 1 off. */
+    if (i2c_read(st->addr, st->reg->s0_ctrl, 1, data) ||
+        i2c_read(st->addr, st->reg->s1_ctrl, 1, data + 1))
+        return -1;
+    continuous = (st->chip_cfg.sensors & INV_XYZ_COMPASS) &&
+        (data[0] & BIT_SLAVE_EN) && !(data[1] & BIT_SLAVE_EN);
+#endif
+    if (setup_compass(st))
+        return -1;
+    /* The divider rounds down, which can land above the limit that
+     * mpu_set_compass_sample_rate checks.
+     */
+    if (mpu_set_compass_sample_rate(st,
+            _min(compass_rate, MAX_COMPASS_SAMPLE_RATE)))
+        return -1;
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+    if (continuous && mpu_set_compass_continuous(st, 1))
+        return -1;
+#endif
 #endif
-
-    mpu_set_sensors(addr, 0);
     return 0;
 }
 
@@ -737,7 +1128,7 @@ int mpu_init(unsigned char addr, struct int_param_s *int_param)
  *                          accel mode.
  *  @return     0 if successful.
  */
-int mpu_lp_accel_mode(unsigned char addr, unsigned short rate)
+int mpu_lp_accel_mode(struct mpu_state_s *st, unsigned short rate)
 {
     unsigned char tmp[2];
 
@@ -745,12 +1136,12 @@ int mpu_lp_accel_mode(unsigned char addr, unsigned short rate)
         return -1;
 
     if (!rate) {
-        mpu_set_int_latched(addr, 0);
+        mpu_set_int_latched(st, 0);
         tmp[0] = 0;
         tmp[1] = BIT_STBY_XYZG;
-        if (i2c_write(addr, st.reg->pwr_mgmt_1, 2, tmp))
+        if (cfg_write(st, st->reg->pwr_mgmt_1, 2, tmp))
             return -1;
-        st.chip_cfg.lp_accel_mode = 0;
+        st->chip_cfg.lp_accel_mode = 0;
         return 0;
     }
     /* For LP accel, we automatically configure the hardware to produce latched
@@ -760,7 +1151,7 @@ int mpu_lp_accel_mode(unsigned char addr, unsigned short rate)
      *
      * Any register read will clear the interrupt.
      */
-    mpu_set_int_latched(addr, 1);
+    mpu_set_int_latched(st, 1);
 #if defined MPU6050
     tmp[0] = BIT_LPA_CYCLE;
     if (rate == 1) {
@@ -777,7 +1168,7 @@ int mpu_lp_accel_mode(unsigned char addr, unsigned short rate)
         mpu_set_lpf(20);
     }
     tmp[1] = (tmp[1] << 6) | BIT_STBY_XYZG;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 2, tmp))
+    if (cfg_write(st, st->reg->pwr_mgmt_1, 2, tmp))
         return -1;
 #elif defined MPU6500
     /* Set wake frequency. */
@@ -801,16 +1192,16 @@ int mpu_lp_accel_mode(unsigned char addr, unsigned short rate)
         tmp[0] = INV_LPA_320HZ;
     else
         tmp[0] = INV_LPA_640HZ;
-    if (i2c_write(addr, st.reg->lp_accel_odr, 1, tmp))
+    if (i2c_write(st->addr, st->reg->lp_accel_odr, 1, tmp))
         return -1;
     tmp[0] = BIT_LPA_CYCLE;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, tmp))
+    if (cfg_write(st, st->reg->pwr_mgmt_1, 1, tmp))
         return -1;
 #endif
-    st.chip_cfg.sensors = INV_XYZ_ACCEL;
-    st.chip_cfg.clk_src = 0;
-    st.chip_cfg.lp_accel_mode = 1;
-    mpu_configure_fifo(addr, 0);
+    st->chip_cfg.sensors = INV_XYZ_ACCEL;
+    st->chip_cfg.clk_src = 0;
+    st->chip_cfg.lp_accel_mode = 1;
+    mpu_configure_fifo(st, 0);
 
     return 0;
 }
@@ -821,14 +1212,14 @@ int mpu_lp_accel_mode(unsigned char addr, unsigned short rate)
  *  @param[out] timestamp   Timestamp in milliseconds. Null if not needed.
  *  @return     0 if successful.
  */
-int mpu_get_gyro_reg(unsigned char addr, short *data, unsigned long *timestamp)
+int mpu_get_gyro_reg(struct mpu_state_s *st, short *data, unsigned long *timestamp)
 {
     unsigned char tmp[6];
 
-    if (!(st.chip_cfg.sensors & INV_XYZ_GYRO))
+    if (!(st->chip_cfg.sensors & INV_XYZ_GYRO))
         return -1;
 
-    if (i2c_read(addr, st.reg->raw_gyro, 6, tmp))
+    if (i2c_read(st->addr, st->reg->raw_gyro, 6, tmp))
         return -1;
     data[0] = (tmp[0] << 8) | tmp[1];
     data[1] = (tmp[2] << 8) | tmp[3];
@@ -844,14 +1235,14 @@ int mpu_get_gyro_reg(unsigned char addr, short *data, unsigned long *timestamp)
  *  @param[out] timestamp   Timestamp in milliseconds. Null if not needed.
  *  @return     0 if successful.
  */
-int mpu_get_accel_reg(unsigned char addr, short *data, unsigned long *timestamp)
+int mpu_get_accel_reg(struct mpu_state_s *st, short *data, unsigned long *timestamp)
 {
     unsigned char tmp[6];
 
-    if (!(st.chip_cfg.sensors & INV_XYZ_ACCEL))
+    if (!(st->chip_cfg.sensors & INV_XYZ_ACCEL))
         return -1;
 
-    if (i2c_read(addr, st.reg->raw_accel, 6, tmp))
+    if (i2c_read(st->addr, st->reg->raw_accel, 6, tmp))
         return -1;
     data[0] = (tmp[0] << 8) | tmp[1];
     data[1] = (tmp[2] << 8) | tmp[3];
@@ -861,27 +1252,33 @@ int mpu_get_accel_reg(unsigned char addr, short *data, unsigned long *timestamp)
     return 0;
 }
 
+/* Raw temperature register value to degrees C in q16. */
+static long temp_to_q16(struct mpu_state_s *st, short raw)
+{
+    return (long)((35 + ((raw - (float)st->hw->temp_offset) / st->hw->temp_sens)) * 65536L);
+}
+
 /**
  *  @brief      Read temperature data directly from the registers.
  *  @param[out] data        Data in q16 format.
  *  @param[out] timestamp   Timestamp in milliseconds. Null if not needed.
  *  @return     0 if successful.
  */
-int mpu_get_temperature(unsigned char addr, long *data, unsigned long *timestamp)
+int mpu_get_temperature(struct mpu_state_s *st, long *data, unsigned long *timestamp)
 {
     unsigned char tmp[2];
     short raw;
 
-    if (!(st.chip_cfg.sensors))
+    if (!(st->chip_cfg.sensors))
         return -1;
 
-    if (i2c_read(addr, st.reg->temp, 2, tmp))
+    if (i2c_read(st->addr, st->reg->temp, 2, tmp))
         return -1;
     raw = (tmp[0] << 8) | tmp[1];
     if (timestamp)
         get_ms(timestamp);
 
-    data[0] = (long)((35 + ((raw - (float)st.hw->temp_offset) / st.hw->temp_sens)) * 65536L);
+    data[0] = temp_to_q16(st, raw);
     return 0;
 }
 
@@ -893,13 +1290,13 @@ int mpu_get_temperature(unsigned char addr, long *data, unsigned long *timestamp
  *  @param[in]  accel_bias  returned structure with the accel bias
  *  @return     0 if successful.
  */
-int mpu_read_6500_accel_bias(unsigned char addr, long *accel_bias) {
+int mpu_read_6500_accel_bias(struct mpu_state_s *st, long *accel_bias) {
 	unsigned char data[6];
-	if (i2c_read(addr, 0x77, 2, &data[0]))
+	if (i2c_read(st->addr, 0x77, 2, &data[0]))
 		return -1;
-	if (i2c_read(addr, 0x7A, 2, &data[2]))
+	if (i2c_read(st->addr, 0x7A, 2, &data[2]))
 		return -1;
-	if (i2c_read(addr, 0x7D, 2, &data[4]))
+	if (i2c_read(st->addr, 0x7D, 2, &data[4]))
 		return -1;
 	accel_bias[0] = ((long)data[0]<<8) | data[1];
 	accel_bias[1] = ((long)data[2]<<8) | data[3];
@@ -915,13 +1312,13 @@ int mpu_read_6500_accel_bias(unsigned char addr, long *accel_bias) {
  *  @param[in]  accel_bias  returned structure with the accel bias
  *  @return     0 if successful.
  */
-int mpu_read_6050_accel_bias(unsigned char addr, long *accel_bias) {
+int mpu_read_6050_accel_bias(struct mpu_state_s *st, long *accel_bias) {
 	unsigned char data[6];
-	if (i2c_read(addr, 0x06, 2, &data[0]))
+	if (i2c_read(st->addr, 0x06, 2, &data[0]))
 		return -1;
-	if (i2c_read(addr, 0x08, 2, &data[2]))
+	if (i2c_read(st->addr, 0x08, 2, &data[2]))
 		return -1;
-	if (i2c_read(addr, 0x0A, 2, &data[4]))
+	if (i2c_read(st->addr, 0x0A, 2, &data[4]))
 		return -1;
 	accel_bias[0] = ((long)data[0]<<8) | data[1];
 	accel_bias[1] = ((long)data[2]<<8) | data[3];
@@ -929,13 +1326,13 @@ int mpu_read_6050_accel_bias(unsigned char addr, long *accel_bias) {
 	return 0;
 }
 
-int mpu_read_6500_gyro_bias(unsigned char addr, long *gyro_bias) {
+int mpu_read_6500_gyro_bias(struct mpu_state_s *st, long *gyro_bias) {
 	unsigned char data[6];
-	if (i2c_read(addr, 0x13, 2, &data[0]))
+	if (i2c_read(st->addr, 0x13, 2, &data[0]))
 		return -1;
-	if (i2c_read(addr, 0x15, 2, &data[2]))
+	if (i2c_read(st->addr, 0x15, 2, &data[2]))
 		return -1;
-	if (i2c_read(addr, 0x17, 2, &data[4]))
+	if (i2c_read(st->addr, 0x17, 2, &data[4]))
 		return -1;
 	gyro_bias[0] = ((long)data[0]<<8) | data[1];
 	gyro_bias[1] = ((long)data[2]<<8) | data[3];
@@ -951,7 +1348,7 @@ int mpu_read_6500_gyro_bias(unsigned char addr, long *gyro_bias) {
  *  @param[in]  gyro_bias  New biases.
  *  @return     0 if successful.
  */
-int mpu_set_gyro_bias_reg(unsigned char addr, long *gyro_bias)
+int mpu_set_gyro_bias_reg(struct mpu_state_s *st, long *gyro_bias)
 {
     unsigned char data[6] = {0, 0, 0, 0, 0, 0};
     int i=0;
@@ -964,11 +1361,11 @@ int mpu_set_gyro_bias_reg(unsigned char addr, long *gyro_bias)
     data[3] = (gyro_bias[1]) & 0xff;
     data[4] = (gyro_bias[2] >> 8) & 0xff;
     data[5] = (gyro_bias[2]) & 0xff;
-    if (i2c_write(addr, 0x13, 2, &data[0]))
+    if (i2c_write(st->addr, 0x13, 2, &data[0]))
         return -1;
-    if (i2c_write(addr, 0x15, 2, &data[2]))
+    if (i2c_write(st->addr, 0x15, 2, &data[2]))
         return -1;
-    if (i2c_write(addr, 0x17, 2, &data[4]))
+    if (i2c_write(st->addr, 0x17, 2, &data[4]))
         return -1;
     return 0;
 }
@@ -981,11 +1378,11 @@ int mpu_set_gyro_bias_reg(unsigned char addr, long *gyro_bias)
  *  @param[in]  accel_bias  New biases.
  *  @return     0 if successful.
  */
-int mpu_set_accel_bias_6050_reg(unsigned char addr, const long *accel_bias) {
+int mpu_set_accel_bias_6050_reg(struct mpu_state_s *st, const long *accel_bias) {
     unsigned char data[6] = {0, 0, 0, 0, 0, 0};
     long accel_reg_bias[3] = {0, 0, 0};
 
-    if(mpu_read_6050_accel_bias(addr, accel_reg_bias))
+    if(mpu_read_6050_accel_bias(st, accel_reg_bias))
         return -1;
 
     accel_reg_bias[0] -= (accel_bias[0] & ~1);
@@ -999,11 +1396,11 @@ int mpu_set_accel_bias_6050_reg(unsigned char addr, const long *accel_bias) {
     data[4] = (accel_reg_bias[2] >> 8) & 0xff;
     data[5] = (accel_reg_bias[2]) & 0xff;
 
-    if (i2c_write(addr, 0x06, 2, &data[0]))
+    if (i2c_write(st->addr, 0x06, 2, &data[0]))
         return -1;
-    if (i2c_write(addr, 0x08, 2, &data[2]))
+    if (i2c_write(st->addr, 0x08, 2, &data[2]))
         return -1;
-    if (i2c_write(addr, 0x0A, 2, &data[4]))
+    if (i2c_write(st->addr, 0x0A, 2, &data[4]))
         return -1;
 
     return 0;
@@ -1019,11 +1416,11 @@ int mpu_set_accel_bias_6050_reg(unsigned char addr, const long *accel_bias) {
  *  @param[in]  accel_bias  New biases.
  *  @return     0 if successful.
  */
-int mpu_set_accel_bias_6500_reg(unsigned char addr, const long *accel_bias) {
+int mpu_set_accel_bias_6500_reg(struct mpu_state_s *st, const long *accel_bias) {
     unsigned char data[6] = {0, 0, 0, 0, 0, 0};
     long accel_reg_bias[3] = {0, 0, 0};
 
-    if(mpu_read_6500_accel_bias(addr, accel_reg_bias))
+    if(mpu_read_6500_accel_bias(st, accel_reg_bias))
         return -1;
 
     // Preserve bit 0 of factory value (for temperature compensation)
@@ -1038,99 +1435,152 @@ int mpu_set_accel_bias_6500_reg(unsigned char addr, const long *accel_bias) {
     data[4] = (accel_reg_bias[2] >> 8) & 0xff;
     data[5] = (accel_reg_bias[2]) & 0xff;
 
-    if (i2c_write(addr, 0x77, 2, &data[0]))
+    if (i2c_write(st->addr, 0x77, 2, &data[0]))
         return -1;
-    if (i2c_write(addr, 0x7A, 2, &data[2]))
+    if (i2c_write(st->addr, 0x7A, 2, &data[2]))
         return -1;
-    if (i2c_write(addr, 0x7D, 2, &data[4]))
+    if (i2c_write(st->addr, 0x7D, 2, &data[4]))
         return -1;
 
     return 0;
 }
 
-/**
- *  @brief  Reset FIFO read/write pointers.
- *  @return 0 if successful.
+/* USER_CTRL enable bits for the current configuration, as set by
+ * mpu_reset_fifo once it is done.
  */
-int mpu_reset_fifo_fast(unsigned char addr)
+static unsigned char user_ctrl_enables(struct mpu_state_s *st)
 {
-    unsigned char data;
-	data = BIT_FIFO_RST | BIT_DMP_RST;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, &data))
-        return -1;
-	return 0;
-	
+    unsigned char data = BIT_FIFO_EN;
+
+    if (st->chip_cfg.dmp_on) {
+        data |= BIT_DMP_EN;
+        if (st->chip_cfg.sensors & INV_XYZ_COMPASS)
+            data |= BIT_AUX_IF_EN;
+    } else if (!st->chip_cfg.bypass_mode &&
+        (st->chip_cfg.sensors & INV_XYZ_COMPASS))
+        data |= BIT_AUX_IF_EN;
+    return data;
 }
 
 /**
- *  @brief  Reset FIFO read/write pointers.
+ *  @brief  Empty the FIFO without stopping it.
+ *  A single write: the DMP and the I2C master keep running and there is no
+ *  settling delay. In DMP mode a packet being written at that moment can be
+ *  cut short, so the next read may need to resync.
  *  @return 0 if successful.
  */
-int mpu_reset_fifo(unsigned char addr)
+int mpu_reset_fifo_fast(struct mpu_state_s *st)
 {
     unsigned char data;
 
-    if (!(st.chip_cfg.sensors))
-        return -1;
-
-    data = 0;
-    if (i2c_write(addr, st.reg->int_enable, 1, &data))
+    if (!(st->chip_cfg.sensors))
         return -1;
-    if (i2c_write(addr, st.reg->fifo_en, 1, &data))
+    data = user_ctrl_enables(st) | BIT_FIFO_RST;
+    if (cfg_write_now(st, st->reg->user_ctrl, 1, &data))
         return -1;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, &data))
+    st->dmp.resync_len = 0;
+    st->timing.locked = 0;
+    st->fifo_stats.last_ok_us = get_us();
+    return 0;
+}
+
+/* mpu_reset_fifo: stop the FIFO and start the reset, then restart it. */
+static int reset_fifo_step(struct mpu_state_s *st, unsigned char *stage)
+{
+    unsigned char data;
+
+    if (!(st->chip_cfg.sensors))
         return -1;
 
-    if (st.chip_cfg.dmp_on) {
-        data = BIT_FIFO_RST | BIT_DMP_RST;
-        if (i2c_write(addr, st.reg->user_ctrl, 1, &data))
+    if ((*stage)++ == 0) {
+        data = 0;
+        if (cfg_update(st, st->reg->int_enable, data))
             return -1;
-        delay_ms(50);
+        if (cfg_update(st, st->reg->fifo_en, data))
+            return -1;
+        if (cfg_write_now(st, st->reg->user_ctrl, 1, &data))
+            return -1;
+
+        if (st->chip_cfg.dmp_on) {
+            data = BIT_FIFO_RST | BIT_DMP_RST;
+            if (cfg_write_now(st, st->reg->user_ctrl, 1, &data))
+                return -1;
+            /* Do not count on the memory pointer surviving a DMP reset. */
+            st->chip_cfg.mem_ptr_valid = 0;
+        } else {
+            data = BIT_FIFO_RST;
+            if (cfg_write_now(st, st->reg->user_ctrl, 1, &data))
+                return -1;
+            if (st->chip_cfg.bypass_mode || !(st->chip_cfg.sensors & INV_XYZ_COMPASS))
+                data = BIT_FIFO_EN;
+            else
+                data = BIT_FIFO_EN | BIT_AUX_IF_EN;
+            if (cfg_write_now(st, st->reg->user_ctrl, 1, &data))
+                return -1;
+        }
+        return 50;
+    }
+
+    if (st->chip_cfg.dmp_on) {
         data = BIT_DMP_EN | BIT_FIFO_EN;
-        if (st.chip_cfg.sensors & INV_XYZ_COMPASS)
+        if (st->chip_cfg.sensors & INV_XYZ_COMPASS)
             data |= BIT_AUX_IF_EN;
-        if (i2c_write(addr, st.reg->user_ctrl, 1, &data))
+        if (cfg_write_now(st, st->reg->user_ctrl, 1, &data))
             return -1;
-        if (st.chip_cfg.int_enable)
+        if (st->chip_cfg.int_enable)
             data = BIT_DMP_INT_EN;
         else
             data = 0;
-        if (i2c_write(addr, st.reg->int_enable, 1, &data))
+        if (cfg_update(st, st->reg->int_enable, data))
             return -1;
         data = 0;
-        if (i2c_write(addr, st.reg->fifo_en, 1, &data))
+        if (cfg_update(st, st->reg->fifo_en, data))
             return -1;
     } else {
-        data = BIT_FIFO_RST;
-        if (i2c_write(addr, st.reg->user_ctrl, 1, &data))
-            return -1;
-        if (st.chip_cfg.bypass_mode || !(st.chip_cfg.sensors & INV_XYZ_COMPASS))
-            data = BIT_FIFO_EN;
-        else
-            data = BIT_FIFO_EN | BIT_AUX_IF_EN;
-        if (i2c_write(addr, st.reg->user_ctrl, 1, &data))
-            return -1;
-        delay_ms(50);
-        if (st.chip_cfg.int_enable)
+        if (st->chip_cfg.int_enable)
             data = BIT_DATA_RDY_EN;
         else
             data = 0;
-        if (i2c_write(addr, st.reg->int_enable, 1, &data))
+        if (cfg_update(st, st->reg->int_enable, data))
             return -1;
-        if (i2c_write(addr, st.reg->fifo_en, 1, &st.chip_cfg.fifo_enable))
+        if (cfg_update(st, st->reg->fifo_en, st->chip_cfg.fifo_enable))
             return -1;
     }
+    st->dmp.resync_len = 0;
+    st->timing.locked = 0;
+    st->fifo_stats.last_ok_us = get_us();
     return 0;
 }
 
+/**
+ *  @brief  Reset FIFO read/write pointers.
+ *  @return 0 if successful.
+ */
+int mpu_reset_fifo(struct mpu_state_s *st)
+{
+    return run_steps(st, reset_fifo_step);
+}
+
+/**
+ *  @brief  Start @e mpu_reset_fifo without blocking.
+ *  Call @e mpu_poll until it stops returning 1.
+ *  @return 1 if in progress, 0 if complete, negative on error.
+ */
+int mpu_reset_fifo_start(struct mpu_state_s *st)
+{
+    if (!(st->chip_cfg.sensors))
+        return -1;
+    return start_steps(st, reset_fifo_step, 0);
+}
+
 /**
  *  @brief      Get the gyro full-scale range.
  *  @param[out] fsr Current full-scale range.
  *  @return     0 if successful.
  */
-int mpu_get_gyro_fsr(unsigned short *fsr)
+int mpu_get_gyro_fsr(struct mpu_state_s *st, unsigned short *fsr)
 {
-    switch (st.chip_cfg.gyro_fsr) {
+    switch (st->chip_cfg.gyro_fsr) {
     case INV_FSR_250DPS:
         fsr[0] = 250;
         break;
@@ -1155,11 +1605,11 @@ int mpu_get_gyro_fsr(unsigned short *fsr)
  *  @param[in]  fsr Desired full-scale range.
  *  @return     0 if successful.
  */
-int mpu_set_gyro_fsr(unsigned char addr, unsigned short fsr)
+int mpu_set_gyro_fsr(struct mpu_state_s *st, unsigned short fsr)
 {
     unsigned char data;
 
-    if (!(st.chip_cfg.sensors))
+    if (!(st->chip_cfg.sensors))
         return -1;
 
     switch (fsr) {
@@ -1179,11 +1629,11 @@ int mpu_set_gyro_fsr(unsigned char addr, unsigned short fsr)
         return -1;
     }
 
-    if (st.chip_cfg.gyro_fsr == (data >> 3))
+    if (st->chip_cfg.gyro_fsr == (data >> 3))
         return 0;
-    if (i2c_write(addr, st.reg->gyro_cfg, 1, &data))
+    if (cfg_write(st, st->reg->gyro_cfg, 1, &data))
         return -1;
-    st.chip_cfg.gyro_fsr = data >> 3;
+    st->chip_cfg.gyro_fsr = data >> 3;
     return 0;
 }
 
@@ -1192,9 +1642,9 @@ int mpu_set_gyro_fsr(unsigned char addr, unsigned short fsr)
  *  @param[out] fsr Current full-scale range.
  *  @return     0 if successful.
  */
-int mpu_get_accel_fsr(unsigned char *fsr)
+int mpu_get_accel_fsr(struct mpu_state_s *st, unsigned char *fsr)
 {
-    switch (st.chip_cfg.accel_fsr) {
+    switch (st->chip_cfg.accel_fsr) {
     case INV_FSR_2G:
         fsr[0] = 2;
         break;
@@ -1210,7 +1660,7 @@ int mpu_get_accel_fsr(unsigned char *fsr)
     default:
         return -1;
     }
-    if (st.chip_cfg.accel_half)
+    if (st->chip_cfg.accel_half)
         fsr[0] <<= 1;
     return 0;
 }
@@ -1220,11 +1670,11 @@ int mpu_get_accel_fsr(unsigned char *fsr)
  *  @param[in]  fsr Desired full-scale range.
  *  @return     0 if successful.
  */
-int mpu_set_accel_fsr(unsigned char addr, unsigned char fsr)
+int mpu_set_accel_fsr(struct mpu_state_s *st, unsigned char fsr)
 {
     unsigned char data;
 
-    if (!(st.chip_cfg.sensors))
+    if (!(st->chip_cfg.sensors))
         return -1;
 
     switch (fsr) {
@@ -1244,11 +1694,11 @@ int mpu_set_accel_fsr(unsigned char addr, unsigned char fsr)
         return -1;
     }
 
-    if (st.chip_cfg.accel_fsr == (data >> 3))
+    if (st->chip_cfg.accel_fsr == (data >> 3))
         return 0;
-    if (i2c_write(addr, st.reg->accel_cfg, 1, &data))
+    if (cfg_write(st, st->reg->accel_cfg, 1, &data))
         return -1;
-    st.chip_cfg.accel_fsr = data >> 3;
+    st->chip_cfg.accel_fsr = data >> 3;
     return 0;
 }
 
@@ -1257,9 +1707,9 @@ int mpu_set_accel_fsr(unsigned char addr, unsigned char fsr)
  *  @param[out] lpf Current LPF setting.
  *  0 if successful.
  */
-int mpu_get_lpf(unsigned short *lpf)
+int mpu_get_lpf(struct mpu_state_s *st, unsigned short *lpf)
 {
-    switch (st.chip_cfg.lpf) {
+    switch (st->chip_cfg.lpf) {
     case INV_FILTER_188HZ:
         lpf[0] = 188;
         break;
@@ -1293,11 +1743,11 @@ int mpu_get_lpf(unsigned short *lpf)
  *  @param[in]  lpf Desired LPF setting.
  *  @return     0 if successful.
  */
-int mpu_set_lpf(unsigned char addr, unsigned short lpf)
+int mpu_set_lpf(struct mpu_state_s *st, unsigned short lpf)
 {
     unsigned char data;
 
-    if (!(st.chip_cfg.sensors))
+    if (!(st->chip_cfg.sensors))
         return -1;
 
     if (lpf >= 188)
@@ -1313,11 +1763,11 @@ int mpu_set_lpf(unsigned char addr, unsigned short lpf)
     else
         data = INV_FILTER_5HZ;
 
-    if (st.chip_cfg.lpf == data)
+    if (st->chip_cfg.lpf == data)
         return 0;
-    if (i2c_write(addr, st.reg->lpf, 1, &data))
+    if (cfg_write(st, st->reg->lpf, 1, &data))
         return -1;
-    st.chip_cfg.lpf = data;
+    st->chip_cfg.lpf = data;
     return 0;
 }
 
@@ -1326,12 +1776,12 @@ int mpu_set_lpf(unsigned char addr, unsigned short lpf)
  *  @param[out] rate    Current sampling rate (Hz).
  *  @return     0 if successful.
  */
-int mpu_get_sample_rate(unsigned short *rate)
+int mpu_get_sample_rate(struct mpu_state_s *st, unsigned short *rate)
 {
-    if (st.chip_cfg.dmp_on)
+    if (st->chip_cfg.dmp_on)
         return -1;
     else
-        rate[0] = st.chip_cfg.sample_rate;
+        rate[0] = st->chip_cfg.sample_rate;
     return 0;
 }
 
@@ -1341,26 +1791,26 @@ int mpu_get_sample_rate(unsigned short *rate)
  *  @param[in]  rate    Desired sampling rate (Hz).
  *  @return     0 if successful.
  */
-int mpu_set_sample_rate(unsigned char addr, unsigned short rate)
+int mpu_set_sample_rate(struct mpu_state_s *st, unsigned short rate)
 {
     unsigned char data;
 
-    if (!(st.chip_cfg.sensors))
+    if (!(st->chip_cfg.sensors))
         return -1;
 
-    if (st.chip_cfg.dmp_on)
+    if (st->chip_cfg.dmp_on)
         return -1;
     else {
-        if (st.chip_cfg.lp_accel_mode) {
+        if (st->chip_cfg.lp_accel_mode) {
             if (rate && (rate <= 40)) {
                 /* Just stay in low-power accel mode. */
-                mpu_lp_accel_mode(addr, rate);
+                mpu_lp_accel_mode(st, rate);
                 return 0;
             }
             /* Requested rate exceeds the allowed frequencies in LP accel mode,
              * switch back to full-power mode.
              */
-            mpu_lp_accel_mode(addr, 0);
+            mpu_lp_accel_mode(st, 0);
         }
         if (rate < 4)
             rate = 4;
@@ -1368,17 +1818,17 @@ int mpu_set_sample_rate(unsigned char addr, unsigned short rate)
             rate = 1000;
 
         data = 1000 / rate - 1;
-        if (i2c_write(addr, st.reg->rate_div, 1, &data))
+        if (cfg_write(st, st->reg->rate_div, 1, &data))
             return -1;
 
-        st.chip_cfg.sample_rate = 1000 / (1 + data);
+        st->chip_cfg.sample_rate = 1000 / (1 + data);
 
 #ifdef AK89xx_SECONDARY
-        mpu_set_compass_sample_rate(addr, _min(st.chip_cfg.compass_sample_rate, MAX_COMPASS_SAMPLE_RATE));
+        mpu_set_compass_sample_rate(st, _min(st->chip_cfg.compass_sample_rate, MAX_COMPASS_SAMPLE_RATE));
 #endif
 
         /* Automatically set LPF to 1/2 sampling rate. */
-        mpu_set_lpf(addr, st.chip_cfg.sample_rate >> 1);
+        mpu_set_lpf(st, st->chip_cfg.sample_rate >> 1);
         return 0;
     }
 }
@@ -1388,10 +1838,10 @@ int mpu_set_sample_rate(unsigned char addr, unsigned short rate)
  *  @param[out] rate    Current compass sampling rate (Hz).
  *  @return     0 if successful.
  */
-int mpu_get_compass_sample_rate(unsigned short *rate)
+int mpu_get_compass_sample_rate(struct mpu_state_s *st, unsigned short *rate)
 {
 #ifdef AK89xx_SECONDARY
-    rate[0] = st.chip_cfg.compass_sample_rate;
+    rate[0] = st->chip_cfg.compass_sample_rate;
     return 0;
 #else
     rate[0] = 0;
@@ -1410,36 +1860,177 @@ int mpu_get_compass_sample_rate(unsigned short *rate)
  *  @param[in]  rate    Desired compass sampling rate (Hz).
  *  @return     0 if successful.
  */
-int mpu_set_compass_sample_rate(unsigned char addr, unsigned short rate)
+int mpu_set_compass_sample_rate(struct mpu_state_s *st, unsigned short rate)
 {
 #ifdef AK89xx_SECONDARY
     unsigned char div;
-    if (!rate || rate > st.chip_cfg.sample_rate || rate > MAX_COMPASS_SAMPLE_RATE)
+    if (!rate || rate > st->chip_cfg.sample_rate || rate > MAX_COMPASS_SAMPLE_RATE)
         return -1;
 
-    div = st.chip_cfg.sample_rate / rate - 1;
-    if (i2c_write(addr, st.reg->s4_ctrl, 1, &div))
+    div = st->chip_cfg.sample_rate / rate - 1;
+    if (i2c_write(st->addr, st->reg->s4_ctrl, 1, &div))
         return -1;
-    st.chip_cfg.compass_sample_rate = st.chip_cfg.sample_rate / (div + 1);
+    st->chip_cfg.compass_sample_rate = st->chip_cfg.sample_rate / (div + 1);
     return 0;
 #else
     return -1;
 #endif
 }
 
-/**
- *  @brief      Get gyro sensitivity scale factor.
- *  @param[out] sens    Conversion from hardware units to dps.
- *  @return     0 if successful.
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+/* Write one AKM register through I2C master slave 4, which makes a single
+ * transfer with the next sample once enabled. Waits for it to finish.
  */
-int mpu_get_gyro_sens(float *sens)
+static int compass_write_slv4(struct mpu_state_s *st, unsigned char reg,
+    unsigned char value)
 {
-    switch (st.chip_cfg.gyro_fsr) {
-    case INV_FSR_250DPS:
-        sens[0] = 131.f;
-        break;
-    case INV_FSR_500DPS:
-        sens[0] = 65.5f;
+    unsigned char tmp[3];
+    unsigned long long start;
+
+    tmp[0] = st->chip_cfg.compass_addr;
+    tmp[1] = reg;
+    tmp[2] = value;
+    if (i2c_write(st->addr, st->reg->s4_addr, 3, tmp))
+        return -1;
+    /* The low bits hold the compass rate divider; keep them. */
+    if (i2c_read(st->addr, st->reg->s4_ctrl, 1, tmp))
+        return -1;
+    tmp[0] |= BIT_SLAVE_EN;
+    if (i2c_write(st->addr, st->reg->s4_ctrl, 1, tmp))
+        return -1;
+
+    start = get_us();
+    do {
+        if (i2c_read(st->addr, st->reg->i2c_mst_status, 1, tmp))
+            return -1;
+        if (tmp[0] & BIT_SLV4_NACK)
+            return -1;
+        if (tmp[0] & BIT_SLV4_DONE)
+            return 0;
+        delay_ms(1);
+    } while (get_us() - start < 2000000ULL / st->chip_cfg.sample_rate + 2000);
+    return -1;
+}
+#endif
+
+/**
+ *  @brief      Let the compass measure on its own.
+ *  By default, I2C master slave 1 starts a single AKM measurement at every
+ *  compass sample, for slave 0 to read at the next one. In continuous mode
+ *  the AK8963 measures at 100Hz (16-bit) by itself and slave 1 is turned
+ *  off; slave 0 picks up each new measurement into EXT_SENS_DATA, where
+ *  @e mpu_get_compass_reg and @e mpu_get_all_reg read it, and the FIFO if
+ *  INV_XYZ_COMPASS is passed to @e mpu_configure_fifo. A compass sample
+ *  rate of 100Hz or more gets every measurement.
+ *  \n Leaves bypass mode. Not available with the AK8975 or AK89xx_BYPASS.
+ *  @param[in]  enable  1 for continuous mode, 0 for single measurements.
+ *  @return     0 if successful.
+ */
+int mpu_set_compass_continuous(struct mpu_state_s *st, unsigned char enable)
+{
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+    unsigned char tmp;
+
+    /* The I2C master has to be running already. */
+    if (!(st->chip_cfg.sensors & INV_XYZ_COMPASS) || st->shadow.staging)
+        return -1;
+    if (st->chip_cfg.compass_continuous == enable)
+        return 0;
+    if (mpu_set_bypass(st, 0))
+        return -1;
+
+    /* The AKM has to go through power-down to change modes. */
+    if (enable) {
+        tmp = 0;
+        if (i2c_write(st->addr, st->reg->s1_ctrl, 1, &tmp))
+            return -1;
+        if (compass_write_slv4(st, AKM_REG_CNTL, AKM_POWER_DOWN))
+            return -1;
+        if (compass_write_slv4(st, AKM_REG_CNTL, AKM_CONTINUOUS_100HZ))
+            return -1;
+    } else {
+        if (compass_write_slv4(st, AKM_REG_CNTL, AKM_POWER_DOWN))
+            return -1;
+        tmp = BIT_SLAVE_EN | 1;
+        if (i2c_write(st->addr, st->reg->s1_ctrl, 1, &tmp))
+            return -1;
+    }
+    st->chip_cfg.compass_continuous = enable;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Correct compass readings for hard and soft iron.
+ *  From then on, every reading (@e mpu_get_compass_reg, @e mpu_get_all_reg
+ *  and FIFO packets) is matrix * (reading - offset), after the sensitivity
+ *  adjustment. The calibration is kept by @e mpu_init.
+ *  @param[in]  offset  Hard-iron offset in hardware units, or NULL to stop
+ *                      correcting.
+ *  @param[in]  matrix  Soft-iron 3x3 matrix in q14, row-major, or NULL for
+ *                      the identity.
+ *  @return     0 if successful.
+ */
+int mpu_set_compass_cal(struct mpu_state_s *st, const short *offset,
+    const short *matrix)
+{
+#ifdef AK89xx_SECONDARY
+    int i;
+
+    if (!offset) {
+        st->chip_cfg.compass_cal = 0;
+        return 0;
+    }
+    for (i = 0; i < 3; i++)
+        st->chip_cfg.compass_offset[i] = offset[i];
+    for (i = 0; i < 9; i++)
+        st->chip_cfg.compass_matrix[i] = matrix ? matrix[i] :
+            ((i % 4) ? 0 : 1 << 14);
+    st->chip_cfg.compass_cal = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Get the compass hard- and soft-iron correction.
+ *  @param[out] offset  Offset in hardware units.
+ *  @param[out] matrix  3x3 matrix in q14, row-major.
+ *  @return     0 if successful, -1 if no correction is applied.
+ */
+int mpu_get_compass_cal(struct mpu_state_s *st, short *offset, short *matrix)
+{
+#ifdef AK89xx_SECONDARY
+    int i;
+
+    if (!st->chip_cfg.compass_cal)
+        return -1;
+    for (i = 0; i < 3; i++)
+        offset[i] = st->chip_cfg.compass_offset[i];
+    for (i = 0; i < 9; i++)
+        matrix[i] = st->chip_cfg.compass_matrix[i];
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Get gyro sensitivity scale factor.
+ *  @param[out] sens    Conversion from hardware units to dps.
+ *  @return     0 if successful.
+ */
+int mpu_get_gyro_sens(struct mpu_state_s *st, float *sens)
+{
+    switch (st->chip_cfg.gyro_fsr) {
+    case INV_FSR_250DPS:
+        sens[0] = 131.f;
+        break;
+    case INV_FSR_500DPS:
+        sens[0] = 65.5f;
         break;
     case INV_FSR_1000DPS:
         sens[0] = 32.8f;
@@ -1458,9 +2049,9 @@ int mpu_get_gyro_sens(float *sens)
  *  @param[out] sens    Conversion from hardware units to g's.
  *  @return     0 if successful.
  */
-int mpu_get_accel_sens(unsigned short *sens)
+int mpu_get_accel_sens(struct mpu_state_s *st, unsigned short *sens)
 {
-    switch (st.chip_cfg.accel_fsr) {
+    switch (st->chip_cfg.accel_fsr) {
     case INV_FSR_2G:
         sens[0] = 16384;
         break;
@@ -1476,7 +2067,7 @@ int mpu_get_accel_sens(unsigned short *sens)
     default:
         return -1;
     }
-    if (st.chip_cfg.accel_half)
+    if (st->chip_cfg.accel_half)
         sens[0] >>= 1;
     return 0;
 }
@@ -1490,50 +2081,81 @@ int mpu_get_accel_sens(unsigned short *sens)
  *  @param[out] sensors Mask of sensors in FIFO.
  *  @return     0 if successful.
  */
-int mpu_get_fifo_config(unsigned char *sensors)
+int mpu_get_fifo_config(struct mpu_state_s *st, unsigned char *sensors)
 {
-    sensors[0] = st.chip_cfg.fifo_enable;
+    sensors[0] = st->chip_cfg.fifo_enable;
     return 0;
 }
 
+/* Size in bytes of one raw FIFO packet for a fifo_en mask. */
+static unsigned char get_fifo_packet_size(unsigned char fifo_enable)
+{
+    unsigned char packet_size = 0;
+
+    if (fifo_enable & INV_X_GYRO)
+        packet_size += 2;
+    if (fifo_enable & INV_Y_GYRO)
+        packet_size += 2;
+    if (fifo_enable & INV_Z_GYRO)
+        packet_size += 2;
+    if (fifo_enable & INV_XYZ_ACCEL)
+        packet_size += 6;
+    /* Slave 0: AKM ST1..ST2. */
+    if (fifo_enable & INV_XYZ_COMPASS)
+        packet_size += 8;
+    return packet_size;
+}
+
 /**
  *  @brief      Select which sensors are pushed to FIFO.
  *  @e sensors can contain a combination of the following flags:
  *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
  *  \n INV_XYZ_GYRO
  *  \n INV_XYZ_ACCEL
+ *  \n INV_XYZ_COMPASS (what I2C master slave 0 reads; leaves bypass mode.
+ *  Not available with AK89xx_BYPASS.)
  *  @param[in]  sensors Mask of sensors to push to FIFO.
  *  @return     0 if successful.
  */
-int mpu_configure_fifo(unsigned char addr, unsigned char sensors)
+int mpu_configure_fifo(struct mpu_state_s *st, unsigned char sensors)
 {
     unsigned char prev;
     int result = 0;
 
+#if defined AK89xx_SECONDARY && !defined AK89xx_BYPASS
+    /* Compass data gets to the FIFO through the I2C master. */
+    if ((sensors & st->chip_cfg.sensors & INV_XYZ_COMPASS) &&
+        !st->chip_cfg.dmp_on && mpu_set_bypass(st, 0))
+        return -1;
+#else
     /* Compass data isn't going into the FIFO. Stop trying. */
     sensors &= ~INV_XYZ_COMPASS;
+#endif
 
-    if (st.chip_cfg.dmp_on)
+    if (st->chip_cfg.dmp_on)
         return 0;
     else {
-        if (!(st.chip_cfg.sensors))
+        if (!(st->chip_cfg.sensors))
             return -1;
-        prev = st.chip_cfg.fifo_enable;
-        st.chip_cfg.fifo_enable = sensors & st.chip_cfg.sensors;
-        if (st.chip_cfg.fifo_enable != sensors)
+        prev = st->chip_cfg.fifo_enable;
+        st->chip_cfg.fifo_enable = sensors & st->chip_cfg.sensors;
+        st->chip_cfg.fifo_packet_size =
+            get_fifo_packet_size(st->chip_cfg.fifo_enable);
+        if (st->chip_cfg.fifo_enable != sensors)
             /* You're not getting what you asked for. Some sensors are
              * asleep.
              */
             result = -1;
         else
             result = 0;
-        if (sensors || st.chip_cfg.lp_accel_mode)
-            set_int_enable(addr, 1);
+        if (sensors || st->chip_cfg.lp_accel_mode)
+            set_int_enable(st, 1);
         else
-            set_int_enable(addr, 0);
+            set_int_enable(st, 0);
         if (sensors) {
-            if (mpu_reset_fifo(addr)) {
-                st.chip_cfg.fifo_enable = prev;
+            if (cfg_reset_fifo(st)) {
+                st->chip_cfg.fifo_enable = prev;
+                st->chip_cfg.fifo_packet_size = get_fifo_packet_size(prev);
                 return -1;
             }
         }
@@ -1547,9 +2169,9 @@ int mpu_configure_fifo(unsigned char addr, unsigned char sensors)
  *  @param[in]  power_on    1 if turned on, 0 if suspended.
  *  @return     0 if successful.
  */
-int mpu_get_power_state(unsigned char *power_on)
+int mpu_get_power_state(struct mpu_state_s *st, unsigned char *power_on)
 {
-    if (st.chip_cfg.sensors)
+    if (st->chip_cfg.sensors)
         power_on[0] = 1;
     else
         power_on[0] = 0;
@@ -1566,7 +2188,39 @@ int mpu_get_power_state(unsigned char *power_on)
  *  @param[in]  sensors    Mask of sensors to wake.
  *  @return     0 if successful.
  */
-int mpu_set_sensors(unsigned char addr, unsigned char sensors)
+int mpu_set_sensors(struct mpu_state_s *st, unsigned char sensors)
+{
+    if (set_sensors_write(st, sensors))
+        return -1;
+    if (st->shadow.staging)
+        st->shadow.settle = 1;
+    else
+        delay_ms(50);
+    return 0;
+}
+
+static int set_sensors_step(struct mpu_state_s *st, unsigned char *stage)
+{
+    if ((*stage)++)
+        return 0;
+    if (set_sensors_write(st, st->async.arg))
+        return -1;
+    return 50;
+}
+
+/**
+ *  @brief      Start @e mpu_set_sensors without blocking.
+ *  Call @e mpu_poll until it stops returning 1.
+ *  @param[in]  sensors    Mask of sensors to wake.
+ *  @return     1 if in progress, 0 if complete, negative on error.
+ */
+int mpu_set_sensors_start(struct mpu_state_s *st, unsigned char sensors)
+{
+    return start_steps(st, set_sensors_step, sensors);
+}
+
+/* mpu_set_sensors without the settling delay. */
+static int set_sensors_write(struct mpu_state_s *st, unsigned char sensors)
 {
     unsigned char data;
 #ifdef AK89xx_SECONDARY
@@ -1579,11 +2233,11 @@ int mpu_set_sensors(unsigned char addr, unsigned char sensors)
         data = 0;
     else
         data = BIT_SLEEP;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, &data)) {
-        st.chip_cfg.sensors = 0;
+    if (cfg_write(st, st->reg->pwr_mgmt_1, 1, &data)) {
+        st->chip_cfg.sensors = 0;
         return -1;
     }
-    st.chip_cfg.clk_src = data & ~BIT_SLEEP;
+    st->chip_cfg.clk_src = data & ~BIT_SLEEP;
 
     data = 0;
     if (!(sensors & INV_X_GYRO))
@@ -1594,23 +2248,23 @@ int mpu_set_sensors(unsigned char addr, unsigned char sensors)
         data |= BIT_STBY_ZG;
     if (!(sensors & INV_XYZ_ACCEL))
         data |= BIT_STBY_XYZA;
-    if (i2c_write(addr, st.reg->pwr_mgmt_2, 1, &data)) {
-        st.chip_cfg.sensors = 0;
+    if (cfg_write(st, st->reg->pwr_mgmt_2, 1, &data)) {
+        st->chip_cfg.sensors = 0;
         return -1;
     }
 
     if (sensors && (sensors != INV_XYZ_ACCEL))
         /* Latched interrupts only used in LP accel mode. */
-        mpu_set_int_latched(addr, 0);
+        mpu_set_int_latched(st, 0);
 
 #ifdef AK89xx_SECONDARY
 #ifdef AK89xx_BYPASS
     if (sensors & INV_XYZ_COMPASS)
-        mpu_set_bypass(addr, 1);
+        mpu_set_bypass(st, 1);
     else
-        mpu_set_bypass(addr, 0);
+        mpu_set_bypass(st, 0);
 #else
-    if (i2c_read(addr, st.reg->user_ctrl, 1, &user_ctrl))
+    if (cfg_read(st, st->reg->user_ctrl, &user_ctrl))
         return -1;
     /* Handle AKM power management. */
     if (sensors & INV_XYZ_COMPASS) {
@@ -1620,21 +2274,113 @@ int mpu_set_sensors(unsigned char addr, unsigned char sensors)
         data = AKM_POWER_DOWN;
         user_ctrl &= ~BIT_AUX_IF_EN;
     }
-    if (st.chip_cfg.dmp_on)
+    if (st->chip_cfg.dmp_on)
         user_ctrl |= BIT_DMP_EN;
     else
         user_ctrl &= ~BIT_DMP_EN;
-    if (i2c_write(addr, st.reg->s1_do, 1, &data))
+    if (i2c_write(st->addr, st->reg->s1_do, 1, &data))
         return -1;
     /* Enable/disable I2C master mode. */
-    if (i2c_write(addr, st.reg->user_ctrl, 1, &user_ctrl))
+    if (cfg_write(st, st->reg->user_ctrl, 1, &user_ctrl))
         return -1;
 #endif
 #endif
 
-    st.chip_cfg.sensors = sensors;
-    st.chip_cfg.lp_accel_mode = 0;
-    delay_ms(50);
+    st->chip_cfg.sensors = sensors;
+    st->chip_cfg.lp_accel_mode = 0;
+    return 0;
+}
+
+/**
+ *  @brief      Start staging configuration changes.
+ *  Until @e mpu_config_commit, the configuration registers written by
+ *  @e mpu_set_gyro_fsr, @e mpu_set_accel_fsr, @e mpu_set_lpf,
+ *  @e mpu_set_sample_rate, @e mpu_configure_fifo, @e mpu_set_sensors,
+ *  @e mpu_lp_accel_mode, @e mpu_set_int_latched and @e mpu_set_dmp_state
+ *  are only recorded, as are the FIFO reset and the settling delay those
+ *  calls need. Getters report the staged configuration straight away.
+ *  \n Other registers (compass, low-power accel rate, bypass mode) are
+ *  still written at once. Non-blocking calls (@e mpu_*_start),
+ *  @e mpu_set_compass_continuous and the self tests need the device
+ *  configured and fail while staging.
+ *  @return     0 if successful, -1 if already staging.
+ */
+int mpu_config_begin(struct mpu_state_s *st)
+{
+    if (st->shadow.staging || st->async.step)
+        return -1;
+    st->shadow.staging = 1;
+    st->shadow.dirty = 0;
+    st->shadow.reset_fifo = 0;
+    st->shadow.settle = 0;
+    return 0;
+}
+
+/**
+ *  @brief      Write the configuration staged since @e mpu_config_begin.
+ *  Registers staged with the value they already hold are skipped. The rest
+ *  are written in address order, neighbours merged into burst writes.
+ *  Then the sensors settle, if they were switched, and the FIFO is reset
+ *  if any staged call asked for it, once each.
+ *  @return     0 if successful. On error the device holds part of the
+ *              staged configuration; run @e mpu_init.
+ */
+int mpu_config_commit(struct mpu_state_s *st)
+{
+    unsigned char data[MPU_SHADOW_REGS];
+    unsigned char ii, jj, last;
+    unsigned short changed, power;
+
+    if (!st->shadow.staging)
+        return -1;
+    st->shadow.staging = 0;
+
+    changed = st->shadow.dirty;
+    for (ii = 0; ii < MPU_SHADOW_REGS; ii++)
+        if ((st->shadow.valid & (1 << ii)) &&
+            st->shadow.value[ii] == st->shadow.staged[ii])
+            changed &= ~(1 << ii);
+    st->shadow.dirty = 0;
+    /* A FIFO reset sets these itself, from the driver state. */
+    if (st->shadow.reset_fifo)
+        changed &= ~((1 << shadow_index(st, st->reg->fifo_en)) |
+            (1 << shadow_index(st, st->reg->int_enable)) |
+            (1 << shadow_index(st, st->reg->user_ctrl)));
+
+    for (ii = 0; ii < MPU_SHADOW_REGS; ii = last + 1) {
+        last = ii;
+        if (!(changed & (1 << ii)))
+            continue;
+        /* Take in the changes that follow, through known unchanged
+         * registers when only a few are in between.
+         */
+        for (jj = ii + 1; jj < MPU_SHADOW_REGS &&
+            shadow_addr(st, jj) == shadow_addr(st, jj - 1) + 1; jj++) {
+            if (changed & (1 << jj))
+                last = jj;
+            else if (!(st->shadow.valid & (1 << jj)) ||
+                jj - last > SHADOW_MAX_GAP)
+                break;
+        }
+        for (jj = ii; jj <= last; jj++) {
+            if (changed & (1 << jj))
+                data[jj - ii] = st->shadow.staged[jj];
+            else
+                data[jj - ii] = st->shadow.value[jj];
+        }
+        if (cfg_write_now(st, shadow_addr(st, ii), last - ii + 1, data)) {
+            st->shadow.valid &= ~changed;
+            return -1;
+        }
+    }
+
+    /* Sensors need to settle only if they were switched on or off. */
+    power = (1 << shadow_index(st, st->reg->pwr_mgmt_1)) |
+        (1 << shadow_index(st, st->reg->pwr_mgmt_2));
+    if (st->shadow.settle && (changed & power))
+        delay_ms(50);
+    if (st->shadow.reset_fifo && mpu_reset_fifo(st))
+        return -1;
     return 0;
 }
 
@@ -1643,12 +2389,12 @@ int mpu_set_sensors(unsigned char addr, unsigned char sensors)
  *  @param[out] status  Mask of interrupt bits.
  *  @return     0 if successful.
  */
-int mpu_get_int_status(unsigned char addr, short *status)
+int mpu_get_int_status(struct mpu_state_s *st, short *status)
 {
     unsigned char tmp[2];
-    if (!st.chip_cfg.sensors)
+    if (!st->chip_cfg.sensors)
         return -1;
-    if (i2c_read(addr, st.reg->dmp_int_status, 2, tmp))
+    if (i2c_read(st->addr, st->reg->dmp_int_status, 2, tmp))
         return -1;
     status[0] = (tmp[0] << 8) | tmp[1];
     return 0;
@@ -1672,81 +2418,130 @@ int mpu_get_int_status(unsigned char addr, short *status)
  *  @param[out] more        Number of remaining packets.
  *  @return     0 if successful.
  */
-int mpu_read_fifo(unsigned char addr, short *gyro, short *accel, unsigned long *timestamp,
+int mpu_read_fifo(struct mpu_state_s *st, short *gyro, short *accel, unsigned long *timestamp,
         unsigned char *sensors, unsigned char *more)
 {
-    /* Assumes maximum packet size is gyro (6) + accel (6). */
-    unsigned char data[MAX_PACKET_LENGTH];
-    unsigned char packet_size = 0;
-    unsigned short fifo_count, index = 0;
-
-    if (st.chip_cfg.dmp_on)
-        return -1;
-
-    sensors[0] = 0;
-    if (!st.chip_cfg.sensors)
-        return -1;
-    if (!st.chip_cfg.fifo_enable)
-        return -1;
-
-    if (st.chip_cfg.fifo_enable & INV_X_GYRO)
-        packet_size += 2;
-    if (st.chip_cfg.fifo_enable & INV_Y_GYRO)
-        packet_size += 2;
-    if (st.chip_cfg.fifo_enable & INV_Z_GYRO)
-        packet_size += 2;
-    if (st.chip_cfg.fifo_enable & INV_XYZ_ACCEL)
-        packet_size += 6;
-
-    if (i2c_read(addr, st.reg->fifo_count_h, 2, data))
-        return -1;
-    fifo_count = (data[0] << 8) | data[1];
-    if (fifo_count < packet_size){
-        //return 0;
-		return -5;
-		//log_i("FIFO count: %hd\n", fifo_count);
-	}
-//    log_i("FIFO count: %hd\n", fifo_count);
-    if (fifo_count > (st.hw->max_fifo >> 1)) {
-        /* FIFO is 50% full, better check overflow bit. */
-        if (i2c_read(addr, st.reg->int_status, 1, data))
-            return -1;
-        if (data[0] & BIT_FIFO_OVERFLOW) {
-            //mpu_reset_fifo(addr);
-			mpu_reset_fifo_fast(addr);
-            return -2;
-        }
-    }
-    get_ms((unsigned long*)timestamp);
+    struct mpu_sample_s sample;
+    unsigned short count, remaining, dropped;
+    int result;
 
-    if (i2c_read(addr, st.reg->fifo_r_w, packet_size, data))
-        return -1;
-    more[0] = fifo_count / packet_size - 1;
     sensors[0] = 0;
+    result = mpu_read_fifo_batch(st, &sample, 1, &count, &remaining, &dropped);
+    if (result)
+        return result;
+    if (!count)
+        return -5;
+
+    if (sample.sensors & INV_XYZ_ACCEL)
+        memcpy(accel, sample.accel, sizeof(sample.accel));
+    if (sample.sensors & (INV_X_GYRO | INV_Y_GYRO | INV_Z_GYRO))
+        memcpy(gyro, sample.gyro, sizeof(sample.gyro));
+    timestamp[0] = sample.timestamp;
+    sensors[0] = (unsigned char)sample.sensors;
+    more[0] = (remaining > 0xFF) ? 0xFF : remaining;
+    return 0;
+}
 
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_XYZ_ACCEL) {
-        accel[0] = (data[index+0] << 8) | data[index+1];
-        accel[1] = (data[index+2] << 8) | data[index+3];
-        accel[2] = (data[index+4] << 8) | data[index+5];
-        sensors[0] |= INV_XYZ_ACCEL;
+/* Parse one raw FIFO packet laid out according to fifo_enable. */
+static void decode_fifo_packet(struct mpu_state_s *st, const unsigned char *data,
+    struct mpu_sample_s *sample)
+{
+    unsigned char index = 0;
+
+    sample->sensors = 0;
+    if (st->chip_cfg.fifo_enable & INV_XYZ_ACCEL) {
+        sample->accel[0] = (data[index+0] << 8) | data[index+1];
+        sample->accel[1] = (data[index+2] << 8) | data[index+3];
+        sample->accel[2] = (data[index+4] << 8) | data[index+5];
+        sample->sensors |= INV_XYZ_ACCEL;
         index += 6;
     }
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_X_GYRO) {
-        gyro[0] = (data[index+0] << 8) | data[index+1];
-        sensors[0] |= INV_X_GYRO;
+    if (st->chip_cfg.fifo_enable & INV_X_GYRO) {
+        sample->gyro[0] = (data[index+0] << 8) | data[index+1];
+        sample->sensors |= INV_X_GYRO;
         index += 2;
     }
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_Y_GYRO) {
-        gyro[1] = (data[index+0] << 8) | data[index+1];
-        sensors[0] |= INV_Y_GYRO;
+    if (st->chip_cfg.fifo_enable & INV_Y_GYRO) {
+        sample->gyro[1] = (data[index+0] << 8) | data[index+1];
+        sample->sensors |= INV_Y_GYRO;
         index += 2;
     }
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_Z_GYRO) {
-        gyro[2] = (data[index+0] << 8) | data[index+1];
-        sensors[0] |= INV_Z_GYRO;
+    if (st->chip_cfg.fifo_enable & INV_Z_GYRO) {
+        sample->gyro[2] = (data[index+0] << 8) | data[index+1];
+        sample->sensors |= INV_Z_GYRO;
         index += 2;
     }
+#ifdef AK89xx_SECONDARY
+    /* Flagged only when slave 0 picked up a new measurement. */
+    if ((st->chip_cfg.fifo_enable & INV_XYZ_COMPASS) &&
+        !decode_compass(st, data + index, sample->compass))
+        sample->sensors |= INV_XYZ_COMPASS;
+#endif
+}
+
+/**
+ *  @brief      Get every available packet from the FIFO.
+ *  FIFO_COUNT is read once, then up to @e max_samples packets are pulled in
+ *  as few burst reads as the bus allows and decoded into @e samples. Only
+ *  the fields flagged in each sample's @e sensors member are valid.
+ *  \n Each sample is stamped with its capture time; see
+ *  @e mpu_stamp_samples.
+ *  \n If the FIFO overflowed, it is recovered as set by
+ *  @e mpu_set_fifo_recovery and @e dropped is set to the number of packets
+ *  lost. If no whole packets survived, -2 is returned.
+ *  @param[out] samples     Decoded packets, oldest first.
+ *  @param[in]  max_samples Capacity of @e samples.
+ *  @param[out] count       Number of packets decoded.
+ *  @param[out] more        Number of packets still in the FIFO.
+ *  @param[out] dropped     Number of packets lost to a FIFO overflow.
+ *  @return     0 if successful.
+ */
+int mpu_read_fifo_batch(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more,
+    unsigned short *dropped)
+{
+    unsigned char data[MAX_BURST_LENGTH];
+    unsigned char packet_size = st->chip_cfg.fifo_packet_size;
+    unsigned short fifo_count, packets, this_read, ii;
+    unsigned long lost;
+    int result;
+
+    count[0] = 0;
+    more[0] = 0;
+    dropped[0] = 0;
+
+    if (st->chip_cfg.dmp_on)
+        return -1;
+    if (!st->chip_cfg.sensors)
+        return -1;
+    if (!st->chip_cfg.fifo_enable || !packet_size)
+        return -1;
+
+    lost = st->fifo_stats.packets_lost;
+    result = mpu_get_fifo_count(st, &fifo_count);
+    if (result == -2) {
+        dropped[0] = st->fifo_stats.packets_lost - lost;
+        if (!fifo_count)
+            return -2;
+    } else if (result)
+        return -1;
+
+    packets = fifo_count / packet_size;
+    if (packets > max_samples) {
+        more[0] = packets - max_samples;
+        packets = max_samples;
+    }
 
+    while (count[0] < packets) {
+        this_read = _min(packets - count[0], MAX_BURST_LENGTH / packet_size);
+        if (mpu_read_fifo_burst(st, this_read * packet_size, data))
+            return -1;
+        for (ii = 0; ii < this_read; ii++) {
+            decode_fifo_packet(st, data + ii * packet_size, &samples[count[0]]);
+            count[0]++;
+        }
+    }
+    mpu_stamp_samples(st, samples, count[0], more[0]);
     return 0;
 }
 
@@ -1757,135 +2552,310 @@ int mpu_read_fifo(unsigned char addr, short *gyro, short *accel, unsigned long *
  *  @param[in]  data    FIFO packet.
  *  @param[in]  more    Number of remaining packets.
  */
-int mpu_read_fifo_stream(unsigned char addr, unsigned short length, unsigned char *data,
+int mpu_read_fifo_stream(struct mpu_state_s *st, unsigned short length, unsigned char *data,
     unsigned char *more)
 {
     unsigned char tmp[2];
     unsigned short fifo_count;
-    if (!st.chip_cfg.dmp_on)
+    if (!st->chip_cfg.dmp_on)
         return -1;
-    if (!st.chip_cfg.sensors)
+    if (!st->chip_cfg.sensors)
         return -2;
 
-    if (i2c_read(addr, st.reg->fifo_count_h, 2, tmp))
+    if (i2c_read(st->addr, st->reg->fifo_count_h, 2, tmp))
         return -3;
     fifo_count = (tmp[0] << 8) | tmp[1];
     if (fifo_count < length) {
         more[0] = 0;
         return -4;
     }
-    if (fifo_count > (st.hw->max_fifo >> 1)) {
+    if (fifo_count > (st->hw->max_fifo >> 1)) {
         /* FIFO is 50% full, better check overflow bit. */
-        if (i2c_read(addr, st.reg->int_status, 1, tmp))
+        if (i2c_read(st->addr, st->reg->int_status, 1, tmp))
             return -5;
         if (tmp[0] & BIT_FIFO_OVERFLOW) {
-            mpu_reset_fifo(addr);
-            return -6;
+            recover_fifo_overflow(st, &fifo_count);
+            if (fifo_count < length)
+                return -6;
         }
     }
 
-    if (i2c_read(addr, st.reg->fifo_r_w, length, data))
+    if (i2c_read(st->addr, st->reg->fifo_r_w, length, data))
         return -7;
     more[0] = fifo_count / length - 1;
     return 0;
 }
 
+/* Packet length the FIFO is currently being filled with. */
+static unsigned short fifo_packet_length(struct mpu_state_s *st)
+{
+    if (st->chip_cfg.dmp_on)
+        return st->dmp.packet_length;
+    return st->chip_cfg.fifo_packet_size;
+}
+
+/* Bring an overflowed FIFO back to a packet boundary, following
+ * chip_cfg.fifo_recovery, and account for it in fifo_stats.
+ * count holds FIFO_COUNT on entry and the bytes left to read on exit.
+ */
+static int recover_fifo_overflow(struct mpu_state_s *st, unsigned short *count)
+{
+    struct mpu_fifo_stats_s *stats = &st->fifo_stats;
+    unsigned short length = fifo_packet_length(st);
+    unsigned short rate, skip, this_read;
+    unsigned long long start, now;
+    unsigned long produced, lost;
+    unsigned char data[16];
+    int result = 0;
+
+    start = get_us();
+    /* Whatever was held over no longer lines up with the FIFO, and the
+     * packets lost can only be estimated.
+     */
+    st->dmp.resync_len = 0;
+    st->timing.locked = 0;
+    if (st->chip_cfg.dmp_on)
+        rate = st->dmp.fifo_rate;
+    else
+        rate = st->chip_cfg.sample_rate;
+    /* What the sensor produced since the FIFO was last seen healthy, minus
+     * what is still in it, is what the overflow overwrote.
+     */
+    produced = (unsigned long)((start - stats->last_ok_us) * rate / 1000000);
+    lost = length ? count[0] / length : 0;
+    lost = (produced > lost) ? produced - lost : 1;
+
+    switch (st->chip_cfg.fifo_recovery) {
+    case INV_FIFO_RECOVER_DISCARD:
+        if (length) {
+            /* The newest bytes end on a packet boundary; only the oldest,
+             * partly overwritten packet has to go.
+             */
+            skip = count[0] % length;
+            count[0] -= skip;
+            stats->bytes_discarded += skip;
+            while (skip && !result) {
+                this_read = _min(skip, sizeof(data));
+                result = mpu_read_fifo_burst(st, this_read, data);
+                skip -= this_read;
+            }
+            if (!result)
+                break;
+        }
+        /* Could not read it out; empty the FIFO instead. */
+        /* Fall through. */
+    case INV_FIFO_RECOVER_FIFO_ONLY:
+        if (length)
+            lost += count[0] / length;
+        count[0] = 0;
+        result = mpu_reset_fifo_fast(st);
+        break;
+    default:
+        if (length)
+            lost += count[0] / length;
+        count[0] = 0;
+        result = mpu_reset_fifo(st);
+        now = get_us();
+        /* Nothing is produced while the DMP is held in reset. */
+        if (st->chip_cfg.dmp_on)
+            lost += (unsigned long)((now - start) * rate / 1000000);
+        break;
+    }
+
+    now = get_us();
+    stats->overflows++;
+    stats->packets_lost += lost;
+    stats->last_recovery_us = (unsigned long)(now - start);
+    if (stats->last_recovery_us > stats->max_recovery_us)
+        stats->max_recovery_us = stats->last_recovery_us;
+    stats->last_ok_us = now;
+    return result;
+}
+
 /**
- *  @brief      Set device to bypass mode.
- *  @param[in]  bypass_on   1 to enable bypass mode.
- *  @return     0 if successful.
+ *  @brief      Read the number of bytes waiting in the FIFO.
+ *  FIFO_COUNT is read once; if the FIFO is more than half full, the overflow
+ *  bit is checked as well. An overflowed FIFO is no longer packet-aligned;
+ *  it is brought back to a packet boundary as set by
+ *  @e mpu_set_fifo_recovery, and the loss is added to the FIFO stats.
+ *  @param[out] count   Number of bytes in the FIFO. On overflow, the number
+ *                      of packet-aligned bytes still left to read.
+ *  @return     0 if successful, -2 if the FIFO overflowed.
  */
-int mpu_set_bypass(unsigned char addr, unsigned char bypass_on)
+int mpu_get_fifo_count(struct mpu_state_s *st, unsigned short *count)
 {
-    unsigned char tmp;
+    unsigned char tmp[2];
 
-    if (st.chip_cfg.bypass_mode == bypass_on)
-        return 0;
+    count[0] = 0;
+    if (!st->chip_cfg.sensors)
+        return -1;
 
-    if (bypass_on) {
-        if (i2c_read(addr, st.reg->user_ctrl, 1, &tmp))
-            return -1;
-        tmp &= ~BIT_AUX_IF_EN;
-        if (i2c_write(addr, st.reg->user_ctrl, 1, &tmp))
-            return -1;
-        delay_ms(3);
-        tmp = BIT_BYPASS_EN;
-        if (st.chip_cfg.active_low_int)
-            tmp |= BIT_ACTL;
-        if (st.chip_cfg.latched_int)
-            tmp |= BIT_LATCH_EN | BIT_ANY_RD_CLR;
-        if (i2c_write(addr, st.reg->int_pin_cfg, 1, &tmp))
-            return -1;
-    } else {
-        /* Enable I2C master mode if compass is being used. */
-        if (i2c_read(addr, st.reg->user_ctrl, 1, &tmp))
-            return -1;
-        if (st.chip_cfg.sensors & INV_XYZ_COMPASS)
-            tmp |= BIT_AUX_IF_EN;
-        else
-            tmp &= ~BIT_AUX_IF_EN;
-        if (i2c_write(addr, st.reg->user_ctrl, 1, &tmp))
-            return -1;
-        delay_ms(3);
-        if (st.chip_cfg.active_low_int)
-            tmp = BIT_ACTL;
-        else
-            tmp = 0;
-        if (st.chip_cfg.latched_int)
-            tmp |= BIT_LATCH_EN | BIT_ANY_RD_CLR;
-        if (i2c_write(addr, st.reg->int_pin_cfg, 1, &tmp))
+    st->timing.count_start_us = get_us();
+    if (i2c_read(st->addr, st->reg->fifo_count_h, 2, tmp))
+        return -1;
+    st->timing.count_end_us = get_us();
+    count[0] = (tmp[0] << 8) | tmp[1];
+    if (count[0] > (st->hw->max_fifo >> 1)) {
+        /* FIFO is 50% full, better check overflow bit. */
+        if (i2c_read(st->addr, st->reg->int_status, 1, tmp))
             return -1;
+        if (tmp[0] & BIT_FIFO_OVERFLOW) {
+            if (recover_fifo_overflow(st, count))
+                return -1;
+            return -2;
+        }
     }
-    st.chip_cfg.bypass_mode = bypass_on;
+    st->fifo_stats.last_ok_us = get_us();
     return 0;
 }
 
 /**
- *  @brief      Set interrupt level.
- *  @param[in]  active_low  1 for active low, 0 for active high.
+ *  @brief      Read a block of bytes from the FIFO.
+ *  The block is split into as few bus reads as the platform allows. No
+ *  packet alignment is enforced; the caller is expected to request a whole
+ *  number of packets, as reported by @e mpu_get_fifo_count.
+ *  @param[in]  length  Number of bytes to read.
+ *  @param[out] data    FIFO contents.
  *  @return     0 if successful.
  */
-int mpu_set_int_level(unsigned char active_low)
+int mpu_read_fifo_burst(struct mpu_state_s *st, unsigned short length, unsigned char *data)
 {
-    st.chip_cfg.active_low_int = active_low;
+    unsigned short this_read;
+    unsigned short max_read = i2c_max_read();
+
+    if (!st->chip_cfg.sensors)
+        return -1;
+
+    while (length) {
+        this_read = _min(length, max_read);
+        if (i2c_read(st->addr, st->reg->fifo_r_w, this_read, data))
+            return -1;
+        data += this_read;
+        length -= this_read;
+    }
     return 0;
 }
 
-/**
- *  @brief      Enable latched interrupts.
- *  Any MPU register will clear the interrupt.
- *  @param[in]  enable  1 to enable, 0 to disable.
- *  @return     0 if successful.
- */
-int mpu_set_int_latched(unsigned char addr, unsigned char enable)
+/* First half of a bypass change: the I2C master lets go of the aux bus. */
+static int set_bypass_master(struct mpu_state_s *st, unsigned char bypass_on)
 {
     unsigned char tmp;
-    if (st.chip_cfg.latched_int == enable)
-        return 0;
 
-    if (enable)
-        tmp = BIT_LATCH_EN | BIT_ANY_RD_CLR;
+    if (cfg_read(st, st->reg->user_ctrl, &tmp))
+        return -1;
+    /* Enable I2C master mode if compass is being used. */
+    if (!bypass_on && (st->chip_cfg.sensors & INV_XYZ_COMPASS))
+        tmp |= BIT_AUX_IF_EN;
     else
-        tmp = 0;
-    if (st.chip_cfg.bypass_mode)
-        tmp |= BIT_BYPASS_EN;
-    if (st.chip_cfg.active_low_int)
-        tmp |= BIT_ACTL;
-    if (i2c_write(addr, st.reg->int_pin_cfg, 1, &tmp))
+        tmp &= ~BIT_AUX_IF_EN;
+    if (cfg_write_now(st, st->reg->user_ctrl, 1, &tmp))
         return -1;
-    st.chip_cfg.latched_int = enable;
     return 0;
 }
 
-#ifdef MPU6050
-static int get_accel_prod_shift(unsigned char addr, float *st_shift)
+/* Second half, 3ms later: connect or disconnect the aux bus. */
+static int set_bypass_pin_cfg(struct mpu_state_s *st, unsigned char bypass_on)
 {
-    unsigned char tmp[4], shift_code[3], ii;
+    unsigned char tmp;
 
-    if (i2c_read(addr, 0x0D, 4, tmp))
-        return 0x07;
+    if (bypass_on)
+        tmp = BIT_BYPASS_EN;
+    else
+        tmp = 0;
+    if (st->chip_cfg.active_low_int)
+        tmp |= BIT_ACTL;
+    if (st->chip_cfg.latched_int)
+        tmp |= BIT_LATCH_EN | BIT_ANY_RD_CLR;
+    if (cfg_write_now(st, st->reg->int_pin_cfg, 1, &tmp))
+        return -1;
+    st->chip_cfg.bypass_mode = bypass_on;
+    return 0;
+}
 
-    shift_code[0] = ((tmp[0] & 0xE0) >> 3) | ((tmp[3] & 0x30) >> 4);
+/**
+ *  @brief      Set device to bypass mode.
+ *  @param[in]  bypass_on   1 to enable bypass mode.
+ *  @return     0 if successful.
+ */
+int mpu_set_bypass(struct mpu_state_s *st, unsigned char bypass_on)
+{
+    if (st->chip_cfg.bypass_mode == bypass_on)
+        return 0;
+    if (set_bypass_master(st, bypass_on))
+        return -1;
+    delay_ms(3);
+    return set_bypass_pin_cfg(st, bypass_on);
+}
+
+static int set_bypass_step(struct mpu_state_s *st, unsigned char *stage)
+{
+    if (st->chip_cfg.bypass_mode == st->async.arg)
+        return 0;
+    if ((*stage)++ == 0) {
+        if (set_bypass_master(st, st->async.arg))
+            return -1;
+        return 3;
+    }
+    return set_bypass_pin_cfg(st, st->async.arg);
+}
+
+/**
+ *  @brief      Start @e mpu_set_bypass without blocking.
+ *  Call @e mpu_poll until it stops returning 1.
+ *  @param[in]  bypass_on   1 to enable bypass mode.
+ *  @return     1 if in progress, 0 if complete, negative on error.
+ */
+int mpu_set_bypass_start(struct mpu_state_s *st, unsigned char bypass_on)
+{
+    return start_steps(st, set_bypass_step, bypass_on);
+}
+
+/**
+ *  @brief      Set interrupt level.
+ *  @param[in]  active_low  1 for active low, 0 for active high.
+ *  @return     0 if successful.
+ */
+int mpu_set_int_level(struct mpu_state_s *st, unsigned char active_low)
+{
+    st->chip_cfg.active_low_int = active_low;
+    return 0;
+}
+
+/**
+ *  @brief      Enable latched interrupts.
+ *  Any MPU register will clear the interrupt.
+ *  @param[in]  enable  1 to enable, 0 to disable.
+ *  @return     0 if successful.
+ */
+int mpu_set_int_latched(struct mpu_state_s *st, unsigned char enable)
+{
+    unsigned char tmp;
+    if (st->chip_cfg.latched_int == enable)
+        return 0;
+
+    if (enable)
+        tmp = BIT_LATCH_EN | BIT_ANY_RD_CLR;
+    else
+        tmp = 0;
+    if (st->chip_cfg.bypass_mode)
+        tmp |= BIT_BYPASS_EN;
+    if (st->chip_cfg.active_low_int)
+        tmp |= BIT_ACTL;
+    if (cfg_write(st, st->reg->int_pin_cfg, 1, &tmp))
+        return -1;
+    st->chip_cfg.latched_int = enable;
+    return 0;
+}
+
+#ifdef MPU6050
+static int get_accel_prod_shift(struct mpu_state_s *st, float *st_shift)
+{
+    unsigned char tmp[4], shift_code[3], ii;
+
+    if (i2c_read(st->addr, 0x0D, 4, tmp))
+        return 0x07;
+
+    shift_code[0] = ((tmp[0] & 0xE0) >> 3) | ((tmp[3] & 0x30) >> 4);
     shift_code[1] = ((tmp[1] & 0xE0) >> 3) | ((tmp[3] & 0x0C) >> 2);
     shift_code[2] = ((tmp[2] & 0xE0) >> 3) | (tmp[3] & 0x03);
     for (ii = 0; ii < 3; ii++) {
@@ -1923,13 +2893,13 @@ static int accel_self_test(long *bias_regular, long *bias_st)
     return result;
 }
 
-static int gyro_self_test(unsigned char addr, long *bias_regular, long *bias_st)
+static int gyro_self_test(struct mpu_state_s *st, long *bias_regular, long *bias_st)
 {
     int jj, result = 0;
     unsigned char tmp[3];
     float st_shift, st_shift_cust, st_shift_var;
 
-    if (i2c_read(addr, 0x0D, 3, tmp))
+    if (i2c_read(st->addr, 0x0D, 3, tmp))
         return 0x07;
 
     tmp[0] &= 0x1F;
@@ -1954,28 +2924,28 @@ static int gyro_self_test(unsigned char addr, long *bias_regular, long *bias_st)
 
 #endif 
 #ifdef AK89xx_SECONDARY
-static int compass_self_test(unsigned char addr)
+static int compass_self_test(struct mpu_state_s *st)
 {
     unsigned char tmp[6];
     unsigned char tries = 10;
     int result = 0x07;
     short data;
 
-    mpu_set_bypass(addr, 1);
+    mpu_set_bypass(st, 1);
 
     tmp[0] = AKM_POWER_DOWN;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp))
+    if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp))
         return 0x07;
     tmp[0] = AKM_BIT_SELF_TEST;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_ASTC, 1, tmp))
+    if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_ASTC, 1, tmp))
         goto AKM_restore;
     tmp[0] = AKM_MODE_SELF_TEST;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp))
+    if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp))
         goto AKM_restore;
 
     do {
         delay_ms(10);
-        if (i2c_read(st.chip_cfg.compass_addr, AKM_REG_ST1, 1, tmp))
+        if (i2c_read(st->chip_cfg.compass_addr, AKM_REG_ST1, 1, tmp))
             goto AKM_restore;
         if (tmp[0] & AKM_DATA_READY)
             break;
@@ -1983,7 +2953,7 @@ static int compass_self_test(unsigned char addr)
     if (!(tmp[0] & AKM_DATA_READY))
         goto AKM_restore;
 
-    if (i2c_read(st.chip_cfg.compass_addr, AKM_REG_HXL, 6, tmp))
+    if (i2c_read(st->chip_cfg.compass_addr, AKM_REG_HXL, 6, tmp))
         goto AKM_restore;
 
     result = 0;
@@ -2010,76 +2980,81 @@ static int compass_self_test(unsigned char addr)
 #endif
 AKM_restore:
     tmp[0] = 0 | SUPPORTS_AK89xx_HIGH_SENS;
-    i2c_write(st.chip_cfg.compass_addr, AKM_REG_ASTC, 1, tmp);
+    i2c_write(st->chip_cfg.compass_addr, AKM_REG_ASTC, 1, tmp);
     tmp[0] = SUPPORTS_AK89xx_HIGH_SENS;
-    i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp);
-    mpu_set_bypass(addr, 0);
+    i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp);
+    mpu_set_bypass(st, 0);
     return result;
 }
 #endif
 
-static int get_st_biases(unsigned char addr, long *gyro, long *accel, unsigned char hw_test)
+static int get_st_biases(struct mpu_state_s *st, long *gyro, long *accel, unsigned char hw_test)
 {
     unsigned char data[MAX_PACKET_LENGTH];
     unsigned char packet_count, ii;
     unsigned short fifo_count;
 
+    /* Registers are written behind the shadow's back from here on, and
+     * the DMP is reset.
+     */
+    st->shadow.valid = 0;
+    st->chip_cfg.mem_ptr_valid = 0;
     data[0] = 0x01;
     data[1] = 0;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 2, data))
+    if (i2c_write(st->addr, st->reg->pwr_mgmt_1, 2, data))
         return -1;
     delay_ms(200);
     data[0] = 0;
-    if (i2c_write(addr, st.reg->int_enable, 1, data))
+    if (i2c_write(st->addr, st->reg->int_enable, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->fifo_en, 1, data))
+    if (i2c_write(st->addr, st->reg->fifo_en, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, data))
+    if (i2c_write(st->addr, st->reg->pwr_mgmt_1, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->i2c_mst, 1, data))
+    if (i2c_write(st->addr, st->reg->i2c_mst, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, data))
+    if (i2c_write(st->addr, st->reg->user_ctrl, 1, data))
         return -1;
     data[0] = BIT_FIFO_RST | BIT_DMP_RST;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, data))
+    if (i2c_write(st->addr, st->reg->user_ctrl, 1, data))
         return -1;
     delay_ms(15);
-    data[0] = st.test->reg_lpf;
-    if (i2c_write(addr, st.reg->lpf, 1, data))
+    data[0] = st->test->reg_lpf;
+    if (i2c_write(st->addr, st->reg->lpf, 1, data))
         return -1;
-    data[0] = st.test->reg_rate_div;
-    if (i2c_write(addr, st.reg->rate_div, 1, data))
+    data[0] = st->test->reg_rate_div;
+    if (i2c_write(st->addr, st->reg->rate_div, 1, data))
         return -1;
     if (hw_test)
-        data[0] = st.test->reg_gyro_fsr | 0xE0;
+        data[0] = st->test->reg_gyro_fsr | 0xE0;
     else
-        data[0] = st.test->reg_gyro_fsr;
-    if (i2c_write(addr, st.reg->gyro_cfg, 1, data))
+        data[0] = st->test->reg_gyro_fsr;
+    if (i2c_write(st->addr, st->reg->gyro_cfg, 1, data))
         return -1;
 
     if (hw_test)
-        data[0] = st.test->reg_accel_fsr | 0xE0;
+        data[0] = st->test->reg_accel_fsr | 0xE0;
     else
         data[0] = test.reg_accel_fsr;
-    if (i2c_write(addr, st.reg->accel_cfg, 1, data))
+    if (i2c_write(st->addr, st->reg->accel_cfg, 1, data))
         return -1;
     if (hw_test)
         delay_ms(200);
 
     /* Fill FIFO for test.wait_ms milliseconds. */
     data[0] = BIT_FIFO_EN;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, data))
+    if (i2c_write(st->addr, st->reg->user_ctrl, 1, data))
         return -1;
 
     data[0] = INV_XYZ_GYRO | INV_XYZ_ACCEL;
-    if (i2c_write(addr, st.reg->fifo_en, 1, data))
+    if (i2c_write(st->addr, st->reg->fifo_en, 1, data))
         return -1;
     delay_ms(test.wait_ms);
     data[0] = 0;
-    if (i2c_write(addr, st.reg->fifo_en, 1, data))
+    if (i2c_write(st->addr, st->reg->fifo_en, 1, data))
         return -1;
 
-    if (i2c_read(addr, st.reg->fifo_count_h, 2, data))
+    if (i2c_read(st->addr, st->reg->fifo_count_h, 2, data))
         return -1;
 
     fifo_count = (data[0] << 8) | data[1];
@@ -2089,7 +3064,7 @@ static int get_st_biases(unsigned char addr, long *gyro, long *accel, unsigned c
 
     for (ii = 0; ii < packet_count; ii++) {
         short accel_cur[3], gyro_cur[3];
-        if (i2c_read(addr, st.reg->fifo_r_w, MAX_PACKET_LENGTH, data))
+        if (i2c_read(st->addr, st->reg->fifo_r_w, MAX_PACKET_LENGTH, data))
             return -1;
         accel_cur[0] = ((short)data[0] << 8) | data[1];
         accel_cur[1] = ((short)data[2] << 8) | data[3];
@@ -2175,13 +3150,13 @@ static const unsigned short mpu_6500_st_tb[256] = {
 	28538,28823,29112,29403,29697,29994,30294,30597,
 	30903,31212,31524,31839,32157,32479,32804,33132
 };
-static int accel_6500_self_test(unsigned char addr, long *bias_regular, long *bias_st, int debug)
+static int accel_6500_self_test(struct mpu_state_s *st, long *bias_regular, long *bias_st, int debug)
 {
     int i, result = 0, otp_value_zero = 0;
     float accel_st_al_min, accel_st_al_max;
     float st_shift_cust[3], st_shift_ratio[3], ct_shift_prod[3], accel_offset_max;
     unsigned char regs[3];
-    if (i2c_read(addr, REG_6500_XA_ST_DATA, 3, regs)) {
+    if (i2c_read(st->addr, REG_6500_XA_ST_DATA, 3, regs)) {
     	if(debug)
     		log_i("Reading OTP Register Error.\n");
     	return 0x07;
@@ -2265,14 +3240,14 @@ static int accel_6500_self_test(unsigned char addr, long *bias_regular, long *bi
     return result;
 }
 
-static int gyro_6500_self_test(unsigned char addr, long *bias_regular, long *bias_st, int debug)
+static int gyro_6500_self_test(struct mpu_state_s *st, long *bias_regular, long *bias_st, int debug)
 {
     int i, result = 0, otp_value_zero = 0;
     float gyro_st_al_max;
     float st_shift_cust[3], st_shift_ratio[3], ct_shift_prod[3], gyro_offset_max;
     unsigned char regs[3];
 
-    if (i2c_read(addr, REG_6500_XG_ST_DATA, 3, regs)) {
+    if (i2c_read(st->addr, REG_6500_XG_ST_DATA, 3, regs)) {
     	if(debug)
     		log_i("Reading OTP Register Error.\n");
         return 0x07;
@@ -2358,61 +3333,66 @@ static int gyro_6500_self_test(unsigned char addr, long *bias_regular, long *bia
     return result;
 }
 
-static int get_st_6500_biases(unsigned char addr, long *gyro, long *accel, unsigned char hw_test, int debug)
+static int get_st_6500_biases(struct mpu_state_s *st, long *gyro, long *accel, unsigned char hw_test, int debug)
 {
     unsigned char data[HWST_MAX_PACKET_LENGTH];
     unsigned char packet_count, ii;
     unsigned short fifo_count;
     int s = 0, read_size = 0, ind;
 
+    /* Registers are written behind the shadow's back from here on, and
+     * the DMP is reset.
+     */
+    st->shadow.valid = 0;
+    st->chip_cfg.mem_ptr_valid = 0;
     data[0] = 0x01;
     data[1] = 0;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 2, data))
+    if (i2c_write(st->addr, st->reg->pwr_mgmt_1, 2, data))
         return -1;
     delay_ms(200);
     data[0] = 0;
-    if (i2c_write(addr, st.reg->int_enable, 1, data))
+    if (i2c_write(st->addr, st->reg->int_enable, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->fifo_en, 1, data))
+    if (i2c_write(st->addr, st->reg->fifo_en, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, data))
+    if (i2c_write(st->addr, st->reg->pwr_mgmt_1, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->i2c_mst, 1, data))
+    if (i2c_write(st->addr, st->reg->i2c_mst, 1, data))
         return -1;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, data))
+    if (i2c_write(st->addr, st->reg->user_ctrl, 1, data))
         return -1;
     data[0] = BIT_FIFO_RST | BIT_DMP_RST;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, data))
+    if (i2c_write(st->addr, st->reg->user_ctrl, 1, data))
         return -1;
     delay_ms(15);
-    data[0] = st.test->reg_lpf;
-    if (i2c_write(addr, st.reg->lpf, 1, data))
+    data[0] = st->test->reg_lpf;
+    if (i2c_write(st->addr, st->reg->lpf, 1, data))
         return -1;
-    data[0] = st.test->reg_rate_div;
-    if (i2c_write(addr, st.reg->rate_div, 1, data))
+    data[0] = st->test->reg_rate_div;
+    if (i2c_write(st->addr, st->reg->rate_div, 1, data))
         return -1;
     if (hw_test)
-        data[0] = st.test->reg_gyro_fsr | 0xE0;
+        data[0] = st->test->reg_gyro_fsr | 0xE0;
     else
-        data[0] = st.test->reg_gyro_fsr;
-    if (i2c_write(addr, st.reg->gyro_cfg, 1, data))
+        data[0] = st->test->reg_gyro_fsr;
+    if (i2c_write(st->addr, st->reg->gyro_cfg, 1, data))
         return -1;
 
     if (hw_test)
-        data[0] = st.test->reg_accel_fsr | 0xE0;
+        data[0] = st->test->reg_accel_fsr | 0xE0;
     else
         data[0] = test.reg_accel_fsr;
-    if (i2c_write(addr, st.reg->accel_cfg, 1, data))
+    if (i2c_write(st->addr, st->reg->accel_cfg, 1, data))
         return -1;
 
     delay_ms(test.wait_ms);  //wait 200ms for sensors to stabilize
 
     /* Enable FIFO */
     data[0] = BIT_FIFO_EN;
-    if (i2c_write(addr, st.reg->user_ctrl, 1, data))
+    if (i2c_write(st->addr, st->reg->user_ctrl, 1, data))
         return -1;
     data[0] = INV_XYZ_GYRO | INV_XYZ_ACCEL;
-    if (i2c_write(addr, st.reg->fifo_en, 1, data))
+    if (i2c_write(st->addr, st->reg->fifo_en, 1, data))
         return -1;
 
     //initialize the bias return values
@@ -2425,7 +3405,7 @@ static int get_st_6500_biases(unsigned char addr, long *gyro, long *accel, unsig
     //start reading samples
     while (s < test.packet_thresh) {
     	delay_ms(test.sample_wait_ms); //wait 10ms to fill FIFO
-		if (i2c_read(addr, st.reg->fifo_count_h, 2, data))
+		if (i2c_read(st->addr, st->reg->fifo_count_h, 2, data))
 			return -1;
 		fifo_count = (data[0] << 8) | data[1];
 		packet_count = fifo_count / MAX_PACKET_LENGTH;
@@ -2434,7 +3414,7 @@ static int get_st_6500_biases(unsigned char addr, long *gyro, long *accel, unsig
 		read_size = packet_count * MAX_PACKET_LENGTH;
 
 		//burst read from FIFO
-		if (i2c_read(addr, st.reg->fifo_r_w, read_size, data))
+		if (i2c_read(st->addr, st->reg->fifo_r_w, read_size, data))
 						return -1;
 		ind = 0;
 		for (ii = 0; ii < packet_count; ii++) {
@@ -2461,7 +3441,7 @@ static int get_st_6500_biases(unsigned char addr, long *gyro, long *accel, unsig
 
     //stop FIFO
     data[0] = 0;
-    if (i2c_write(addr, st.reg->fifo_en, 1, data))
+    if (i2c_write(st->addr, st->reg->fifo_en, 1, data))
         return -1;
 
     gyro[0] = (long)(((long long)gyro[0]<<16) / test.gyro_sens / s);
@@ -2500,7 +3480,7 @@ static int get_st_6500_biases(unsigned char addr, long *gyro, long *accel, unsig
  *  @param[in]  debug       Debug flag used to print out more detailed logs. Must first set up logging in Motion Driver.
  *  @return     Result mask (see above).
  */
-int mpu_run_6500_self_test(unsigned char addr, long *gyro, long *accel, unsigned char debug)
+int mpu_run_6500_self_test(struct mpu_state_s *st, long *gyro, long *accel, unsigned char debug)
 {
     const unsigned char tries = 2;
     long gyro_st[3], accel_st[3];
@@ -2514,31 +3494,40 @@ int mpu_run_6500_self_test(unsigned char addr, long *gyro, long *accel, unsigned
     unsigned char accel_fsr, fifo_sensors, sensors_on;
     unsigned short gyro_fsr, sample_rate, lpf;
     unsigned char dmp_was_on;
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+    unsigned char compass_continuous;
+#endif
 
 
 
     if(debug)
     	log_i("Starting MPU6500 HWST!\r\n");
 
-    if (st.chip_cfg.dmp_on) {
-        mpu_set_dmp_state(addr, 0);
+    if (st->shadow.staging)
+        return 0;
+
+    if (st->chip_cfg.dmp_on) {
+        mpu_set_dmp_state(st, 0);
         dmp_was_on = 1;
     } else
         dmp_was_on = 0;
 
     /* Get initial settings. */
-    mpu_get_gyro_fsr(&gyro_fsr);
-    mpu_get_accel_fsr(&accel_fsr);
-    mpu_get_lpf(&lpf);
-    mpu_get_sample_rate(&sample_rate);
-    sensors_on = st.chip_cfg.sensors;
-    mpu_get_fifo_config(&fifo_sensors);
+    mpu_get_gyro_fsr(st, &gyro_fsr);
+    mpu_get_accel_fsr(st, &accel_fsr);
+    mpu_get_lpf(st, &lpf);
+    mpu_get_sample_rate(st, &sample_rate);
+    sensors_on = st->chip_cfg.sensors;
+    mpu_get_fifo_config(st, &fifo_sensors);
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+    compass_continuous = st->chip_cfg.compass_continuous;
+#endif
 
     if(debug)
     	log_i("Retrieving Biases\r\n");
 
     for (ii = 0; ii < tries; ii++)
-        if (!get_st_6500_biases(addr, gyro, accel, 0, debug))
+        if (!get_st_6500_biases(st, gyro, accel, 0, debug))
             break;
     if (ii == tries) {
         /* If we reach this point, we most likely encountered an I2C error.
@@ -2555,7 +3544,7 @@ int mpu_run_6500_self_test(unsigned char addr, long *gyro, long *accel, unsigned
     	log_i("Retrieving ST Biases\n");
 
     for (ii = 0; ii < tries; ii++)
-        if (!get_st_6500_biases(addr, gyro_st, accel_st, 1, debug))
+        if (!get_st_6500_biases(st, gyro_st, accel_st, 1, debug))
             break;
     if (ii == tries) {
 
@@ -2567,11 +3556,11 @@ int mpu_run_6500_self_test(unsigned char addr, long *gyro, long *accel, unsigned
         goto restore;
     }
 
-    accel_result = accel_6500_self_test(addr, accel, accel_st, debug);
+    accel_result = accel_6500_self_test(st, accel, accel_st, debug);
     if(debug)
     	log_i("Accel Self Test Results: %d\n", accel_result);
 
-    gyro_result = gyro_6500_self_test(addr, gyro, gyro_st, debug);
+    gyro_result = gyro_6500_self_test(st, gyro, gyro_st, debug);
     if(debug)
     	log_i("Gyro Self Test Results: %d\n", gyro_result);
 
@@ -2582,7 +3571,7 @@ int mpu_run_6500_self_test(unsigned char addr, long *gyro, long *accel, unsigned
         result |= 0x02;
 
 #ifdef AK89xx_SECONDARY
-    compass_result = compass_self_test(addr);
+    compass_result = compass_self_test(st);
     if(debug)
     	log_i("Compass Self Test Results: %d\n", compass_result);
     if (!compass_result)
@@ -2594,22 +3583,30 @@ restore:
 	if(debug)
 		log_i("Exiting HWST\n");
 	/* Set to invalid values to ensure no I2C writes are skipped. */
-	st.chip_cfg.gyro_fsr = 0xFF;
-	st.chip_cfg.accel_fsr = 0xFF;
-	st.chip_cfg.lpf = 0xFF;
-	st.chip_cfg.sample_rate = 0xFFFF;
-	st.chip_cfg.sensors = 0xFF;
-	st.chip_cfg.fifo_enable = 0xFF;
-	st.chip_cfg.clk_src = INV_CLK_PLL;
-	mpu_set_gyro_fsr(addr, gyro_fsr);
-	mpu_set_accel_fsr(addr, accel_fsr);
-	mpu_set_lpf(addr, lpf);
-	mpu_set_sample_rate(addr, sample_rate);
-	mpu_set_sensors(addr, sensors_on);
-	mpu_configure_fifo(addr, fifo_sensors);
+	st->chip_cfg.gyro_fsr = 0xFF;
+	st->chip_cfg.accel_fsr = 0xFF;
+	st->chip_cfg.lpf = 0xFF;
+	st->chip_cfg.sample_rate = 0xFFFF;
+	st->chip_cfg.sensors = 0xFF;
+	st->chip_cfg.fifo_enable = 0xFF;
+	st->chip_cfg.clk_src = INV_CLK_PLL;
+	mpu_set_gyro_fsr(st, gyro_fsr);
+	mpu_set_accel_fsr(st, accel_fsr);
+	mpu_set_lpf(st, lpf);
+	mpu_set_sample_rate(st, sample_rate);
+	mpu_set_sensors(st, sensors_on);
+	mpu_configure_fifo(st, fifo_sensors);
+#if defined AK8963_SECONDARY && !defined AK89xx_BYPASS
+	/* The compass test leaves the AKM powered down with slave 1 as it
+	 * found it, which is off in continuous mode.
+	 */
+	st->chip_cfg.compass_continuous = 0;
+	if (compass_continuous)
+		mpu_set_compass_continuous(st, 1);
+#endif
 
 	if (dmp_was_on)
-		mpu_set_dmp_state(addr, 1);
+		mpu_set_dmp_state(st, 1);
 
 	return result;
 }
@@ -2621,7 +3618,7 @@ restore:
  *  @param[out] accel       Accel biases (if applicable) in q16 format.
  *  @return     Result mask (see above).
  */
-int mpu_run_self_test(unsigned char addr, long *gyro, long *accel)
+int mpu_run_self_test(struct mpu_state_s *st, long *gyro, long *accel)
 {
 #ifdef MPU6050
     const unsigned char tries = 2;
@@ -2637,19 +3634,22 @@ int mpu_run_self_test(unsigned char addr, long *gyro, long *accel)
     unsigned short gyro_fsr, sample_rate, lpf;
     unsigned char dmp_was_on;
 
-    if (st.chip_cfg.dmp_on) {
-        mpu_set_dmp_state(addr, 0);
+    if (st->shadow.staging)
+        return 0;
+
+    if (st->chip_cfg.dmp_on) {
+        mpu_set_dmp_state(st, 0);
         dmp_was_on = 1;
     } else
         dmp_was_on = 0;
 
     /* Get initial settings. */
-    mpu_get_gyro_fsr(&gyro_fsr);
-    mpu_get_accel_fsr(&accel_fsr);
-    mpu_get_lpf(&lpf);
-    mpu_get_sample_rate(&sample_rate);
-    sensors_on = st.chip_cfg.sensors;
-    mpu_get_fifo_config(&fifo_sensors);
+    mpu_get_gyro_fsr(st, &gyro_fsr);
+    mpu_get_accel_fsr(st, &accel_fsr);
+    mpu_get_lpf(st, &lpf);
+    mpu_get_sample_rate(st, &sample_rate);
+    sensors_on = st->chip_cfg.sensors;
+    mpu_get_fifo_config(st, &fifo_sensors);
 
     /* For older chips, the self-test will be different. */
 #if defined MPU6050
@@ -2692,60 +3692,101 @@ restore:
     /* For now, this function will return a "pass" result for all three sensors
      * for compatibility with current test applications.
      */
-    get_st_biases(addr, gyro, accel, 0);
+    get_st_biases(st, gyro, accel, 0);
     result = 0x7;
 #endif
     /* Set to invalid values to ensure no I2C writes are skipped. */
-    st.chip_cfg.gyro_fsr = 0xFF;
-    st.chip_cfg.accel_fsr = 0xFF;
-    st.chip_cfg.lpf = 0xFF;
-    st.chip_cfg.sample_rate = 0xFFFF;
-    st.chip_cfg.sensors = 0xFF;
-    st.chip_cfg.fifo_enable = 0xFF;
-    st.chip_cfg.clk_src = INV_CLK_PLL;
-    mpu_set_gyro_fsr(addr, gyro_fsr);
-    mpu_set_accel_fsr(addr, accel_fsr);
-    mpu_set_lpf(addr, lpf);
-    mpu_set_sample_rate(addr, sample_rate);
-    mpu_set_sensors(addr, sensors_on);
-    mpu_configure_fifo(addr, fifo_sensors);
+    st->chip_cfg.gyro_fsr = 0xFF;
+    st->chip_cfg.accel_fsr = 0xFF;
+    st->chip_cfg.lpf = 0xFF;
+    st->chip_cfg.sample_rate = 0xFFFF;
+    st->chip_cfg.sensors = 0xFF;
+    st->chip_cfg.fifo_enable = 0xFF;
+    st->chip_cfg.clk_src = INV_CLK_PLL;
+    mpu_set_gyro_fsr(st, gyro_fsr);
+    mpu_set_accel_fsr(st, accel_fsr);
+    mpu_set_lpf(st, lpf);
+    mpu_set_sample_rate(st, sample_rate);
+    mpu_set_sensors(st, sensors_on);
+    mpu_configure_fifo(st, fifo_sensors);
 
     if (dmp_was_on)
-        mpu_set_dmp_state(addr, 1);
+        mpu_set_dmp_state(st, 1);
 
     return result;
 }
 
+/* Point the DMP memory port at mem_addr, sending only what changed: nothing
+ * if the last access ended there, the start address alone within the same
+ * bank, both bytes otherwise.
+ */
+static int set_mem_ptr(struct mpu_state_s *st, unsigned short mem_addr)
+{
+    unsigned char tmp[2];
+
+    tmp[0] = (unsigned char)(mem_addr >> 8);
+    tmp[1] = (unsigned char)(mem_addr & 0xFF);
+    if (st->chip_cfg.mem_ptr_valid) {
+        if (st->chip_cfg.mem_ptr == mem_addr)
+            return 0;
+        if ((st->chip_cfg.mem_ptr >> 8) == tmp[0]) {
+            if (i2c_write(st->addr, st->reg->mem_start_addr, 1, &tmp[1])) {
+                st->chip_cfg.mem_ptr_valid = 0;
+                return -1;
+            }
+            st->chip_cfg.mem_ptr = mem_addr;
+            return 0;
+        }
+    }
+    if (i2c_write(st->addr, st->reg->bank_sel, 2, tmp)) {
+        st->chip_cfg.mem_ptr_valid = 0;
+        return -1;
+    }
+    st->chip_cfg.mem_ptr = mem_addr;
+    st->chip_cfg.mem_ptr_valid = 1;
+    return 0;
+}
+
+/* The port moves past the bytes accessed. Where it goes at the end of a
+ * bank is not relied on.
+ */
+static void advance_mem_ptr(struct mpu_state_s *st, unsigned short length)
+{
+    if ((st->chip_cfg.mem_ptr & 0xFF) + length >= st->hw->bank_size)
+        st->chip_cfg.mem_ptr_valid = 0;
+    else
+        st->chip_cfg.mem_ptr += length;
+}
+
 /**
  *  @brief      Write to the DMP memory.
  *  This function prevents I2C writes past the bank boundaries. The DMP memory
- *  is only accessible when the chip is awake.
+ *  is only accessible when the chip is awake. The bank and start address are
+ *  only sent when the last access did not leave the memory pointer there.
  *  @param[in]  mem_addr    Memory location (bank << 8 | start address)
  *  @param[in]  length      Number of bytes to write.
  *  @param[in]  data        Bytes to write to memory.
  *  @return     0 if successful.
  */
-int mpu_write_mem(unsigned char addr, unsigned short mem_addr, unsigned short length,
+int mpu_write_mem(struct mpu_state_s *st, unsigned short mem_addr, unsigned short length,
         unsigned char *data)
 {
-    unsigned char tmp[2];
-
     if (!data)
         return -1;
-    if (!st.chip_cfg.sensors)
+    if (!st->chip_cfg.sensors)
         return -1;
 
-    tmp[0] = (unsigned char)(mem_addr >> 8);
-    tmp[1] = (unsigned char)(mem_addr & 0xFF);
-
     /* Check bank boundaries. */
-    if (tmp[1] + length > st.hw->bank_size)
+    if ((mem_addr & 0xFF) + length > st->hw->bank_size)
         return -1;
 
-    if (i2c_write(addr, st.reg->bank_sel, 2, tmp))
+    if (set_mem_ptr(st, mem_addr))
         return -1;
-    if (i2c_write(addr, st.reg->mem_r_w, length, data))
+    if (i2c_write(st->addr, st->reg->mem_r_w, length, data)) {
+        st->chip_cfg.mem_ptr_valid = 0;
         return -1;
+    }
+    advance_mem_ptr(st, length);
     return 0;
 }
 
@@ -2758,109 +3799,546 @@ int mpu_write_mem(unsigned char addr, unsigned short mem_addr, unsigned short le
  *  @param[out] data        Bytes read from memory.
  *  @return     0 if successful.
  */
-int mpu_read_mem(unsigned char addr, unsigned short mem_addr, unsigned short length,
+int mpu_read_mem(struct mpu_state_s *st, unsigned short mem_addr, unsigned short length,
         unsigned char *data)
 {
-    unsigned char tmp[2];
-
     if (!data)
         return -1;
-    if (!st.chip_cfg.sensors)
+    if (!st->chip_cfg.sensors)
         return -1;
 
-    tmp[0] = (unsigned char)(mem_addr >> 8);
-    tmp[1] = (unsigned char)(mem_addr & 0xFF);
-
     /* Check bank boundaries. */
-    if (tmp[1] + length > st.hw->bank_size)
+    if ((mem_addr & 0xFF) + length > st->hw->bank_size)
         return -1;
 
-    if (i2c_write(addr, st.reg->bank_sel, 2, tmp))
+    if (set_mem_ptr(st, mem_addr))
         return -1;
-    if (i2c_read(addr, st.reg->mem_r_w, length, data))
+    if (i2c_read(st->addr, st->reg->mem_r_w, length, data)) {
+        st->chip_cfg.mem_ptr_valid = 0;
         return -1;
+    }
+    advance_mem_ptr(st, length);
     return 0;
 }
 
 /**
  *  @brief      Load and verify DMP image.
+ *  The image is written in as few transfers as the bus allows, up to one
+ *  memory bank each. How much of it is read back is set by
+ *  @e mpu_set_firmware_verify.
  *  @param[in]  length      Length of DMP image.
  *  @param[in]  firmware    DMP code.
  *  @param[in]  start_addr  Starting address of DMP code memory.
  *  @param[in]  sample_rate Fixed sampling rate used when DMP is enabled.
- *  @return     0 if successful.
+ *  @return     0 if successful, -2 if the readback did not match.
  */
-int mpu_load_firmware(unsigned char addr, unsigned short length, const unsigned char *firmware,
+int mpu_load_firmware(struct mpu_state_s *st, unsigned short length, const unsigned char *firmware,
     unsigned short start_addr, unsigned short sample_rate)
 {
     unsigned short ii;
-    unsigned short this_write;
-    /* Must divide evenly into st.hw->bank_size to avoid bank crossings. */
-#define LOAD_CHUNK  (16)
+    unsigned short this_write, max_write, skip;
+    /* Largest write: one full bank. */
+#define LOAD_CHUNK  (256)
+    /* Bytes checked at the end of each write in INV_FW_VERIFY_SAMPLED. */
+#define LOAD_SAMPLE (16)
     unsigned char cur[LOAD_CHUNK], tmp[2];
 
-    if (st.chip_cfg.dmp_loaded)
+    if (st->chip_cfg.dmp_loaded)
         /* DMP should only be loaded once. */
         return -1;
 
     if (!firmware)
         return -1;
+    max_write = _min(LOAD_CHUNK, i2c_max_read());
     for (ii = 0; ii < length; ii += this_write) {
-        this_write = _min(LOAD_CHUNK, length - ii);
-        if (mpu_write_mem(addr, ii, this_write, (unsigned char*)&firmware[ii]))
+        /* Never cross a bank boundary. */
+        this_write = _min(max_write, length - ii);
+        this_write = _min(this_write, st->hw->bank_size - ii % st->hw->bank_size);
+        if (mpu_write_mem(st, ii, this_write, (unsigned char*)&firmware[ii]))
             return -1;
-        if (mpu_read_mem(addr, ii, this_write, cur))
+        if (st->chip_cfg.fw_verify == INV_FW_VERIFY_NONE)
+            continue;
+        /* The tail of a write lands last, so a short or misaddressed
+         * transfer shows up there.
+         */
+        if (st->chip_cfg.fw_verify == INV_FW_VERIFY_SAMPLED)
+            skip = this_write - _min(LOAD_SAMPLE, this_write);
+        else
+            skip = 0;
+        if (mpu_read_mem(st, ii + skip, this_write - skip, cur))
             return -1;
-        if (memcmp(firmware+ii, cur, this_write))
+        if (memcmp(firmware + ii + skip, cur, this_write - skip))
             return -2;
     }
 
     /* Set program start address. */
     tmp[0] = start_addr >> 8;
     tmp[1] = start_addr & 0xFF;
-    if (i2c_write(addr, st.reg->prgm_start_h, 2, tmp))
+    if (i2c_write(st->addr, st->reg->prgm_start_h, 2, tmp))
+        return -1;
+
+    st->chip_cfg.dmp_loaded = 1;
+    st->chip_cfg.dmp_sample_rate = sample_rate;
+    return 0;
+}
+
+/**
+ *  @brief      Adopt a DMP image that is already loaded.
+ *  Checks the program start address and a region of the image that is
+ *  never rewritten at runtime. On a match the driver treats the image as
+ *  loaded by @e mpu_load_firmware, without writing it again.
+ *  @param[in]  firmware    DMP code.
+ *  @param[in]  start_addr  Starting address of DMP code memory.
+ *  @param[in]  sig_addr    Start of the region compared.
+ *  @param[in]  sig_length  Length of the region compared.
+ *  @param[in]  sample_rate Fixed sampling rate used when DMP is enabled.
+ *  @return     0 if adopted, 1 if the image needs loading.
+ */
+int mpu_adopt_firmware(struct mpu_state_s *st, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sig_addr, unsigned short sig_length,
+    unsigned short sample_rate)
+{
+    unsigned short ii;
+    unsigned short this_read;
+    unsigned char cur[LOAD_SAMPLE], tmp[2];
+
+    if (!firmware)
+        return -1;
+    if (i2c_read(st->addr, st->reg->prgm_start_h, 2, tmp))
+        return -1;
+    if (((tmp[0] << 8) | tmp[1]) != start_addr)
+        return 1;
+    for (ii = sig_addr; ii < sig_addr + sig_length; ii += this_read) {
+        this_read = _min(LOAD_SAMPLE, sig_addr + sig_length - ii);
+        this_read = _min(this_read, st->hw->bank_size - ii % st->hw->bank_size);
+        if (mpu_read_mem(st, ii, this_read, cur))
+            return -1;
+        if (memcmp(firmware + ii, cur, this_read))
+            return 1;
+    }
+
+    st->chip_cfg.dmp_loaded = 1;
+    st->chip_cfg.dmp_sample_rate = sample_rate;
+    return 0;
+}
+
+/**
+ *  @brief      Select how much of the DMP image is read back after loading.
+ *  INV_FW_VERIFY_FULL compares every byte, INV_FW_VERIFY_SAMPLED the last
+ *  bytes of every write, and INV_FW_VERIFY_NONE skips the readback.
+ *  The setting is kept across @e mpu_init.
+ *  @param[in]  mode    INV_FW_VERIFY_FULL, INV_FW_VERIFY_SAMPLED or
+ *                      INV_FW_VERIFY_NONE.
+ *  @return     0 if successful.
+ */
+int mpu_set_firmware_verify(struct mpu_state_s *st, unsigned char mode)
+{
+    if (mode > INV_FW_VERIFY_NONE)
         return -1;
+    st->chip_cfg.fw_verify = mode;
+    return 0;
+}
+
+/**
+ *  @brief      Select how a FIFO overflow is recovered from.
+ *  \n INV_FIFO_RECOVER_RESET: reset the FIFO and the DMP. Safest, but the
+ *  DMP is held in reset for 50ms and every packet in the FIFO is lost.
+ *  \n INV_FIFO_RECOVER_FIFO_ONLY: empty the FIFO with a single write and
+ *  no delay. The DMP keeps running.
+ *  \n INV_FIFO_RECOVER_DISCARD: read out the partly overwritten oldest
+ *  packet and keep every whole packet behind it. Falls back to
+ *  INV_FIFO_RECOVER_FIFO_ONLY if the packet length is not known.
+ *  \n The setting is kept across @e mpu_init.
+ *  @param[in]  policy  One of the INV_FIFO_RECOVER_* values.
+ *  @return     0 if successful.
+ */
+int mpu_set_fifo_recovery(struct mpu_state_s *st, unsigned char policy)
+{
+    if (policy > INV_FIFO_RECOVER_DISCARD)
+        return -1;
+    st->chip_cfg.fifo_recovery = policy;
+    return 0;
+}
 
-    st.chip_cfg.dmp_loaded = 1;
-    st.chip_cfg.dmp_sample_rate = sample_rate;
+/**
+ *  @brief      Get the FIFO overflow counters.
+ *  @param[out] stats   Copy of the counters.
+ *  @return     0 if successful.
+ */
+int mpu_get_fifo_stats(struct mpu_state_s *st, struct mpu_fifo_stats_s *stats)
+{
+    memcpy(stats, &st->fifo_stats, sizeof(*stats));
     return 0;
 }
 
+/**
+ *  @brief      Clear the FIFO overflow counters.
+ *  @return     0 if successful.
+ */
+int mpu_reset_fifo_stats(struct mpu_state_s *st)
+{
+    memset(&st->fifo_stats, 0, sizeof(st->fifo_stats));
+    st->fifo_stats.last_ok_us = get_us();
+    return 0;
+}
+
+/* Sample period expected from the configuration, in ns. */
+static unsigned long nominal_period_ns(struct mpu_state_s *st)
+{
+    unsigned short rate;
+
+    if (st->chip_cfg.dmp_on)
+        rate = st->dmp.fifo_rate;
+    else
+        rate = st->chip_cfg.sample_rate;
+    return rate ? 1000000000UL / rate : 0;
+}
+
+/* Move the earliest capture time of the newest packet by @e ns. */
+static void move_newest(struct mpu_timing_s *t, long long ns)
+{
+    long long frac = t->newest_frac_ns + ns;
+    long long us = frac / 1000;
+
+    frac -= us * 1000;
+    if (frac < 0) {
+        frac += 1000;
+        us--;
+    }
+    t->newest_us += us;
+    t->newest_frac_ns = (unsigned short)frac;
+}
+
+/**
+ *  @brief      Stamp FIFO packets with the time they were captured.
+ *  Called by the batch FIFO readers once FIFO_COUNT has been read and the
+ *  packets decoded. The packets the FIFO held when its count was read are
+ *  @e count in @e samples, oldest first, followed by @e more left behind.
+ *  \n The newest of them was captured before FIFO_COUNT was read, and the
+ *  one after it was not. The driver keeps the window its capture time must
+ *  fall in, carries it forward from read to read by the packets produced
+ *  in between, and narrows it with each read: reads made at varying points
+ *  of the sample period pin it down to within the time a FIFO_COUNT read
+ *  takes. A data ready interrupt marked with @e mpu_mark_data_ready pins it
+ *  down at once. Packets are stamped one sample period apart from the
+ *  middle of the window.
+ *  \n The sample period is measured against the host clock, over a span
+ *  that grows from one second up to half a minute and then starts over, so
+ *  the timestamps follow the drift of the sensor's internal oscillator.
+ *  Timestamps never go backwards.
+ *  @param[in]  samples Packets just read.
+ *  @param[in]  count   Number of packets in @e samples.
+ *  @param[in]  more    Number of packets still in the FIFO.
+ */
+void mpu_stamp_samples(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short count, unsigned short more)
+{
+    struct mpu_timing_s *t = &st->timing;
+    unsigned long nominal = nominal_period_ns(st);
+    unsigned long period, produced, elapsed, measured;
+    unsigned long long middle, stamp, irq;
+    long long slack, early, late, back_ns;
+    unsigned short ii;
+    unsigned char pending;
+    long drift;
+
+    if (nominal != t->nominal_ns) {
+        /* The oscillator error carries over to the new rate. */
+        if (t->period_valid && t->nominal_ns && nominal)
+            t->period_ns = (unsigned long)((unsigned long long)t->period_ns *
+                nominal / t->nominal_ns);
+        else
+            t->period_ns = nominal;
+        t->nominal_ns = nominal;
+        t->locked = 0;
+    }
+    period = t->period_ns;
+
+    produced = count + more;
+    if (t->locked && produced >= t->left) {
+        /* Carry the window forward, widened by what the period may be off. */
+        produced -= t->left;
+        slack = (long long)produced * period / 1000000 *
+            (t->period_valid ? MPU_TIMING_TRACK_PPM : MPU_TIMING_MAX_DRIFT_PPM);
+        move_newest(t, (long long)produced * period - slack);
+        t->newest_spread_ns += 2 * slack;
+        t->window_packets += produced;
+    } else
+        t->locked = 0;
+
+    /* Read it whole even if the interrupt comes in halfway. */
+    pending = t->irq_pending;
+    do {
+        irq = t->irq_us;
+    } while (irq != t->irq_us);
+    if (pending && irq <= t->count_start_us &&
+            t->count_start_us - irq < period / 1000) {
+        /* The newest packet raised the interrupt. */
+        t->newest_us = irq;
+        t->newest_frac_ns = 0;
+        t->newest_spread_ns = 0;
+    } else {
+        /* How far the window reaches before the previous packet period, and
+         * past the end of the FIFO_COUNT read.
+         */
+        early = (long long)(t->count_start_us - t->newest_us) * 1000 -
+            period - t->newest_frac_ns;
+        late = (long long)(t->newest_us - t->count_end_us) * 1000 +
+            t->newest_frac_ns + t->newest_spread_ns;
+        if (!t->locked || early >= (long long)t->newest_spread_ns ||
+                late >= (long long)t->newest_spread_ns) {
+            /* No overlap: start again from this read alone. */
+            t->newest_us = t->count_start_us;
+            t->newest_frac_ns = 0;
+            move_newest(t, -(long long)period);
+            t->newest_spread_ns = (unsigned long)(t->count_end_us - t->count_start_us) *
+                1000 + period;
+        } else {
+            if (early > 0) {
+                move_newest(t, early);
+                t->newest_spread_ns -= early;
+            }
+            if (late > 0)
+                t->newest_spread_ns -= late;
+        }
+    }
+    /* Only the interrupt read above is used up. One that came in since has
+     * moved irq_us on, and stays pending for the next read.
+     */
+    t->irq_pending = 0;
+    if (t->irq_us != irq)
+        t->irq_pending = 1;
+    middle = t->newest_us + (t->newest_frac_ns + t->newest_spread_ns / 2) / 1000;
+
+    elapsed = (unsigned long)_min(middle - t->window_us, MPU_TIMING_MAX_WINDOW_US);
+    if (!t->locked || elapsed >= MPU_TIMING_MAX_WINDOW_US) {
+        /* Start a new measurement from here. */
+        t->locked = 1;
+        t->window_us = middle;
+        t->window_packets = 0;
+        t->window_period_ns = t->period_valid ? t->period_ns : 0;
+    } else if (elapsed >= MPU_TIMING_MIN_WINDOW_US && t->window_packets) {
+        measured = (unsigned long)((unsigned long long)elapsed * 1000 /
+            t->window_packets);
+        drift = (long)(((long long)nominal - (long long)measured) * 1000000 /
+            (long long)measured);
+        /* Far off nominal means packets went uncounted, not drift. */
+        if (labs(drift) <= MPU_TIMING_MAX_DRIFT_PPM) {
+            /* Trust the measurement more as it spans more time. */
+            if (t->window_period_ns)
+                t->period_ns = t->window_period_ns + (long)((long long)((long)measured -
+                    (long)t->window_period_ns) * (long)(elapsed / 1000) /
+                    (long)(MPU_TIMING_MAX_WINDOW_US / 1000));
+            else
+                t->period_ns = measured;
+            t->period_valid = 1;
+        }
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        back_ns = (long long)(count - 1 - ii + more) * period -
+            t->newest_frac_ns - t->newest_spread_ns / 2;
+        stamp = t->newest_us - back_ns / 1000;
+        if (t->stamped && stamp <= t->last_us)
+            stamp = t->last_us + 1;
+        samples[ii].timestamp_us = stamp;
+        samples[ii].timestamp = (unsigned long)(stamp / 1000);
+        t->last_us = stamp;
+        t->stamped = 1;
+    }
+    t->left = more;
+}
+
+/**
+ *  @brief      Note that a data ready interrupt just fired.
+ *  Call from the interrupt handler, or as soon after it as possible. The
+ *  next FIFO read then takes the capture time of the newest packet from the
+ *  interrupt instead of estimating it. Interrupts that turn out not to
+ *  belong to the newest packet are ignored.
+ */
+void mpu_mark_data_ready(struct mpu_state_s *st)
+{
+    st->timing.irq_us = get_us();
+    st->timing.irq_pending = 1;
+}
+
+/**
+ *  @brief      Get the sample period measured against the host clock.
+ *  The drift is how fast the sensor's internal clock runs relative to the
+ *  host clock, in parts per million: positive if the sensor produces
+ *  samples faster than configured. It is measured while the FIFO is read,
+ *  from one second of reads on.
+ *  @param[out] period_ns   Sample period, in ns.
+ *  @param[out] drift_ppm   Drift of the sensor clock, in ppm.
+ *  @return     0 if successful, -1 if nothing has been measured yet (the
+ *              configured period and no drift are returned).
+ */
+int mpu_get_sample_timing(struct mpu_state_s *st, unsigned long *period_ns,
+    long *drift_ppm)
+{
+    struct mpu_timing_s *t = &st->timing;
+
+    if (!t->period_valid || !t->nominal_ns ||
+            t->nominal_ns != nominal_period_ns(st)) {
+        period_ns[0] = nominal_period_ns(st);
+        drift_ppm[0] = 0;
+        return -1;
+    }
+    period_ns[0] = t->period_ns;
+    drift_ppm[0] = (long)(((long long)t->nominal_ns - (long long)t->period_ns) *
+        1000000 / (long long)t->period_ns);
+    return 0;
+}
+
+/**
+ *  @brief      Set up an empty sample ring.
+ *  @param[in]  buf     Storage for @e size samples. Must outlive @e ring.
+ *  @param[in]  size    Capacity of the ring: a power of two, up to 32768.
+ *  @return     0 if successful.
+ */
+int mpu_ring_init(struct mpu_ring_s *ring, struct mpu_sample_s *buf,
+    unsigned short size)
+{
+    if (!size || (size & (size - 1)) || size > 32768)
+        return -1;
+    ring->buf = buf;
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->full = 0;
+    return 0;
+}
+
+/**
+ *  @brief      Get the number of samples waiting in a ring.
+ *  Safe to call from either side.
+ *  @return     Number of samples.
+ */
+unsigned short mpu_ring_count(struct mpu_ring_s *ring)
+{
+    return (unsigned short)(ring_load(&ring->head) - ring_load(&ring->tail));
+}
+
+/**
+ *  @brief      Take samples out of a ring, oldest first.
+ *  Consumer side: only one thread may call this at a time.
+ *  @param[out] samples     Array of at least @e max_samples samples.
+ *  @param[in]  max_samples Maximum number of samples to take.
+ *  @return     Number of samples written to @e samples.
+ */
+unsigned short mpu_ring_pop(struct mpu_ring_s *ring, struct mpu_sample_s *samples,
+    unsigned short max_samples)
+{
+    unsigned short mask = ring->size - 1;
+    unsigned short tail = ring->tail;
+    unsigned short count, first;
+
+    count = (unsigned short)(ring_load(&ring->head) - tail);
+    if (count > max_samples)
+        count = max_samples;
+    first = _min(count, ring->size - (tail & mask));
+    memcpy(samples, &ring->buf[tail & mask], first * sizeof(*samples));
+    memcpy(samples + first, ring->buf, (count - first) * sizeof(*samples));
+    ring_store(&ring->tail, (unsigned short)(tail + count));
+    return count;
+}
+
+/**
+ *  @brief      Drain the FIFO into a ring.
+ *  Producer side: only one thread may call this at a time, and nothing else
+ *  may use @e st meanwhile. Packets are decoded by @e read straight into
+ *  the free space of the ring, in one go unless it wraps around, and
+ *  published to the consumer as each part is done. Packets that do not fit
+ *  are left in the FIFO for the next call.
+ *  @param[in]  read    Batch reader, such as @e dmp_read_fifo_batch.
+ *  @return     Number of samples added, or negative on error.
+ */
+int mpu_ring_fill(struct mpu_state_s *st, struct mpu_ring_s *ring,
+    int (*read)(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more))
+{
+    unsigned short mask = ring->size - 1;
+    unsigned short head = ring->head;
+    unsigned short room, span, count, more = 0;
+    int added = 0, result;
+
+    room = ring->size - (unsigned short)(head - ring_load(&ring->tail));
+    if (!room) {
+        ring->full++;
+        return 0;
+    }
+    while (room) {
+        span = _min(room, ring->size - (head & mask));
+        result = read(st, &ring->buf[head & mask], span, &count, &more);
+        if (count) {
+            head += count;
+            room -= count;
+            added += count;
+            ring_store(&ring->head, head);
+        }
+        if (result)
+            return result;
+        if (count < span || !more)
+            break;
+    }
+    if (!room && more)
+        ring->full++;
+    return added;
+}
+
+static int read_fifo_batch(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more)
+{
+    unsigned short dropped;
+
+    return mpu_read_fifo_batch(st, samples, max_samples, count, more, &dropped);
+}
+
+/**
+ *  @brief      Drain the FIFO into a ring, with the DMP off.
+ *  See @e mpu_ring_fill; packets are read by @e mpu_read_fifo_batch.
+ *  @return     Number of samples added, or negative on error.
+ */
+int mpu_read_fifo_ring(struct mpu_state_s *st, struct mpu_ring_s *ring)
+{
+    return mpu_ring_fill(st, ring, read_fifo_batch);
+}
+
 /**
  *  @brief      Enable/disable DMP support.
  *  @param[in]  enable  1 to turn on the DMP.
  *  @return     0 if successful.
  */
-int mpu_set_dmp_state(unsigned char addr, unsigned char enable)
+int mpu_set_dmp_state(struct mpu_state_s *st, unsigned char enable)
 {
     unsigned char tmp;
-    if (st.chip_cfg.dmp_on == enable)
+    if (st->chip_cfg.dmp_on == enable)
         return 0;
 
     if (enable) {
-        if (!st.chip_cfg.dmp_loaded)
+        if (!st->chip_cfg.dmp_loaded)
             return -1;
         /* Disable data ready interrupt. */
-        set_int_enable(addr, 0);
+        set_int_enable(st, 0);
         /* Disable bypass mode. */
-        mpu_set_bypass(addr, 0);
+        mpu_set_bypass(st, 0);
         /* Keep constant sample rate, FIFO rate controlled by DMP. */
-        mpu_set_sample_rate(addr, st.chip_cfg.dmp_sample_rate);
+        mpu_set_sample_rate(st, st->chip_cfg.dmp_sample_rate);
         /* Remove FIFO elements. */
         tmp = 0;
-        i2c_write(addr, 0x23, 1, &tmp);
-        st.chip_cfg.dmp_on = 1;
+        cfg_write(st, st->reg->fifo_en, 1, &tmp);
+        st->chip_cfg.dmp_on = 1;
         /* Enable DMP interrupt. */
-        set_int_enable(addr, 1);
-        mpu_reset_fifo(addr);
+        set_int_enable(st, 1);
+        cfg_reset_fifo(st);
     } else {
         /* Disable DMP interrupt. */
-        set_int_enable(addr, 0);
+        set_int_enable(st, 0);
         /* Restore FIFO settings. */
-        tmp = st.chip_cfg.fifo_enable;
-        i2c_write(addr, 0x23, 1, &tmp);
-        st.chip_cfg.dmp_on = 0;
-        mpu_reset_fifo(addr);
+        tmp = st->chip_cfg.fifo_enable;
+        cfg_write(st, st->reg->fifo_en, 1, &tmp);
+        st->chip_cfg.dmp_on = 0;
+        cfg_reset_fifo(st);
     }
     return 0;
 }
@@ -2870,112 +4348,189 @@ int mpu_set_dmp_state(unsigned char addr, unsigned char enable)
  *  @param[out] enabled 1 if enabled.
  *  @return     0 if successful.
  */
-int mpu_get_dmp_state(unsigned char *enabled)
+int mpu_get_dmp_state(struct mpu_state_s *st, unsigned char *enabled)
 {
-    enabled[0] = st.chip_cfg.dmp_on;
+    enabled[0] = st->chip_cfg.dmp_on;
     return 0;
 }
 
 #ifdef AK89xx_SECONDARY
 /* This initialization is similar to the one in ak8975.c. */
-static int setup_compass(unsigned char addr)
+static int setup_compass_step(struct mpu_state_s *st, unsigned char *stage)
 {
     unsigned char data[4], akm_addr;
 
-    mpu_set_bypass(addr, 1);
+    switch ((*stage)++) {
+    case 0:
+        if (st->chip_cfg.bypass_mode != 1) {
+            if (set_bypass_master(st, 1))
+                return -1;
+            return 3;
+        }
+        (*stage)++;
+        /* Fall through. */
+    case 1:
+        if (st->chip_cfg.bypass_mode != 1 && set_bypass_pin_cfg(st, 1))
+            return -1;
 
-    /* Find compass. Possible addresses range from 0x0C to 0x0F. */
-    for (akm_addr = 0x0C; akm_addr <= 0x0F; akm_addr++) {
-        int result;
-        result = i2c_read(akm_addr, AKM_REG_WHOAMI, 1, data);
-        if (!result && (data[0] == AKM_WHOAMI))
-            break;
-    }
+        /* Find compass. Possible addresses range from 0x0C to 0x0F. */
+        for (akm_addr = 0x0C; akm_addr <= 0x0F; akm_addr++) {
+            int result;
+            result = i2c_read(akm_addr, AKM_REG_WHOAMI, 1, data);
+            if (!result && (data[0] == AKM_WHOAMI))
+                break;
+        }
 
-    if (akm_addr > 0x0F) {
-        /* TODO: Handle this case in all compass-related functions. */
-        log_e("Compass not found.\n");
-        return -1;
-    }
+        if (akm_addr > 0x0F) {
+            /* TODO: Handle this case in all compass-related functions. */
+            log_e("Compass not found.\n");
+            return -1;
+        }
 
-    st.chip_cfg.compass_addr = akm_addr;
+        st->chip_cfg.compass_addr = akm_addr;
 
-    data[0] = AKM_POWER_DOWN;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, data))
-        return -1;
-    delay_ms(1);
+        data[0] = AKM_POWER_DOWN;
+        if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, data))
+            return -1;
+        return 1;
 
-    data[0] = AKM_FUSE_ROM_ACCESS;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, data))
-        return -1;
-    delay_ms(1);
+    case 2:
+        data[0] = AKM_FUSE_ROM_ACCESS;
+        if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, data))
+            return -1;
+        return 1;
 
-    /* Get sensitivity adjustment data from fuse ROM. */
-    if (i2c_read(st.chip_cfg.compass_addr, AKM_REG_ASAX, 3, data))
-        return -1;
-    st.chip_cfg.mag_sens_adj[0] = (long)data[0] + 128;
-    st.chip_cfg.mag_sens_adj[1] = (long)data[1] + 128;
-    st.chip_cfg.mag_sens_adj[2] = (long)data[2] + 128;
+    case 3:
+        /* Get sensitivity adjustment data from fuse ROM. */
+        if (i2c_read(st->chip_cfg.compass_addr, AKM_REG_ASAX, 3, data))
+            return -1;
+        st->chip_cfg.mag_sens_adj[0] = (long)data[0] + 128;
+        st->chip_cfg.mag_sens_adj[1] = (long)data[1] + 128;
+        st->chip_cfg.mag_sens_adj[2] = (long)data[2] + 128;
 
-    data[0] = AKM_POWER_DOWN;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, data))
-        return -1;
-    delay_ms(1);
+        data[0] = AKM_POWER_DOWN;
+        if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, data))
+            return -1;
+        return 1;
 
-    mpu_set_bypass(addr, 0);
+    case 4:
+        if (set_bypass_master(st, 0))
+            return -1;
+        return 3;
 
-    /* Set up master mode, master clock, and ES bit. */
-    data[0] = 0x40;
-    if (i2c_write(addr, st.reg->i2c_mst, 1, data))
-        return -1;
+    case 5:
+        if (set_bypass_pin_cfg(st, 0))
+            return -1;
 
-    /* Slave 0 reads from AKM data registers. */
-    data[0] = BIT_I2C_READ | st.chip_cfg.compass_addr;
-    if (i2c_write(addr, st.reg->s0_addr, 1, data))
-        return -1;
+        /* Set up master mode, master clock, and ES bit. */
+        data[0] = 0x40;
+        if (i2c_write(st->addr, st->reg->i2c_mst, 1, data))
+            return -1;
 
-    /* Compass reads start at this register. */
-    data[0] = AKM_REG_ST1;
-    if (i2c_write(addr, st.reg->s0_reg, 1, data))
-        return -1;
+        /* Slave 0 reads from AKM data registers. */
+        data[0] = BIT_I2C_READ | st->chip_cfg.compass_addr;
+        if (i2c_write(st->addr, st->reg->s0_addr, 1, data))
+            return -1;
 
-    /* Enable slave 0, 8-byte reads. */
-    data[0] = BIT_SLAVE_EN | 8;
-    if (i2c_write(addr, st.reg->s0_ctrl, 1, data))
-        return -1;
+        /* Compass reads start at this register. */
+        data[0] = AKM_REG_ST1;
+        if (i2c_write(st->addr, st->reg->s0_reg, 1, data))
+            return -1;
 
-    /* Slave 1 changes AKM measurement mode. */
-    data[0] = st.chip_cfg.compass_addr;
-    if (i2c_write(addr, st.reg->s1_addr, 1, data))
-        return -1;
+        /* Enable slave 0, 8-byte reads. */
+        data[0] = BIT_SLAVE_EN | 8;
+        if (i2c_write(st->addr, st->reg->s0_ctrl, 1, data))
+            return -1;
 
-    /* AKM measurement mode register. */
-    data[0] = AKM_REG_CNTL;
-    if (i2c_write(addr, st.reg->s1_reg, 1, data))
-        return -1;
+        /* Slave 1 changes AKM measurement mode. */
+        data[0] = st->chip_cfg.compass_addr;
+        if (i2c_write(st->addr, st->reg->s1_addr, 1, data))
+            return -1;
 
-    /* Enable slave 1, 1-byte writes. */
-    data[0] = BIT_SLAVE_EN | 1;
-    if (i2c_write(addr, st.reg->s1_ctrl, 1, data))
-        return -1;
+        /* AKM measurement mode register. */
+        data[0] = AKM_REG_CNTL;
+        if (i2c_write(st->addr, st->reg->s1_reg, 1, data))
+            return -1;
 
-    /* Set slave 1 data. */
-    data[0] = AKM_SINGLE_MEASUREMENT;
-    if (i2c_write(addr, st.reg->s1_do, 1, data))
-        return -1;
+        /* Enable slave 1, 1-byte writes. */
+        data[0] = BIT_SLAVE_EN | 1;
+        if (i2c_write(st->addr, st->reg->s1_ctrl, 1, data))
+            return -1;
 
-    /* Trigger slave 0 and slave 1 actions at each sample. */
-    data[0] = 0x03;
-    if (i2c_write(addr, st.reg->i2c_delay_ctrl, 1, data))
-        return -1;
+        /* Set slave 1 data. */
+        data[0] = AKM_SINGLE_MEASUREMENT;
+        if (i2c_write(st->addr, st->reg->s1_do, 1, data))
+            return -1;
+        st->chip_cfg.compass_continuous = 0;
+
+        /* Trigger slave 0 and slave 1 actions at each sample. */
+        data[0] = 0x03;
+        if (i2c_write(st->addr, st->reg->i2c_delay_ctrl, 1, data))
+            return -1;
 
 #ifdef MPU9150
-    /* For the MPU9150, the auxiliary I2C bus needs to be set to VDD. */
-    data[0] = BIT_I2C_MST_VDDIO;
-    if (i2c_write(addr, st.reg->yg_offs_tc, 1, data))
-        return -1;
+        /* For the MPU9150, the auxiliary I2C bus needs to be set to VDD. */
+        data[0] = BIT_I2C_MST_VDDIO;
+        if (i2c_write(st->addr, st->reg->yg_offs_tc, 1, data))
+            return -1;
 #endif
+    }
+    return 0;
+}
+
+static int setup_compass(struct mpu_state_s *st)
+{
+    return run_steps(st, setup_compass_step);
+}
+#endif
+
+#ifdef AK89xx_SECONDARY
+/* Check ST1/ST2 of an 8-byte ST1..ST2 read and scale the readings by the
+ * sensitivity adjustment. Returns nonzero if there is no valid reading.
+ */
+static int decode_compass(struct mpu_state_s *st, const unsigned char *tmp,
+    short *data)
+{
+#if defined AK8975_SECONDARY
+    /* AK8975 doesn't have the overrun error bit. */
+    if (!(tmp[0] & AKM_DATA_READY))
+        return -2;
+    if ((tmp[7] & AKM_OVERFLOW) || (tmp[7] & AKM_DATA_ERROR))
+        return -3;
+#elif defined AK8963_SECONDARY
+    /* AK8963 doesn't have the data read error bit. In continuous mode an
+     * overrun only means a measurement went unread; this one is good.
+     */
+    if (!(tmp[0] & AKM_DATA_READY) ||
+        ((tmp[0] & AKM_DATA_OVERRUN) && !st->chip_cfg.compass_continuous))
+        return -2;
+    if (tmp[7] & AKM_OVERFLOW)
+        return -3;
+#endif
+    data[0] = (tmp[2] << 8) | tmp[1];
+    data[1] = (tmp[4] << 8) | tmp[3];
+    data[2] = (tmp[6] << 8) | tmp[5];
 
+    data[0] = ((long)data[0] * st->chip_cfg.mag_sens_adj[0]) >> 8;
+    data[1] = ((long)data[1] * st->chip_cfg.mag_sens_adj[1]) >> 8;
+    data[2] = ((long)data[2] * st->chip_cfg.mag_sens_adj[2]) >> 8;
+    if (st->chip_cfg.compass_cal) {
+        const short *m = st->chip_cfg.compass_matrix;
+        long v[3], out;
+        int i;
+
+        for (i = 0; i < 3; i++)
+            v[i] = (long)data[i] - st->chip_cfg.compass_offset[i];
+        for (i = 0; i < 3; i++) {
+            out = ((long)m[i * 3] * v[0] + (long)m[i * 3 + 1] * v[1] +
+                (long)m[i * 3 + 2] * v[2] + 8192) >> 14;
+            if (out > 32767)
+                out = 32767;
+            else if (out < -32768)
+                out = -32768;
+            data[i] = (short)out;
+        }
+    }
     return 0;
 }
 #endif
@@ -2986,45 +4541,29 @@ static int setup_compass(unsigned char addr)
  *  @param[out] timestamp   Timestamp in milliseconds. Null if not needed.
  *  @return     0 if successful.
  */
-int mpu_get_compass_reg(unsigned char addr, short *data, unsigned long *timestamp)
+int mpu_get_compass_reg(struct mpu_state_s *st, short *data, unsigned long *timestamp)
 {
 #ifdef AK89xx_SECONDARY
     unsigned char tmp[9];
+    int result;
 
-    if (!(st.chip_cfg.sensors & INV_XYZ_COMPASS))
+    if (!(st->chip_cfg.sensors & INV_XYZ_COMPASS))
         return -1;
 
 #ifdef AK89xx_BYPASS
-    if (i2c_read(st.chip_cfg.compass_addr, AKM_REG_ST1, 8, tmp))
+    if (i2c_read(st->chip_cfg.compass_addr, AKM_REG_ST1, 8, tmp))
         return -1;
     tmp[8] = AKM_SINGLE_MEASUREMENT;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp+8))
+    if (i2c_write(st->chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp+8))
         return -1;
 #else
-    if (i2c_read(addr, st.reg->raw_compass, 8, tmp))
+    if (i2c_read(st->addr, st->reg->raw_compass, 8, tmp))
         return -1;
 #endif
 
-#if defined AK8975_SECONDARY
-    /* AK8975 doesn't have the overrun error bit. */
-    if (!(tmp[0] & AKM_DATA_READY))
-        return -2;
-    if ((tmp[7] & AKM_OVERFLOW) || (tmp[7] & AKM_DATA_ERROR))
-        return -3;
-#elif defined AK8963_SECONDARY
-    /* AK8963 doesn't have the data read error bit. */
-    if (!(tmp[0] & AKM_DATA_READY) || (tmp[0] & AKM_DATA_OVERRUN))
-        return -2;
-    if (tmp[7] & AKM_OVERFLOW)
-        return -3;
-#endif
-    data[0] = (tmp[2] << 8) | tmp[1];
-    data[1] = (tmp[4] << 8) | tmp[3];
-    data[2] = (tmp[6] << 8) | tmp[5];
-
-    data[0] = ((long)data[0] * st.chip_cfg.mag_sens_adj[0]) >> 8;
-    data[1] = ((long)data[1] * st.chip_cfg.mag_sens_adj[1]) >> 8;
-    data[2] = ((long)data[2] * st.chip_cfg.mag_sens_adj[2]) >> 8;
+    result = decode_compass(st, tmp, data);
+    if (result)
+        return result;
 
     if (timestamp)
         get_ms(timestamp);
@@ -3034,15 +4573,81 @@ int mpu_get_compass_reg(unsigned char addr, short *data, unsigned long *timestam
 #endif
 }
 
+/**
+ *  @brief      Read accel, temperature, gyro and compass data in one burst.
+ *  Reads INT_STATUS through the gyro registers, and on through the
+ *  compass data the I2C master copies into EXT_SENS_DATA when the
+ *  compass is on, in a single bus transaction. With AK89xx_BYPASS the
+ *  compass is on its own slave address and is read separately.
+ *  \n Reading INT_STATUS clears it, as with mpu_get_int_status.
+ *  @param[out] accel       Raw accel data in hardware units.
+ *  @param[out] gyro        Raw gyro data in hardware units.
+ *  @param[out] temperature Temperature in q16 degrees C.
+ *  @param[out] compass     Raw compass data in hardware units.
+ *  @param[out] int_status  INT_STATUS. Null if not needed.
+ *  @param[out] sensors     Mask of the data read: INV_XYZ_ACCEL,
+ *                          INV_XYZ_GYRO, INV_XYZ_COMPASS. The temperature
+ *                          is valid whenever a sensor is on.
+ *  @param[out] timestamp   Timestamp in milliseconds. Null if not needed.
+ *  @return     0 if successful.
+ */
+int mpu_get_all_reg(struct mpu_state_s *st, short *accel, short *gyro,
+    long *temperature, short *compass, unsigned char *int_status,
+    short *sensors, unsigned long *timestamp)
+{
+    unsigned char tmp[23];
+    unsigned char length = 15;
+
+    sensors[0] = 0;
+    if (!st->chip_cfg.sensors)
+        return -1;
+#if defined AK89xx_SECONDARY && !defined AK89xx_BYPASS
+    if (st->chip_cfg.sensors & INV_XYZ_COMPASS)
+        length = 23;
+#endif
+
+    /* INT_STATUS, ACCEL_XOUT_H..GYRO_ZOUT_L, EXT_SENS_DATA_00..07 */
+    if (i2c_read(st->addr, st->reg->int_status, length, tmp))
+        return -1;
+    if (timestamp)
+        get_ms(timestamp);
+
+    if (int_status)
+        int_status[0] = tmp[0];
+    if (st->chip_cfg.sensors & INV_XYZ_ACCEL) {
+        accel[0] = (tmp[1] << 8) | tmp[2];
+        accel[1] = (tmp[3] << 8) | tmp[4];
+        accel[2] = (tmp[5] << 8) | tmp[6];
+        sensors[0] |= INV_XYZ_ACCEL;
+    }
+    temperature[0] = temp_to_q16(st, (short)((tmp[7] << 8) | tmp[8]));
+    if (st->chip_cfg.sensors & INV_XYZ_GYRO) {
+        gyro[0] = (tmp[9] << 8) | tmp[10];
+        gyro[1] = (tmp[11] << 8) | tmp[12];
+        gyro[2] = (tmp[13] << 8) | tmp[14];
+        sensors[0] |= INV_XYZ_GYRO;
+    }
+#ifdef AK89xx_SECONDARY
+    if (length == 23) {
+        if (!decode_compass(st, tmp + 15, compass))
+            sensors[0] |= INV_XYZ_COMPASS;
+    } else if (st->chip_cfg.sensors & INV_XYZ_COMPASS) {
+        if (!mpu_get_compass_reg(st, compass, NULL))
+            sensors[0] |= INV_XYZ_COMPASS;
+    }
+#endif
+    return 0;
+}
+
 /**
  *  @brief      Get the compass full-scale range.
  *  @param[out] fsr Current full-scale range.
  *  @return     0 if successful.
  */
-int mpu_get_compass_fsr(unsigned short *fsr)
+int mpu_get_compass_fsr(struct mpu_state_s *st, unsigned short *fsr)
 {
 #ifdef AK89xx_SECONDARY
-    fsr[0] = st.hw->compass_fsr;
+    fsr[0] = st->hw->compass_fsr;
     return 0;
 #else
     return -1;
@@ -3087,7 +4692,7 @@ int mpu_get_compass_fsr(unsigned short *fsr)
  *  @param[in]  lpa_freq    Minimum sampling rate, or zero to disable.
  *  @return     0 if successful.
  */
-int mpu_lp_motion_interrupt(unsigned char addr, unsigned short thresh, unsigned char time,
+int mpu_lp_motion_interrupt(struct mpu_state_s *st, unsigned short thresh, unsigned char time,
     unsigned short lpa_freq)
 {
 
@@ -3119,35 +4724,35 @@ int mpu_lp_motion_interrupt(unsigned char addr, unsigned short thresh, unsigned
             return -1;
 #endif
 
-        if (!st.chip_cfg.int_motion_only) {
+        if (!st->chip_cfg.int_motion_only) {
             /* Store current settings for later. */
-            if (st.chip_cfg.dmp_on) {
-                mpu_set_dmp_state(addr, 0);
-                st.chip_cfg.cache.dmp_on = 1;
+            if (st->chip_cfg.dmp_on) {
+                mpu_set_dmp_state(st, 0);
+                st->chip_cfg.cache.dmp_on = 1;
             } else
-                st.chip_cfg.cache.dmp_on = 0;
-            mpu_get_gyro_fsr(&st.chip_cfg.cache.gyro_fsr);
-            mpu_get_accel_fsr(&st.chip_cfg.cache.accel_fsr);
-            mpu_get_lpf(&st.chip_cfg.cache.lpf);
-            mpu_get_sample_rate(&st.chip_cfg.cache.sample_rate);
-            st.chip_cfg.cache.sensors_on = st.chip_cfg.sensors;
-            mpu_get_fifo_config(&st.chip_cfg.cache.fifo_sensors);
+                st->chip_cfg.cache.dmp_on = 0;
+            mpu_get_gyro_fsr(st, &st->chip_cfg.cache.gyro_fsr);
+            mpu_get_accel_fsr(st, &st->chip_cfg.cache.accel_fsr);
+            mpu_get_lpf(st, &st->chip_cfg.cache.lpf);
+            mpu_get_sample_rate(st, &st->chip_cfg.cache.sample_rate);
+            st->chip_cfg.cache.sensors_on = st->chip_cfg.sensors;
+            mpu_get_fifo_config(st, &st->chip_cfg.cache.fifo_sensors);
         }
 
 #if defined MPU6500
         /* Disable hardware interrupts. */
-        set_int_enable(addr, 0);
+        set_int_enable(st, 0);
 
         /* Enter full-power accel-only mode, no FIFO/DMP. */
         data[0] = 0;
         data[1] = 0;
         data[2] = BIT_STBY_XYZG;
-        if (i2c_write(addr, st.reg->user_ctrl, 3, data))
+        if (cfg_write(st, st->reg->user_ctrl, 3, data))
             goto lp_int_restore;
 
         /* Set motion threshold. */
         data[0] = thresh_hw;
-        if (i2c_write(addr, st.reg->motion_thr, 1, data))
+        if (i2c_write(st->addr, st->reg->motion_thr, 1, data))
             goto lp_int_restore;
 
         /* Set wake frequency. */
@@ -3171,32 +4776,32 @@ int mpu_lp_motion_interrupt(unsigned char addr, unsigned short thresh, unsigned
             data[0] = INV_LPA_320HZ;
         else
             data[0] = INV_LPA_640HZ;
-        if (i2c_write(addr, st.reg->lp_accel_odr, 1, data))
+        if (i2c_write(st->addr, st->reg->lp_accel_odr, 1, data))
             goto lp_int_restore;
 
         /* Enable motion interrupt (MPU6500 version). */
         data[0] = BITS_WOM_EN;
-        if (i2c_write(addr, st.reg->accel_intel, 1, data))
+        if (i2c_write(st->addr, st->reg->accel_intel, 1, data))
             goto lp_int_restore;
 
         /* Enable cycle mode. */
         data[0] = BIT_LPA_CYCLE;
-        if (i2c_write(addr, st.reg->pwr_mgmt_1, 1, data))
+        if (cfg_write(st, st->reg->pwr_mgmt_1, 1, data))
             goto lp_int_restore;
 
         /* Enable interrupt. */
         data[0] = BIT_MOT_INT_EN;
-        if (i2c_write(addr, st.reg->int_enable, 1, data))
+        if (cfg_write(st, st->reg->int_enable, 1, data))
             goto lp_int_restore;
 
-        st.chip_cfg.int_motion_only = 1;
+        st->chip_cfg.int_motion_only = 1;
         return 0;
 #endif
     } else {
         /* Don't "restore" the previous state if no state has been saved. */
         unsigned int ii;
-        char *cache_ptr = (char*)&st.chip_cfg.cache;
-        for (ii = 0; ii < sizeof(st.chip_cfg.cache); ii++) {
+        char *cache_ptr = (char*)&st->chip_cfg.cache;
+        for (ii = 0; ii < sizeof(st->chip_cfg.cache); ii++) {
             if (cache_ptr[ii] != 0)
                 goto lp_int_restore;
         }
@@ -3205,31 +4810,31 @@ int mpu_lp_motion_interrupt(unsigned char addr, unsigned short thresh, unsigned
     }
 lp_int_restore:
     /* Set to invalid values to ensure no I2C writes are skipped. */
-    st.chip_cfg.gyro_fsr = 0xFF;
-    st.chip_cfg.accel_fsr = 0xFF;
-    st.chip_cfg.lpf = 0xFF;
-    st.chip_cfg.sample_rate = 0xFFFF;
-    st.chip_cfg.sensors = 0xFF;
-    st.chip_cfg.fifo_enable = 0xFF;
-    st.chip_cfg.clk_src = INV_CLK_PLL;
-    mpu_set_sensors(addr, st.chip_cfg.cache.sensors_on);
-    mpu_set_gyro_fsr(addr, st.chip_cfg.cache.gyro_fsr);
-    mpu_set_accel_fsr(addr, st.chip_cfg.cache.accel_fsr);
-    mpu_set_lpf(addr, st.chip_cfg.cache.lpf);
-    mpu_set_sample_rate(addr, st.chip_cfg.cache.sample_rate);
-    mpu_configure_fifo(addr, st.chip_cfg.cache.fifo_sensors);
-
-    if (st.chip_cfg.cache.dmp_on)
-        mpu_set_dmp_state(addr, 1);
+    st->chip_cfg.gyro_fsr = 0xFF;
+    st->chip_cfg.accel_fsr = 0xFF;
+    st->chip_cfg.lpf = 0xFF;
+    st->chip_cfg.sample_rate = 0xFFFF;
+    st->chip_cfg.sensors = 0xFF;
+    st->chip_cfg.fifo_enable = 0xFF;
+    st->chip_cfg.clk_src = INV_CLK_PLL;
+    mpu_set_sensors(st, st->chip_cfg.cache.sensors_on);
+    mpu_set_gyro_fsr(st, st->chip_cfg.cache.gyro_fsr);
+    mpu_set_accel_fsr(st, st->chip_cfg.cache.accel_fsr);
+    mpu_set_lpf(st, st->chip_cfg.cache.lpf);
+    mpu_set_sample_rate(st, st->chip_cfg.cache.sample_rate);
+    mpu_configure_fifo(st, st->chip_cfg.cache.fifo_sensors);
+
+    if (st->chip_cfg.cache.dmp_on)
+        mpu_set_dmp_state(st, 1);
 
 #ifdef MPU6500
     /* Disable motion interrupt (MPU6500 version). */
     data[0] = 0;
-    if (i2c_write(addr, st.reg->accel_intel, 1, data))
+    if (i2c_write(st->addr, st->reg->accel_intel, 1, data))
         goto lp_int_restore;
 #endif
 
-    st.chip_cfg.int_motion_only = 0;
+    st->chip_cfg.int_motion_only = 0;
     return 0;
 }
 
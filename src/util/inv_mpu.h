@@ -28,6 +28,16 @@
 #define INV_XYZ_ACCEL   (0x08)
 #define INV_XYZ_COMPASS (0x01)
 
+/* DMP image readback done by mpu_load_firmware. */
+#define INV_FW_VERIFY_FULL      (0)
+#define INV_FW_VERIFY_SAMPLED   (1)
+#define INV_FW_VERIFY_NONE      (2)
+
+/* What to do when a FIFO overflow is found (see mpu_set_fifo_recovery). */
+#define INV_FIFO_RECOVER_RESET      (0)
+#define INV_FIFO_RECOVER_FIFO_ONLY  (1)
+#define INV_FIFO_RECOVER_DISCARD    (2)
+
 struct int_param_s {
 #if defined EMPL_TARGET_MSP430 || defined MOTION_DRIVER_TARGET_MSP430
     void (*cb)(void);
@@ -58,78 +68,424 @@ struct int_param_s {
 #define MPU_INT_STATUS_DMP_4            (0x1000)
 #define MPU_INT_STATUS_DMP_5            (0x2000)
 
+/* When entering motion interrupt mode, the driver keeps track of the
+ * previous state so that it can be restored at a later time.
+ * TODO: This is tacky. Fix it.
+ */
+struct motion_int_cache_s {
+    unsigned short gyro_fsr;
+    unsigned char accel_fsr;
+    unsigned short lpf;
+    unsigned short sample_rate;
+    unsigned char sensors_on;
+    unsigned char fifo_sensors;
+    unsigned char dmp_on;
+};
+
+/* Cached chip configuration data.
+ * TODO: A lot of these can be handled with a bitmask.
+ */
+struct chip_cfg_s {
+    /* Matches gyro_cfg >> 3 & 0x03 */
+    unsigned char gyro_fsr;
+    /* Matches accel_cfg >> 3 & 0x03 */
+    unsigned char accel_fsr;
+    /* Enabled sensors. Uses same masks as fifo_en, NOT pwr_mgmt_2. */
+    unsigned char sensors;
+    /* Matches config register. */
+    unsigned char lpf;
+    unsigned char clk_src;
+    /* Sample rate, NOT rate divider. */
+    unsigned short sample_rate;
+    /* Matches fifo_en register. */
+    unsigned char fifo_enable;
+    /* Bytes per FIFO packet for fifo_enable. Unused when the DMP is on. */
+    unsigned char fifo_packet_size;
+    /* Matches int enable register. */
+    unsigned char int_enable;
+    /* 1 if devices on auxiliary I2C bus appear on the primary. */
+    unsigned char bypass_mode;
+    /* 1 if half-sensitivity.
+     * NOTE: This doesn't belong here, but everything else in hw_s is const,
+     * and this allows us to save some precious RAM.
+     */
+    unsigned char accel_half;
+    /* 1 if device in low-power accel-only mode. */
+    unsigned char lp_accel_mode;
+    /* 1 if interrupts are only triggered on motion events. */
+    unsigned char int_motion_only;
+    struct motion_int_cache_s cache;
+    /* 1 for active low interrupts. */
+    unsigned char active_low_int;
+    /* 1 for latched interrupts. */
+    unsigned char latched_int;
+    /* 1 if DMP is enabled. */
+    unsigned char dmp_on;
+    /* Ensures that DMP will only be loaded once. */
+    unsigned char dmp_loaded;
+    /* Sampling rate used when DMP is enabled. */
+    unsigned short dmp_sample_rate;
+    /* INV_FW_VERIFY_* mode used by mpu_load_firmware. */
+    unsigned char fw_verify;
+    /* INV_FIFO_RECOVER_* policy used when the FIFO overflows. */
+    unsigned char fifo_recovery;
+    /* Compass state. Only used when the driver is built with
+     * AK89xx_SECONDARY, but always present so that the layout does not
+     * depend on the includer's defines.
+     */
+    unsigned short compass_sample_rate;
+    unsigned char compass_addr;
+    short mag_sens_adj[3];
+    /* 1 if the compass measures on its own (mpu_set_compass_continuous). */
+    unsigned char compass_continuous;
+    /* Hard- and soft-iron correction applied after mag_sens_adj, if
+     * compass_cal is set: offset in hardware units, 3x3 matrix in q14.
+     */
+    short compass_offset[3];
+    short compass_matrix[9];
+    unsigned char compass_cal;
+    /* Matches bank_sel and mem_start_addr, which every DMP memory access
+     * moves forward. Only used if mem_ptr_valid is set.
+     */
+    unsigned short mem_ptr;
+    unsigned char mem_ptr_valid;
+};
+
+/* Bytes dmp_read_fifo_batch can hold over between calls while it resyncs:
+ * enough for a corrupted packet and the run of good ones after it.
+ */
+#define DMP_RESYNC_BUF_SIZE (160)
+
+/* Bytes of DMP configuration mirrored by the DMP driver (dmp_keys in
+ * inv_mpu_dmp_motion_driver.c).
+ */
+#define DMP_MEM_SHADOW_SIZE (101)
+
+/* DMP driver state. Managed by inv_mpu_dmp_motion_driver.c. */
+struct dmp_state_s {
+    void (*tap_cb)(void *arg, unsigned char direction, unsigned char count);
+    void *tap_arg;
+    void (*android_orient_cb)(void *arg, unsigned char orientation);
+    void *android_orient_arg;
+    unsigned short orient;
+    unsigned short feature_mask;
+    unsigned short fifo_rate;
+    unsigned char packet_length;
+    /* Which fields a packet carries; selects the packet decoder. */
+    unsigned char packet_layout;
+    /* Resync on a corrupted packet instead of resetting the FIFO. */
+    unsigned char resync;
+    /* FIFO bytes read but not yet decoded. They start at a packet boundary,
+     * or at a corrupted packet while a new boundary is being looked for
+     * (resync_wait set). Dropped whenever the FIFO is reset.
+     */
+    unsigned char resync_wait;
+    unsigned char resync_len;
+    unsigned char resync_buf[DMP_RESYNC_BUF_SIZE];
+    /* Copy of the DMP configuration keys, one bit per key in the masks:
+     * keys known to hold their copy, and keys waiting for the end of a
+     * batch (dmp_mem_batch_begin), nested mem_batch deep.
+     */
+    unsigned char mem_shadow[DMP_MEM_SHADOW_SIZE];
+    unsigned long mem_valid;
+    unsigned long mem_dirty;
+    unsigned char mem_batch;
+};
+
+/* Bus transport used to reach a device and the slaves behind it.
+ * @e write and @e read transfer @e length bytes starting at register
+ * @e reg_addr of the slave at @e slave_addr, and return 0 on success.
+ * @e max_transfer is the largest @e length a single call may carry.
+ * @e ctx is passed back untouched to both functions.
+ */
+struct mpu_bus_s {
+    int (*write)(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+        unsigned short length, unsigned char const *data);
+    int (*read)(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+        unsigned short length, unsigned char *data);
+    unsigned short max_transfer;
+    void *ctx;
+};
+
+/* Time source a device reads timestamps and timeouts from, and waits out
+ * its delays on. @e now_us returns microseconds from any fixed origin; it
+ * must never go backwards, and is wide enough never to wrap. @e delay_ms
+ * waits at least @e ms milliseconds. @e ctx is passed back untouched to
+ * both functions.
+ */
+struct mpu_clock_s {
+    unsigned long long (*now_us)(void *ctx);
+    void (*delay_ms)(void *ctx, unsigned long ms);
+    void *ctx;
+};
+
+/* Per-device driver state. Every mpu_* and dmp_* function operates on one
+ * of these, so several devices can be driven at once. Initialize it with
+ * mpu_init_state; treat the contents as private to the driver.
+ */
+struct gyro_reg_s;
+struct hw_s;
+struct test_s;
+/* FIFO overflow counters, kept by the driver. See mpu_get_fifo_stats. */
+struct mpu_fifo_stats_s {
+    /* Overflows found and recovered from. */
+    unsigned long overflows;
+    /* Packets lost: overwritten by the hardware, discarded to resync or
+     * never produced while the DMP was held in reset. Estimated from the
+     * time since the FIFO was last found healthy.
+     */
+    unsigned long packets_lost;
+    /* Bytes read out and thrown away to resync on a packet boundary. */
+    unsigned long bytes_discarded;
+    /* Corrupted DMP packets realigned on, and bytes skipped to do it. */
+    unsigned long resyncs;
+    unsigned long resync_bytes_skipped;
+    /* Time the FIFO was unavailable, in microseconds. */
+    unsigned long last_recovery_us;
+    unsigned long max_recovery_us;
+    /* Last time the FIFO count was read without an overflow. */
+    unsigned long long last_ok_us;
+};
+
+/* Sample timing, reconstructed by the driver from the FIFO depth at each
+ * read. See mpu_get_sample_timing.
+ */
+struct mpu_timing_s {
+    /* Host time, in us, just before and just after FIFO_COUNT was read. */
+    unsigned long long count_start_us;
+    unsigned long long count_end_us;
+    /* Host time of the last data ready interrupt, from mpu_mark_data_ready. */
+    volatile unsigned long long irq_us;
+    volatile unsigned char irq_pending;
+    /* Set once newest_us holds an estimate. Cleared whenever packets may
+     * have gone missing without being counted (FIFO reset or overflow).
+     */
+    unsigned char locked;
+    /* Window the capture time of the newest packet counted in the FIFO
+     * falls in: its start, in us plus a fraction in ns, and its length.
+     * left is the number of packets that were left behind with it.
+     */
+    unsigned long long newest_us;
+    unsigned short newest_frac_ns;
+    unsigned long newest_spread_ns;
+    unsigned short left;
+    /* Last timestamp handed out; timestamps never go backwards. */
+    unsigned long long last_us;
+    unsigned char stamped;
+    /* Sample period expected from the configuration, and as measured
+     * against the host clock, in ns.
+     */
+    unsigned long nominal_ns;
+    unsigned long period_ns;
+    unsigned char period_valid;
+    /* Sample period measurement: capture time of its first packet, the
+     * packets produced since, and the period measured before it (0 if
+     * none).
+     */
+    unsigned long long window_us;
+    unsigned long window_packets;
+    unsigned long window_period_ns;
+};
+
+/* Configuration registers mirrored by the driver, so that changes can be
+ * staged and sent together (see mpu_config_begin). Bit n of a mask stands
+ * for register n of the list in inv_mpu.c.
+ */
+#define MPU_SHADOW_REGS (11)
+struct mpu_shadow_s {
+    /* Last value written to or read from each register, and the value to
+     * write on commit.
+     */
+    unsigned char value[MPU_SHADOW_REGS];
+    unsigned char staged[MPU_SHADOW_REGS];
+    /* Registers whose value is known, and registers staged. */
+    unsigned short valid;
+    unsigned short dirty;
+    /* 1 between mpu_config_begin and mpu_config_commit. */
+    unsigned char staging;
+    /* Work left to the commit: a FIFO reset, the sensor settling delay. */
+    unsigned char reset_fifo;
+    unsigned char settle;
+};
+
+struct mpu_state_s;
+
+/* Operation being run by mpu_poll.
+ * step returns the ms to wait before it is called again, 0 when done, or
+ * negative on error.
+ */
+struct mpu_async_s {
+    int (*step)(struct mpu_state_s *st, unsigned char *stage);
+    unsigned char stage;
+    unsigned char arg;
+    unsigned long long start_us;
+    unsigned long wait_ms;
+};
+
+struct mpu_state_s {
+    const struct mpu_bus_s *bus;
+    const struct mpu_clock_s *clock;
+    unsigned char addr;
+    const struct gyro_reg_s *reg;
+    const struct hw_s *hw;
+    const struct test_s *test;
+    struct chip_cfg_s chip_cfg;
+    struct dmp_state_s dmp;
+    struct mpu_async_s async;
+    struct mpu_fifo_stats_s fifo_stats;
+    struct mpu_timing_s timing;
+    struct mpu_shadow_s shadow;
+};
+
+/* One decoded FIFO packet.
+ * Only the fields flagged in @e sensors hold valid data.
+ * The timestamps are the time the sensor captured the packet, on the
+ * device's clock (see mpu_set_clock), in ms and in us.
+ */
+struct mpu_sample_s {
+    long quat[4];
+    short accel[3];
+    short gyro[3];
+    short compass[3];
+    short sensors;
+    unsigned long timestamp;
+    unsigned long long timestamp_us;
+};
+
+/* Fixed-size queue of samples between one producer, which fills it from
+ * the FIFO (mpu_read_fifo_ring, dmp_read_fifo_ring), and one consumer,
+ * which takes them out (mpu_ring_pop). The two may run in different
+ * threads, or from an interrupt and the main loop, without a lock. head
+ * and tail count up freely and are masked into buf; only the producer
+ * writes head, only the consumer writes tail.
+ */
+struct mpu_ring_s {
+    struct mpu_sample_s *buf;
+    unsigned short size;
+    unsigned short head;
+    unsigned short tail;
+    /* Times the producer found no room left, leaving packets in the FIFO. */
+    unsigned long full;
+};
+
 /* Set up APIs */
-int set_int_enable(unsigned char addr, unsigned char enable);
-int mpu_init(unsigned char addr, struct int_param_s *int_param);
+void mpu_init_state(struct mpu_state_s *st, const struct mpu_bus_s *bus,
+    unsigned char addr);
+void mpu_set_clock(struct mpu_state_s *st, const struct mpu_clock_s *clock);
+int set_int_enable(struct mpu_state_s *st, unsigned char enable);
+int mpu_init(struct mpu_state_s *st, struct int_param_s *int_param);
+int mpu_init_start(struct mpu_state_s *st, struct int_param_s *int_param);
+int mpu_poll(struct mpu_state_s *st);
+int mpu_init_warm(struct mpu_state_s *st, struct int_param_s *int_param);
 int mpu_init_slave(void);
-int mpu_set_bypass(unsigned char addr, unsigned char bypass_on);
+int mpu_set_bypass(struct mpu_state_s *st, unsigned char bypass_on);
+int mpu_set_bypass_start(struct mpu_state_s *st, unsigned char bypass_on);
 
 /* Configuration APIs */
-int mpu_lp_accel_mode(unsigned char addr, unsigned short rate);
-int mpu_lp_motion_interrupt(unsigned char addr, unsigned short thresh, unsigned char time,
+int mpu_lp_accel_mode(struct mpu_state_s *st, unsigned short rate);
+int mpu_lp_motion_interrupt(struct mpu_state_s *st, unsigned short thresh, unsigned char time,
     unsigned short lpa_freq);
-int mpu_set_int_level(unsigned char active_low);
-int mpu_set_int_latched(unsigned char addr, unsigned char enable);
+int mpu_set_int_level(struct mpu_state_s *st, unsigned char active_low);
+int mpu_set_int_latched(struct mpu_state_s *st, unsigned char enable);
 
-int mpu_set_dmp_state(unsigned char addr, unsigned char enable);
-int mpu_get_dmp_state(unsigned char *enabled);
+int mpu_set_dmp_state(struct mpu_state_s *st, unsigned char enable);
+int mpu_get_dmp_state(struct mpu_state_s *st, unsigned char *enabled);
 
-int mpu_get_lpf(unsigned short *lpf);
-int mpu_set_lpf(unsigned char addr, unsigned short lpf);
+int mpu_get_lpf(struct mpu_state_s *st, unsigned short *lpf);
+int mpu_set_lpf(struct mpu_state_s *st, unsigned short lpf);
 
-int mpu_get_gyro_fsr(unsigned short *fsr);
-int mpu_set_gyro_fsr(unsigned char addr, unsigned short fsr);
+int mpu_get_gyro_fsr(struct mpu_state_s *st, unsigned short *fsr);
+int mpu_set_gyro_fsr(struct mpu_state_s *st, unsigned short fsr);
 
-int mpu_get_accel_fsr(unsigned char *fsr);
-int mpu_set_accel_fsr(unsigned char addr, unsigned char fsr);
+int mpu_get_accel_fsr(struct mpu_state_s *st, unsigned char *fsr);
+int mpu_set_accel_fsr(struct mpu_state_s *st, unsigned char fsr);
 
-int mpu_get_compass_fsr(unsigned short *fsr);
+int mpu_get_compass_fsr(struct mpu_state_s *st, unsigned short *fsr);
 
-int mpu_get_gyro_sens(float *sens);
-int mpu_get_accel_sens(unsigned short *sens);
+int mpu_get_gyro_sens(struct mpu_state_s *st, float *sens);
+int mpu_get_accel_sens(struct mpu_state_s *st, unsigned short *sens);
 
-int mpu_get_sample_rate(unsigned short *rate);
-int mpu_set_sample_rate(unsigned char addr, unsigned short rate);
-int mpu_get_compass_sample_rate(unsigned short *rate);
-int mpu_set_compass_sample_rate(unsigned char addr, unsigned short rate);
+int mpu_get_sample_rate(struct mpu_state_s *st, unsigned short *rate);
+int mpu_set_sample_rate(struct mpu_state_s *st, unsigned short rate);
+int mpu_get_compass_sample_rate(struct mpu_state_s *st, unsigned short *rate);
+int mpu_set_compass_sample_rate(struct mpu_state_s *st, unsigned short rate);
+int mpu_set_compass_continuous(struct mpu_state_s *st, unsigned char enable);
+int mpu_set_compass_cal(struct mpu_state_s *st, const short *offset,
+    const short *matrix);
+int mpu_get_compass_cal(struct mpu_state_s *st, short *offset, short *matrix);
 
-int mpu_get_fifo_config(unsigned char *sensors);
-int mpu_configure_fifo(unsigned char addr, unsigned char sensors);
+int mpu_get_fifo_config(struct mpu_state_s *st, unsigned char *sensors);
+int mpu_configure_fifo(struct mpu_state_s *st, unsigned char sensors);
 
-int mpu_get_power_state(unsigned char *power_on);
-int mpu_set_sensors(unsigned char addr, unsigned char sensors);
+int mpu_get_power_state(struct mpu_state_s *st, unsigned char *power_on);
+int mpu_set_sensors(struct mpu_state_s *st, unsigned char sensors);
+int mpu_set_sensors_start(struct mpu_state_s *st, unsigned char sensors);
 
-int mpu_read_6500_accel_bias(unsigned char addr, long *accel_bias);
-int mpu_set_gyro_bias_reg(unsigned char addr, long * gyro_bias);
-int mpu_set_accel_bias_6500_reg(unsigned char addr, const long *accel_bias);
-int mpu_read_6050_accel_bias(unsigned char addr, long *accel_bias);
-int mpu_set_accel_bias_6050_reg(unsigned char addr, const long *accel_bias);
+int mpu_config_begin(struct mpu_state_s *st);
+int mpu_config_commit(struct mpu_state_s *st);
+
+int mpu_read_6500_accel_bias(struct mpu_state_s *st, long *accel_bias);
+int mpu_set_gyro_bias_reg(struct mpu_state_s *st, long * gyro_bias);
+int mpu_set_accel_bias_6500_reg(struct mpu_state_s *st, const long *accel_bias);
+int mpu_read_6050_accel_bias(struct mpu_state_s *st, long *accel_bias);
+int mpu_set_accel_bias_6050_reg(struct mpu_state_s *st, const long *accel_bias);
 
 /* Data getter/setter APIs */
-int mpu_get_gyro_reg(unsigned char addr, short *data, unsigned long *timestamp);
-int mpu_get_accel_reg(unsigned char addr, short *data, unsigned long *timestamp);
-int mpu_get_compass_reg(unsigned char addr, short *data, unsigned long *timestamp);
-int mpu_get_temperature(unsigned char addr, long *data, unsigned long *timestamp);
+int mpu_get_gyro_reg(struct mpu_state_s *st, short *data, unsigned long *timestamp);
+int mpu_get_accel_reg(struct mpu_state_s *st, short *data, unsigned long *timestamp);
+int mpu_get_compass_reg(struct mpu_state_s *st, short *data, unsigned long *timestamp);
+int mpu_get_temperature(struct mpu_state_s *st, long *data, unsigned long *timestamp);
+int mpu_get_all_reg(struct mpu_state_s *st, short *accel, short *gyro,
+    long *temperature, short *compass, unsigned char *int_status,
+    short *sensors, unsigned long *timestamp);
 
-int mpu_get_int_status(unsigned char addr, short *status);
-int mpu_read_fifo(unsigned char addr, short *gyro, short *accel, unsigned long *timestamp,
+int mpu_get_int_status(struct mpu_state_s *st, short *status);
+int mpu_read_fifo(struct mpu_state_s *st, short *gyro, short *accel, unsigned long *timestamp,
     unsigned char *sensors, unsigned char *more);
-int mpu_read_fifo_stream(unsigned char addr, unsigned short length, unsigned char *data,
+int mpu_read_fifo_stream(struct mpu_state_s *st, unsigned short length, unsigned char *data,
     unsigned char *more);
-int mpu_reset_fifo_fast(unsigned char addr);
-int mpu_reset_fifo(unsigned char addr);
+int mpu_read_fifo_batch(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more,
+    unsigned short *dropped);
+int mpu_get_fifo_count(struct mpu_state_s *st, unsigned short *count);
+int mpu_read_fifo_burst(struct mpu_state_s *st, unsigned short length, unsigned char *data);
+int mpu_reset_fifo_fast(struct mpu_state_s *st);
+int mpu_reset_fifo(struct mpu_state_s *st);
+int mpu_reset_fifo_start(struct mpu_state_s *st);
+int mpu_set_fifo_recovery(struct mpu_state_s *st, unsigned char policy);
+int mpu_get_fifo_stats(struct mpu_state_s *st, struct mpu_fifo_stats_s *stats);
+int mpu_reset_fifo_stats(struct mpu_state_s *st);
+void mpu_stamp_samples(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short count, unsigned short more);
+void mpu_mark_data_ready(struct mpu_state_s *st);
+int mpu_get_sample_timing(struct mpu_state_s *st, unsigned long *period_ns,
+    long *drift_ppm);
+
+int mpu_ring_init(struct mpu_ring_s *ring, struct mpu_sample_s *buf,
+    unsigned short size);
+unsigned short mpu_ring_count(struct mpu_ring_s *ring);
+unsigned short mpu_ring_pop(struct mpu_ring_s *ring, struct mpu_sample_s *samples,
+    unsigned short max_samples);
+int mpu_ring_fill(struct mpu_state_s *st, struct mpu_ring_s *ring,
+    int (*read)(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more));
+int mpu_read_fifo_ring(struct mpu_state_s *st, struct mpu_ring_s *ring);
 
-int mpu_write_mem(unsigned char addr, unsigned short mem_addr, unsigned short length,
+int mpu_write_mem(struct mpu_state_s *st, unsigned short mem_addr, unsigned short length,
     unsigned char *data);
-int mpu_read_mem(unsigned char addr, unsigned short mem_addr, unsigned short length,
+int mpu_read_mem(struct mpu_state_s *st, unsigned short mem_addr, unsigned short length,
     unsigned char *data);
-int mpu_load_firmware(unsigned char addr, unsigned short length, const unsigned char *firmware,
+int mpu_load_firmware(struct mpu_state_s *st, unsigned short length, const unsigned char *firmware,
     unsigned short start_addr, unsigned short sample_rate);
+int mpu_set_firmware_verify(struct mpu_state_s *st, unsigned char mode);
+int mpu_adopt_firmware(struct mpu_state_s *st, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sig_addr, unsigned short sig_length,
+    unsigned short sample_rate);
 
-int mpu_reg_dump(unsigned char addr);
-int mpu_read_reg(unsigned char addr, unsigned char reg, unsigned char *data);
-int mpu_run_self_test(unsigned char addr, long *gyro, long *accel);
-int mpu_run_6500_self_test(unsigned char addr, long *gyro, long *accel, unsigned char debug);
+int mpu_reg_dump(struct mpu_state_s *st);
+int mpu_read_reg(struct mpu_state_s *st, unsigned char reg, unsigned char *data);
+int mpu_run_self_test(struct mpu_state_s *st, long *gyro, long *accel);
+int mpu_run_6500_self_test(struct mpu_state_s *st, long *gyro, long *accel, unsigned char debug);
 int mpu_register_tap_cb(void (*func)(unsigned char, unsigned char));
 
 #endif  /* #ifndef _INV_MPU_H_ */
@@ -25,20 +25,22 @@
 #include "dmpmap.h"
 
 /* The following functions must be defined for this platform:
- * i2c_write(unsigned char slave_addr, unsigned char reg_addr,
- *      unsigned char length, unsigned char const *data)
- * i2c_read(unsigned char slave_addr, unsigned char reg_addr,
- *      unsigned char length, unsigned char *data)
  * delay_ms(unsigned long num_ms)
  * get_ms(unsigned long *count)
  */
+#if defined(ARDUINO)
 #include <arduino.h>
-#include "arduino_mpu9250_i2c.h"
 #include "arduino_mpu9250_clk.h"
-#define i2c_write(a, b, c, d) arduino_i2c_write(a, b, c, d)
-#define i2c_read(a, b, c, d)  arduino_i2c_read(a, b, c, d)
 #define delay_ms  arduino_delay_ms
 #define get_ms    arduino_get_clock_ms
+#else
+#include "linux_mpu9250_clk.h"
+#define delay_ms  linux_delay_ms
+#define get_ms    linux_get_clock_ms
+#define log_i(...)  do { } while (0)
+#define log_e(...)  fprintf(stderr, __VA_ARGS__)
+#define _min(a, b)  (((a) < (b)) ? (a) : (b))
+#endif
 //#define log_i     _MLPrintLog
 //#define log_e     _MLPrintLog
 
@@ -441,8 +443,17 @@ static const unsigned short sStartAddress = 0x0400;
                                      DMP_FEATURE_SEND_CAL_GYRO)
 
 #define MAX_PACKET_LENGTH   (32)
+/* Bytes pulled from the FIFO per burst by dmp_read_fifo_batch. Must be at
+ * least MAX_PACKET_LENGTH.
+ */
+#define MAX_BURST_LENGTH    (256)
 
 #define DMP_SAMPLE_RATE     (200)
+/* Compared by dmp_adopt_motion_driver_firmware: the end of the image is
+ * code, past the last key rewritten at runtime (CFG_6).
+ */
+#define DMP_SIGNATURE_LENGTH    (32)
+#define DMP_SIGNATURE_ADDR      (DMP_CODE_SIZE - DMP_SIGNATURE_LENGTH)
 #define GYRO_SF             (46850825LL * 200 / DMP_SAMPLE_RATE)
 
 #define FIFO_CORRUPTION_CHECK
@@ -453,32 +464,236 @@ static const unsigned short sStartAddress = 0x0400;
 #define QUAT_MAG_SQ_MAX         (QUAT_MAG_SQ_NORMALIZED + QUAT_ERROR_THRESH)
 #endif
 
-struct dmp_s {
-    void (*tap_cb)(unsigned char count, unsigned char direction);
-    void (*android_orient_cb)(unsigned char orientation);
-    unsigned short orient;
-    unsigned short feature_mask;
-    unsigned short fifo_rate;
-    unsigned char packet_length;
+/* Bytes in one DMP FIFO packet for a feature mask. */
+static unsigned char get_packet_length(unsigned short mask)
+{
+    unsigned char length = 0;
+
+    if (mask & DMP_FEATURE_SEND_RAW_ACCEL)
+        length += 6;
+    if (mask & DMP_FEATURE_SEND_ANY_GYRO)
+        length += 6;
+    if (mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
+        length += 16;
+    if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
+        length += 4;
+    return length;
+}
+
+/* Fields carried by a DMP packet, in FIFO order. The combination indexes
+ * packet_decoders.
+ */
+#define LAYOUT_QUAT         (0x01)
+#define LAYOUT_ACCEL        (0x02)
+#define LAYOUT_GYRO         (0x04)
+#define LAYOUT_GESTURE      (0x08)
+#define NUM_LAYOUTS         (16)
+
+static unsigned char get_packet_layout(unsigned short mask)
+{
+    unsigned char layout = 0;
+
+    if (mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
+        layout |= LAYOUT_QUAT;
+    if (mask & DMP_FEATURE_SEND_RAW_ACCEL)
+        layout |= LAYOUT_ACCEL;
+    if (mask & DMP_FEATURE_SEND_ANY_GYRO)
+        layout |= LAYOUT_GYRO;
+    if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
+        layout |= LAYOUT_GESTURE;
+    return layout;
+}
+
+/* DMP memory locations this driver configures, in address order. Their
+ * contents are mirrored in dmp.mem_shadow, one key after the other, so
+ * that unchanged values are not written again and a batch can be sent as
+ * few runs of adjacent keys. Biases and pedometer counters are not here:
+ * the DMP updates them itself.
+ */
+struct dmp_key_s {
+    unsigned short addr;
+    unsigned char length;
 };
 
-static struct dmp_s dmp = {
-    .tap_cb = NULL,
-    .android_orient_cb = NULL,
-    .orient = 0,
-    .feature_mask = 0,
-    .fifo_rate = 0,
-    .packet_length = 0
+static const struct dmp_key_s dmp_keys[] = {
+    {D_0_104, 4},
+    {D_1_36, 2},
+    {D_1_40, 2},
+    {D_1_44, 2},
+    {D_1_72, 1},
+    {D_1_79, 1},
+    {D_1_88, 2},
+    {D_1_90, 2},
+    {D_1_92, 4},
+    {DMP_TAP_THX, 2},
+    {DMP_TAP_THY, 2},
+    {D_1_218, 2},
+    {DMP_TAP_THZ, 2},
+    {DMP_TAPW_MIN, 2},
+    {D_0_22, 2},
+    {FCFG_1, 3},
+    {FCFG_2, 3},
+    {FCFG_7, 3},
+    {FCFG_3, 3},
+    {CFG_MOTION_BIAS, 9},
+    {CFG_ANDROID_ORIENT_INT, 1},
+    {CFG_20, 1},
+    {CFG_FIFO_ON_EVENT, 11},
+    {CFG_LP_QUAT, 4},
+    {CFG_8, 4},
+    {CFG_GYRO_RAW_DATA, 4},
+    {CFG_15, 10},
+    {CFG_27, 1},
+    {CFG_6, 12}
 };
+#define NUM_DMP_KEYS    (sizeof(dmp_keys) / sizeof(dmp_keys[0]))
+
+/* Index of the key at addr, or -1. offset is where it starts in
+ * dmp.mem_shadow.
+ */
+static int find_key(unsigned short addr, unsigned short *offset)
+{
+    unsigned char ii;
+
+    offset[0] = 0;
+    for (ii = 0; ii < NUM_DMP_KEYS; ii++) {
+        if (dmp_keys[ii].addr == addr)
+            return ii;
+        offset[0] += dmp_keys[ii].length;
+    }
+    return -1;
+}
+
+/* Write a DMP memory location through the shadow. Inside a batch, keys are
+ * only recorded and written by dmp_mem_batch_end.
+ */
+static int write_key(struct mpu_state_s *st, unsigned short addr,
+    unsigned short length, const unsigned char *data)
+{
+    unsigned short offset;
+    unsigned long bit;
+    int key;
+
+    key = find_key(addr, &offset);
+    if (key < 0)
+        return mpu_write_mem(st, addr, length, (unsigned char*)data);
+    bit = 1UL << key;
+    if (dmp_keys[key].length != length) {
+        st->dmp.mem_valid &= ~bit;
+        return mpu_write_mem(st, addr, length, (unsigned char*)data);
+    }
+    if ((st->dmp.mem_valid & bit) &&
+        !memcmp(&st->dmp.mem_shadow[offset], data, length))
+        return 0;
+
+    memcpy(&st->dmp.mem_shadow[offset], data, length);
+    st->dmp.mem_valid &= ~bit;
+    if (st->dmp.mem_batch) {
+        st->dmp.mem_dirty |= bit;
+        return 0;
+    }
+    st->dmp.mem_dirty &= ~bit;
+    if (mpu_write_mem(st, addr, length, &st->dmp.mem_shadow[offset]))
+        return -1;
+    st->dmp.mem_valid |= bit;
+    return 0;
+}
+
+/**
+ *  @brief  Hold back DMP configuration writes until @e dmp_mem_batch_end.
+ *  Batches nest; only the outermost end writes.
+ */
+void dmp_mem_batch_begin(struct mpu_state_s *st)
+{
+    st->dmp.mem_batch++;
+}
+
+/**
+ *  @brief  Write what changed since @e dmp_mem_batch_begin.
+ *  Changed keys are written in address order, and keys next to each other
+ *  in the same bank go out as one write.
+ *  @return 0 if successful.
+ */
+int dmp_mem_batch_end(struct mpu_state_s *st)
+{
+    unsigned short offset, run_addr, run_offset, run_length;
+    unsigned char ii;
+    unsigned long run;
+    int result = 0;
+
+    if (!st->dmp.mem_batch)
+        return -1;
+    if (--st->dmp.mem_batch)
+        return 0;
+
+    offset = 0;
+    for (ii = 0; ii < NUM_DMP_KEYS; ) {
+        if (!(st->dmp.mem_dirty & (1UL << ii))) {
+            offset += dmp_keys[ii++].length;
+            continue;
+        }
+        run_addr = dmp_keys[ii].addr;
+        run_offset = offset;
+        run_length = 0;
+        run = 0;
+        do {
+            run |= 1UL << ii;
+            run_length += dmp_keys[ii].length;
+            offset += dmp_keys[ii++].length;
+        } while (ii < NUM_DMP_KEYS && (st->dmp.mem_dirty & (1UL << ii)) &&
+            dmp_keys[ii].addr == run_addr + run_length &&
+            (dmp_keys[ii].addr >> 8) == (run_addr >> 8));
+
+        st->dmp.mem_dirty &= ~run;
+        if (mpu_write_mem(st, run_addr, run_length,
+                &st->dmp.mem_shadow[run_offset]))
+            result = -1;
+        else
+            st->dmp.mem_valid |= run;
+    }
+    return result;
+}
 
 /**
  *  @brief  Load the DMP with this image.
  *  @return 0 if successful.
  */
-int dmp_load_motion_driver_firmware(unsigned char addr)
+int dmp_load_motion_driver_firmware(struct mpu_state_s *st)
 {
-    return mpu_load_firmware(addr, DMP_CODE_SIZE, dmp_memory, sStartAddress,
+    unsigned short offset;
+    unsigned char ii;
+    int result;
+
+    result = mpu_load_firmware(st, DMP_CODE_SIZE, dmp_memory, sStartAddress,
         DMP_SAMPLE_RATE);
+    if (result)
+        return result;
+
+    /* Keys in program memory hold what was just loaded. Data memory is the
+     * DMP's to change, so those are learned on the first write.
+     */
+    offset = 0;
+    for (ii = 0; ii < NUM_DMP_KEYS; ii++) {
+        if (dmp_keys[ii].addr >= sStartAddress) {
+            memcpy(&st->dmp.mem_shadow[offset], &dmp_memory[dmp_keys[ii].addr],
+                dmp_keys[ii].length);
+            st->dmp.mem_valid |= 1UL << ii;
+        }
+        offset += dmp_keys[ii].length;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  Use this image if it is already loaded and running.
+ *  For a host-only reset: checks the program start address and the end of
+ *  the image instead of writing it again.
+ *  @return 0 if the image is in place, 1 if it must be loaded.
+ */
+int dmp_adopt_motion_driver_firmware(struct mpu_state_s *st)
+{
+    return mpu_adopt_firmware(st, dmp_memory, sStartAddress,
+        DMP_SIGNATURE_ADDR, DMP_SIGNATURE_LENGTH, DMP_SAMPLE_RATE);
 }
 
 /**
@@ -488,7 +703,7 @@ int dmp_load_motion_driver_firmware(unsigned char addr)
  *  @param[in]  orient  Gyro and accel orientation in body frame.
  *  @return     0 if successful.
  */
-int dmp_set_orientation(unsigned char addr, unsigned short orient)
+int dmp_set_orientation(struct mpu_state_s *st, unsigned short orient)
 {
     unsigned char gyro_regs[3], accel_regs[3];
     const unsigned char gyro_axes[3] = {DINA4C, DINACD, DINA6C};
@@ -503,11 +718,10 @@ int dmp_set_orientation(unsigned char addr, unsigned short orient)
     accel_regs[1] = accel_axes[(orient >> 3) & 3];
     accel_regs[2] = accel_axes[(orient >> 6) & 3];
 
+    dmp_mem_batch_begin(st);
     /* Chip-to-body, axes only. */
-    if (mpu_write_mem(addr, FCFG_1, 3, gyro_regs))
-        return -1;
-    if (mpu_write_mem(addr, FCFG_2, 3, accel_regs))
-        return -1;
+    write_key(st, FCFG_1, 3, gyro_regs);
+    write_key(st, FCFG_2, 3, accel_regs);
 
     memcpy(gyro_regs, gyro_sign, 3);
     memcpy(accel_regs, accel_sign, 3);
@@ -525,11 +739,11 @@ int dmp_set_orientation(unsigned char addr, unsigned short orient)
     }
 
     /* Chip-to-body, sign only. */
-    if (mpu_write_mem(addr, FCFG_3, 3, gyro_regs))
-        return -1;
-    if (mpu_write_mem(addr, FCFG_7, 3, accel_regs))
+    write_key(st, FCFG_3, 3, gyro_regs);
+    write_key(st, FCFG_7, 3, accel_regs);
+    if (dmp_mem_batch_end(st))
         return -1;
-    dmp.orient = orient;
+    st->dmp.orient = orient;
     return 0;
 }
 
@@ -543,19 +757,19 @@ int dmp_set_orientation(unsigned char addr, unsigned short orient)
  *  @param[in]  bias    Gyro biases in q16.
  *  @return     0 if successful.
  */
-int dmp_set_gyro_bias(unsigned char addr, long *bias)
+int dmp_set_gyro_bias(struct mpu_state_s *st, long *bias)
 {
     long gyro_bias_body[3];
     unsigned char regs[4];
 
-    gyro_bias_body[0] = bias[dmp.orient & 3];
-    if (dmp.orient & 4)
+    gyro_bias_body[0] = bias[st->dmp.orient & 3];
+    if (st->dmp.orient & 4)
         gyro_bias_body[0] *= -1;
-    gyro_bias_body[1] = bias[(dmp.orient >> 3) & 3];
-    if (dmp.orient & 0x20)
+    gyro_bias_body[1] = bias[(st->dmp.orient >> 3) & 3];
+    if (st->dmp.orient & 0x20)
         gyro_bias_body[1] *= -1;
-    gyro_bias_body[2] = bias[(dmp.orient >> 6) & 3];
-    if (dmp.orient & 0x100)
+    gyro_bias_body[2] = bias[(st->dmp.orient >> 6) & 3];
+    if (st->dmp.orient & 0x100)
         gyro_bias_body[2] *= -1;
 
 #ifdef EMPL_NO_64BIT
@@ -572,21 +786,21 @@ int dmp_set_gyro_bias(unsigned char addr, long *bias)
     regs[1] = (unsigned char)((gyro_bias_body[0] >> 16) & 0xFF);
     regs[2] = (unsigned char)((gyro_bias_body[0] >> 8) & 0xFF);
     regs[3] = (unsigned char)(gyro_bias_body[0] & 0xFF);
-    if (mpu_write_mem(addr, D_EXT_GYRO_BIAS_X, 4, regs))
+    if (mpu_write_mem(st, D_EXT_GYRO_BIAS_X, 4, regs))
         return -1;
 
     regs[0] = (unsigned char)((gyro_bias_body[1] >> 24) & 0xFF);
     regs[1] = (unsigned char)((gyro_bias_body[1] >> 16) & 0xFF);
     regs[2] = (unsigned char)((gyro_bias_body[1] >> 8) & 0xFF);
     regs[3] = (unsigned char)(gyro_bias_body[1] & 0xFF);
-    if (mpu_write_mem(addr, D_EXT_GYRO_BIAS_Y, 4, regs))
+    if (mpu_write_mem(st, D_EXT_GYRO_BIAS_Y, 4, regs))
         return -1;
 
     regs[0] = (unsigned char)((gyro_bias_body[2] >> 24) & 0xFF);
     regs[1] = (unsigned char)((gyro_bias_body[2] >> 16) & 0xFF);
     regs[2] = (unsigned char)((gyro_bias_body[2] >> 8) & 0xFF);
     regs[3] = (unsigned char)(gyro_bias_body[2] & 0xFF);
-    return mpu_write_mem(addr, D_EXT_GYRO_BIAS_Z, 4, regs);
+    return mpu_write_mem(st, D_EXT_GYRO_BIAS_Z, 4, regs);
 }
 
 /**
@@ -595,25 +809,25 @@ int dmp_set_gyro_bias(unsigned char addr, long *bias)
  *  @param[in]  bias    Accel biases in q16.
  *  @return     0 if successful.
  */
-int dmp_set_accel_bias(unsigned char addr, long *bias)
+int dmp_set_accel_bias(struct mpu_state_s *st, long *bias)
 {
     long accel_bias_body[3];
     unsigned char regs[12];
     long long accel_sf;
     unsigned short accel_sens;
 
-    mpu_get_accel_sens(&accel_sens);
+    mpu_get_accel_sens(st, &accel_sens);
     accel_sf = (long long)accel_sens << 15;
     __no_operation();
 
-    accel_bias_body[0] = bias[dmp.orient & 3];
-    if (dmp.orient & 4)
+    accel_bias_body[0] = bias[st->dmp.orient & 3];
+    if (st->dmp.orient & 4)
         accel_bias_body[0] *= -1;
-    accel_bias_body[1] = bias[(dmp.orient >> 3) & 3];
-    if (dmp.orient & 0x20)
+    accel_bias_body[1] = bias[(st->dmp.orient >> 3) & 3];
+    if (st->dmp.orient & 0x20)
         accel_bias_body[1] *= -1;
-    accel_bias_body[2] = bias[(dmp.orient >> 6) & 3];
-    if (dmp.orient & 0x100)
+    accel_bias_body[2] = bias[(st->dmp.orient >> 6) & 3];
+    if (st->dmp.orient & 0x100)
         accel_bias_body[2] *= -1;
 
 #ifdef EMPL_NO_64BIT
@@ -638,7 +852,7 @@ int dmp_set_accel_bias(unsigned char addr, long *bias)
     regs[9] = (unsigned char)((accel_bias_body[2] >> 16) & 0xFF);
     regs[10] = (unsigned char)((accel_bias_body[2] >> 8) & 0xFF);
     regs[11] = (unsigned char)(accel_bias_body[2] & 0xFF);
-    return mpu_write_mem(addr, D_ACCEL_BIAS, 12, regs);
+    return mpu_write_mem(st, D_ACCEL_BIAS, 12, regs);
 }
 
 /**
@@ -647,7 +861,7 @@ int dmp_set_accel_bias(unsigned char addr, long *bias)
  *  @param[in]  rate    Desired fifo rate (Hz).
  *  @return     0 if successful.
  */
-int dmp_set_fifo_rate(unsigned char addr, unsigned short rate)
+int dmp_set_fifo_rate(struct mpu_state_s *st, unsigned short rate)
 {
     const unsigned char regs_end[12] = {DINAFE, DINAF2, DINAAB,
         0xc4, DINAAA, DINAF1, DINADF, DINADF, 0xBB, 0xAF, DINADF, DINADF};
@@ -659,12 +873,13 @@ int dmp_set_fifo_rate(unsigned char addr, unsigned short rate)
     div = DMP_SAMPLE_RATE / rate - 1;
     tmp[0] = (unsigned char)((div >> 8) & 0xFF);
     tmp[1] = (unsigned char)(div & 0xFF);
-    if (mpu_write_mem(addr, D_0_22, 2, tmp))
-        return -1;
-    if (mpu_write_mem(addr, CFG_6, 12, (unsigned char*)regs_end))
+    dmp_mem_batch_begin(st);
+    write_key(st, D_0_22, 2, tmp);
+    write_key(st, CFG_6, 12, regs_end);
+    if (dmp_mem_batch_end(st))
         return -1;
 
-    dmp.fifo_rate = rate;
+    st->dmp.fifo_rate = rate;
     return 0;
 }
 
@@ -673,9 +888,9 @@ int dmp_set_fifo_rate(unsigned char addr, unsigned short rate)
  *  @param[out] rate    Current fifo rate (Hz).
  *  @return     0 if successful.
  */
-int dmp_get_fifo_rate(unsigned short *rate)
+int dmp_get_fifo_rate(struct mpu_state_s *st, unsigned short *rate)
 {
-    rate[0] = dmp.fifo_rate;
+    rate[0] = st->dmp.fifo_rate;
     return 0;
 }
 
@@ -685,7 +900,7 @@ int dmp_get_fifo_rate(unsigned short *rate)
  *  @param[in]  thresh  Tap threshold, in mg/ms.
  *  @return     0 if successful.
  */
-int dmp_set_tap_thresh(unsigned char addr, unsigned char axis, unsigned short thresh)
+int dmp_set_tap_thresh(struct mpu_state_s *st, unsigned char axis, unsigned short thresh)
 {
     unsigned char tmp[4], accel_fsr;
     float scaled_thresh;
@@ -695,7 +910,7 @@ int dmp_set_tap_thresh(unsigned char addr, unsigned char axis, unsigned short th
 
     scaled_thresh = (float)thresh / DMP_SAMPLE_RATE;
 
-    mpu_get_accel_fsr(&accel_fsr);
+    mpu_get_accel_fsr(st, &accel_fsr);
     switch (accel_fsr) {
     case 2:
         dmp_thresh = (unsigned short)(scaled_thresh * 16384);
@@ -725,25 +940,20 @@ int dmp_set_tap_thresh(unsigned char addr, unsigned char axis, unsigned short th
     tmp[2] = (unsigned char)(dmp_thresh_2 >> 8);
     tmp[3] = (unsigned char)(dmp_thresh_2 & 0xFF);
 
+    dmp_mem_batch_begin(st);
     if (axis & TAP_X) {
-        if (mpu_write_mem(addr, DMP_TAP_THX, 2, tmp))
-            return -1;
-        if (mpu_write_mem(addr, D_1_36, 2, tmp+2))
-            return -1;
+        write_key(st, DMP_TAP_THX, 2, tmp);
+        write_key(st, D_1_36, 2, tmp+2);
     }
     if (axis & TAP_Y) {
-        if (mpu_write_mem(addr, DMP_TAP_THY, 2, tmp))
-            return -1;
-        if (mpu_write_mem(addr, D_1_40, 2, tmp+2))
-            return -1;
+        write_key(st, DMP_TAP_THY, 2, tmp);
+        write_key(st, D_1_40, 2, tmp+2);
     }
     if (axis & TAP_Z) {
-        if (mpu_write_mem(addr, DMP_TAP_THZ, 2, tmp))
-            return -1;
-        if (mpu_write_mem(addr, D_1_44, 2, tmp+2))
-            return -1;
+        write_key(st, DMP_TAP_THZ, 2, tmp);
+        write_key(st, D_1_44, 2, tmp+2);
     }
-    return 0;
+    return dmp_mem_batch_end(st);
 }
 
 /**
@@ -751,7 +961,7 @@ int dmp_set_tap_thresh(unsigned char addr, unsigned char axis, unsigned short th
  *  @param[in]  axis    1, 2, and 4 for XYZ, respectively.
  *  @return     0 if successful.
  */
-int dmp_set_tap_axes(unsigned char addr, unsigned char axis)
+int dmp_set_tap_axes(struct mpu_state_s *st, unsigned char axis)
 {
     unsigned char tmp = 0;
 
@@ -761,7 +971,7 @@ int dmp_set_tap_axes(unsigned char addr, unsigned char axis)
         tmp |= 0x0C;
     if (axis & TAP_Z)
         tmp |= 0x03;
-    return mpu_write_mem(addr, D_1_72, 1, &tmp);
+    return write_key(st, D_1_72, 1, &tmp);
 }
 
 /**
@@ -769,7 +979,7 @@ int dmp_set_tap_axes(unsigned char addr, unsigned char axis)
  *  @param[in]  min_taps    Minimum consecutive taps (1-4).
  *  @return     0 if successful.
  */
-int dmp_set_tap_count(unsigned char addr, unsigned char min_taps)
+int dmp_set_tap_count(struct mpu_state_s *st, unsigned char min_taps)
 {
     unsigned char tmp;
 
@@ -779,7 +989,7 @@ int dmp_set_tap_count(unsigned char addr, unsigned char min_taps)
         min_taps = 4;
 
     tmp = min_taps - 1;
-    return mpu_write_mem(addr, D_1_79, 1, &tmp);
+    return write_key(st, D_1_79, 1, &tmp);
 }
 
 /**
@@ -787,7 +997,7 @@ int dmp_set_tap_count(unsigned char addr, unsigned char min_taps)
  *  @param[in]  time    Milliseconds between taps.
  *  @return     0 if successful.
  */
-int dmp_set_tap_time(unsigned char addr, unsigned short time)
+int dmp_set_tap_time(struct mpu_state_s *st, unsigned short time)
 {
     unsigned short dmp_time;
     unsigned char tmp[2];
@@ -795,7 +1005,7 @@ int dmp_set_tap_time(unsigned char addr, unsigned short time)
     dmp_time = time / (1000 / DMP_SAMPLE_RATE);
     tmp[0] = (unsigned char)(dmp_time >> 8);
     tmp[1] = (unsigned char)(dmp_time & 0xFF);
-    return mpu_write_mem(addr, DMP_TAPW_MIN, 2, tmp);
+    return write_key(st, DMP_TAPW_MIN, 2, tmp);
 }
 
 /**
@@ -803,7 +1013,7 @@ int dmp_set_tap_time(unsigned char addr, unsigned short time)
  *  @param[in]  time    Max milliseconds between taps.
  *  @return     0 if successful.
  */
-int dmp_set_tap_time_multi(unsigned char addr, unsigned short time)
+int dmp_set_tap_time_multi(struct mpu_state_s *st, unsigned short time)
 {
     unsigned short dmp_time;
     unsigned char tmp[2];
@@ -811,7 +1021,7 @@ int dmp_set_tap_time_multi(unsigned char addr, unsigned short time)
     dmp_time = time / (1000 / DMP_SAMPLE_RATE);
     tmp[0] = (unsigned char)(dmp_time >> 8);
     tmp[1] = (unsigned char)(dmp_time & 0xFF);
-    return mpu_write_mem(addr, D_1_218, 2, tmp);
+    return write_key(st, D_1_218, 2, tmp);
 }
 
 /**
@@ -821,7 +1031,7 @@ int dmp_set_tap_time_multi(unsigned char addr, unsigned short time)
  *  @param[in]  thresh  Gyro threshold in dps.
  *  @return     0 if successful.
  */
-int dmp_set_shake_reject_thresh(unsigned char addr, long sf, unsigned short thresh)
+int dmp_set_shake_reject_thresh(struct mpu_state_s *st, long sf, unsigned short thresh)
 {
     unsigned char tmp[4];
     long thresh_scaled = sf / 1000 * thresh;
@@ -829,7 +1039,7 @@ int dmp_set_shake_reject_thresh(unsigned char addr, long sf, unsigned short thre
     tmp[1] = (unsigned char)(((long)thresh_scaled >> 16) & 0xFF);
     tmp[2] = (unsigned char)(((long)thresh_scaled >> 8) & 0xFF);
     tmp[3] = (unsigned char)((long)thresh_scaled & 0xFF);
-    return mpu_write_mem(addr, D_1_92, 4, tmp);
+    return write_key(st, D_1_92, 4, tmp);
 }
 
 /**
@@ -840,14 +1050,14 @@ int dmp_set_shake_reject_thresh(unsigned char addr, long sf, unsigned short thre
  *  @param[in]  time    Time in milliseconds.
  *  @return     0 if successful.
  */
-int dmp_set_shake_reject_time(unsigned char addr, unsigned short time)
+int dmp_set_shake_reject_time(struct mpu_state_s *st, unsigned short time)
 {
     unsigned char tmp[2];
 
     time /= (1000 / DMP_SAMPLE_RATE);
     tmp[0] = time >> 8;
     tmp[1] = time & 0xFF;
-    return mpu_write_mem(addr, D_1_90,2,tmp);
+    return write_key(st, D_1_90,2,tmp);
 }
 
 /**
@@ -858,14 +1068,14 @@ int dmp_set_shake_reject_time(unsigned char addr, unsigned short time)
  *  @param[in]  time    Time in milliseconds.
  *  @return     0 if successful.
  */
-int dmp_set_shake_reject_timeout(unsigned char addr, unsigned short time)
+int dmp_set_shake_reject_timeout(struct mpu_state_s *st, unsigned short time)
 {
     unsigned char tmp[2];
 
     time /= (1000 / DMP_SAMPLE_RATE);
     tmp[0] = time >> 8;
     tmp[1] = time & 0xFF;
-    return mpu_write_mem(addr, D_1_88,2,tmp);
+    return write_key(st, D_1_88,2,tmp);
 }
 
 /**
@@ -873,13 +1083,13 @@ int dmp_set_shake_reject_timeout(unsigned char addr, unsigned short time)
  *  @param[out] count   Number of steps detected.
  *  @return     0 if successful.
  */
-int dmp_get_pedometer_step_count(unsigned char addr, unsigned long *count)
+int dmp_get_pedometer_step_count(struct mpu_state_s *st, unsigned long *count)
 {
     unsigned char tmp[4];
     if (!count)
         return -1;
 
-    if (mpu_read_mem(addr, D_PEDSTD_STEPCTR, 4, tmp))
+    if (mpu_read_mem(st, D_PEDSTD_STEPCTR, 4, tmp))
         return -1;
 
     count[0] = ((unsigned long)tmp[0] << 24) | ((unsigned long)tmp[1] << 16) |
@@ -894,7 +1104,7 @@ int dmp_get_pedometer_step_count(unsigned char addr, unsigned long *count)
  *  @param[in]  count   New step count.
  *  @return     0 if successful.
  */
-int dmp_set_pedometer_step_count(unsigned char addr, unsigned long count)
+int dmp_set_pedometer_step_count(struct mpu_state_s *st, unsigned long count)
 {
     unsigned char tmp[4];
 
@@ -902,7 +1112,7 @@ int dmp_set_pedometer_step_count(unsigned char addr, unsigned long count)
     tmp[1] = (unsigned char)((count >> 16) & 0xFF);
     tmp[2] = (unsigned char)((count >> 8) & 0xFF);
     tmp[3] = (unsigned char)(count & 0xFF);
-    return mpu_write_mem(addr, D_PEDSTD_STEPCTR, 4, tmp);
+    return mpu_write_mem(st, D_PEDSTD_STEPCTR, 4, tmp);
 }
 
 /**
@@ -910,13 +1120,13 @@ int dmp_set_pedometer_step_count(unsigned char addr, unsigned long count)
  *  @param[in]  time    Walk time in milliseconds.
  *  @return     0 if successful.
  */
-int dmp_get_pedometer_walk_time(unsigned char addr, unsigned long *time)
+int dmp_get_pedometer_walk_time(struct mpu_state_s *st, unsigned long *time)
 {
     unsigned char tmp[4];
     if (!time)
         return -1;
 
-    if (mpu_read_mem(addr, D_PEDSTD_TIMECTR, 4, tmp))
+    if (mpu_read_mem(st, D_PEDSTD_TIMECTR, 4, tmp))
         return -1;
 
     time[0] = (((unsigned long)tmp[0] << 24) | ((unsigned long)tmp[1] << 16) |
@@ -930,7 +1140,7 @@ int dmp_get_pedometer_walk_time(unsigned char addr, unsigned long *time)
  *  a race condition if called while the pedometer is enabled.
  *  @param[in]  time    New walk time in milliseconds.
  */
-int dmp_set_pedometer_walk_time(unsigned char addr, unsigned long time)
+int dmp_set_pedometer_walk_time(struct mpu_state_s *st, unsigned long time)
 {
     unsigned char tmp[4];
 
@@ -940,7 +1150,39 @@ int dmp_set_pedometer_walk_time(unsigned char addr, unsigned long time)
     tmp[1] = (unsigned char)((time >> 16) & 0xFF);
     tmp[2] = (unsigned char)((time >> 8) & 0xFF);
     tmp[3] = (unsigned char)(time & 0xFF);
-    return mpu_write_mem(addr, D_PEDSTD_TIMECTR, 4, tmp);
+    return mpu_write_mem(st, D_PEDSTD_TIMECTR, 4, tmp);
+}
+
+/* The quaternion switches without the FIFO reset, for dmp_enable_feature to
+ * do once.
+ */
+static int write_lp_quat(struct mpu_state_s *st, unsigned char enable)
+{
+    unsigned char regs[4];
+    if (enable) {
+        regs[0] = DINBC0;
+        regs[1] = DINBC2;
+        regs[2] = DINBC4;
+        regs[3] = DINBC6;
+    }
+    else
+        memset(regs, 0x8B, 4);
+
+    return write_key(st, CFG_LP_QUAT, 4, regs);
+}
+
+static int write_6x_lp_quat(struct mpu_state_s *st, unsigned char enable)
+{
+    unsigned char regs[4];
+    if (enable) {
+        regs[0] = DINA20;
+        regs[1] = DINA28;
+        regs[2] = DINA30;
+        regs[3] = DINA38;
+    } else
+        memset(regs, 0xA3, 4);
+
+    return write_key(st, CFG_8, 4, regs);
 }
 
 /**
@@ -953,26 +1195,38 @@ int dmp_set_pedometer_walk_time(unsigned char addr, unsigned long time)
  *  \n DMP_FEATURE_GYRO_CAL
  *  \n DMP_FEATURE_SEND_RAW_ACCEL
  *  \n DMP_FEATURE_SEND_RAW_GYRO
+ *  \n DMP_FEATURE_SEND_COMPASS
  *  \n NOTE: DMP_FEATURE_LP_QUAT and DMP_FEATURE_6X_LP_QUAT are mutually
  *  exclusive.
  *  \n NOTE: DMP_FEATURE_SEND_RAW_GYRO and DMP_FEATURE_SEND_CAL_GYRO are also
  *  mutually exclusive.
+ *  \n NOTE: The DMP image has no compass output. With
+ *  DMP_FEATURE_SEND_COMPASS, @e dmp_read_fifo_batch reads what I2C master
+ *  slave 0 last picked up from the compass (one extra read per call, not
+ *  per packet) and attaches it to the newest packet when it is a new
+ *  reading. The flag is not kept in DMP memory, so
+ *  @e dmp_adopt_features cannot recover it.
  *  @param[in]  mask    Mask of features to enable.
  *  @return     0 if successful.
  */
-int dmp_enable_feature(unsigned char addr, unsigned short mask)
+int dmp_enable_feature(struct mpu_state_s *st, unsigned short mask)
 {
     unsigned char tmp[10];
 
     /* TODO: All of these settings can probably be integrated into the default
      * DMP image.
      */
+    /* Everything below goes out as one batch: only what changed, and a
+     * single FIFO reset at the end.
+     */
+    dmp_mem_batch_begin(st);
+
     /* Set integration scale factor. */
     tmp[0] = (unsigned char)((GYRO_SF >> 24) & 0xFF);
     tmp[1] = (unsigned char)((GYRO_SF >> 16) & 0xFF);
     tmp[2] = (unsigned char)((GYRO_SF >> 8) & 0xFF);
     tmp[3] = (unsigned char)(GYRO_SF & 0xFF);
-    mpu_write_mem(addr, D_0_104, 4, tmp);
+    write_key(st, D_0_104, 4, tmp);
 
     /* Send sensor data to the FIFO. */
     tmp[0] = 0xA3;
@@ -997,19 +1251,19 @@ int dmp_enable_feature(unsigned char addr, unsigned short mask)
     tmp[7] = 0xA3;
     tmp[8] = 0xA3;
     tmp[9] = 0xA3;
-    mpu_write_mem(addr, CFG_15,10,tmp);
+    write_key(st, CFG_15, 10, tmp);
 
     /* Send gesture data to the FIFO. */
     if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
         tmp[0] = DINA20;
     else
         tmp[0] = 0xD8;
-    mpu_write_mem(addr, CFG_27,1,tmp);
+    write_key(st, CFG_27, 1, tmp);
 
     if (mask & DMP_FEATURE_GYRO_CAL)
-        dmp_enable_gyro_cal(addr, 1);
+        dmp_enable_gyro_cal(st, 1);
     else
-        dmp_enable_gyro_cal(addr, 0);
+        dmp_enable_gyro_cal(st, 0);
 
     if (mask & DMP_FEATURE_SEND_ANY_GYRO) {
         if (mask & DMP_FEATURE_SEND_CAL_GYRO) {
@@ -1023,68 +1277,112 @@ int dmp_enable_feature(unsigned char addr, unsigned short mask)
             tmp[2] = DINAC2;
             tmp[3] = DINA90;
         }
-        mpu_write_mem(addr, CFG_GYRO_RAW_DATA, 4, tmp);
+        write_key(st, CFG_GYRO_RAW_DATA, 4, tmp);
     }
 
     if (mask & DMP_FEATURE_TAP) {
         /* Enable tap. */
         tmp[0] = 0xF8;
-        mpu_write_mem(addr, CFG_20, 1, tmp);
-        dmp_set_tap_thresh(addr, TAP_XYZ, 250);
-        dmp_set_tap_axes(addr, TAP_XYZ);
-        dmp_set_tap_count(addr, 1);
-        dmp_set_tap_time(addr, 100);
-        dmp_set_tap_time_multi(addr, 500);
-
-        dmp_set_shake_reject_thresh(addr, GYRO_SF, 200);
-        dmp_set_shake_reject_time(addr, 40);
-        dmp_set_shake_reject_timeout(addr, 10);
+        write_key(st, CFG_20, 1, tmp);
+        dmp_set_tap_thresh(st, TAP_XYZ, 250);
+        dmp_set_tap_axes(st, TAP_XYZ);
+        dmp_set_tap_count(st, 1);
+        dmp_set_tap_time(st, 100);
+        dmp_set_tap_time_multi(st, 500);
+
+        dmp_set_shake_reject_thresh(st, GYRO_SF, 200);
+        dmp_set_shake_reject_time(st, 40);
+        dmp_set_shake_reject_timeout(st, 10);
     } else {
         tmp[0] = 0xD8;
-        mpu_write_mem(addr, CFG_20, 1, tmp);
+        write_key(st, CFG_20, 1, tmp);
     }
 
     if (mask & DMP_FEATURE_ANDROID_ORIENT) {
         tmp[0] = 0xD9;
     } else
         tmp[0] = 0xD8;
-    mpu_write_mem(addr, CFG_ANDROID_ORIENT_INT, 1, tmp);
+    write_key(st, CFG_ANDROID_ORIENT_INT, 1, tmp);
 
-    if (mask & DMP_FEATURE_LP_QUAT)
-        dmp_enable_lp_quat(addr, 1);
-    else
-        dmp_enable_lp_quat(addr, 0);
+    write_lp_quat(st, !!(mask & DMP_FEATURE_LP_QUAT));
+    write_6x_lp_quat(st, !!(mask & DMP_FEATURE_6X_LP_QUAT));
 
-    if (mask & DMP_FEATURE_6X_LP_QUAT)
-        dmp_enable_6x_lp_quat(addr, 1);
-    else
-        dmp_enable_6x_lp_quat(addr, 0);
+    if (dmp_mem_batch_end(st))
+        return -1;
 
     /* Pedometer is always enabled. */
-    dmp.feature_mask = mask | DMP_FEATURE_PEDOMETER;
-    mpu_reset_fifo(addr);
+    st->dmp.feature_mask = mask | DMP_FEATURE_PEDOMETER;
+    mpu_reset_fifo(st);
 
-    dmp.packet_length = 0;
-    if (mask & DMP_FEATURE_SEND_RAW_ACCEL)
-        dmp.packet_length += 6;
-    if (mask & DMP_FEATURE_SEND_ANY_GYRO)
-        dmp.packet_length += 6;
-    if (mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
-        dmp.packet_length += 16;
-    if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
-        dmp.packet_length += 4;
+    st->dmp.packet_length = get_packet_length(mask);
+    st->dmp.packet_layout = get_packet_layout(mask);
 
     return 0;
 }
 
+/**
+ *  @brief      Recover the enabled features and FIFO rate from DMP memory.
+ *  After @e dmp_adopt_motion_driver_firmware, this rebuilds the state
+ *  @e dmp_enable_feature and @e dmp_set_fifo_rate would have left, so that
+ *  FIFO packets can be parsed without reconfiguring the DMP. Tap and
+ *  orientation thresholds are not read back.
+ *  @return     0 if successful.
+ */
+int dmp_adopt_features(struct mpu_state_s *st)
+{
+    unsigned char tmp[10];
+    unsigned short mask = DMP_FEATURE_PEDOMETER;
+
+    if (mpu_read_mem(st, CFG_15, 10, tmp))
+        return -1;
+    if (tmp[1] == 0xC0)
+        mask |= DMP_FEATURE_SEND_RAW_ACCEL;
+    if (tmp[4] == 0xC4) {
+        if (mpu_read_mem(st, CFG_GYRO_RAW_DATA, 1, tmp))
+            return -1;
+        if (tmp[0] == 0xB2)
+            mask |= DMP_FEATURE_SEND_CAL_GYRO;
+        else
+            mask |= DMP_FEATURE_SEND_RAW_GYRO;
+    }
+    if (mpu_read_mem(st, CFG_20, 1, tmp))
+        return -1;
+    if (tmp[0] == 0xF8)
+        mask |= DMP_FEATURE_TAP;
+    if (mpu_read_mem(st, CFG_ANDROID_ORIENT_INT, 1, tmp))
+        return -1;
+    if (tmp[0] == 0xD9)
+        mask |= DMP_FEATURE_ANDROID_ORIENT;
+    if (mpu_read_mem(st, CFG_LP_QUAT, 1, tmp))
+        return -1;
+    if (tmp[0] == DINBC0)
+        mask |= DMP_FEATURE_LP_QUAT;
+    if (mpu_read_mem(st, CFG_8, 1, tmp))
+        return -1;
+    if (tmp[0] == DINA20)
+        mask |= DMP_FEATURE_6X_LP_QUAT;
+    if (mpu_read_mem(st, CFG_MOTION_BIAS, 3, tmp))
+        return -1;
+    if (tmp[2] == 0xB3)
+        mask |= DMP_FEATURE_GYRO_CAL;
+    if (mpu_read_mem(st, D_0_22, 2, tmp))
+        return -1;
+
+    st->dmp.feature_mask = mask;
+    st->dmp.packet_length = get_packet_length(mask);
+    st->dmp.packet_layout = get_packet_layout(mask);
+    st->dmp.fifo_rate = DMP_SAMPLE_RATE / (((tmp[0] << 8) | tmp[1]) + 1);
+    return 0;
+}
+
 /**
  *  @brief      Get list of currently enabled DMP features.
  *  @param[out] Mask of enabled features.
  *  @return     0 if successful.
  */
-int dmp_get_enabled_features(unsigned short *mask)
+int dmp_get_enabled_features(struct mpu_state_s *st, unsigned short *mask)
 {
-    mask[0] = dmp.feature_mask;
+    mask[0] = st->dmp.feature_mask;
     return 0;
 }
 
@@ -1097,14 +1395,14 @@ int dmp_get_enabled_features(unsigned short *mask)
  *  @param[in]  enable  1 to enable gyro calibration.
  *  @return     0 if successful.
  */
-int dmp_enable_gyro_cal(unsigned char addr, unsigned char enable)
+int dmp_enable_gyro_cal(struct mpu_state_s *st, unsigned char enable)
 {
     if (enable) {
         unsigned char regs[9] = {0xb8, 0xaa, 0xb3, 0x8d, 0xb4, 0x98, 0x0d, 0x35, 0x5d};
-        return mpu_write_mem(addr, CFG_MOTION_BIAS, 9, regs);
+        return write_key(st, CFG_MOTION_BIAS, 9, regs);
     } else {
         unsigned char regs[9] = {0xb8, 0xaa, 0xaa, 0xaa, 0xb0, 0x88, 0xc3, 0xc5, 0xc7};
-        return mpu_write_mem(addr, CFG_MOTION_BIAS, 9, regs);
+        return write_key(st, CFG_MOTION_BIAS, 9, regs);
     }
 }
 
@@ -1115,21 +1413,11 @@ int dmp_enable_gyro_cal(unsigned char addr, unsigned char enable)
  *  @param[in]  enable  1 to enable 3-axis quaternion.
  *  @return     0 if successful.
  */
-int dmp_enable_lp_quat(unsigned char addr, unsigned char enable)
+int dmp_enable_lp_quat(struct mpu_state_s *st, unsigned char enable)
 {
-    unsigned char regs[4];
-    if (enable) {
-        regs[0] = DINBC0;
-        regs[1] = DINBC2;
-        regs[2] = DINBC4;
-        regs[3] = DINBC6;
-    }
-    else
-        memset(regs, 0x8B, 4);
-
-    mpu_write_mem(addr, CFG_LP_QUAT, 4, regs);
-
-    return mpu_reset_fifo(addr);
+    if (write_lp_quat(st, enable))
+        return -1;
+    return mpu_reset_fifo(st);
 }
 
 /**
@@ -1139,20 +1427,11 @@ int dmp_enable_lp_quat(unsigned char addr, unsigned char enable)
  *  @param[in]   enable  1 to enable 6-axis quaternion.
  *  @return      0 if successful.
  */
-int dmp_enable_6x_lp_quat(unsigned char addr, unsigned char enable)
+int dmp_enable_6x_lp_quat(struct mpu_state_s *st, unsigned char enable)
 {
-    unsigned char regs[4];
-    if (enable) {
-        regs[0] = DINA20;
-        regs[1] = DINA28;
-        regs[2] = DINA30;
-        regs[3] = DINA38;
-    } else
-        memset(regs, 0xA3, 4);
-
-    mpu_write_mem(addr, CFG_8, 4, regs);
-
-    return mpu_reset_fifo(addr);
+    if (write_6x_lp_quat(st, enable))
+        return -1;
+    return mpu_reset_fifo(st);
 }
 
 /**
@@ -1160,7 +1439,7 @@ int dmp_enable_6x_lp_quat(unsigned char addr, unsigned char enable)
  *  @param[in]  gesture Gesture data from DMP packet.
  *  @return     0 if successful.
  */
-static int decode_gesture(unsigned char *gesture)
+static int decode_gesture(struct mpu_state_s *st, const unsigned char *gesture)
 {
     unsigned char tap, android_orient;
 
@@ -1171,13 +1450,14 @@ static int decode_gesture(unsigned char *gesture)
         unsigned char direction, count;
         direction = tap >> 3;
         count = (tap % 8) + 1;
-        if (dmp.tap_cb)
-            dmp.tap_cb(direction, count);
+        if (st->dmp.tap_cb)
+            st->dmp.tap_cb(st->dmp.tap_arg, direction, count);
     }
 
     if (gesture[1] & INT_SRC_ANDROID_ORIENT) {
-        if (dmp.android_orient_cb)
-            dmp.android_orient_cb(android_orient >> 6);
+        if (st->dmp.android_orient_cb)
+            st->dmp.android_orient_cb(st->dmp.android_orient_arg,
+                android_orient >> 6);
     }
 
     return 0;
@@ -1192,7 +1472,7 @@ static int decode_gesture(unsigned char *gesture)
  *  @param[in]  mode    DMP_INT_GESTURE or DMP_INT_CONTINUOUS.
  *  @return     0 if successful.
  */
-int dmp_set_interrupt_mode(unsigned char addr, unsigned char mode)
+int dmp_set_interrupt_mode(struct mpu_state_s *st, unsigned char mode)
 {
     const unsigned char regs_continuous[11] =
         {0xd8, 0xb1, 0xb9, 0xf3, 0x8b, 0xa3, 0x91, 0xb6, 0x09, 0xb4, 0xd9};
@@ -1201,16 +1481,361 @@ int dmp_set_interrupt_mode(unsigned char addr, unsigned char mode)
 
     switch (mode) {
     case DMP_INT_CONTINUOUS:
-        return mpu_write_mem(addr, CFG_FIFO_ON_EVENT, 11,
-            (unsigned char*)regs_continuous);
+        return write_key(st, CFG_FIFO_ON_EVENT, 11, regs_continuous);
     case DMP_INT_GESTURE:
-        return mpu_write_mem(addr, CFG_FIFO_ON_EVENT, 11,
-            (unsigned char*)regs_gesture);
+        return write_key(st, CFG_FIFO_ON_EVENT, 11, regs_gesture);
     default:
         return -1;
     }
 }
 
+#ifdef FIFO_CORRUPTION_CHECK
+/* We can detect a corrupted FIFO by monitoring the quaternion data and
+ * ensuring that the magnitude is always normalized to one. This shouldn't
+ * happen in normal operation, but if an I2C error occurs, the FIFO reads
+ * might become misaligned.
+ */
+static int quat_is_valid(const unsigned char *fifo_data)
+{
+    long quat_q14[4], quat_mag_sq;
+    unsigned char ii;
+
+    /* Scale down the quaternion data to avoid long long math. */
+    for (ii = 0; ii < 4; ii++)
+        quat_q14[ii] = (short)((fifo_data[ii * 4] << 8) | fifo_data[ii * 4 + 1]);
+    quat_mag_sq = quat_q14[0] * quat_q14[0] + quat_q14[1] * quat_q14[1] +
+        quat_q14[2] * quat_q14[2] + quat_q14[3] * quat_q14[3];
+    return (quat_mag_sq >= QUAT_MAG_SQ_MIN) && (quat_mag_sq <= QUAT_MAG_SQ_MAX);
+}
+#endif
+
+#define BIG_ENDIAN_32(p)    (((long)(p)[0] << 24) | ((long)(p)[1] << 16) | \
+                             ((long)(p)[2] << 8) | (p)[3])
+#define BIG_ENDIAN_16(p)    ((short)(((p)[0] << 8) | (p)[1]))
+
+#ifdef FIFO_CORRUPTION_CHECK
+#define QUAT_CHECK(p)       quat_is_valid(p)
+#else
+#define QUAT_CHECK(p)       (1)
+#endif
+
+/* Parser for one DMP packet layout. Each expansion tests a constant, so the
+ * compiler keeps only the straight-line unpacking for the fields present.
+ * Returns 0, or -2 if the packet looks corrupted.
+ */
+#define DEFINE_PACKET_DECODER(layout)                                       \
+static int decode_packet_##layout(struct mpu_state_s *st,                  \
+    const unsigned char *fifo_data, struct mpu_sample_s *sample)            \
+{                                                                           \
+    if ((layout) & LAYOUT_QUAT) {                                           \
+        if (!QUAT_CHECK(fifo_data)) {                                       \
+            /* Quaternion is outside of the acceptable threshold. */        \
+            sample->sensors = 0;                                            \
+            return -2;                                                      \
+        }                                                                   \
+        sample->quat[0] = BIG_ENDIAN_32(fifo_data);                         \
+        sample->quat[1] = BIG_ENDIAN_32(fifo_data + 4);                     \
+        sample->quat[2] = BIG_ENDIAN_32(fifo_data + 8);                     \
+        sample->quat[3] = BIG_ENDIAN_32(fifo_data + 12);                    \
+        fifo_data += 16;                                                    \
+    }                                                                       \
+    if ((layout) & LAYOUT_ACCEL) {                                          \
+        sample->accel[0] = BIG_ENDIAN_16(fifo_data);                        \
+        sample->accel[1] = BIG_ENDIAN_16(fifo_data + 2);                    \
+        sample->accel[2] = BIG_ENDIAN_16(fifo_data + 4);                    \
+        fifo_data += 6;                                                     \
+    }                                                                       \
+    if ((layout) & LAYOUT_GYRO) {                                           \
+        sample->gyro[0] = BIG_ENDIAN_16(fifo_data);                         \
+        sample->gyro[1] = BIG_ENDIAN_16(fifo_data + 2);                     \
+        sample->gyro[2] = BIG_ENDIAN_16(fifo_data + 4);                     \
+        fifo_data += 6;                                                     \
+    }                                                                       \
+    /* Gesture data is at the end of the DMP packet. Parse it and call      \
+     * the gesture callbacks (if registered).                               \
+     */                                                                     \
+    if ((layout) & LAYOUT_GESTURE)                                          \
+        decode_gesture(st, fifo_data);                                      \
+    sample->sensors = (((layout) & LAYOUT_QUAT) ? INV_WXYZ_QUAT : 0) |      \
+        (((layout) & LAYOUT_ACCEL) ? INV_XYZ_ACCEL : 0) |                   \
+        (((layout) & LAYOUT_GYRO) ? INV_XYZ_GYRO : 0);                      \
+    return 0;                                                               \
+}
+
+DEFINE_PACKET_DECODER(0)
+DEFINE_PACKET_DECODER(1)
+DEFINE_PACKET_DECODER(2)
+DEFINE_PACKET_DECODER(3)
+DEFINE_PACKET_DECODER(4)
+DEFINE_PACKET_DECODER(5)
+DEFINE_PACKET_DECODER(6)
+DEFINE_PACKET_DECODER(7)
+DEFINE_PACKET_DECODER(8)
+DEFINE_PACKET_DECODER(9)
+DEFINE_PACKET_DECODER(10)
+DEFINE_PACKET_DECODER(11)
+DEFINE_PACKET_DECODER(12)
+DEFINE_PACKET_DECODER(13)
+DEFINE_PACKET_DECODER(14)
+DEFINE_PACKET_DECODER(15)
+
+/* Indexed by st->dmp.packet_layout, set along with the packet length. */
+static int (* const packet_decoders[NUM_LAYOUTS])(struct mpu_state_s *st,
+    const unsigned char *fifo_data, struct mpu_sample_s *sample) = {
+    decode_packet_0,  decode_packet_1,  decode_packet_2,  decode_packet_3,
+    decode_packet_4,  decode_packet_5,  decode_packet_6,  decode_packet_7,
+    decode_packet_8,  decode_packet_9,  decode_packet_10, decode_packet_11,
+    decode_packet_12, decode_packet_13, decode_packet_14, decode_packet_15
+};
+
+/* Consecutive packets that must pass the quaternion check before a byte
+ * offset is trusted as the new packet boundary.
+ */
+#define RESYNC_RUN          (3)
+
+/* Offset of the first packet boundary in @e data, after the first byte,
+ * followed by RESYNC_RUN packets in a row that pass the quaternion check.
+ * -1 if there is not enough data to find one.
+ * A glitch on the bus shifts what was read, not what is in the FIFO, which
+ * still ends on a packet boundary @e fifo_left bytes after @e data (as
+ * counted by the FIFO, after the glitch). That leaves one candidate offset
+ * per packet length; checking only those keeps data that happens to look
+ * like a unit quaternion (a level accelerometer reads 1g as 0x4000) from
+ * being taken for one.
+ */
+static int find_packet_boundary(struct mpu_state_s *st, const unsigned char *data,
+    unsigned short length, unsigned short fifo_left)
+{
+#ifdef FIFO_CORRUPTION_CHECK
+    unsigned short packet_length = st->dmp.packet_length;
+    unsigned short offset;
+    unsigned char ii;
+
+    offset = (length + fifo_left) % packet_length;
+    if (!offset)
+        offset = packet_length;
+    for (; offset + RESYNC_RUN * packet_length <= length; offset += packet_length) {
+        for (ii = 0; ii < RESYNC_RUN; ii++)
+            if (!quat_is_valid(data + offset + ii * packet_length))
+                break;
+        if (ii == RESYNC_RUN)
+            return offset;
+    }
+#endif
+    return -1;
+}
+
+/* Decode the packets in @e data, which starts on a packet boundary. On a
+ * corrupted packet, either reset the FIFO (-2) or, with resync enabled,
+ * skip to the next boundary found in the data, reading up to one packet more
+ * from the FIFO to end on a boundary again. Bytes left over are kept in
+ * st->dmp.resync_buf for the next call.
+ * @e size is the capacity of @e data, @e fifo_left the bytes still in the
+ * FIFO.
+ */
+static int decode_fifo_data(struct mpu_state_s *st, unsigned char *data,
+    unsigned short length, unsigned short size, unsigned short *fifo_left,
+    struct mpu_sample_s *samples, unsigned short max_samples,
+    unsigned short *count)
+{
+    int (*decode)(struct mpu_state_s *st, const unsigned char *fifo_data,
+        struct mpu_sample_s *sample) = packet_decoders[st->dmp.packet_layout];
+    unsigned short packet_length = st->dmp.packet_length;
+    unsigned short offset = 0, extra;
+    int boundary, result;
+
+    st->dmp.resync_wait = 0;
+
+    while (count[0] < max_samples && offset + packet_length <= length) {
+        struct mpu_sample_s *sample = &samples[count[0]];
+        if (!decode(st, data + offset, sample)) {
+            count[0]++;
+            offset += packet_length;
+            continue;
+        }
+        boundary = -1;
+        if (st->dmp.resync) {
+            /* Bytes lost or repeated on the bus leave our own count of what
+             * is left in the FIFO off; ask the FIFO.
+             */
+            result = mpu_get_fifo_count(st, fifo_left);
+            if (result == -2) {
+                /* Overflowed meanwhile and recovered: nothing held lines up
+                 * any more.
+                 */
+                return 0;
+            }
+            if (result)
+                return -1;
+            boundary = find_packet_boundary(st, data + offset, length - offset,
+                fifo_left[0]);
+            if (boundary < 0 && length - offset < DMP_RESYNC_BUF_SIZE) {
+                /* Not enough data yet to tell where the next packet starts. */
+                st->dmp.resync_wait = 1;
+                break;
+            }
+        }
+        if (boundary < 0) {
+            /* Everything behind a misaligned packet is suspect. */
+            mpu_reset_fifo(st);
+            return -2;
+        }
+        st->fifo_stats.resyncs++;
+        st->fifo_stats.resync_bytes_skipped += boundary;
+        st->fifo_stats.packets_lost += (boundary + packet_length - 1) / packet_length;
+        offset += boundary;
+        /* The FIFO still ends on a packet boundary: complete the packet cut
+         * short by the end of the data.
+         */
+        extra = (length - offset) % packet_length;
+        if (extra)
+            extra = packet_length - extra;
+        if (extra && extra <= fifo_left[0] && length + extra <= size) {
+            if (mpu_read_fifo_burst(st, extra, data + length))
+                return -1;
+            length += extra;
+            fifo_left[0] -= extra;
+        }
+    }
+
+    if (length - offset > DMP_RESYNC_BUF_SIZE) {
+        mpu_reset_fifo(st);
+        return -2;
+    }
+    memcpy(st->dmp.resync_buf, data + offset, length - offset);
+    st->dmp.resync_len = length - offset;
+    return 0;
+}
+
+/**
+ *  @brief      Drain every complete packet from the FIFO.
+ *  FIFO_COUNT is read once, then up to @e max_samples packets are pulled out
+ *  in as few bus reads as possible and parsed into @e samples. This costs
+ *  one or two transactions plus one per @e MAX_BURST_LENGTH bytes, instead of
+ *  two or three transactions per packet with @e dmp_read_fifo.
+ *  \n Each packet is stamped with its capture time; see
+ *  @e mpu_stamp_samples.
+ *  \n A FIFO overflow is recovered from as set by @e mpu_set_fifo_recovery;
+ *  the loss is counted in @e mpu_get_fifo_stats.
+ *  \n A corrupted packet resets the FIFO, unless resync is enabled with
+ *  @e dmp_set_fifo_resync.
+ *  @param[out] samples     Array of at least @e max_samples samples.
+ *  @param[in]  max_samples Maximum number of packets to read.
+ *  @param[out] count       Number of samples written to @e samples, also
+ *                          on error: packets decoded before it are kept.
+ *  @param[out] more        Number of complete packets left in the FIFO.
+ *  @return     0 if successful, -2 if a corrupted packet caused a FIFO reset.
+ */
+int dmp_read_fifo_batch(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more)
+{
+    unsigned char fifo_data[MAX_BURST_LENGTH + MAX_PACKET_LENGTH];
+    unsigned short fifo_count, wanted, length, this_read;
+    unsigned short packet_length = st->dmp.packet_length;
+    unsigned char dmp_on;
+    int result;
+
+    count[0] = 0;
+    more[0] = 0;
+
+    mpu_get_dmp_state(st, &dmp_on);
+    if (!dmp_on || !packet_length)
+        return -1;
+
+    /* An overflow has already been recovered from; read what survived. */
+    if (mpu_get_fifo_count(st, &fifo_count) == -1)
+        return -1;
+
+    while (count[0] < max_samples) {
+        /* Start with what the last call could not decode. */
+        length = st->dmp.resync_len;
+        memcpy(fifo_data, st->dmp.resync_buf, length);
+        st->dmp.resync_len = 0;
+
+        /* Read whole packets, or a full resync window while looking for a
+         * packet boundary.
+         */
+        wanted = (max_samples - count[0]) * packet_length;
+        if (st->dmp.resync_wait && length && wanted < DMP_RESYNC_BUF_SIZE)
+            wanted = DMP_RESYNC_BUF_SIZE;
+        wanted = _min(wanted, MAX_BURST_LENGTH);
+        this_read = 0;
+        if (wanted > length) {
+            this_read = _min(fifo_count, wanted - length);
+            if (length < packet_length) {
+                /* Stop on a packet boundary. */
+                if (length + this_read < packet_length)
+                    this_read = 0;
+                else
+                    this_read -= (length + this_read) % packet_length;
+            }
+        }
+        result = 0;
+        if (this_read) {
+            if (mpu_read_fifo_burst(st, this_read, fifo_data + length))
+                result = -1;
+            else {
+                fifo_count -= this_read;
+                length += this_read;
+            }
+        }
+
+        if (!result)
+            result = decode_fifo_data(st, fifo_data, length,
+                sizeof(fifo_data), &fifo_count, samples, max_samples, count);
+        if (result) {
+            /* The packets decoded so far are good, but the count of what
+             * follows them is lost.
+             */
+            if (count[0])
+                mpu_stamp_samples(st, samples, count[0], 0);
+            st->timing.locked = 0;
+            return result;
+        }
+        if (!this_read)
+            break;
+    }
+    more[0] = (fifo_count + st->dmp.resync_len) / packet_length;
+
+    /* No compass in DMP packets: pair the latest reading with the newest. */
+    if ((st->dmp.feature_mask & DMP_FEATURE_SEND_COMPASS) && count[0] &&
+        !mpu_get_compass_reg(st, samples[count[0] - 1].compass, NULL))
+        samples[count[0] - 1].sensors |= INV_XYZ_COMPASS;
+
+    mpu_stamp_samples(st, samples, count[0], more[0]);
+    return 0;
+}
+
+/**
+ *  @brief      Resync on a corrupted FIFO packet instead of resetting.
+ *  A packet that fails the quaternion check normally resets the FIFO and
+ *  the DMP, losing everything in the FIFO and the 50ms reset time. With
+ *  resync enabled, the bytes after it are scanned for a packet boundary
+ *  followed by several good packets in a row, and reading goes on from
+ *  there. If the data gathered over the following calls holds no such
+ *  boundary, the FIFO is reset as before. Skipped bytes are counted in
+ *  @e mpu_get_fifo_stats.
+ *  \n Needs a quaternion feature (DMP_FEATURE_LP_QUAT or
+ *  DMP_FEATURE_6X_LP_QUAT); without one, corruption cannot be detected.
+ *  @param[in]  enable  1 to resync, 0 to reset.
+ *  @return     0 if successful.
+ */
+int dmp_set_fifo_resync(struct mpu_state_s *st, unsigned char enable)
+{
+    st->dmp.resync = enable ? 1 : 0;
+    return 0;
+}
+
+/**
+ *  @brief      Drain the FIFO into a ring, with the DMP on.
+ *  See @e mpu_ring_fill; packets are read by @e dmp_read_fifo_batch.
+ *  @return     Number of samples added, or negative on error.
+ */
+int dmp_read_fifo_ring(struct mpu_state_s *st, struct mpu_ring_s *ring)
+{
+    return mpu_ring_fill(st, ring, dmp_read_fifo_batch);
+}
+
 /**
  *  @brief      Get one packet from the FIFO.
  *  If @e sensors does not contain a particular sensor, disregard the data
@@ -1231,84 +1856,28 @@ int dmp_set_interrupt_mode(unsigned char addr, unsigned char mode)
  *  @param[out] more        Number of remaining packets.
  *  @return     0 if successful.
  */
-int dmp_read_fifo(unsigned char addr, short *gyro, short *accel, long *quat,
+int dmp_read_fifo(struct mpu_state_s *st, short *gyro, short *accel, long *quat,
     unsigned long *timestamp, short *sensors, unsigned char *more)
 {
-    unsigned char fifo_data[MAX_PACKET_LENGTH];
-    unsigned char ii = 0;
+    struct mpu_sample_s sample;
+    unsigned short count, remaining;
+    int result;
 
-    /* TODO: sensors[0] only changes when dmp_enable_feature is called. We can
-     * cache this value and save some cycles.
-     */
     sensors[0] = 0;
+    more[0] = 0;
 
-    /* Get a packet. */
-    if (mpu_read_fifo_stream(addr, dmp.packet_length, fifo_data, more))
+    result = dmp_read_fifo_batch(st, &sample, 1, &count, &remaining);
+    if (result)
+        return result;
+    if (!count)
         return -1;
 
-    /* Parse DMP packet. */
-    if (dmp.feature_mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
-#ifdef FIFO_CORRUPTION_CHECK
-        long quat_q14[4], quat_mag_sq;
-#endif
-        quat[0] = ((long)fifo_data[0] << 24) | ((long)fifo_data[1] << 16) |
-            ((long)fifo_data[2] << 8) | fifo_data[3];
-        quat[1] = ((long)fifo_data[4] << 24) | ((long)fifo_data[5] << 16) |
-            ((long)fifo_data[6] << 8) | fifo_data[7];
-        quat[2] = ((long)fifo_data[8] << 24) | ((long)fifo_data[9] << 16) |
-            ((long)fifo_data[10] << 8) | fifo_data[11];
-        quat[3] = ((long)fifo_data[12] << 24) | ((long)fifo_data[13] << 16) |
-            ((long)fifo_data[14] << 8) | fifo_data[15];
-        ii += 16;
-#ifdef FIFO_CORRUPTION_CHECK
-        /* We can detect a corrupted FIFO by monitoring the quaternion data and
-         * ensuring that the magnitude is always normalized to one. This
-         * shouldn't happen in normal operation, but if an I2C error occurs,
-         * the FIFO reads might become misaligned.
-         *
-         * Let's start by scaling down the quaternion data to avoid long long
-         * math.
-         */
-        quat_q14[0] = quat[0] >> 16;
-        quat_q14[1] = quat[1] >> 16;
-        quat_q14[2] = quat[2] >> 16;
-        quat_q14[3] = quat[3] >> 16;
-        quat_mag_sq = quat_q14[0] * quat_q14[0] + quat_q14[1] * quat_q14[1] +
-            quat_q14[2] * quat_q14[2] + quat_q14[3] * quat_q14[3];
-        if ((quat_mag_sq < QUAT_MAG_SQ_MIN) ||
-            (quat_mag_sq > QUAT_MAG_SQ_MAX)) {
-            /* Quaternion is outside of the acceptable threshold. */
-            mpu_reset_fifo(addr);
-            sensors[0] = 0;
-            return -2;
-        }
-        sensors[0] |= INV_WXYZ_QUAT;
-#endif
-    }
-
-    if (dmp.feature_mask & DMP_FEATURE_SEND_RAW_ACCEL) {
-        accel[0] = ((short)fifo_data[ii+0] << 8) | fifo_data[ii+1];
-        accel[1] = ((short)fifo_data[ii+2] << 8) | fifo_data[ii+3];
-        accel[2] = ((short)fifo_data[ii+4] << 8) | fifo_data[ii+5];
-        ii += 6;
-        sensors[0] |= INV_XYZ_ACCEL;
-    }
-
-    if (dmp.feature_mask & DMP_FEATURE_SEND_ANY_GYRO) {
-        gyro[0] = ((short)fifo_data[ii+0] << 8) | fifo_data[ii+1];
-        gyro[1] = ((short)fifo_data[ii+2] << 8) | fifo_data[ii+3];
-        gyro[2] = ((short)fifo_data[ii+4] << 8) | fifo_data[ii+5];
-        ii += 6;
-        sensors[0] |= INV_XYZ_GYRO;
-    }
-
-    /* Gesture data is at the end of the DMP packet. Parse it and call
-     * the gesture callbacks (if registered).
-     */
-    if (dmp.feature_mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
-        decode_gesture(fifo_data + ii);
-
-    get_ms(timestamp);
+    memcpy(gyro, sample.gyro, sizeof(sample.gyro));
+    memcpy(accel, sample.accel, sizeof(sample.accel));
+    memcpy(quat, sample.quat, sizeof(sample.quat));
+    sensors[0] = sample.sensors;
+    timestamp[0] = sample.timestamp;
+    more[0] = (remaining > 0xFF) ? 0xFF : (unsigned char)remaining;
     return 0;
 }
 
@@ -1322,22 +1891,28 @@ int dmp_read_fifo(unsigned char addr, short *gyro, short *accel, long *quat,
  *  \n TAP_Z_UP
  *  \n TAP_Z_DOWN
  *  @param[in]  func    Callback function.
+ *  @param[in]  arg     Passed back as the first argument of @e func.
  *  @return     0 if successful.
  */
-int dmp_register_tap_cb(void (*func)(unsigned char, unsigned char))
+int dmp_register_tap_cb(struct mpu_state_s *st,
+    void (*func)(void *, unsigned char, unsigned char), void *arg)
 {
-    dmp.tap_cb = func;
+    st->dmp.tap_cb = func;
+    st->dmp.tap_arg = arg;
     return 0;
 }
 
 /**
  *  @brief      Register a function to be executed on a android orientation event.
  *  @param[in]  func    Callback function.
+ *  @param[in]  arg     Passed back as the first argument of @e func.
  *  @return     0 if successful.
  */
-int dmp_register_android_orient_cb(void (*func)(unsigned char))
+int dmp_register_android_orient_cb(struct mpu_state_s *st,
+    void (*func)(void *, unsigned char), void *arg)
 {
-    dmp.android_orient_cb = func;
+    st->dmp.android_orient_cb = func;
+    st->dmp.android_orient_arg = arg;
     return 0;
 }
 
@@ -46,52 +46,68 @@
 #define DMP_FEATURE_SEND_RAW_ACCEL  (0x040)
 #define DMP_FEATURE_SEND_RAW_GYRO   (0x080)
 #define DMP_FEATURE_SEND_CAL_GYRO   (0x100)
+/* Not a DMP feature: the driver adds the compass to the packets it reads. */
+#define DMP_FEATURE_SEND_COMPASS    (0x200)
 
 #define INV_WXYZ_QUAT       (0x100)
 
+struct mpu_sample_s;
+struct mpu_ring_s;
+struct mpu_state_s;
+
 /* Set up functions. */
-int dmp_load_motion_driver_firmware(unsigned char addr);
-int dmp_set_fifo_rate(unsigned char addr, unsigned short rate);
-int dmp_get_fifo_rate(unsigned short *rate);
-int dmp_enable_feature(unsigned char addr, unsigned short mask);
-int dmp_get_enabled_features(unsigned short *mask);
-int dmp_set_interrupt_mode(unsigned char addr, unsigned char mode);
-int dmp_set_orientation(unsigned char addr, unsigned short orient);
-int dmp_set_gyro_bias(unsigned char addr, long *bias);
-int dmp_set_accel_bias(unsigned char addr, long *bias);
+int dmp_load_motion_driver_firmware(struct mpu_state_s *st);
+int dmp_adopt_motion_driver_firmware(struct mpu_state_s *st);
+int dmp_adopt_features(struct mpu_state_s *st);
+void dmp_mem_batch_begin(struct mpu_state_s *st);
+int dmp_mem_batch_end(struct mpu_state_s *st);
+int dmp_set_fifo_rate(struct mpu_state_s *st, unsigned short rate);
+int dmp_get_fifo_rate(struct mpu_state_s *st, unsigned short *rate);
+int dmp_enable_feature(struct mpu_state_s *st, unsigned short mask);
+int dmp_get_enabled_features(struct mpu_state_s *st, unsigned short *mask);
+int dmp_set_interrupt_mode(struct mpu_state_s *st, unsigned char mode);
+int dmp_set_orientation(struct mpu_state_s *st, unsigned short orient);
+int dmp_set_gyro_bias(struct mpu_state_s *st, long *bias);
+int dmp_set_accel_bias(struct mpu_state_s *st, long *bias);
 
 /* Tap functions. */
-int dmp_register_tap_cb(void (*func)(unsigned char, unsigned char));
-int dmp_set_tap_thresh(unsigned char addr, unsigned char axis, unsigned short thresh);
-int dmp_set_tap_axes(unsigned char addr, unsigned char axis);
-int dmp_set_tap_count(unsigned char addr, unsigned char min_taps);
-int dmp_set_tap_time(unsigned char addr, unsigned short time);
-int dmp_set_tap_time_multi(unsigned char addr, unsigned short time);
-int dmp_set_shake_reject_thresh(unsigned char addr, long sf, unsigned short thresh);
-int dmp_set_shake_reject_time(unsigned char addr, unsigned short time);
-int dmp_set_shake_reject_timeout(unsigned char addr, unsigned short time);
+int dmp_register_tap_cb(struct mpu_state_s *st,
+    void (*func)(void *, unsigned char, unsigned char), void *arg);
+int dmp_set_tap_thresh(struct mpu_state_s *st, unsigned char axis, unsigned short thresh);
+int dmp_set_tap_axes(struct mpu_state_s *st, unsigned char axis);
+int dmp_set_tap_count(struct mpu_state_s *st, unsigned char min_taps);
+int dmp_set_tap_time(struct mpu_state_s *st, unsigned short time);
+int dmp_set_tap_time_multi(struct mpu_state_s *st, unsigned short time);
+int dmp_set_shake_reject_thresh(struct mpu_state_s *st, long sf, unsigned short thresh);
+int dmp_set_shake_reject_time(struct mpu_state_s *st, unsigned short time);
+int dmp_set_shake_reject_timeout(struct mpu_state_s *st, unsigned short time);
 
 /* Android orientation functions. */
-int dmp_register_android_orient_cb(void (*func)(unsigned char));
+int dmp_register_android_orient_cb(struct mpu_state_s *st,
+    void (*func)(void *, unsigned char), void *arg);
 
 /* LP quaternion functions. */
-int dmp_enable_lp_quat(unsigned char addr, unsigned char enable);
-int dmp_enable_6x_lp_quat(unsigned char addr, unsigned char enable);
+int dmp_enable_lp_quat(struct mpu_state_s *st, unsigned char enable);
+int dmp_enable_6x_lp_quat(struct mpu_state_s *st, unsigned char enable);
 
 /* Pedometer functions. */
-int dmp_get_pedometer_step_count(unsigned char addr, unsigned long *count);
-int dmp_set_pedometer_step_count(unsigned char addr, unsigned long count);
-int dmp_get_pedometer_walk_time(unsigned char addr, unsigned long *time);
-int dmp_set_pedometer_walk_time(unsigned char addr, unsigned long time);
+int dmp_get_pedometer_step_count(struct mpu_state_s *st, unsigned long *count);
+int dmp_set_pedometer_step_count(struct mpu_state_s *st, unsigned long count);
+int dmp_get_pedometer_walk_time(struct mpu_state_s *st, unsigned long *time);
+int dmp_set_pedometer_walk_time(struct mpu_state_s *st, unsigned long time);
 
 /* DMP gyro calibration functions. */
-int dmp_enable_gyro_cal(unsigned char addr, unsigned char enable);
+int dmp_enable_gyro_cal(struct mpu_state_s *st, unsigned char enable);
 
 /* Read function. This function should be called whenever the MPU interrupt is
  * detected.
  */
-int dmp_read_fifo(unsigned char addr, short *gyro, short *accel, long *quat,
+int dmp_read_fifo(struct mpu_state_s *st, short *gyro, short *accel, long *quat,
     unsigned long *timestamp, short *sensors, unsigned char *more);
+int dmp_read_fifo_batch(struct mpu_state_s *st, struct mpu_sample_s *samples,
+    unsigned short max_samples, unsigned short *count, unsigned short *more);
+int dmp_set_fifo_resync(struct mpu_state_s *st, unsigned char enable);
+int dmp_read_fifo_ring(struct mpu_state_s *st, struct mpu_ring_s *ring);
 
 #endif  /* #ifndef _INV_MPU_DMP_MOTION_DRIVER_H_ */
 
@@ -0,0 +1,60 @@
+/******************************************************************************
+linux_mpu9250_clk.c - MPU-9250 Digital Motion Processor Arduino Library 
+Timing functions for building the driver on a Linux host.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Linux (i2c-dev, spidev)
+******************************************************************************/
+#if defined(__linux__) && !defined(ARDUINO)
+
+#include "linux_mpu9250_clk.h"
+#include "inv_mpu.h"
+#include <time.h>
+
+int linux_get_clock_ms(unsigned long *count)
+{
+	struct timespec ts;
+	
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return -1;
+	*count = (unsigned long)ts.tv_sec * 1000UL + ts.tv_nsec / 1000000L;
+	return 0;
+}
+
+int linux_delay_ms(unsigned long num_ms)
+{
+	struct timespec ts;
+	
+	ts.tv_sec = num_ms / 1000;
+	ts.tv_nsec = (num_ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts))
+		;
+	return 0;
+}
+
+unsigned long long linux_clock_now_us(void * ctx)
+{
+	struct timespec ts;
+	
+	(void)ctx;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000L;
+}
+
+void linux_clock_delay_ms(void * ctx, unsigned long ms)
+{
+	(void)ctx;
+	linux_delay_ms(ms);
+}
+
+const struct mpu_clock_s linux_clock = {
+	linux_clock_now_us,
+	linux_clock_delay_ms,
+	0
+};
+
+#endif // __linux__ && !ARDUINO
@@ -0,0 +1,35 @@
+/******************************************************************************
+linux_mpu9250_clk.h - MPU-9250 Digital Motion Processor Arduino Library 
+Timing functions for building the driver on a Linux host.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Linux (i2c-dev, spidev)
+******************************************************************************/
+#ifndef _LINUX_MPU9250_CLK_H_
+#define _LINUX_MPU9250_CLK_H_
+
+#if defined(__cplusplus) 
+extern "C" {
+#endif
+
+int linux_get_clock_ms(unsigned long *count);
+int linux_delay_ms(unsigned long num_ms);
+
+struct mpu_clock_s;
+
+// Microseconds on CLOCK_MONOTONIC_RAW: not slewed by NTP, so sample
+// periods and drift are measured against the undisciplined oscillator.
+unsigned long long linux_clock_now_us(void * ctx);
+void linux_clock_delay_ms(void * ctx, unsigned long ms);
+// Clock over the above; the default for every device.
+extern const struct mpu_clock_s linux_clock;
+
+#if defined(__cplusplus) 
+}
+#endif
+
+#endif // _LINUX_MPU9250_CLK_H_
@@ -0,0 +1,94 @@
+/******************************************************************************
+linux_mpu9250_i2c.c - MPU-9250 Digital Motion Processor Arduino Library 
+Bus transport over a Linux i2c-dev adapter (/dev/i2c-N).
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Linux (i2c-dev)
+******************************************************************************/
+#if defined(__linux__) && !defined(ARDUINO)
+
+#include "linux_mpu9250_i2c.h"
+#include "inv_mpu.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+int linux_i2c_open(struct linux_i2c_s * dev, struct mpu_bus_s * bus,
+                   const char * path)
+{
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd < 0)
+		return -1;
+	
+	bus->write = linux_i2c_write;
+	bus->read = linux_i2c_read;
+	bus->max_transfer = LINUX_I2C_MAX_TRANSFER;
+	bus->ctx = dev;
+	return 0;
+}
+
+void linux_i2c_close(struct linux_i2c_s * dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+int linux_i2c_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                    unsigned short length, unsigned char const * data)
+{
+	struct linux_i2c_s * dev = (struct linux_i2c_s *)ctx;
+	unsigned char buf[LINUX_I2C_MAX_TRANSFER + 1];
+	struct i2c_msg msg;
+	struct i2c_rdwr_ioctl_data xfer;
+	
+	if (length > LINUX_I2C_MAX_TRANSFER)
+		return -1;
+	buf[0] = reg_addr;
+	if (length)
+		memcpy(buf + 1, data, length);
+	
+	msg.addr = slave_addr;
+	msg.flags = 0;
+	msg.len = length + 1;
+	msg.buf = buf;
+	xfer.msgs = &msg;
+	xfer.nmsgs = 1;
+	if (ioctl(dev->fd, I2C_RDWR, &xfer) != 1)
+		return -1;
+	return 0;
+}
+
+int linux_i2c_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                   unsigned short length, unsigned char * data)
+{
+	struct linux_i2c_s * dev = (struct linux_i2c_s *)ctx;
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+	
+	if (length > LINUX_I2C_MAX_TRANSFER)
+		return -1;
+	
+	msgs[0].addr = slave_addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &reg_addr;
+	msgs[1].addr = slave_addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = data;
+	xfer.msgs = msgs;
+	xfer.nmsgs = 2;
+	if (ioctl(dev->fd, I2C_RDWR, &xfer) != 2)
+		return -1;
+	return 0;
+}
+
+#endif // __linux__ && !ARDUINO
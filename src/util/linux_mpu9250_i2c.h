@@ -0,0 +1,47 @@
+/******************************************************************************
+linux_mpu9250_i2c.h - MPU-9250 Digital Motion Processor Arduino Library 
+Bus transport over a Linux i2c-dev adapter (/dev/i2c-N).
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Linux (i2c-dev)
+******************************************************************************/
+#ifndef _LINUX_MPU9250_I2C_H_
+#define _LINUX_MPU9250_I2C_H_
+
+#if defined(__cplusplus) 
+extern "C" {
+#endif
+
+struct mpu_bus_s;
+
+// Largest transfer handed to the adapter in one I2C_RDWR call. The whole
+// 1 kB FIFO fits in one read.
+#define LINUX_I2C_MAX_TRANSFER 1024
+
+struct linux_i2c_s {
+	int fd;
+};
+
+// linux_i2c_open -- Open an i2c-dev adapter and point bus at it.
+// Every register read is issued as a single I2C_RDWR call holding the
+// register-address write and the data read, joined by a repeated start.
+// Input: Adapter to open (e.g. "/dev/i2c-1")
+// Output: 0 on success, otherwise -1 (errno is set)
+int linux_i2c_open(struct linux_i2c_s * dev, struct mpu_bus_s * bus,
+                   const char * path);
+void linux_i2c_close(struct linux_i2c_s * dev);
+
+int linux_i2c_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                    unsigned short length, unsigned char const * data);
+int linux_i2c_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                   unsigned short length, unsigned char * data);
+
+#if defined(__cplusplus) 
+}
+#endif
+
+#endif // _LINUX_MPU9250_I2C_H_
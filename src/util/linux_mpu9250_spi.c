@@ -0,0 +1,211 @@
+/******************************************************************************
+linux_mpu9250_spi.c - MPU-9250 Digital Motion Processor Arduino Library 
+Bus transport over a Linux spidev device (/dev/spidevB.C).
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Linux (spidev)
+******************************************************************************/
+#if defined(__linux__) && !defined(ARDUINO)
+
+#include "linux_mpu9250_spi.h"
+#include "inv_mpu.h"
+#include "MPU9250_RegisterMap.h"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#define SPI_READ_FLAG       0x80
+#define BIT_I2C_IF_DIS      0x10
+#define BIT_I2C_MST_EN      0x20
+#define BIT_SLV4_EN         0x80
+#define BIT_SLV4_DONE       0x40
+#define BIT_SLV4_NACK       0x10
+#define BIT_I2C_READ        0x80
+// Slave 4 moves one byte in ~25 us at 400 kHz; give up after 10 ms.
+#define SLV4_POLL_US        100
+#define SLV4_POLL_TRIES     100
+
+static int spi_transfer(struct linux_spi_s * dev, unsigned char * tx,
+                        unsigned char * rx, unsigned short length,
+                        unsigned long speed_hz)
+{
+	struct spi_ioc_transfer xfer;
+	
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)tx;
+	xfer.rx_buf = (unsigned long)rx;
+	xfer.len = length;
+	xfer.speed_hz = speed_hz;
+	xfer.bits_per_word = 8;
+	if (ioctl(dev->fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+		return -1;
+	return 0;
+}
+
+// Registers the datasheet allows to be read at the fast SPI clock.
+static unsigned char is_fast_reg(unsigned char reg_addr)
+{
+	return (reg_addr >= MPU9250_INT_STATUS && reg_addr <= MPU9250_EXT_SENS_DATA_23) ||
+	       reg_addr == MPU9250_FIFO_R_W;
+}
+
+static int mpu_write(struct linux_spi_s * dev, unsigned char reg_addr,
+                     unsigned short length, unsigned char const * data)
+{
+	unsigned char buf[LINUX_SPI_MAX_TRANSFER + 1];
+	
+	if (length > LINUX_SPI_MAX_TRANSFER)
+		return -1;
+	buf[0] = reg_addr;
+	if (length)
+		memcpy(buf + 1, data, length);
+	// The I2C slave interface must stay disabled while the part is driven
+	// over SPI, whatever the driver writes to USER_CTRL.
+	if (reg_addr <= MPU9250_USER_CTRL && reg_addr + length > MPU9250_USER_CTRL)
+		buf[1 + MPU9250_USER_CTRL - reg_addr] |= BIT_I2C_IF_DIS;
+	return spi_transfer(dev, buf, buf, length + 1, LINUX_SPI_SLOW_HZ);
+}
+
+static int mpu_read(struct linux_spi_s * dev, unsigned char reg_addr,
+                    unsigned short length, unsigned char * data)
+{
+	unsigned char buf[LINUX_SPI_MAX_TRANSFER + 1];
+	
+	if (length > LINUX_SPI_MAX_TRANSFER)
+		return -1;
+	memset(buf, 0, length + 1);
+	buf[0] = reg_addr | SPI_READ_FLAG;
+	if (spi_transfer(dev, buf, buf, length + 1,
+	                 is_fast_reg(reg_addr) ? dev->fast_hz : LINUX_SPI_SLOW_HZ))
+		return -1;
+	memcpy(data, buf + 1, length);
+	return 0;
+}
+
+static int slv4_wait(struct linux_spi_s * dev)
+{
+	struct timespec ts = { 0, SLV4_POLL_US * 1000L };
+	unsigned char status;
+	int ii;
+	
+	for (ii = 0; ii < SLV4_POLL_TRIES; ii++) {
+		if (mpu_read(dev, MPU9250_I2C_MST_STATUS, 1, &status))
+			return -1;
+		if (status & BIT_SLV4_NACK)
+			return -1;
+		if (status & BIT_SLV4_DONE)
+			return 0;
+		nanosleep(&ts, NULL);
+	}
+	return -1;
+}
+
+// Run length single-byte transactions on the auxiliary bus through slave 4,
+// enabling the I2C master for the duration if the driver has it off.
+static int slv4_transfer(struct linux_spi_s * dev, unsigned char slave_addr,
+                         unsigned char reg_addr, unsigned short length,
+                         unsigned char * data, unsigned char read)
+{
+	unsigned char user_ctrl, tmp;
+	unsigned short ii;
+	int result = 0;
+	
+	if (mpu_read(dev, MPU9250_USER_CTRL, 1, &user_ctrl))
+		return -1;
+	if (!(user_ctrl & BIT_I2C_MST_EN)) {
+		tmp = user_ctrl | BIT_I2C_MST_EN;
+		if (mpu_write(dev, MPU9250_USER_CTRL, 1, &tmp))
+			return -1;
+	}
+	
+	tmp = slave_addr | (read ? BIT_I2C_READ : 0);
+	if (mpu_write(dev, MPU9250_I2C_SLV4_ADDR, 1, &tmp))
+		result = -1;
+	for (ii = 0; ii < length && !result; ii++) {
+		tmp = reg_addr + ii;
+		if (mpu_write(dev, MPU9250_I2C_SLV4_REG, 1, &tmp))
+			result = -1;
+		else if (!read && mpu_write(dev, MPU9250_I2C_SLV4_DO, 1, &data[ii]))
+			result = -1;
+		else {
+			tmp = BIT_SLV4_EN;
+			if (mpu_write(dev, MPU9250_I2C_SLV4_CTRL, 1, &tmp) || slv4_wait(dev))
+				result = -1;
+			else if (read && mpu_read(dev, MPU9250_I2C_SLV4_DI, 1, &data[ii]))
+				result = -1;
+		}
+	}
+	
+	if (!(user_ctrl & BIT_I2C_MST_EN)) {
+		if (mpu_write(dev, MPU9250_USER_CTRL, 1, &user_ctrl))
+			result = -1;
+	}
+	return result;
+}
+
+static unsigned char is_mpu_addr(unsigned char slave_addr)
+{
+	return slave_addr == 0x68 || slave_addr == 0x69;
+}
+
+int linux_spi_open(struct linux_spi_s * dev, struct mpu_bus_s * bus,
+                   const char * path, unsigned long fast_hz)
+{
+	unsigned char mode = SPI_MODE_3;
+	unsigned char bits = 8;
+	unsigned int speed = LINUX_SPI_SLOW_HZ;
+	
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd < 0)
+		return -1;
+	if (ioctl(dev->fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+	    ioctl(dev->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+	    ioctl(dev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+		linux_spi_close(dev);
+		return -1;
+	}
+	dev->fast_hz = fast_hz ? fast_hz : LINUX_SPI_SLOW_HZ;
+	
+	bus->write = linux_spi_write;
+	bus->read = linux_spi_read;
+	bus->max_transfer = LINUX_SPI_MAX_TRANSFER;
+	bus->ctx = dev;
+	return 0;
+}
+
+void linux_spi_close(struct linux_spi_s * dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+int linux_spi_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                    unsigned short length, unsigned char const * data)
+{
+	struct linux_spi_s * dev = (struct linux_spi_s *)ctx;
+	
+	if (is_mpu_addr(slave_addr))
+		return mpu_write(dev, reg_addr, length, data);
+	return slv4_transfer(dev, slave_addr, reg_addr, length,
+	                     (unsigned char *)data, 0);
+}
+
+int linux_spi_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                   unsigned short length, unsigned char * data)
+{
+	struct linux_spi_s * dev = (struct linux_spi_s *)ctx;
+	
+	if (is_mpu_addr(slave_addr))
+		return mpu_read(dev, reg_addr, length, data);
+	return slv4_transfer(dev, slave_addr, reg_addr, length, data, 1);
+}
+
+#endif // __linux__ && !ARDUINO
@@ -0,0 +1,56 @@
+/******************************************************************************
+linux_mpu9250_spi.h - MPU-9250 Digital Motion Processor Arduino Library 
+Bus transport over a Linux spidev device (/dev/spidevB.C).
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Linux (spidev)
+******************************************************************************/
+#ifndef _LINUX_MPU9250_SPI_H_
+#define _LINUX_MPU9250_SPI_H_
+
+#if defined(__cplusplus) 
+extern "C" {
+#endif
+
+struct mpu_bus_s;
+
+// Largest transfer handed to spidev in one message. The whole 1 kB FIFO
+// fits in one read.
+#define LINUX_SPI_MAX_TRANSFER 1024
+// The MPU-9250 accepts 1 MHz for every register, and up to 20 MHz when
+// reading the sensor, interrupt and FIFO registers.
+#define LINUX_SPI_SLOW_HZ 1000000
+#define LINUX_SPI_FAST_HZ 20000000
+
+struct linux_spi_s {
+	int fd;
+	unsigned long fast_hz;
+};
+
+// linux_spi_open -- Open a spidev device and point bus at it.
+// Register writes and configuration reads run at LINUX_SPI_SLOW_HZ; reads of
+// the sensor, interrupt status and FIFO registers run at fastHz.
+// SPI has no slave address: 0x68 and 0x69 both reach the MPU-9250. Any other
+// address (e.g. the AK8963) is relayed over the auxiliary I2C bus one byte at
+// a time through the MPU-9250's I2C master (slave 4), since bypass mode is
+// not available over SPI.
+// Input: Device to open (e.g. "/dev/spidev0.0"), clock for fast reads
+// Output: 0 on success, otherwise -1 (errno is set)
+int linux_spi_open(struct linux_spi_s * dev, struct mpu_bus_s * bus,
+                   const char * path, unsigned long fast_hz);
+void linux_spi_close(struct linux_spi_s * dev);
+
+int linux_spi_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                    unsigned short length, unsigned char const * data);
+int linux_spi_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                   unsigned short length, unsigned char * data);
+
+#if defined(__cplusplus) 
+}
+#endif
+
+#endif // _LINUX_MPU9250_SPI_H_
@@ -0,0 +1,147 @@
+/******************************************************************************
+mpu_convert.c - MPU-9250 Digital Motion Processor Arduino Library
+Batch conversion of raw 16-bit sensor values to physical units, as float or
+fixed point. Uses SSE2/AVX2 or NEON on hosts that have them, and the
+Cortex-M DSP extension where available.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#include "mpu_convert.h"
+#include <string.h>
+
+// The widest instruction set the compiler was told it may use. Each path
+// converts what it can in whole vectors and leaves the tail to the scalar
+// loop.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CONVERT_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONVERT_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#elif defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+#define CONVERT_DSP
+#endif
+
+void mpu_convert_float(const short *raw, float *out, unsigned long count,
+	float scale)
+{
+	unsigned long i = 0;
+
+#if defined(CONVERT_AVX2)
+	const __m256 s = _mm256_set1_ps(scale);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i r = _mm_loadu_si128((const __m128i *)(raw + i));
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(r));
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(f, s));
+	}
+#elif defined(CONVERT_SSE2)
+	const __m128 s = _mm_set1_ps(scale);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i r = _mm_loadu_si128((const __m128i *)(raw + i));
+		// Sign-extend by placing each value in the top half and shifting
+		// it back down.
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(r, r), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(r, r), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), s));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));
+	}
+#elif defined(CONVERT_NEON)
+	for (; i + 8 <= count; i += 8)
+	{
+		int16x8_t r = vld1q_s16(raw + i);
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(r)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(r)));
+		vst1q_f32(out + i, vmulq_n_f32(lo, scale));
+		vst1q_f32(out + i + 4, vmulq_n_f32(hi, scale));
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = raw[i] * scale;
+}
+
+void mpu_convert_fixed(const short *raw, long *out, unsigned long count,
+	long scale, unsigned char shift)
+{
+	const long long half = shift ? 1LL << (shift - 1) : 0;
+	unsigned long i = 0;
+
+#if defined(CONVERT_AVX2) && __SIZEOF_LONG__ == 8
+	// 64-bit products of the even lanes, then of the odd ones moved down.
+	// AVX2 has no 64-bit arithmetic shift: flip negative values around
+	// a logical one.
+	const __m256i s = _mm256_set1_epi32((int)scale);
+	const __m256i rnd = _mm256_set1_epi64x(half);
+	const __m128i sh = _mm_cvtsi32_si128(shift);
+	const __m256i zero = _mm256_setzero_si256();
+	if (scale == (int)scale)
+	{
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256i v = _mm256_cvtepi16_epi32(
+				_mm_loadu_si128((const __m128i *)(raw + i)));
+			__m256i even = _mm256_add_epi64(_mm256_mul_epi32(v, s), rnd);
+			__m256i odd = _mm256_add_epi64(
+				_mm256_mul_epi32(_mm256_srli_epi64(v, 32), s), rnd);
+			__m256i neg = _mm256_cmpgt_epi64(zero, even);
+			even = _mm256_xor_si256(_mm256_srl_epi64(
+				_mm256_xor_si256(even, neg), sh), neg);
+			neg = _mm256_cmpgt_epi64(zero, odd);
+			odd = _mm256_xor_si256(_mm256_srl_epi64(
+				_mm256_xor_si256(odd, neg), sh), neg);
+			// Interleave back to sample order: lanes 0,1 | 2,3 of each
+			// 128-bit half, then the halves in order.
+			__m256i a = _mm256_unpacklo_epi64(even, odd);
+			__m256i b = _mm256_unpackhi_epi64(even, odd);
+			_mm256_storeu_si256((__m256i *)(out + i),
+				_mm256_permute2x128_si256(a, b, 0x20));
+			_mm256_storeu_si256((__m256i *)(out + i + 4),
+				_mm256_permute2x128_si256(a, b, 0x31));
+		}
+	}
+#elif defined(CONVERT_NEON)
+	const int64x2_t sh = vdupq_n_s64(-(long long)shift);
+	if (scale == (int)scale)
+	{
+		for (; i + 4 <= count; i += 4)
+		{
+			int32x4_t v = vmovl_s16(vld1_s16(raw + i));
+			// Rounding shift right: a negative count shifts right.
+			int64x2_t lo = vrshlq_s64(vmull_n_s32(vget_low_s32(v), (int)scale), sh);
+			int64x2_t hi = vrshlq_s64(vmull_n_s32(vget_high_s32(v), (int)scale), sh);
+#if __SIZEOF_LONG__ == 8
+			vst1q_s64((int64_t *)(out + i), lo);
+			vst1q_s64((int64_t *)(out + i + 2), hi);
+#else
+			vst1q_s32((int32_t *)(out + i), vcombine_s32(vmovn_s64(lo), vmovn_s64(hi)));
+#endif
+		}
+	}
+#elif defined(CONVERT_DSP)
+	// Two 16x16 multiplies per word when the product needs no shift and
+	// the scale fits in 16 bits (accel and mag, see the class).
+	if (!shift && scale == (short)scale)
+	{
+		const int s = (unsigned short)scale;
+		for (; i + 2 <= count; i += 2)
+		{
+			int pair;
+			memcpy(&pair, raw + i, sizeof(pair));
+			out[i] = __smulbb(pair, s);
+			out[i + 1] = __smultb(pair, s);
+		}
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = (long)(((long long)raw[i] * scale + half) >> shift);
+}
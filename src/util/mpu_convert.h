@@ -0,0 +1,34 @@
+/******************************************************************************
+mpu_convert.h - MPU-9250 Digital Motion Processor Arduino Library
+Batch conversion of raw 16-bit sensor values to physical units, as float or
+fixed point. Uses SSE2/AVX2 or NEON on hosts that have them, and the
+Cortex-M DSP extension where available.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#ifndef _MPU_CONVERT_H_
+#define _MPU_CONVERT_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// out[i] = raw[i] * scale, for count values, e.g. N samples of 3 axes.
+void mpu_convert_float(const short *raw, float *out, unsigned long count,
+	float scale);
+
+// out[i] = raw[i] * scale / 2^shift, rounded, for count values. The product
+// is exact; the result must fit in a long.
+void mpu_convert_fixed(const short *raw, long *out, unsigned long count,
+	long scale, unsigned char shift);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _MPU_CONVERT_H_
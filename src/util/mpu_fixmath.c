@@ -0,0 +1,187 @@
+/******************************************************************************
+mpu_fixmath.c - MPU-9250 Digital Motion Processor Arduino Library
+Integer-only angle and quaternion math for targets without an FPU, such as
+the SAMD21 (Cortex-M0+): CORDIC atan2 and magnitude, Euler angles from Q30
+quaternions, and quaternion normalization.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#include "mpu_fixmath.h"
+
+// CORDIC steps. Each adds about one bit; after 18 the angle left over is
+// under 0.0005 degree.
+#define CORDIC_STEPS 18
+
+// atan(2^-i) in degrees, Q16.
+static const long cordic_atan[CORDIC_STEPS] = {
+	2949120, 1740967, 919879, 466945, 234379, 117304, 58666, 29335,
+	14668, 7334, 3667, 1833, 917, 458, 229, 115, 57, 29
+};
+
+// 1 / prod(sqrt(1 + 2^-2i)), the CORDIC gain undone, Q30.
+#define CORDIC_INV_GAIN 652032874L
+// pi / 180, Q30.
+#define DEG_TO_RAD_Q30  18740330L
+
+// Largest input magnitude the rotations start from. Leaves room for the
+// gain (1.65) and the first rotation (1.41) below 2^31.
+#define CORDIC_IN_MAX   (1L << 28)
+
+static unsigned long abs_long(long v)
+{
+	return v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+}
+
+long mpu_atan2_q16(long y, long x, long *mag)
+{
+	unsigned long big;
+	long angle, t;
+	int shift = 0;
+	unsigned char i;
+
+	big = abs_long(x) | abs_long(y);
+	if (!big)
+	{
+		if (mag)
+			*mag = 0;
+		return 0;
+	}
+	// Scale to just under CORDIC_IN_MAX, so that small inputs keep their
+	// precision and large ones cannot overflow.
+	while (big >= (unsigned long)CORDIC_IN_MAX)
+	{
+		big >>= 1;
+		shift++;
+	}
+	while (big < (unsigned long)CORDIC_IN_MAX / 2)
+	{
+		big <<= 1;
+		shift--;
+	}
+	if (shift > 0)
+	{
+		x >>= shift;
+		y >>= shift;
+	}
+	else
+	{
+		x = (long)((unsigned long)x << -shift);
+		y = (long)((unsigned long)y << -shift);
+	}
+
+	// Rotations converge for angles within about 99 degrees; start from
+	// the right half-plane.
+	angle = 0;
+	if (x < 0)
+	{
+		t = x;
+		if (y >= 0)
+		{
+			x = y;
+			y = -t;
+			angle = 90L << 16;
+		}
+		else
+		{
+			x = -y;
+			y = t;
+			angle = -(90L << 16);
+		}
+	}
+	for (i = 0; i < CORDIC_STEPS; i++)
+	{
+		t = x;
+		if (y > 0)
+		{
+			x += y >> i;
+			y -= t >> i;
+			angle += cordic_atan[i];
+		}
+		else
+		{
+			x -= y >> i;
+			y += t >> i;
+			angle -= cordic_atan[i];
+		}
+	}
+	if (angle <= -MPU_Q16_DEG_180)
+		angle += MPU_Q16_DEG_360;
+
+	if (mag)
+	{
+		t = (long)(((long long)x * CORDIC_INV_GAIN + (1L << 29)) >> 30);
+		if (shift > 0)
+			t <<= shift;
+		else if (shift < 0)
+			t = (t + (1L << (-shift - 1))) >> -shift;
+		*mag = t;
+	}
+	return angle;
+}
+
+long mpu_deg_to_rad_q16(long deg)
+{
+	return (long)(((long long)deg * DEG_TO_RAD_Q30 + (1L << 29)) >> 30);
+}
+
+// a * b for Q30 operands, rounded.
+static long long mul_q30(long long a, long long b)
+{
+	return (a * b + (1LL << 29)) >> 30;
+}
+
+int mpu_quat_normalize_q30(const long *quat, long *out)
+{
+	long long s, r, prev;
+	unsigned char i;
+
+	// Squared length, Q30.
+	s = 0;
+	for (i = 0; i < 4; i++)
+		s += ((long long)quat[i] * quat[i]) >> 30;
+	if (s < (1LL << 29) || s >= (1LL << 31))
+		return -1;
+
+	// Newton's iteration for 1 / sqrt(s) from 1: r = r * (3 - s r^2) / 2.
+	// DMP quaternions settle in two or three steps, the worst allowed
+	// input in six.
+	r = 1LL << 30;
+	for (i = 0; i < 8; i++)
+	{
+		prev = r;
+		r = mul_q30(r, (3LL << 30) - mul_q30(s, mul_q30(r, r))) >> 1;
+		if (r == prev)
+			break;
+	}
+
+	for (i = 0; i < 4; i++)
+		out[i] = (long)mul_q30(quat[i], r);
+	return 0;
+}
+
+void mpu_quat_to_euler_q16(const long *quat, long *euler)
+{
+	long long w = quat[0], x = quat[1], y = quat[2], z = quat[3];
+	long long t0, t1, t2, t3, t4;
+	long hyp;
+
+	// The terms of computeEulerAngles, Q30. Each is within [-1, 1] for a
+	// unit quaternion; Q28 keeps a little slack for one that is not.
+	t0 = (1LL << 30) - 2 * (mul_q30(y, y) + mul_q30(z, z));
+	t1 = 2 * (mul_q30(x, y) - mul_q30(w, z));
+	t2 = -2 * (mul_q30(x, z) + mul_q30(w, y));
+	t3 = 2 * (mul_q30(y, z) - mul_q30(w, x));
+	t4 = (1LL << 30) - 2 * (mul_q30(x, x) + mul_q30(y, y));
+
+	// t2, t3 and t4 are a row of a rotation matrix, so
+	// sqrt(t3^2 + t4^2) = sqrt(1 - t2^2) and asin(t2) is the angle of
+	// (hyp, t2). That needs no square root and is exact at +/-90 degrees.
+	euler[0] = mpu_atan2_q16((long)(t3 >> 2), (long)(t4 >> 2), &hyp);
+	euler[1] = mpu_atan2_q16((long)(t2 >> 2), hyp, 0);
+	euler[2] = mpu_atan2_q16((long)(t1 >> 2), (long)(t0 >> 2), 0);
+}
@@ -0,0 +1,48 @@
+/******************************************************************************
+mpu_fixmath.h - MPU-9250 Digital Motion Processor Arduino Library
+Integer-only angle and quaternion math for targets without an FPU, such as
+the SAMD21 (Cortex-M0+): CORDIC atan2 and magnitude, Euler angles from Q30
+quaternions, and quaternion normalization.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#ifndef _MPU_FIXMATH_H_
+#define _MPU_FIXMATH_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Angles are in degrees, Q16 (65536 = 1 degree), unless noted.
+#define MPU_Q16_DEG_180 (180L << 16)
+#define MPU_Q16_DEG_360 (360L << 16)
+
+// Angle of (x, y) in (-180, 180] degrees, Q16. Error is under 0.001
+// degree. Inputs may use any common scale; if mag is not NULL, it gets
+// sqrt(x^2 + y^2) in that same scale. Both zero gives 0.
+long mpu_atan2_q16(long y, long x, long *mag);
+
+// Convert a Q16 angle from degrees to radians (Q16).
+long mpu_deg_to_rad_q16(long deg);
+
+// Scale a Q30 quaternion {w, x, y, z} to unit length. Its squared length
+// must be within [0.5, 2), as DMP output always is.
+// Returns 0 on success, -1 if the input is out of range.
+int mpu_quat_normalize_q30(const long *quat, long *out);
+
+// Euler angles {roll, pitch, yaw} in degrees, Q16, from a Q30 quaternion
+// {w, x, y, z}, with the same axes and signs as
+// MPU9250_DMP::computeEulerAngles. Roll and yaw are in (-180, 180], pitch
+// in [-90, 90]. The quaternion need not be exactly unit length.
+void mpu_quat_to_euler_q16(const long *quat, long *euler);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _MPU_FIXMATH_H_
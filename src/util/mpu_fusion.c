@@ -0,0 +1,620 @@
+/******************************************************************************
+mpu_fusion.c - MPU-9250 Digital Motion Processor Arduino Library
+9-axis orientation on the host: Madgwick and Mahony filters fed with FIFO
+samples (accel, gyro and compass), in float or in integer math for targets
+without an FPU.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#include "mpu_fusion.h"
+#include "inv_mpu.h"
+#include "mpu_fixmath.h"
+#include <math.h>
+
+#define RAD_TO_DEG_F 57.29577951f
+#define ONE_Q30      (1LL << 30)
+
+// Both filters follow Madgwick's and Mahony's published algorithms. In
+// Madgwick's, the earth's field is taken as (bx, 0, bz) in the world
+// frame: the compass reading turned to the world, with its horizontal part
+// along X; the gradient uses half the Jacobian, as it is normalized
+// anyway. Mahony's corrects only the heading from the compass, which
+// keeps magnetic disturbances out of roll and pitch and converges much
+// faster from a wrong heading than the full field error would.
+
+// The AK8963's axes are the accel/gyro's with X and Y swapped and Z
+// reversed.
+static void mag_to_body(const short *compass, long *m)
+{
+	m[0] = compass[1];
+	m[1] = compass[0];
+	m[2] = -(long)compass[2];
+}
+
+// Microseconds since the previous sample, or 0 if there is no step to
+// take from it: the first sample, a repeated timestamp, or one out of
+// order or after a gap, which restart the settling time.
+static unsigned long elapsed_us(unsigned long long *last_us,
+	unsigned char *started, unsigned long *settle_us, unsigned long long now)
+{
+	unsigned long long prev = *last_us;
+
+	*last_us = now;
+	if (*started && now == prev)
+		return 0;
+	if (!*started || now < prev || now - prev > MPU_FUSION_MAX_GAP_US)
+	{
+		*started = 1;
+		*settle_us = MPU_FUSION_SETTLE_US;
+		return 0;
+	}
+	now -= prev;
+	*settle_us = *settle_us > now ? *settle_us - (unsigned long)now : 0;
+	return (unsigned long)now;
+}
+
+// Rotation matrix of q, body to world, row-major.
+static void quat_matrix_float(const float *q, float *r)
+{
+	float q01 = q[0] * q[1], q02 = q[0] * q[2], q03 = q[0] * q[3];
+	float q11 = q[1] * q[1], q12 = q[1] * q[2], q13 = q[1] * q[3];
+	float q22 = q[2] * q[2], q23 = q[2] * q[3], q33 = q[3] * q[3];
+
+	r[0] = 1.0f - 2.0f * (q22 + q33);
+	r[1] = 2.0f * (q12 - q03);
+	r[2] = 2.0f * (q13 + q02);
+	r[3] = 2.0f * (q12 + q03);
+	r[4] = 1.0f - 2.0f * (q11 + q33);
+	r[5] = 2.0f * (q23 - q01);
+	r[6] = 2.0f * (q13 - q02);
+	r[7] = 2.0f * (q23 + q01);
+	r[8] = 1.0f - 2.0f * (q11 + q22);
+}
+
+static int normalize_float(float *v, unsigned char n)
+{
+	float s = 0.0f;
+	unsigned char i;
+
+	for (i = 0; i < n; i++)
+		s += v[i] * v[i];
+	if (!(s > 0.0f))
+		return 0;
+	s = 1.0f / sqrtf(s);
+	for (i = 0; i < n; i++)
+		v[i] *= s;
+	return 1;
+}
+
+// The earth's field as the body should see it at orientation r, from the
+// compass reading m: R^T (bx, 0, bz), and bx and bz.
+static void earth_field_float(const float *r, const float *m, float *w,
+	float *bx, float *bz)
+{
+	float hx, hy;
+
+	hx = r[0] * m[0] + r[1] * m[1] + r[2] * m[2];
+	hy = r[3] * m[0] + r[4] * m[1] + r[5] * m[2];
+	*bz = r[6] * m[0] + r[7] * m[1] + r[8] * m[2];
+	*bx = sqrtf(hx * hx + hy * hy);
+	w[0] = *bx * r[0] + *bz * r[6];
+	w[1] = *bx * r[1] + *bz * r[7];
+	w[2] = *bx * r[2] + *bz * r[8];
+}
+
+// qd = q * (0, g) / 2, the rate of change of q at body rates g.
+static void quat_rate_float(const float *q, const float *g, float *qd)
+{
+	qd[0] = 0.5f * (-q[1] * g[0] - q[2] * g[1] - q[3] * g[2]);
+	qd[1] = 0.5f * (q[0] * g[0] + q[2] * g[2] - q[3] * g[1]);
+	qd[2] = 0.5f * (q[0] * g[1] - q[1] * g[2] + q[3] * g[0]);
+	qd[3] = 0.5f * (q[0] * g[2] + q[1] * g[1] - q[2] * g[0]);
+}
+
+static void quat_step_float(float *q, const float *qd, float dt)
+{
+	unsigned char i;
+
+	for (i = 0; i < 4; i++)
+		q[i] += qd[i] * dt;
+	normalize_float(q, 4);
+}
+
+static void madgwick_float(struct mpu_fusion_s *f, const float *g,
+	const float *a, const float *m, float dt, float gain)
+{
+	float *q = f->q;
+	float r[9], w[3], fg[3], fb[3], s[4], qd[4];
+	float bx, bz;
+	unsigned char i;
+
+	quat_rate_float(q, g, qd);
+	if (a)
+	{
+		quat_matrix_float(q, r);
+		// Gravity: estimated minus measured, and the gradient of its
+		// squared norm.
+		fg[0] = r[6] - a[0];
+		fg[1] = r[7] - a[1];
+		fg[2] = r[8] - a[2];
+		s[0] = -q[2] * fg[0] + q[1] * fg[1];
+		s[1] = q[3] * fg[0] + q[0] * fg[1] - 2.0f * q[1] * fg[2];
+		s[2] = -q[0] * fg[0] + q[3] * fg[1] - 2.0f * q[2] * fg[2];
+		s[3] = q[1] * fg[0] + q[2] * fg[1];
+		if (m)
+		{
+			earth_field_float(r, m, w, &bx, &bz);
+			for (i = 0; i < 3; i++)
+				fb[i] = w[i] - m[i];
+			s[0] += -bz * q[2] * fb[0] + (bz * q[1] - bx * q[3]) * fb[1] +
+				bx * q[2] * fb[2];
+			s[1] += bz * q[3] * fb[0] + (bx * q[2] + bz * q[0]) * fb[1] +
+				(bx * q[3] - 2.0f * bz * q[1]) * fb[2];
+			s[2] += (-2.0f * bx * q[2] - bz * q[0]) * fb[0] +
+				(bx * q[1] + bz * q[3]) * fb[1] +
+				(bx * q[0] - 2.0f * bz * q[2]) * fb[2];
+			s[3] += (bz * q[1] - 2.0f * bx * q[3]) * fb[0] +
+				(bz * q[2] - bx * q[0]) * fb[1] + bx * q[1] * fb[2];
+		}
+		if (normalize_float(s, 4))
+			for (i = 0; i < 4; i++)
+				qd[i] -= f->beta * gain * s[i];
+	}
+	quat_step_float(q, qd, dt);
+}
+
+static void mahony_float(struct mpu_fusion_s *f, const float *g,
+	const float *a, const float *m, float dt, float gain)
+{
+	float r[9], h[3], e[3], rate[3], qd[4];
+	float d;
+	unsigned char i;
+
+	for (i = 0; i < 3; i++)
+		rate[i] = g[i] + f->bias[i];
+	if (a)
+	{
+		quat_matrix_float(f->q, r);
+		// Error: the rotation from the estimated to the measured direction
+		// of gravity, plus, about the vertical only, from north to the
+		// horizontal part of the compass reading.
+		e[0] = a[1] * r[8] - a[2] * r[7];
+		e[1] = a[2] * r[6] - a[0] * r[8];
+		e[2] = a[0] * r[7] - a[1] * r[6];
+		if (m)
+		{
+			d = m[0] * r[6] + m[1] * r[7] + m[2] * r[8];
+			for (i = 0; i < 3; i++)
+				h[i] = m[i] - d * r[6 + i];
+			if (normalize_float(h, 3))
+			{
+				e[0] += h[1] * r[2] - h[2] * r[1];
+				e[1] += h[2] * r[0] - h[0] * r[2];
+				e[2] += h[0] * r[1] - h[1] * r[0];
+			}
+		}
+		for (i = 0; i < 3; i++)
+		{
+			// The bias is only learnt once the orientation has settled.
+			if (gain == 1.0f)
+				f->bias[i] += f->ki * e[i] * dt;
+			rate[i] += f->kp * gain * e[i];
+		}
+	}
+	quat_rate_float(f->q, rate, qd);
+	quat_step_float(f->q, qd, dt);
+}
+
+void mpu_fusion_init(struct mpu_fusion_s *f, unsigned char algorithm,
+	float gyro_scale)
+{
+	unsigned char i;
+
+	f->q[0] = 1.0f;
+	f->q[1] = f->q[2] = f->q[3] = 0.0f;
+	for (i = 0; i < 3; i++)
+		f->bias[i] = f->mag[i] = 0.0f;
+	f->beta = MPU_FUSION_BETA;
+	f->kp = MPU_FUSION_KP;
+	f->ki = MPU_FUSION_KI;
+	f->gyro_scale = gyro_scale;
+	f->last_us = 0;
+	f->settle_us = 0;
+	f->algorithm = algorithm;
+	f->started = 0;
+	f->have_mag = 0;
+}
+
+unsigned short mpu_fusion_update(struct mpu_fusion_s *f,
+	const struct mpu_sample_s *samples, unsigned short count)
+{
+	const struct mpu_sample_s *s;
+	float g[3], a[3], m[3], dt, gain;
+	const float *pa;
+	long raw[3];
+	unsigned long us;
+	unsigned short n, used = 0;
+	unsigned char i;
+
+	for (n = 0; n < count; n++)
+	{
+		s = &samples[n];
+		if (s->sensors & INV_XYZ_COMPASS)
+		{
+			mag_to_body(s->compass, raw);
+			for (i = 0; i < 3; i++)
+				m[i] = (float)raw[i];
+			if (normalize_float(m, 3))
+			{
+				for (i = 0; i < 3; i++)
+					f->mag[i] = m[i];
+				f->have_mag = 1;
+			}
+		}
+		if ((s->sensors & INV_XYZ_GYRO) != INV_XYZ_GYRO)
+			continue;
+		us = elapsed_us(&f->last_us, &f->started, &f->settle_us,
+			s->timestamp_us);
+		if (!us)
+			continue;
+
+		dt = us * 1e-6f;
+		gain = f->settle_us ? (float)MPU_FUSION_SETTLE_GAIN : 1.0f;
+		for (i = 0; i < 3; i++)
+		{
+			g[i] = s->gyro[i] * f->gyro_scale;
+			a[i] = s->accel[i];
+		}
+		pa = (s->sensors & INV_XYZ_ACCEL) && normalize_float(a, 3) ? a : 0;
+		if (f->algorithm == MPU_FUSION_MAHONY)
+			mahony_float(f, g, pa, f->have_mag ? f->mag : 0, dt, gain);
+		else
+			madgwick_float(f, g, pa, f->have_mag ? f->mag : 0, dt, gain);
+		used++;
+	}
+	return used;
+}
+
+void mpu_fusion_get_quat(const struct mpu_fusion_s *f, long *quat)
+{
+	unsigned char i;
+
+	for (i = 0; i < 4; i++)
+		quat[i] = (long)(f->q[i] * 1073741824.0f);
+}
+
+float mpu_fusion_heading(const struct mpu_fusion_s *f)
+{
+	const float *q = f->q;
+	float h;
+
+	// Yaw, counterclockwise from north, negated.
+	h = -RAD_TO_DEG_F * atan2f(2.0f * (q[0] * q[3] + q[1] * q[2]),
+		1.0f - 2.0f * (q[2] * q[2] + q[3] * q[3]));
+	if (h < 0.0f)
+		h += 360.0f;
+	if (h >= 360.0f)
+		h -= 360.0f;
+	return h;
+}
+
+// Integer filter. Quaternions, matrices and vectors are Q30 in long long,
+// which leaves room for sums of products; rates are rad/s Q24 and time
+// steps seconds Q24.
+
+// a * b for Q30 operands, rounded.
+static long long mul_q30(long long a, long long b)
+{
+	return (a * b + (1LL << 29)) >> 30;
+}
+
+// 1 / sqrt(s) for s > 0, both Q30.
+static long long rsqrt_q30(long long s)
+{
+	long long r, prev;
+	int shift = 0;
+	unsigned char i;
+
+	// Bring s into [0.5, 2) by powers of four, where Newton's iteration
+	// converges in a few steps from the guesses below, and undo that on
+	// the result by powers of two.
+	while (s >= (2LL << 30))
+	{
+		s >>= 2;
+		shift++;
+	}
+	while (s < (1LL << 29))
+	{
+		s <<= 2;
+		shift--;
+	}
+	r = s < ONE_Q30 ? 1288490189LL : 858993459LL;
+	for (i = 0; i < 8; i++)
+	{
+		prev = r;
+		r = mul_q30(r, (3LL << 30) - mul_q30(s, mul_q30(r, r))) >> 1;
+		if (r == prev)
+			break;
+	}
+	return shift >= 0 ? r >> shift : r << -shift;
+}
+
+// Scale v, of any common scale, to unit length Q30 in out. Returns 0 if
+// v is zero.
+static int normalize_fixed(const long long *v, unsigned char n, long *out)
+{
+	unsigned long long big = 0;
+	long long t[4], s, r;
+	int shift = 0;
+	unsigned char i;
+
+	for (i = 0; i < n; i++)
+		big |= v[i] < 0 ? 0ULL - (unsigned long long)v[i] :
+			(unsigned long long)v[i];
+	if (!big)
+		return 0;
+	// Largest component to [0.5, 1), so the squares neither overflow nor
+	// lose precision.
+	while (big >= (1ULL << 30))
+	{
+		big >>= 1;
+		shift++;
+	}
+	while (big < (1ULL << 29))
+	{
+		big <<= 1;
+		shift--;
+	}
+	s = 0;
+	for (i = 0; i < n; i++)
+	{
+		t[i] = shift >= 0 ? v[i] >> shift :
+			(long long)((unsigned long long)v[i] << -shift);
+		s += mul_q30(t[i], t[i]);
+	}
+	r = rsqrt_q30(s);
+	for (i = 0; i < n; i++)
+		out[i] = (long)mul_q30(t[i], r);
+	return 1;
+}
+
+static void quat_matrix_fixed(const long long *q, long long *r)
+{
+	long long q01 = mul_q30(q[0], q[1]), q02 = mul_q30(q[0], q[2]);
+	long long q03 = mul_q30(q[0], q[3]), q11 = mul_q30(q[1], q[1]);
+	long long q12 = mul_q30(q[1], q[2]), q13 = mul_q30(q[1], q[3]);
+	long long q22 = mul_q30(q[2], q[2]), q23 = mul_q30(q[2], q[3]);
+	long long q33 = mul_q30(q[3], q[3]);
+
+	r[0] = ONE_Q30 - 2 * (q22 + q33);
+	r[1] = 2 * (q12 - q03);
+	r[2] = 2 * (q13 + q02);
+	r[3] = 2 * (q12 + q03);
+	r[4] = ONE_Q30 - 2 * (q11 + q33);
+	r[5] = 2 * (q23 - q01);
+	r[6] = 2 * (q13 - q02);
+	r[7] = 2 * (q23 + q01);
+	r[8] = ONE_Q30 - 2 * (q11 + q22);
+}
+
+static void earth_field_fixed(const long long *r, const long long *m,
+	long long *w, long long *bx, long long *bz)
+{
+	long long hx, hy, s;
+
+	hx = mul_q30(r[0], m[0]) + mul_q30(r[1], m[1]) + mul_q30(r[2], m[2]);
+	hy = mul_q30(r[3], m[0]) + mul_q30(r[4], m[1]) + mul_q30(r[5], m[2]);
+	*bz = mul_q30(r[6], m[0]) + mul_q30(r[7], m[1]) + mul_q30(r[8], m[2]);
+	s = mul_q30(hx, hx) + mul_q30(hy, hy);
+	*bx = s > 0 ? mul_q30(s, rsqrt_q30(s)) : 0;
+	w[0] = mul_q30(*bx, r[0]) + mul_q30(*bz, r[6]);
+	w[1] = mul_q30(*bx, r[1]) + mul_q30(*bz, r[7]);
+	w[2] = mul_q30(*bx, r[2]) + mul_q30(*bz, r[8]);
+}
+
+// Rate of change of q (Q30 per second) at body rates g (Q24).
+static void quat_rate_fixed(const long long *q, const long long *g,
+	long long *qd)
+{
+	const long long half = 1LL << 24;
+
+	qd[0] = (-q[1] * g[0] - q[2] * g[1] - q[3] * g[2] + half) >> 25;
+	qd[1] = (q[0] * g[0] + q[2] * g[2] - q[3] * g[1] + half) >> 25;
+	qd[2] = (q[0] * g[1] - q[1] * g[2] + q[3] * g[0] + half) >> 25;
+	qd[3] = (q[0] * g[2] + q[1] * g[1] - q[2] * g[0] + half) >> 25;
+}
+
+static void quat_step_fixed(struct mpu_fusion_fixed_s *f, long long *q,
+	const long long *qd, long long dt)
+{
+	unsigned char i;
+
+	for (i = 0; i < 4; i++)
+		q[i] += (qd[i] * dt + (1LL << 23)) >> 24;
+	normalize_fixed(q, 4, f->q);
+}
+
+static void madgwick_fixed(struct mpu_fusion_fixed_s *f, const long long *g,
+	const long long *a, const long long *m, long long dt, long gain)
+{
+	long long q[4], r[9], w[3], fg[3], fb[3], s[4], qd[4];
+	long long bx, bz;
+	long shat[4];
+	unsigned char i;
+
+	for (i = 0; i < 4; i++)
+		q[i] = f->q[i];
+	quat_rate_fixed(q, g, qd);
+	if (a)
+	{
+		quat_matrix_fixed(q, r);
+		for (i = 0; i < 3; i++)
+			fg[i] = r[6 + i] - a[i];
+		s[0] = -mul_q30(q[2], fg[0]) + mul_q30(q[1], fg[1]);
+		s[1] = mul_q30(q[3], fg[0]) + mul_q30(q[0], fg[1]) -
+			2 * mul_q30(q[1], fg[2]);
+		s[2] = -mul_q30(q[0], fg[0]) + mul_q30(q[3], fg[1]) -
+			2 * mul_q30(q[2], fg[2]);
+		s[3] = mul_q30(q[1], fg[0]) + mul_q30(q[2], fg[1]);
+		if (m)
+		{
+			earth_field_fixed(r, m, w, &bx, &bz);
+			for (i = 0; i < 3; i++)
+				fb[i] = w[i] - m[i];
+			s[0] += -mul_q30(mul_q30(bz, q[2]), fb[0]) +
+				mul_q30(mul_q30(bz, q[1]) - mul_q30(bx, q[3]), fb[1]) +
+				mul_q30(mul_q30(bx, q[2]), fb[2]);
+			s[1] += mul_q30(mul_q30(bz, q[3]), fb[0]) +
+				mul_q30(mul_q30(bx, q[2]) + mul_q30(bz, q[0]), fb[1]) +
+				mul_q30(mul_q30(bx, q[3]) - 2 * mul_q30(bz, q[1]), fb[2]);
+			s[2] += mul_q30(-2 * mul_q30(bx, q[2]) - mul_q30(bz, q[0]), fb[0]) +
+				mul_q30(mul_q30(bx, q[1]) + mul_q30(bz, q[3]), fb[1]) +
+				mul_q30(mul_q30(bx, q[0]) - 2 * mul_q30(bz, q[2]), fb[2]);
+			s[3] += mul_q30(mul_q30(bz, q[1]) - 2 * mul_q30(bx, q[3]), fb[0]) +
+				mul_q30(mul_q30(bz, q[2]) - mul_q30(bx, q[0]), fb[1]) +
+				mul_q30(mul_q30(bx, q[1]), fb[2]);
+		}
+		if (normalize_fixed(s, 4, shat))
+			for (i = 0; i < 4; i++)
+				qd[i] -= ((long long)f->beta * gain * shat[i] + (1LL << 15)) >> 16;
+	}
+	quat_step_fixed(f, q, qd, dt);
+}
+
+static void mahony_fixed(struct mpu_fusion_fixed_s *f, const long long *g,
+	const long long *a, const long long *m, long long dt, long gain)
+{
+	long long q[4], r[9], h[3], e[3], rate[3], qd[4];
+	long long d;
+	long hu[3];
+	unsigned char i;
+
+	for (i = 0; i < 4; i++)
+		q[i] = f->q[i];
+	for (i = 0; i < 3; i++)
+		rate[i] = g[i] + (f->bias[i] >> 6);
+	if (a)
+	{
+		quat_matrix_fixed(q, r);
+		e[0] = mul_q30(a[1], r[8]) - mul_q30(a[2], r[7]);
+		e[1] = mul_q30(a[2], r[6]) - mul_q30(a[0], r[8]);
+		e[2] = mul_q30(a[0], r[7]) - mul_q30(a[1], r[6]);
+		if (m)
+		{
+			d = mul_q30(m[0], r[6]) + mul_q30(m[1], r[7]) + mul_q30(m[2], r[8]);
+			for (i = 0; i < 3; i++)
+				h[i] = m[i] - mul_q30(d, r[6 + i]);
+			if (normalize_fixed(h, 3, hu))
+			{
+				e[0] += mul_q30(hu[1], r[2]) - mul_q30(hu[2], r[1]);
+				e[1] += mul_q30(hu[2], r[0]) - mul_q30(hu[0], r[2]);
+				e[2] += mul_q30(hu[0], r[1]) - mul_q30(hu[1], r[0]);
+			}
+		}
+		for (i = 0; i < 3; i++)
+		{
+			if (gain == 1)
+				f->bias[i] += ((((long long)f->ki * e[i]) >> 16) * dt) >> 24;
+			rate[i] += ((long long)f->kp * gain * e[i]) >> 22;
+		}
+	}
+	quat_rate_fixed(q, rate, qd);
+	quat_step_fixed(f, q, qd, dt);
+}
+
+void mpu_fusion_init_fixed(struct mpu_fusion_fixed_s *f,
+	unsigned char algorithm, long gyro_scale)
+{
+	unsigned char i;
+
+	f->q[0] = 1L << 30;
+	f->q[1] = f->q[2] = f->q[3] = 0;
+	for (i = 0; i < 3; i++)
+	{
+		f->bias[i] = 0;
+		f->mag[i] = 0;
+	}
+	f->beta = MPU_FUSION_BETA_Q16;
+	f->kp = MPU_FUSION_KP_Q16;
+	f->ki = MPU_FUSION_KI_Q16;
+	f->gyro_scale = gyro_scale;
+	f->last_us = 0;
+	f->settle_us = 0;
+	f->algorithm = algorithm;
+	f->started = 0;
+	f->have_mag = 0;
+}
+
+unsigned short mpu_fusion_update_fixed(struct mpu_fusion_fixed_s *f,
+	const struct mpu_sample_s *samples, unsigned short count)
+{
+	const struct mpu_sample_s *s;
+	long long g[3], v[3], a[3], m[3], dt;
+	const long long *pa;
+	long raw[3], unit[3], gain;
+	unsigned long us;
+	unsigned short n, used = 0;
+	unsigned char i;
+
+	for (n = 0; n < count; n++)
+	{
+		s = &samples[n];
+		if (s->sensors & INV_XYZ_COMPASS)
+		{
+			mag_to_body(s->compass, raw);
+			for (i = 0; i < 3; i++)
+				v[i] = raw[i];
+			if (normalize_fixed(v, 3, f->mag))
+				f->have_mag = 1;
+		}
+		if ((s->sensors & INV_XYZ_GYRO) != INV_XYZ_GYRO)
+			continue;
+		us = elapsed_us(&f->last_us, &f->started, &f->settle_us,
+			s->timestamp_us);
+		if (!us)
+			continue;
+
+		// 2^44 / 10^6: microseconds to seconds, Q24.
+		dt = (long long)(((unsigned long long)us * 17592186ULL) >> 20);
+		gain = f->settle_us ? MPU_FUSION_SETTLE_GAIN : 1;
+		for (i = 0; i < 3; i++)
+		{
+			g[i] = ((long long)s->gyro[i] * f->gyro_scale + 32) >> 6;
+			v[i] = s->accel[i];
+			m[i] = f->mag[i];
+		}
+		pa = 0;
+		if ((s->sensors & INV_XYZ_ACCEL) && normalize_fixed(v, 3, unit))
+		{
+			for (i = 0; i < 3; i++)
+				a[i] = unit[i];
+			pa = a;
+		}
+		if (f->algorithm == MPU_FUSION_MAHONY)
+			mahony_fixed(f, g, pa, f->have_mag ? m : 0, dt, gain);
+		else
+			madgwick_fixed(f, g, pa, f->have_mag ? m : 0, dt, gain);
+		used++;
+	}
+	return used;
+}
+
+long mpu_fusion_heading_fixed(const struct mpu_fusion_fixed_s *f)
+{
+	const long *q = f->q;
+	long long y, x;
+	long h;
+
+	y = 2 * (mul_q30(q[0], q[3]) + mul_q30(q[1], q[2]));
+	x = ONE_Q30 - 2 * (mul_q30(q[2], q[2]) + mul_q30(q[3], q[3]));
+	// Q28, so that +/-1 fits.
+	h = -mpu_atan2_q16((long)(y >> 2), (long)(x >> 2), 0);
+	if (h < 0)
+		h += MPU_Q16_DEG_360;
+	return h;
+}
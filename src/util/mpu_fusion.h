@@ -0,0 +1,117 @@
+/******************************************************************************
+mpu_fusion.h - MPU-9250 Digital Motion Processor Arduino Library
+9-axis orientation on the host: Madgwick and Mahony filters fed with FIFO
+samples (accel, gyro and compass), in float or in integer math for targets
+without an FPU.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#ifndef _MPU_FUSION_H_
+#define _MPU_FUSION_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct mpu_sample_s;
+
+#define MPU_FUSION_MADGWICK 0
+#define MPU_FUSION_MAHONY   1
+
+// Default gains, rad/s: Madgwick's beta, Mahony's proportional and
+// integral gains. Float and Q16.
+#define MPU_FUSION_BETA         0.1f
+#define MPU_FUSION_KP           0.5f
+#define MPU_FUSION_KI           0.02f
+#define MPU_FUSION_BETA_Q16     6554L
+#define MPU_FUSION_KP_Q16       32768L
+#define MPU_FUSION_KI_Q16       1311L
+
+// For this long after the first sample, and after a gap in the samples,
+// the gains are raised MPU_FUSION_SETTLE_GAIN times so the orientation
+// converges in a few seconds from any start.
+#define MPU_FUSION_SETTLE_US    3000000UL
+#define MPU_FUSION_SETTLE_GAIN  10
+// Samples further apart than this are not integrated across: the filter
+// restarts its settling from the next one.
+#define MPU_FUSION_MAX_GAP_US   500000UL
+
+// Orientations are quaternions {w, x, y, z} from the body (accel/gyro
+// axes) to the world frame: X towards magnetic north, Y west, Z up. The
+// same convention as util/mpu_orient.h, whose functions accept them in
+// Q30. Without compass readings, X is wherever the gyros take it.
+
+// Float filter state.
+struct mpu_fusion_s {
+	float q[4];
+	// Gyro bias learnt by Mahony's integral term, rad/s.
+	float bias[3];
+	// Latest compass reading as a unit vector in body axes, reused for
+	// the samples that come between readings.
+	float mag[3];
+	// Gains, rad/s: beta (Madgwick), kp and ki (Mahony).
+	float beta, kp, ki;
+	// rad/s per gyro LSB.
+	float gyro_scale;
+	unsigned long long last_us;
+	// Time left at raised gains.
+	unsigned long settle_us;
+	unsigned char algorithm;
+	unsigned char started;
+	unsigned char have_mag;
+};
+
+// Integer filter state. Quaternion and vectors are Q30.
+struct mpu_fusion_fixed_s {
+	long q[4];
+	long long bias[3];
+	long mag[3];
+	// Gains, rad/s, Q16.
+	long beta, kp, ki;
+	// rad/s per gyro LSB, Q30.
+	long gyro_scale;
+	unsigned long long last_us;
+	unsigned long settle_us;
+	unsigned char algorithm;
+	unsigned char started;
+	unsigned char have_mag;
+};
+
+// Start a filter at the identity orientation with the default gains, which
+// may be changed in the state afterwards.
+// Input: MPU_FUSION_MADGWICK or MPU_FUSION_MAHONY, and the gyro's rad/s per
+//        LSB for its full-scale range
+void mpu_fusion_init(struct mpu_fusion_s *f, unsigned char algorithm,
+	float gyro_scale);
+void mpu_fusion_init_fixed(struct mpu_fusion_fixed_s *f,
+	unsigned char algorithm, long gyro_scale);
+
+// Fuse count samples, oldest first, as read from the FIFO (raw or DMP).
+// Each step spans the time since the previous sample (timestamp_us), so
+// any sample rate up to 1 kHz works, and lost packets are bridged. Samples
+// without the three gyro axes are skipped; accel and compass readings
+// correct the orientation when present.
+// Returns the number of samples that advanced the orientation.
+unsigned short mpu_fusion_update(struct mpu_fusion_s *f,
+	const struct mpu_sample_s *samples, unsigned short count);
+unsigned short mpu_fusion_update_fixed(struct mpu_fusion_fixed_s *f,
+	const struct mpu_sample_s *samples, unsigned short count);
+
+// Orientation as a Q30 quaternion {w, x, y, z}.
+void mpu_fusion_get_quat(const struct mpu_fusion_s *f, long *quat);
+
+// Tilt-compensated heading of the body X axis, clockwise from magnetic
+// north, in [0, 360) degrees (Q16 for the integer filter).
+float mpu_fusion_heading(const struct mpu_fusion_s *f);
+long mpu_fusion_heading_fixed(const struct mpu_fusion_fixed_s *f);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _MPU_FUSION_H_
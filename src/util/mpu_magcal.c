@@ -0,0 +1,411 @@
+/******************************************************************************
+mpu_magcal.c - MPU-9250 Digital Motion Processor Arduino Library
+Online hard- and soft-iron calibration of the magnetometer: readings are
+folded into a fixed set of sums as they arrive, and an ellipsoid is fitted
+to them on demand.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#include "mpu_magcal.h"
+#include <math.h>
+#include <string.h>
+
+// Readings are scaled down by this much before they are summed, so the
+// fourth powers of a 50 uT field stay near 1.
+#define MAGCAL_SCALE      256.0f
+
+// A fit is accepted when the readings spread at least this much along
+// their narrowest direction, as a share of their total variance: a full
+// sphere of orientations gives 1/3, a hemisphere 1/9, turning about a
+// single axis 0.
+#define MIN_SPREAD_ELLIPSOID  0.15
+#define MIN_SPREAD_SPHERE     0.03
+// Longest over shortest axis of a plausible ellipsoid. Soft iron distorts
+// by tens of percent at most; more means the fit is chasing noise.
+#define MAX_AXIS_RATIO        2.0
+
+// Both fits are linear least squares over the readings. The normal
+// equations only involve sums of products of up to four coordinates, which
+// is what is kept; the readings themselves never are. The ellipsoid is
+//     a x^2 + b y^2 + c z^2 + 2d xy + 2e xz + 2f yz + 2g x + 2h y + 2i z = 1
+// and the sphere
+//     x^2 + y^2 + z^2 = 2 cx x + 2 cy y + 2 cz z + k.
+
+// Position of the sum of x^i y^j z^k in moment[]: by degree, then by
+// falling power of x, then of y.
+static int moment_index(int i, int j, int k)
+{
+	int d = i + j + k;
+
+	return d * (d + 1) * (d + 2) / 6 + (d - i) * (d - i + 1) / 2 + (d - i - j);
+}
+
+static double moment(const struct mpu_magcal_s *cal, int i, int j, int k)
+{
+	return cal->moment[moment_index(i, j, k)];
+}
+
+// Solve the n x n system a x = b in place by Gaussian elimination with
+// partial pivoting; x is left in b. Returns -1 if a is near singular.
+static int solve(double *a, double *b, int n)
+{
+	int row, col, k, pivot;
+	double scale = 0, t;
+
+	for (k = 0; k < n; k++)
+		if (fabs(a[k * n + k]) > scale)
+			scale = fabs(a[k * n + k]);
+	for (col = 0; col < n; col++)
+	{
+		pivot = col;
+		for (row = col + 1; row < n; row++)
+			if (fabs(a[row * n + col]) > fabs(a[pivot * n + col]))
+				pivot = row;
+		if (fabs(a[pivot * n + col]) <= scale * 1e-12)
+			return -1;
+		if (pivot != col)
+		{
+			for (k = col; k < n; k++)
+			{
+				t = a[col * n + k];
+				a[col * n + k] = a[pivot * n + k];
+				a[pivot * n + k] = t;
+			}
+			t = b[col];
+			b[col] = b[pivot];
+			b[pivot] = t;
+		}
+		for (row = col + 1; row < n; row++)
+		{
+			t = a[row * n + col] / a[col * n + col];
+			for (k = col; k < n; k++)
+				a[row * n + k] -= t * a[col * n + k];
+			b[row] -= t * b[col];
+		}
+	}
+	for (row = n - 1; row >= 0; row--)
+	{
+		t = b[row];
+		for (k = row + 1; k < n; k++)
+			t -= a[row * n + k] * b[k];
+		b[row] = t / a[row * n + row];
+	}
+	return 0;
+}
+
+// Eigenvalues d and eigenvectors (the columns of v) of the symmetric 3x3
+// matrix a, by Jacobi rotations. a is destroyed.
+static void eigen3(double *a, double *d, double *v)
+{
+	int sweep, p, q, k;
+	double theta, t, c, s, x, y;
+
+	for (k = 0; k < 9; k++)
+		v[k] = (k % 4) ? 0 : 1;
+	for (sweep = 0; sweep < 20; sweep++)
+	{
+		if (fabs(a[1]) + fabs(a[2]) + fabs(a[5]) <=
+			1e-15 * (fabs(a[0]) + fabs(a[4]) + fabs(a[8])))
+			break;
+		for (p = 0; p < 2; p++)
+			for (q = p + 1; q < 3; q++)
+			{
+				if (a[p * 3 + q] == 0)
+					continue;
+				theta = (a[q * 3 + q] - a[p * 3 + p]) / (2 * a[p * 3 + q]);
+				t = 1 / (fabs(theta) + sqrt(theta * theta + 1));
+				if (theta < 0)
+					t = -t;
+				c = 1 / sqrt(t * t + 1);
+				s = t * c;
+				for (k = 0; k < 3; k++)
+				{
+					x = a[k * 3 + p];
+					y = a[k * 3 + q];
+					a[k * 3 + p] = c * x - s * y;
+					a[k * 3 + q] = s * x + c * y;
+				}
+				for (k = 0; k < 3; k++)
+				{
+					x = a[p * 3 + k];
+					y = a[q * 3 + k];
+					a[p * 3 + k] = c * x - s * y;
+					a[q * 3 + k] = s * x + c * y;
+				}
+				for (k = 0; k < 3; k++)
+				{
+					x = v[k * 3 + p];
+					y = v[k * 3 + q];
+					v[k * 3 + p] = c * x - s * y;
+					v[k * 3 + q] = s * x + c * y;
+				}
+			}
+	}
+	for (k = 0; k < 3; k++)
+		d[k] = a[k * 4];
+}
+
+// Variance of the readings along their narrowest direction, over their
+// total variance.
+static double min_spread(const struct mpu_magcal_s *cal)
+{
+	static const unsigned char e[6][3] = {
+		{2, 0, 0}, {1, 1, 0}, {1, 0, 1}, {0, 2, 0}, {0, 1, 1}, {0, 0, 2}
+	};
+	static const unsigned char at[9] = {0, 1, 2, 1, 3, 4, 2, 4, 5};
+	double n = cal->moment[0], mean[3], cov[9], d[3], v[9], m[6];
+	int k;
+
+	mean[0] = moment(cal, 1, 0, 0) / n;
+	mean[1] = moment(cal, 0, 1, 0) / n;
+	mean[2] = moment(cal, 0, 0, 1) / n;
+	for (k = 0; k < 6; k++)
+		m[k] = moment(cal, e[k][0], e[k][1], e[k][2]) / n;
+	for (k = 0; k < 9; k++)
+		cov[k] = m[at[k]] - mean[k / 3] * mean[k % 3];
+	eigen3(cov, d, v);
+	if (d[0] + d[1] + d[2] <= 0)
+		return 0;
+	k = d[1] < d[0] ? 1 : 0;
+	if (d[2] < d[k])
+		k = 2;
+	return d[k] / (d[0] + d[1] + d[2]);
+}
+
+// Exponents and factors of the ellipsoid's terms.
+static const unsigned char ellipsoid_terms[9][3] = {
+	{2, 0, 0}, {0, 2, 0}, {0, 0, 2}, {1, 1, 0}, {1, 0, 1}, {0, 1, 1},
+	{1, 0, 0}, {0, 1, 0}, {0, 0, 1}
+};
+
+static void ellipsoid_normal(const struct mpu_magcal_s *cal, double *a,
+	double *b)
+{
+	const unsigned char (*e)[3] = ellipsoid_terms;
+	int p, q;
+
+	for (p = 0; p < 9; p++)
+	{
+		double fp = p < 3 ? 1 : 2;
+
+		b[p] = fp * moment(cal, e[p][0], e[p][1], e[p][2]);
+		for (q = 0; q < 9; q++)
+			a[p * 9 + q] = fp * (q < 3 ? 1 : 2) * moment(cal,
+				e[p][0] + e[q][0], e[p][1] + e[q][1], e[p][2] + e[q][2]);
+	}
+}
+
+static int fit_ellipsoid(const struct mpu_magcal_s *cal,
+	struct mpu_magcal_fit_s *fit)
+{
+	double a[81], b[9], p[9], quad[9], center[3], d[3], v[9], w[9];
+	double res, k, radius, r, rmin, rmax, n = cal->moment[0];
+	int i, j;
+
+	if (min_spread(cal) < MIN_SPREAD_ELLIPSOID)
+		return -1;
+	ellipsoid_normal(cal, a, b);
+	memcpy(p, b, sizeof(p));
+	if (solve(a, p, 9))
+		return -1;
+	// Fit residual from the sums: p'Ap - 2p'b + n.
+	ellipsoid_normal(cal, a, b);
+	res = n;
+	for (i = 0; i < 9; i++)
+	{
+		double ap = 0;
+
+		for (j = 0; j < 9; j++)
+			ap += a[i * 9 + j] * p[j];
+		res += p[i] * (ap - 2 * b[i]);
+	}
+
+	// Center: where the gradient vanishes, Q c = -(g, h, i).
+	quad[0] = p[0];
+	quad[4] = p[1];
+	quad[8] = p[2];
+	quad[1] = quad[3] = p[3];
+	quad[2] = quad[6] = p[4];
+	quad[5] = quad[7] = p[5];
+	memcpy(a, quad, sizeof(quad));
+	for (i = 0; i < 3; i++)
+		center[i] = -p[6 + i];
+	if (solve(a, center, 3))
+		return -1;
+	// About the center the surface is x' (Q / k) x = 1 with k = 1 + c' Q c;
+	// both Q and k are negative when the origin lies outside it.
+	k = 1;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			k += center[i] * quad[i * 3 + j] * center[j];
+	if (k == 0)
+		return -1;
+	for (i = 0; i < 9; i++)
+		quad[i] /= k;
+	eigen3(quad, d, v);
+	if (d[0] <= 0 || d[1] <= 0 || d[2] <= 0)
+		return -1;
+
+	// The correction is the symmetric square root of Q, scaled to
+	// determinant 1: it maps the ellipsoid onto a sphere whose radius is
+	// the geometric mean of the semi-axes.
+	rmin = rmax = 1 / sqrt(d[0]);
+	radius = rmin;
+	for (i = 1; i < 3; i++)
+	{
+		r = 1 / sqrt(d[i]);
+		radius *= r;
+		if (r < rmin)
+			rmin = r;
+		if (r > rmax)
+			rmax = r;
+	}
+	if (rmax > rmin * MAX_AXIS_RATIO)
+		return -1;
+	radius = pow(radius, 1.0 / 3);
+	for (i = 0; i < 3; i++)
+		d[i] = sqrt(d[i]) * radius;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			w[i * 3 + j] = v[i * 3] * d[0] * v[j * 3] +
+				v[i * 3 + 1] * d[1] * v[j * 3 + 1] +
+				v[i * 3 + 2] * d[2] * v[j * 3 + 2];
+
+	for (i = 0; i < 3; i++)
+		fit->offset[i] = (float)(center[i] * MAGCAL_SCALE);
+	for (i = 0; i < 9; i++)
+		fit->matrix[i] = (float)w[i];
+	fit->field = (float)(radius * MAGCAL_SCALE);
+	// Each residual is k (x' A x - 1), about 2k times the relative distance
+	// from the surface.
+	fit->error = (float)(sqrt(res > 0 ? res / n : 0) / (2 * fabs(k)));
+	fit->model = MPU_MAGCAL_ELLIPSOID;
+	return 0;
+}
+
+static int fit_sphere(const struct mpu_magcal_s *cal,
+	struct mpu_magcal_fit_s *fit)
+{
+	static const unsigned char e[4][3] = {
+		{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, {0, 0, 0}
+	};
+	double a[16], b[4], s[4], res, r2, n = cal->moment[0];
+	int i, j;
+
+	if (min_spread(cal) < MIN_SPREAD_SPHERE)
+		return -1;
+	// Rows (2x, 2y, 2z, 1) against x^2 + y^2 + z^2.
+	for (i = 0; i < 4; i++)
+	{
+		double fi = i < 3 ? 2 : 1;
+
+		b[i] = fi * (moment(cal, e[i][0] + 2, e[i][1], e[i][2]) +
+			moment(cal, e[i][0], e[i][1] + 2, e[i][2]) +
+			moment(cal, e[i][0], e[i][1], e[i][2] + 2));
+		for (j = 0; j < 4; j++)
+			a[i * 4 + j] = fi * (j < 3 ? 2 : 1) * moment(cal,
+				e[i][0] + e[j][0], e[i][1] + e[j][1], e[i][2] + e[j][2]);
+	}
+	memcpy(s, b, sizeof(s));
+	if (solve(a, s, 4))
+		return -1;
+	r2 = s[3] + s[0] * s[0] + s[1] * s[1] + s[2] * s[2];
+	if (r2 <= 0)
+		return -1;
+
+	// Residual s'As - 2s'b + sum of (x^2 + y^2 + z^2)^2; a was reduced by
+	// the solve, so its products are taken from the sums again.
+	res = moment(cal, 4, 0, 0) + moment(cal, 0, 4, 0) + moment(cal, 0, 0, 4) +
+		2 * (moment(cal, 2, 2, 0) + moment(cal, 2, 0, 2) +
+		moment(cal, 0, 2, 2));
+	for (i = 0; i < 4; i++)
+	{
+		double as = 0;
+
+		for (j = 0; j < 4; j++)
+			as += (i < 3 ? 2 : 1) * (j < 3 ? 2 : 1) * moment(cal,
+				e[i][0] + e[j][0], e[i][1] + e[j][1], e[i][2] + e[j][2]) * s[j];
+		res += s[i] * (as - 2 * b[i]);
+	}
+
+	for (i = 0; i < 3; i++)
+		fit->offset[i] = (float)(s[i] * MAGCAL_SCALE);
+	for (i = 0; i < 9; i++)
+		fit->matrix[i] = (i % 4) ? 0.0f : 1.0f;
+	fit->field = (float)(sqrt(r2) * MAGCAL_SCALE);
+	// Each residual is about 2 r^2 times the relative distance.
+	fit->error = (float)(sqrt(res > 0 ? res / n : 0) / (2 * r2));
+	fit->model = MPU_MAGCAL_SPHERE;
+	return 0;
+}
+
+void mpu_magcal_init(struct mpu_magcal_s *cal)
+{
+	memset(cal, 0, sizeof(*cal));
+}
+
+void mpu_magcal_add(struct mpu_magcal_s *cal, const short *reading)
+{
+	float px[5], py[5], pz[5];
+	int d, i, j, n;
+
+	px[0] = py[0] = pz[0] = 1;
+	px[1] = reading[0] * (1 / MAGCAL_SCALE);
+	py[1] = reading[1] * (1 / MAGCAL_SCALE);
+	pz[1] = reading[2] * (1 / MAGCAL_SCALE);
+	for (i = 2; i < 5; i++)
+	{
+		px[i] = px[i - 1] * px[1];
+		py[i] = py[i - 1] * py[1];
+		pz[i] = pz[i - 1] * pz[1];
+	}
+	if (cal->moment[0] >= MPU_MAGCAL_MAX_SAMPLES)
+		for (n = 0; n < MPU_MAGCAL_MOMENTS; n++)
+			cal->moment[n] *= 0.5f;
+	// Same order as moment_index().
+	n = 0;
+	for (d = 0; d <= 4; d++)
+		for (i = d; i >= 0; i--)
+			for (j = d - i; j >= 0; j--)
+				cal->moment[n++] += px[i] * py[j] * pz[d - i - j];
+}
+
+int mpu_magcal_solve(const struct mpu_magcal_s *cal,
+	struct mpu_magcal_fit_s *fit)
+{
+	if (cal->moment[0] < MPU_MAGCAL_MIN_SAMPLES)
+		return -1;
+	if (!fit_ellipsoid(cal, fit) || !fit_sphere(cal, fit))
+		return 0;
+	return -1;
+}
+
+int mpu_magcal_compose(struct mpu_magcal_fit_s *fit, const float *offset,
+	const float *matrix)
+{
+	// new (m (r - o) - o2) = new m (r - o - m^-1 o2)
+	double a[9], b[3], w[9];
+	int i, j;
+
+	for (i = 0; i < 9; i++)
+		a[i] = matrix[i];
+	for (i = 0; i < 3; i++)
+		b[i] = fit->offset[i];
+	if (solve(a, b, 3))
+		return -1;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			w[i * 3 + j] = fit->matrix[i * 3] * matrix[j] +
+				fit->matrix[i * 3 + 1] * matrix[3 + j] +
+				fit->matrix[i * 3 + 2] * matrix[6 + j];
+	for (i = 0; i < 3; i++)
+		fit->offset[i] = (float)(offset[i] + b[i]);
+	for (i = 0; i < 9; i++)
+		fit->matrix[i] = (float)w[i];
+	return 0;
+}
@@ -0,0 +1,78 @@
+/******************************************************************************
+mpu_magcal.h - MPU-9250 Digital Motion Processor Arduino Library
+Online hard- and soft-iron calibration of the magnetometer: readings are
+folded into a fixed set of sums as they arrive, and an ellipsoid is fitted
+to them on demand.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#ifndef _MPU_MAGCAL_H_
+#define _MPU_MAGCAL_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Sums kept: one per monomial x^i y^j z^k with i + j + k <= 4.
+#define MPU_MAGCAL_MOMENTS      35
+// Readings needed before a fit. Once the sums hold MPU_MAGCAL_MAX_SAMPLES
+// they are halved, so they stay within float precision and the oldest
+// readings fade out.
+#define MPU_MAGCAL_MIN_SAMPLES  100
+#define MPU_MAGCAL_MAX_SAMPLES  4096
+
+// Model fitted: none, a sphere (hard iron only), or an ellipsoid (hard and
+// soft iron). The sphere needs fewer orientations, and is used when the
+// readings do not pin an ellipsoid down.
+#define MPU_MAGCAL_NONE         0
+#define MPU_MAGCAL_SPHERE       1
+#define MPU_MAGCAL_ELLIPSOID    2
+
+struct mpu_magcal_s {
+	// Sums over the readings, scaled down by 256, in order of degree;
+	// moment[0] is the number of readings.
+	float moment[MPU_MAGCAL_MOMENTS];
+};
+
+// A correction: corrected = matrix * (reading - offset).
+struct mpu_magcal_fit_s {
+	// Hard-iron offset, in hardware units.
+	float offset[3];
+	// Soft-iron matrix, row-major, of determinant 1, so the corrected
+	// readings keep the sensor's scale.
+	float matrix[9];
+	// Strength of the field after correction, in hardware units.
+	float field;
+	// RMS distance of the readings from the fitted surface, as a fraction
+	// of the field. Under 0.01 for a good fit.
+	float error;
+	unsigned char model;
+};
+
+void mpu_magcal_init(struct mpu_magcal_s *cal);
+
+// Fold one compass reading {x, y, z} into the sums.
+void mpu_magcal_add(struct mpu_magcal_s *cal, const short *reading);
+
+// Fit the readings gathered so far. Tries an ellipsoid, then a sphere.
+// Returns 0 on success, -1 if there are too few readings or they cover
+// too few orientations for either model.
+int mpu_magcal_solve(const struct mpu_magcal_s *cal,
+	struct mpu_magcal_fit_s *fit);
+
+// Turn a fit of readings that were already corrected with offset and
+// matrix into one for the uncorrected readings, by combining the two.
+// Returns 0 on success, -1 (fit unchanged) if matrix is singular.
+int mpu_magcal_compose(struct mpu_magcal_fit_s *fit, const float *offset,
+	const float *matrix);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _MPU_MAGCAL_H_
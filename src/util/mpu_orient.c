@@ -0,0 +1,203 @@
+/******************************************************************************
+mpu_orient.c - MPU-9250 Digital Motion Processor Arduino Library
+Batch conversion of Q30 quaternions, such as the DMP's, to Euler angles,
+rotation matrices, gravity vectors and tilt angles. Float only, with a
+choice of accuracy for the trigonometry.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#include "mpu_orient.h"
+#include <math.h>
+
+// Constants are float: nothing here is promoted to double.
+#define Q30_TO_FLOAT    (1.0f / 1073741824.0f)
+#define RAD_TO_DEG_F    57.29577951f
+
+// atan(k / 128) in degrees, k = 0..128.
+#define ATAN_TABLE_STEPS 128
+static const float atan_table[ATAN_TABLE_STEPS + 1] = {
+	0.0f, 0.4476142f, 0.8951737f, 1.342624f, 1.789911f, 2.236979f,
+	2.683775f, 3.130245f, 3.576334f, 4.02199f, 4.467159f, 4.911788f,
+	5.355825f, 5.799218f, 6.241914f, 6.683864f, 7.125016f, 7.565321f,
+	8.004729f, 8.443191f, 8.880659f, 9.317086f, 9.752425f, 10.18663f,
+	10.61966f, 11.05146f, 11.48199f, 11.91122f, 12.33909f, 12.76557f,
+	13.19061f, 13.61418f, 14.03624f, 14.45676f, 14.87568f, 15.29299f,
+	15.70864f, 16.1226f, 16.53484f, 16.94532f, 17.35402f, 17.76091f,
+	18.16596f, 18.56913f, 18.97041f, 19.36976f, 19.76717f, 20.1626f,
+	20.55605f, 20.94747f, 21.33686f, 21.72419f, 22.10945f, 22.49261f,
+	22.87367f, 23.25259f, 23.62938f, 24.00401f, 24.37647f, 24.74675f,
+	25.11483f, 25.48072f, 25.84439f, 26.20583f, 26.56505f, 26.92203f,
+	27.27676f, 27.62925f, 27.97947f, 28.32744f, 28.67315f, 29.01658f,
+	29.35775f, 29.69665f, 30.03328f, 30.36764f, 30.69972f, 31.02954f,
+	31.35709f, 31.68237f, 32.00538f, 32.32614f, 32.64464f, 32.96089f,
+	33.27489f, 33.58665f, 33.89617f, 34.20346f, 34.50852f, 34.81137f,
+	35.11201f, 35.41045f, 35.70669f, 36.00075f, 36.29263f, 36.58234f,
+	36.8699f, 37.1553f, 37.43857f, 37.71971f, 37.99873f, 38.27565f,
+	38.55047f, 38.8232f, 39.09386f, 39.36246f, 39.62901f, 39.89352f,
+	40.156f, 40.41647f, 40.67494f, 40.93142f, 41.18593f, 41.43847f,
+	41.68906f, 41.93771f, 42.18444f, 42.42926f, 42.67218f, 42.91322f,
+	43.15239f, 43.3897f, 43.62517f, 43.8588f, 44.09062f, 44.32064f,
+	44.54886f, 44.77531f, 45.0f
+};
+
+// atan(r) in degrees, for r in [0, 1].
+static float atan_unit(float r, unsigned char accuracy)
+{
+	float z, p;
+	int k;
+
+	if (accuracy == MPU_ORIENT_LUT)
+	{
+		p = r * ATAN_TABLE_STEPS;
+		k = (int)p;
+		if (k >= ATAN_TABLE_STEPS)
+			k = ATAN_TABLE_STEPS - 1;
+		p -= k;
+		return atan_table[k] + p * (atan_table[k + 1] - atan_table[k]);
+	}
+	// Abramowitz & Stegun 4.4.47, error under 1e-5 rad.
+	z = r * r;
+	p = 0.9998660f + z * (-0.3302995f + z * (0.1801410f +
+		z * (-0.0851330f + z * 0.0208351f)));
+	return r * p * RAD_TO_DEG_F;
+}
+
+// atan2(y, x) in degrees.
+static float angle(float y, float x, unsigned char accuracy)
+{
+	float ax, ay, a;
+
+	if (accuracy == MPU_ORIENT_EXACT)
+		return atan2f(y, x) * RAD_TO_DEG_F;
+
+	ax = fabsf(x);
+	ay = fabsf(y);
+	if (ax == 0.0f && ay == 0.0f)
+		return 0.0f;
+	// Fold into the first octant, where the argument is at most 1.
+	if (ay <= ax)
+		a = atan_unit(ay / ax, accuracy);
+	else
+		a = 90.0f - atan_unit(ax / ay, accuracy);
+	if (x < 0.0f)
+		a = 180.0f - a;
+	return y < 0.0f ? -a : a;
+}
+
+void mpu_quat_to_euler(const long *quat, float *euler, unsigned long count,
+	unsigned char accuracy)
+{
+	float w, x, y, z, t0, t1, t2, t3, t4;
+	unsigned long i;
+
+	for (i = 0; i < count; i++, quat += 4, euler += 3)
+	{
+		w = quat[0] * Q30_TO_FLOAT;
+		x = quat[1] * Q30_TO_FLOAT;
+		y = quat[2] * Q30_TO_FLOAT;
+		z = quat[3] * Q30_TO_FLOAT;
+
+		t0 = 1.0f - 2.0f * (y * y + z * z);
+		t1 = 2.0f * (x * y - w * z);
+		t2 = -2.0f * (x * z + w * y);
+		t3 = 2.0f * (y * z - w * x);
+		t4 = 1.0f - 2.0f * (x * x + y * y);
+
+		euler[0] = angle(t3, t4, accuracy);
+		if (accuracy == MPU_ORIENT_EXACT)
+		{
+			if (t2 > 1.0f)
+				t2 = 1.0f;
+			else if (t2 < -1.0f)
+				t2 = -1.0f;
+			euler[1] = asinf(t2) * RAD_TO_DEG_F;
+		}
+		else
+		{
+			// t2, t3 and t4 are a row of a rotation matrix, so asin(t2) is
+			// the angle of (sqrt(t3^2 + t4^2), t2).
+			euler[1] = angle(t2, sqrtf(t3 * t3 + t4 * t4), accuracy);
+		}
+		euler[2] = angle(t1, t0, accuracy);
+	}
+}
+
+void mpu_quat_to_matrix(const long *quat, float *matrix, unsigned long count)
+{
+	float w, x, y, z;
+	unsigned long i;
+
+	for (i = 0; i < count; i++, quat += 4, matrix += 9)
+	{
+		w = quat[0] * Q30_TO_FLOAT;
+		x = quat[1] * Q30_TO_FLOAT;
+		y = quat[2] * Q30_TO_FLOAT;
+		z = quat[3] * Q30_TO_FLOAT;
+
+		matrix[0] = 1.0f - 2.0f * (y * y + z * z);
+		matrix[1] = 2.0f * (x * y - w * z);
+		matrix[2] = 2.0f * (x * z + w * y);
+		matrix[3] = 2.0f * (x * y + w * z);
+		matrix[4] = 1.0f - 2.0f * (x * x + z * z);
+		matrix[5] = 2.0f * (y * z - w * x);
+		matrix[6] = 2.0f * (x * z - w * y);
+		matrix[7] = 2.0f * (y * z + w * x);
+		matrix[8] = 1.0f - 2.0f * (x * x + y * y);
+	}
+}
+
+void mpu_quat_to_gravity(const long *quat, float *gravity,
+	unsigned long count)
+{
+	float w, x, y, z;
+	unsigned long i;
+
+	// The bottom row of the rotation matrix: world Z seen from the body.
+	for (i = 0; i < count; i++, quat += 4, gravity += 3)
+	{
+		w = quat[0] * Q30_TO_FLOAT;
+		x = quat[1] * Q30_TO_FLOAT;
+		y = quat[2] * Q30_TO_FLOAT;
+		z = quat[3] * Q30_TO_FLOAT;
+
+		gravity[0] = 2.0f * (x * z - w * y);
+		gravity[1] = 2.0f * (y * z + w * x);
+		gravity[2] = 1.0f - 2.0f * (x * x + y * y);
+	}
+}
+
+void mpu_quat_to_tilt(const long *quat, float *tilt, unsigned long count,
+	unsigned char accuracy)
+{
+	float w, x, y, z, gx, gy, gz;
+	unsigned long i;
+
+	for (i = 0; i < count; i++, quat += 4)
+	{
+		w = quat[0] * Q30_TO_FLOAT;
+		x = quat[1] * Q30_TO_FLOAT;
+		y = quat[2] * Q30_TO_FLOAT;
+		z = quat[3] * Q30_TO_FLOAT;
+
+		gx = 2.0f * (x * z - w * y);
+		gy = 2.0f * (y * z + w * x);
+		gz = 1.0f - 2.0f * (x * x + y * y);
+		if (accuracy == MPU_ORIENT_EXACT)
+		{
+			if (gz > 1.0f)
+				gz = 1.0f;
+			else if (gz < -1.0f)
+				gz = -1.0f;
+			tilt[i] = acosf(gz) * RAD_TO_DEG_F;
+		}
+		else
+		{
+			tilt[i] = angle(sqrtf(gx * gx + gy * gy), gz, accuracy);
+		}
+	}
+}
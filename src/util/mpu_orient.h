@@ -0,0 +1,55 @@
+/******************************************************************************
+mpu_orient.h - MPU-9250 Digital Motion Processor Arduino Library
+Batch conversion of Q30 quaternions, such as the DMP's, to Euler angles,
+rotation matrices, gravity vectors and tilt angles. Float only, with a
+choice of accuracy for the trigonometry.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#ifndef _MPU_ORIENT_H_
+#define _MPU_ORIENT_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Accuracy of the angles computed below.
+// Exact: atan2f/asinf from the C library.
+#define MPU_ORIENT_EXACT    0
+// Polynomial: under 0.001 degree error, no library calls but sqrtf.
+#define MPU_ORIENT_POLY     1
+// Table: linear interpolation in a 129-entry arctangent table, under
+// 0.001 degree error.
+#define MPU_ORIENT_LUT      2
+
+// Quaternions are count x 4 Q30 values {w, x, y, z}, packed.
+
+// Euler angles {roll, pitch, yaw} in degrees per quaternion, with the axes
+// and signs of MPU9250_DMP::computeEulerAngles: roll and yaw in
+// (-180, 180], pitch in [-90, 90] (not doubled or wrapped to [0, 360)).
+void mpu_quat_to_euler(const long *quat, float *euler, unsigned long count,
+	unsigned char accuracy);
+
+// 3x3 rotation matrix per quaternion, row-major, from body to world frame.
+void mpu_quat_to_matrix(const long *quat, float *matrix, unsigned long count);
+
+// Direction of gravity in the body frame per quaternion, {x, y, z} in g:
+// what a still accelerometer would read.
+void mpu_quat_to_gravity(const long *quat, float *gravity,
+	unsigned long count);
+
+// Angle between the body Z axis and vertical per quaternion, in degrees
+// [0, 180].
+void mpu_quat_to_tilt(const long *quat, float *tilt, unsigned long count,
+	unsigned char accuracy);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _MPU_ORIENT_H_
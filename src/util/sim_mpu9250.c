@@ -0,0 +1,643 @@
+/******************************************************************************
+sim_mpu9250.c - MPU-9250 Digital Motion Processor Arduino Library
+In-memory simulated MPU-9250 and AK8963, usable as a bus transport so the
+driver can be exercised, measured and regression-tested without hardware.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#include "sim_mpu9250.h"
+#include "inv_mpu.h"
+#include "MPU9250_RegisterMap.h"
+#include <string.h>
+
+#define SIM_MAX_TRANSFER        1024
+#define MPU9250_DMP_INT_STATUS  0x39
+
+#define BIT_RESET               0x80
+#define BIT_SLEEP               0x40
+#define BIT_DMP_EN              0x80
+#define BIT_FIFO_EN             0x40
+#define BIT_I2C_MST_EN          0x20
+#define BIT_FIFO_RST            0x04
+#define BIT_SIG_COND_RST        0x01
+#define USER_CTRL_RESET_BITS    0x0F
+#define BIT_FIFO_MODE           0x40
+#define BITS_FIFO_SIZE          0xC0
+#define BIT_BYPASS_EN           0x02
+#define BIT_ANY_RD_CLR          0x10
+#define BIT_INT_DMP             0x02
+#define BIT_INT_FIFO_OVERFLOW   0x10
+#define BIT_INT_RAW_RDY         0x01
+#define BIT_SLV3_FIFO_EN        0x20
+#define BIT_SLV4_DONE           0x40
+#define BIT_SLV4_NACK           0x10
+#define BIT_SLAVE_EN            0x80
+#define BITS_SLAVE_LENGTH       0x0F
+#define BIT_I2C_READ            0x80
+#define BIT_FIFO_TEMP           0x80
+#define BIT_FIFO_XG             0x40
+#define BIT_FIFO_YG             0x20
+#define BIT_FIFO_ZG             0x10
+#define BIT_FIFO_ACCEL          0x08
+
+#define AK8963_BIT_DRDY         0x01
+#define AK8963_BIT_DOR          0x02
+#define AK8963_BIT_16BIT        0x10
+#define AK8963_BIT_SRST         0x01
+#define AK8963_MODE_MASK        0x0F
+#define AK8963_MODE_SINGLE      0x01
+#define AK8963_MODE_CONT_8HZ    0x02
+#define AK8963_MODE_CONT_100HZ  0x06
+#define AK8963_MODE_FUSE_ROM    0x0F
+#define AK8963_ASA_DEFAULT      128
+
+// DMP memory holding the FIFO rate divider (D_0_22 in the DMP driver).
+#define DMP_FIFO_DIV_ADDR       (22 + 512)
+#define DMP_SAMPLE_RATE         200
+
+static void sim_reset(struct sim_mpu9250_s * sim)
+{
+	memset(sim->regs, 0, sizeof(sim->regs));
+	sim->regs[MPU9250_PWR_MGMT_1] = 0x01;
+	sim->regs[MPU9250_WHO_AM_I] = MPU9250_WHO_AM_I_RESULT;
+	sim->mem_ptr = 0;
+	sim->fifo_head = 0;
+	sim->fifo_count = 0;
+	sim->sample_phase_us = 0;
+}
+
+static void ak_reset(struct sim_mpu9250_s * sim)
+{
+	unsigned char asa[3];
+
+	memcpy(asa, &sim->ak_regs[AK8963_ASAX], sizeof(asa));
+	memset(sim->ak_regs, 0, sizeof(sim->ak_regs));
+	memcpy(&sim->ak_regs[AK8963_ASAX], asa, sizeof(asa));
+	sim->ak_regs[AK8963_WIA] = AK8963_WHO_AM_I_RESULT;
+}
+
+void sim_mpu9250_init(struct sim_mpu9250_s * sim, struct mpu_bus_s * bus,
+                      unsigned char addr)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->addr = addr;
+	sim_reset(sim);
+	sim->ak_regs[AK8963_ASAX] = AK8963_ASA_DEFAULT;
+	sim->ak_regs[AK8963_ASAY] = AK8963_ASA_DEFAULT;
+	sim->ak_regs[AK8963_ASAZ] = AK8963_ASA_DEFAULT;
+	ak_reset(sim);
+	// Resting flat: 1 g on Z at the default +/-2 g range.
+	sim->accel[2] = 16384;
+
+	bus->write = sim_mpu9250_write;
+	bus->read = sim_mpu9250_read;
+	bus->max_transfer = SIM_MAX_TRANSFER;
+	bus->ctx = sim;
+}
+
+void sim_mpu9250_set_trace(struct sim_mpu9250_s * sim, const unsigned char * packets,
+                           unsigned short packet_length, unsigned long num_packets)
+{
+	sim->trace = packets;
+	sim->trace_packet_length = packet_length;
+	sim->trace_packets = num_packets;
+	sim->trace_pos = 0;
+}
+
+void sim_mpu9250_set_clock(struct sim_mpu9250_s * sim, unsigned long (*clock_us)(void))
+{
+	sim->clock_us = clock_us;
+	if (clock_us)
+		sim->clock_last_us = clock_us();
+}
+
+static unsigned long long sim_clock_now_us(void * ctx)
+{
+	return ((struct sim_mpu9250_s *)ctx)->time_us;
+}
+
+static void sim_clock_delay_ms(void * ctx, unsigned long ms)
+{
+	sim_mpu9250_advance((struct sim_mpu9250_s *)ctx, ms * 1000UL);
+}
+
+void sim_mpu9250_clock_init(struct sim_mpu9250_s * sim, struct mpu_clock_s * clock)
+{
+	clock->now_us = sim_clock_now_us;
+	clock->delay_ms = sim_clock_delay_ms;
+	clock->ctx = sim;
+}
+
+// Catch up with the attached clock, if any.
+static void sync_clock(struct sim_mpu9250_s * sim)
+{
+	unsigned long now;
+
+	if (!sim->clock_us)
+		return;
+	now = sim->clock_us();
+	sim_mpu9250_advance(sim, now - sim->clock_last_us);
+	sim->clock_last_us = now;
+}
+
+void sim_mpu9250_reset_stats(struct sim_mpu9250_s * sim)
+{
+	memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+// Every I2C byte is 8 data bits plus ACK. A write sends the slave and
+// register address; a read also sends a repeated start and the slave
+// address again. Start and stop conditions are counted as one bit each.
+unsigned long sim_mpu9250_i2c_time_us(const struct sim_mpu9250_stats_s * stats,
+                                      unsigned long bus_hz)
+{
+	unsigned long long bits;
+
+	if (!bus_hz)
+		return 0;
+	bits = 9ULL * (2 * stats->write_transactions + stats->write_bytes) +
+	       2ULL * stats->write_transactions;
+	bits += 9ULL * (3 * stats->read_transactions + stats->read_bytes) +
+	        3ULL * stats->read_transactions;
+	return (unsigned long)((bits * 1000000ULL + bus_hz - 1) / bus_hz);
+}
+
+// An SPI transfer is the register address byte followed by the payload.
+unsigned long sim_mpu9250_spi_time_us(const struct sim_mpu9250_stats_s * stats,
+                                      unsigned long bus_hz)
+{
+	unsigned long long bits;
+
+	if (!bus_hz)
+		return 0;
+	bits = 8ULL * (stats->write_transactions + stats->write_bytes +
+	               stats->read_transactions + stats->read_bytes);
+	return (unsigned long)((bits * 1000000ULL + bus_hz - 1) / bus_hz);
+}
+
+static unsigned char dmp_on(const struct sim_mpu9250_s * sim)
+{
+	return (sim->regs[MPU9250_USER_CTRL] & BIT_DMP_EN) ? 1 : 0;
+}
+
+unsigned long sim_mpu9250_sample_rate(const struct sim_mpu9250_s * sim)
+{
+	unsigned short div;
+
+	if (sim->fill_rate_hz)
+		return sim->fill_rate_hz;
+	if (dmp_on(sim)) {
+		div = (sim->mem[DMP_FIFO_DIV_ADDR] << 8) | sim->mem[DMP_FIFO_DIV_ADDR + 1];
+		return DMP_SAMPLE_RATE / (div + 1);
+	}
+	return 1000 / (1 + sim->regs[MPU9250_SMPLRT_DIV]);
+}
+
+/******************************************************************************
+ * AK8963
+ ******************************************************************************/
+
+static void ak_measure(struct sim_mpu9250_s * sim)
+{
+	unsigned char ii;
+
+	if (sim->ak_regs[AK8963_ST1] & AK8963_BIT_DRDY)
+		sim->ak_regs[AK8963_ST1] |= AK8963_BIT_DOR;
+	for (ii = 0; ii < 3; ii++) {
+		sim->ak_regs[AK8963_HXL + 2 * ii] = sim->mag[ii] & 0xFF;
+		sim->ak_regs[AK8963_HXL + 2 * ii + 1] = (sim->mag[ii] >> 8) & 0xFF;
+	}
+	sim->ak_regs[AK8963_ST1] |= AK8963_BIT_DRDY;
+	sim->ak_regs[AK8963_ST2] = sim->ak_regs[AK8963_CNTL] & AK8963_BIT_16BIT;
+	// Single measurement mode drops back to power-down.
+	if ((sim->ak_regs[AK8963_CNTL] & AK8963_MODE_MASK) == AK8963_MODE_SINGLE)
+		sim->ak_regs[AK8963_CNTL] &= ~AK8963_MODE_MASK;
+}
+
+static void ak_write_reg(struct sim_mpu9250_s * sim, unsigned char reg,
+                         unsigned char value)
+{
+	switch (reg) {
+	case AK8963_CNTL:
+		sim->ak_regs[reg] = value;
+		if ((value & AK8963_MODE_MASK) == AK8963_MODE_SINGLE)
+			ak_measure(sim);
+		sim->ak_next_us = sim->time_us;
+		return;
+	case AK8963_RSV:
+		if (value & AK8963_BIT_SRST)
+			ak_reset(sim);
+		return;
+	case AK8963_ASTC:
+	case AK8963_I2CDIS:
+		sim->ak_regs[reg] = value;
+		return;
+	}
+	// Everything else is read-only.
+}
+
+static unsigned char ak_read_reg(struct sim_mpu9250_s * sim, unsigned char reg)
+{
+	unsigned char value = sim->ak_regs[reg];
+
+	if (reg >= AK8963_ASAX &&
+	    (sim->ak_regs[AK8963_CNTL] & AK8963_MODE_MASK) != AK8963_MODE_FUSE_ROM)
+		return 0;
+	// Reading ST2 ends the data read and releases the data registers.
+	if (reg == AK8963_ST2)
+		sim->ak_regs[AK8963_ST1] &= ~(AK8963_BIT_DRDY | AK8963_BIT_DOR);
+	return value;
+}
+
+static void ak_tick(struct sim_mpu9250_s * sim)
+{
+	unsigned long period_us;
+
+	switch (sim->ak_regs[AK8963_CNTL] & AK8963_MODE_MASK) {
+	case AK8963_MODE_CONT_8HZ:
+		period_us = 125000;
+		break;
+	case AK8963_MODE_CONT_100HZ:
+		period_us = 10000;
+		break;
+	default:
+		return;
+	}
+	if (sim->time_us >= sim->ak_next_us) {
+		ak_measure(sim);
+		sim->ak_next_us = sim->time_us + period_us;
+	}
+}
+
+// The AK8963 is on the auxiliary bus; it is only visible on the primary bus
+// in bypass mode, with the I2C master off.
+static unsigned char ak_bypassed(const struct sim_mpu9250_s * sim)
+{
+	return (sim->regs[MPU9250_INT_PIN_CFG] & BIT_BYPASS_EN) &&
+	       !(sim->regs[MPU9250_USER_CTRL] & BIT_I2C_MST_EN);
+}
+
+/******************************************************************************
+ * MPU-9250 I2C master
+ ******************************************************************************/
+
+// Run the enabled slaves 0-3 in order, filling EXT_SENS_DATA with reads.
+static void i2c_master_tick(struct sim_mpu9250_s * sim)
+{
+	unsigned char slave, base, addr, reg, ctrl, len, ii;
+	unsigned char ext = MPU9250_EXT_SENS_DATA_00;
+
+	for (slave = 0; slave < 4; slave++) {
+		base = MPU9250_I2C_SLV0_ADDR + 3 * slave;
+		addr = sim->regs[base];
+		reg = sim->regs[base + 1];
+		ctrl = sim->regs[base + 2];
+		if (!(ctrl & BIT_SLAVE_EN))
+			continue;
+		len = ctrl & BITS_SLAVE_LENGTH;
+		if (addr & BIT_I2C_READ) {
+			for (ii = 0; ii < len && ext <= MPU9250_EXT_SENS_DATA_23; ii++, ext++) {
+				if ((addr & 0x7F) == SIM_AK8963_ADDR && reg + ii < SIM_AK8963_NUM_REGS)
+					sim->regs[ext] = ak_read_reg(sim, reg + ii);
+				else
+					sim->regs[ext] = 0;
+			}
+		} else if ((addr & 0x7F) == SIM_AK8963_ADDR && reg < SIM_AK8963_NUM_REGS) {
+			ak_write_reg(sim, reg, sim->regs[MPU9250_I2C_SLV0_DO + slave]);
+		}
+	}
+}
+
+// Slave 4 runs one byte as soon as it is enabled.
+static void i2c_slv4_start(struct sim_mpu9250_s * sim)
+{
+	unsigned char addr = sim->regs[MPU9250_I2C_SLV4_ADDR];
+	unsigned char reg = sim->regs[MPU9250_I2C_SLV4_REG];
+
+	sim->regs[MPU9250_I2C_SLV4_CTRL] &= ~BIT_SLAVE_EN;
+	if (!(sim->regs[MPU9250_USER_CTRL] & BIT_I2C_MST_EN))
+		return;
+	if ((addr & 0x7F) != SIM_AK8963_ADDR || reg >= SIM_AK8963_NUM_REGS) {
+		sim->regs[MPU9250_I2C_MST_STATUS] |= BIT_SLV4_NACK;
+		return;
+	}
+	if (addr & BIT_I2C_READ)
+		sim->regs[MPU9250_I2C_SLV4_DI] = ak_read_reg(sim, reg);
+	else
+		ak_write_reg(sim, reg, sim->regs[MPU9250_I2C_SLV4_DO]);
+	sim->regs[MPU9250_I2C_MST_STATUS] |= BIT_SLV4_DONE;
+}
+
+/******************************************************************************
+ * MPU-9250 FIFO and sampling
+ ******************************************************************************/
+
+static unsigned short fifo_size(const struct sim_mpu9250_s * sim)
+{
+	unsigned short size = 512 << ((sim->regs[MPU9250_ACCEL_CONFIG_2] & BITS_FIFO_SIZE) >> 6);
+
+	return (size > SIM_MPU9250_FIFO_SIZE) ? SIM_MPU9250_FIFO_SIZE : size;
+}
+
+// Write a packet. When it does not fit, either the packet is dropped
+// (FIFO_MODE set) or the oldest bytes are overwritten, which leaves the
+// FIFO misaligned just as the hardware does.
+static void fifo_push(struct sim_mpu9250_s * sim, const unsigned char * data,
+                      unsigned short length)
+{
+	unsigned short size = fifo_size(sim);
+	unsigned short ii, tail, excess;
+
+	if (!length)
+		return;
+	if (sim->fifo_count + length > size) {
+		sim->regs[MPU9250_INT_STATUS] |= BIT_INT_FIFO_OVERFLOW;
+		if (sim->regs[MPU9250_CONFIG] & BIT_FIFO_MODE) {
+			sim->stats.fifo_bytes_lost += length;
+			return;
+		}
+		excess = sim->fifo_count + length - size;
+		if (excess > sim->fifo_count)
+			excess = sim->fifo_count;
+		sim->fifo_head = (sim->fifo_head + excess) % size;
+		sim->fifo_count -= excess;
+		sim->stats.fifo_bytes_lost += excess;
+	}
+	for (ii = 0; ii < length; ii++) {
+		tail = (sim->fifo_head + sim->fifo_count) % size;
+		sim->fifo[tail] = data[ii];
+		sim->fifo_count++;
+	}
+	sim->stats.fifo_packets++;
+}
+
+static unsigned char fifo_pop(struct sim_mpu9250_s * sim)
+{
+	unsigned char value;
+
+	if (!sim->fifo_count)
+		return 0xFF;
+	value = sim->fifo[sim->fifo_head];
+	sim->fifo_head = (sim->fifo_head + 1) % fifo_size(sim);
+	sim->fifo_count--;
+	sim->stats.fifo_bytes_read++;
+	return value;
+}
+
+static void put_be16(unsigned char * dst, short value)
+{
+	dst[0] = (value >> 8) & 0xFF;
+	dst[1] = value & 0xFF;
+}
+
+static void raw_fifo_packet(struct sim_mpu9250_s * sim)
+{
+	unsigned char packet[6 + 2 + 6 + 24];
+	unsigned char fifo_en = sim->regs[MPU9250_FIFO_EN];
+	unsigned short length = 0;
+	unsigned char slave, len, ext = 0;
+
+	// Same order as the data registers: accel, temp, gyro, external.
+	if (fifo_en & BIT_FIFO_ACCEL) {
+		memcpy(&packet[length], &sim->regs[MPU9250_ACCEL_XOUT_H], 6);
+		length += 6;
+	}
+	if (fifo_en & BIT_FIFO_TEMP) {
+		memcpy(&packet[length], &sim->regs[MPU9250_TEMP_OUT_H], 2);
+		length += 2;
+	}
+	if (fifo_en & BIT_FIFO_XG) {
+		memcpy(&packet[length], &sim->regs[MPU9250_GYRO_XOUT_H], 2);
+		length += 2;
+	}
+	if (fifo_en & BIT_FIFO_YG) {
+		memcpy(&packet[length], &sim->regs[MPU9250_GYRO_XOUT_H + 2], 2);
+		length += 2;
+	}
+	if (fifo_en & BIT_FIFO_ZG) {
+		memcpy(&packet[length], &sim->regs[MPU9250_GYRO_XOUT_H + 4], 2);
+		length += 2;
+	}
+	for (slave = 0; slave < 4; slave++) {
+		len = sim->regs[MPU9250_I2C_SLV0_CTRL + 3 * slave];
+		if (!(len & BIT_SLAVE_EN) || !(sim->regs[MPU9250_I2C_SLV0_ADDR + 3 * slave] & BIT_I2C_READ))
+			continue;
+		len &= BITS_SLAVE_LENGTH;
+		if ((slave < 3 && (fifo_en & (1 << slave))) ||
+		    (slave == 3 && (sim->regs[MPU9250_I2C_MST_CTRL] & BIT_SLV3_FIFO_EN))) {
+			memcpy(&packet[length], &sim->regs[MPU9250_EXT_SENS_DATA_00 + ext], len);
+			length += len;
+		}
+		ext += len;
+	}
+	fifo_push(sim, packet, length);
+}
+
+static void run_sample(struct sim_mpu9250_s * sim)
+{
+	unsigned char ii;
+
+	sim->stats.samples++;
+	if (sim->sample_cb)
+		sim->sample_cb(sim, sim->sample_arg);
+
+	for (ii = 0; ii < 3; ii++) {
+		put_be16(&sim->regs[MPU9250_ACCEL_XOUT_H + 2 * ii], sim->accel[ii]);
+		put_be16(&sim->regs[MPU9250_GYRO_XOUT_H + 2 * ii], sim->gyro[ii]);
+	}
+	put_be16(&sim->regs[MPU9250_TEMP_OUT_H], sim->temp);
+	ak_tick(sim);
+	if (sim->regs[MPU9250_USER_CTRL] & BIT_I2C_MST_EN)
+		i2c_master_tick(sim);
+	sim->regs[MPU9250_INT_STATUS] |= BIT_INT_RAW_RDY;
+
+	if (!(sim->regs[MPU9250_USER_CTRL] & BIT_FIFO_EN))
+		return;
+	if (dmp_on(sim)) {
+		if (sim->trace && sim->trace_packets) {
+			fifo_push(sim, sim->trace + sim->trace_pos * sim->trace_packet_length,
+			          sim->trace_packet_length);
+			sim->trace_pos = (sim->trace_pos + 1) % sim->trace_packets;
+			sim->regs[MPU9250_INT_STATUS] |= BIT_INT_DMP;
+		}
+	} else {
+		raw_fifo_packet(sim);
+	}
+}
+
+void sim_mpu9250_advance(struct sim_mpu9250_s * sim, unsigned long us)
+{
+	unsigned long rate;
+	unsigned long long period, end = sim->time_us + us;
+
+	sim->time_us = end;
+	if (sim->regs[MPU9250_PWR_MGMT_1] & BIT_SLEEP)
+		return;
+	rate = sim_mpu9250_sample_rate(sim);
+	if (!rate)
+		return;
+	period = 1000000ULL / rate;
+	sim->sample_phase_us += us;
+	while (sim->sample_phase_us >= period) {
+		sim->sample_phase_us -= period;
+		// Each sample at the time it completes, so that the AK8963's own
+		// measurement clock lines up with it.
+		sim->time_us = end - sim->sample_phase_us;
+		run_sample(sim);
+	}
+	sim->time_us = end;
+}
+
+/******************************************************************************
+ * MPU-9250 registers
+ ******************************************************************************/
+
+static void sim_write_reg(struct sim_mpu9250_s * sim, unsigned char reg,
+                          unsigned char value)
+{
+	switch (reg) {
+	case MPU9250_PWR_MGMT_1:
+		if (value & BIT_RESET) {
+			sim_reset(sim);
+			return;
+		}
+		break;
+	case MPU9250_USER_CTRL:
+		if (value & BIT_FIFO_RST) {
+			sim->fifo_head = 0;
+			sim->fifo_count = 0;
+		}
+		if (value & BIT_SIG_COND_RST)
+			memset(&sim->regs[MPU9250_ACCEL_XOUT_H], 0,
+			       MPU9250_EXT_SENS_DATA_00 - MPU9250_ACCEL_XOUT_H);
+		// Reset requests complete immediately and read back as 0.
+		value &= ~USER_CTRL_RESET_BITS;
+		break;
+	case MPU9250_BANK_SEL:
+		sim->mem_ptr = (value << 8) | (sim->mem_ptr & 0xFF);
+		break;
+	case MPU9250_MEM_START_ADDR:
+		sim->mem_ptr = (sim->mem_ptr & 0xFF00) | value;
+		break;
+	case MPU9250_MEM_R_W:
+		sim->mem[sim->mem_ptr % SIM_MPU9250_MEM_SIZE] = value;
+		sim->mem_ptr++;
+		return;
+	case MPU9250_FIFO_R_W:
+		fifo_push(sim, &value, 1);
+		return;
+	case MPU9250_I2C_SLV4_CTRL:
+		sim->regs[reg] = value;
+		if (value & BIT_SLAVE_EN)
+			i2c_slv4_start(sim);
+		return;
+	case MPU9250_INT_STATUS:
+	case MPU9250_DMP_INT_STATUS:
+	case MPU9250_I2C_MST_STATUS:
+	case MPU9250_FIFO_COUNTH:
+	case MPU9250_FIFO_COUNTL:
+	case MPU9250_WHO_AM_I:
+		return;
+	}
+	if (reg >= MPU9250_ACCEL_XOUT_H && reg <= MPU9250_EXT_SENS_DATA_23)
+		return;
+	sim->regs[reg] = value;
+}
+
+static unsigned char sim_read_reg(struct sim_mpu9250_s * sim, unsigned char reg)
+{
+	unsigned char value;
+
+	switch (reg) {
+	case MPU9250_MEM_R_W:
+		return sim->mem[sim->mem_ptr++ % SIM_MPU9250_MEM_SIZE];
+	case MPU9250_FIFO_R_W:
+		return fifo_pop(sim);
+	case MPU9250_FIFO_COUNTH:
+		return (sim->fifo_count >> 8) & 0x1F;
+	case MPU9250_FIFO_COUNTL:
+		return sim->fifo_count & 0xFF;
+	case MPU9250_INT_STATUS:
+	case MPU9250_DMP_INT_STATUS:
+	case MPU9250_I2C_MST_STATUS:
+		// Status bits clear on read.
+		value = sim->regs[reg];
+		sim->regs[reg] = 0;
+		return value;
+	}
+	value = sim->regs[reg];
+	if (sim->regs[MPU9250_INT_PIN_CFG] & BIT_ANY_RD_CLR)
+		sim->regs[MPU9250_INT_STATUS] = 0;
+	return value;
+}
+
+// FIFO_R_W and MEM_R_W are ports: bursts keep hitting the same register.
+static unsigned char next_reg(unsigned char reg)
+{
+	if (reg == MPU9250_FIFO_R_W || reg == MPU9250_MEM_R_W)
+		return reg;
+	return reg + 1;
+}
+
+int sim_mpu9250_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                      unsigned short length, unsigned char const * data)
+{
+	struct sim_mpu9250_s * sim = (struct sim_mpu9250_s *)ctx;
+	unsigned short ii;
+
+	sync_clock(sim);
+	sim->stats.write_transactions++;
+	sim->stats.write_bytes += length;
+	if (slave_addr == sim->addr) {
+		for (ii = 0; ii < length; ii++) {
+			if (reg_addr >= SIM_MPU9250_NUM_REGS)
+				return -1;
+			sim_write_reg(sim, reg_addr, data[ii]);
+			reg_addr = next_reg(reg_addr);
+		}
+		return 0;
+	}
+	if (slave_addr == SIM_AK8963_ADDR && ak_bypassed(sim)) {
+		if (reg_addr + length > SIM_AK8963_NUM_REGS)
+			return -1;
+		for (ii = 0; ii < length; ii++)
+			ak_write_reg(sim, reg_addr + ii, data[ii]);
+		return 0;
+	}
+	sim->stats.nacks++;
+	return -1;
+}
+
+int sim_mpu9250_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                     unsigned short length, unsigned char * data)
+{
+	struct sim_mpu9250_s * sim = (struct sim_mpu9250_s *)ctx;
+	unsigned short ii;
+
+	sync_clock(sim);
+	sim->stats.read_transactions++;
+	sim->stats.read_bytes += length;
+	if (slave_addr == sim->addr) {
+		for (ii = 0; ii < length; ii++) {
+			if (reg_addr >= SIM_MPU9250_NUM_REGS)
+				return -1;
+			data[ii] = sim_read_reg(sim, reg_addr);
+			reg_addr = next_reg(reg_addr);
+		}
+		return 0;
+	}
+	if (slave_addr == SIM_AK8963_ADDR && ak_bypassed(sim)) {
+		if (reg_addr + length > SIM_AK8963_NUM_REGS)
+			return -1;
+		for (ii = 0; ii < length; ii++)
+			data[ii] = ak_read_reg(sim, reg_addr + ii);
+		return 0;
+	}
+	sim->stats.nacks++;
+	return -1;
+}
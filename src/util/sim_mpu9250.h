@@ -0,0 +1,147 @@
+/******************************************************************************
+sim_mpu9250.h - MPU-9250 Digital Motion Processor Arduino Library
+In-memory simulated MPU-9250 and AK8963, usable as a bus transport so the
+driver can be exercised, measured and regression-tested without hardware.
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Supported Platforms:
+- Any (no hardware access)
+******************************************************************************/
+#ifndef _SIM_MPU9250_H_
+#define _SIM_MPU9250_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct mpu_bus_s;
+struct mpu_clock_s;
+
+#define SIM_MPU9250_NUM_REGS  128
+#define SIM_MPU9250_MEM_SIZE  4096
+#define SIM_MPU9250_FIFO_SIZE 1024
+#define SIM_AK8963_NUM_REGS   0x13
+#define SIM_AK8963_ADDR       0x0C
+
+// Bus traffic seen by the simulator. A transaction is one read or write
+// call; bytes count payload only (not the slave or register address).
+struct sim_mpu9250_stats_s {
+	unsigned long read_transactions;
+	unsigned long write_transactions;
+	unsigned long read_bytes;
+	unsigned long write_bytes;
+	// Transactions addressed to a slave that did not answer.
+	unsigned long nacks;
+	// Bytes read from FIFO_R_W, and bytes the FIFO had to discard.
+	unsigned long fifo_bytes_read;
+	unsigned long fifo_bytes_lost;
+	// Sample periods simulated, and FIFO packets written.
+	unsigned long samples;
+	unsigned long fifo_packets;
+};
+
+struct sim_mpu9250_s {
+	// Slave address the MPU-9250 answers on.
+	unsigned char addr;
+	unsigned char regs[SIM_MPU9250_NUM_REGS];
+	// DMP memory, addressed through BANK_SEL/MEM_START_ADDR/MEM_R_W.
+	unsigned char mem[SIM_MPU9250_MEM_SIZE];
+	unsigned short mem_ptr;
+	// FIFO contents, as a ring buffer.
+	unsigned char fifo[SIM_MPU9250_FIFO_SIZE];
+	unsigned short fifo_head;
+	unsigned short fifo_count;
+	unsigned char ak_regs[SIM_AK8963_NUM_REGS];
+	// Simulated time of the next AK8963 measurement in continuous mode.
+	unsigned long long ak_next_us;
+
+	// Sensor readings reported on the next sample, in hardware units.
+	short accel[3];
+	short gyro[3];
+	short temp;
+	short mag[3];
+	// Called at the start of every sample period so readings can vary.
+	void (*sample_cb)(struct sim_mpu9250_s * sim, void * arg);
+	void * sample_arg;
+	// Optional time source, in microseconds (see sim_mpu9250_set_clock).
+	unsigned long (*clock_us)(void);
+	unsigned long clock_last_us;
+
+	// Samples per second. 0 derives it from the device configuration:
+	// 1 kHz / (1 + SMPLRT_DIV), or the DMP FIFO rate when the DMP is on.
+	unsigned long fill_rate_hz;
+	// DMP packets pushed to the FIFO while the DMP is on, one per sample,
+	// replayed in a loop. Must match the packet layout the driver expects.
+	const unsigned char * trace;
+	unsigned short trace_packet_length;
+	unsigned long trace_packets;
+	unsigned long trace_pos;
+
+	// Simulated time, in microseconds, and the part of a sample period
+	// already elapsed.
+	unsigned long long time_us;
+	unsigned long long sample_phase_us;
+
+	struct sim_mpu9250_stats_s stats;
+};
+
+// sim_mpu9250_init -- Put the simulated parts in their power-on state and
+// point bus at them.
+// Input: Slave address for the MPU-9250 (0x68 or 0x69)
+void sim_mpu9250_init(struct sim_mpu9250_s * sim, struct mpu_bus_s * bus,
+                      unsigned char addr);
+
+// sim_mpu9250_advance -- Move simulated time forward, running every sample
+// period that completes: sensor and external sensor registers are updated,
+// the I2C master services its slaves, and a packet is written to the FIFO
+// (setting the overflow interrupt if it does not fit).
+// Input: Microseconds to advance
+void sim_mpu9250_advance(struct sim_mpu9250_s * sim, unsigned long us);
+
+// sim_mpu9250_set_trace -- Feed recorded DMP packets to the FIFO.
+// Input: Packet data (num_packets * packet_length bytes), kept by reference
+void sim_mpu9250_set_trace(struct sim_mpu9250_s * sim, const unsigned char * packets,
+                           unsigned short packet_length, unsigned long num_packets);
+
+// sim_mpu9250_set_clock -- Follow a running clock, such as micros(). Before
+// every bus transaction the simulator advances by the time elapsed since
+// the last one, so samples pile up during driver delays as on hardware.
+// Input: Clock function, or 0 to advance only through sim_mpu9250_advance
+void sim_mpu9250_set_clock(struct sim_mpu9250_s * sim, unsigned long (*clock_us)(void));
+
+// sim_mpu9250_clock_init -- Point clock at the simulated time, to run the
+// driver on it (see mpu_set_clock): it reads the simulated time, and its
+// delays advance it instead of waiting. Time then only moves through the
+// driver's delays and sim_mpu9250_advance, so runs are repeatable and
+// faster than real time. Not to be combined with sim_mpu9250_set_clock.
+void sim_mpu9250_clock_init(struct sim_mpu9250_s * sim, struct mpu_clock_s * clock);
+
+// sim_mpu9250_sample_rate -- Samples per second currently being simulated.
+unsigned long sim_mpu9250_sample_rate(const struct sim_mpu9250_s * sim);
+
+void sim_mpu9250_reset_stats(struct sim_mpu9250_s * sim);
+
+// sim_mpu9250_i2c_time_us -- Time the counted traffic would keep an I2C
+// bus busy, including addressing, ACK bits and start/stop conditions.
+// Input: Counters to convert and bus clock in Hz (e.g. 100000, 400000)
+// Output: Microseconds, rounded up
+unsigned long sim_mpu9250_i2c_time_us(const struct sim_mpu9250_stats_s * stats,
+                                      unsigned long bus_hz);
+
+// sim_mpu9250_spi_time_us -- As sim_mpu9250_i2c_time_us, for SPI.
+unsigned long sim_mpu9250_spi_time_us(const struct sim_mpu9250_stats_s * stats,
+                                      unsigned long bus_hz);
+
+int sim_mpu9250_write(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                      unsigned short length, unsigned char const * data);
+int sim_mpu9250_read(void * ctx, unsigned char slave_addr, unsigned char reg_addr,
+                     unsigned short length, unsigned char * data);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _SIM_MPU9250_H_